@@ -165,6 +165,43 @@ tor_get_thread_id(void)
   return r.id;
 }
 
+/* Thread-local storage. */
+
+/** Initialize <b>threadlocal</b>, so that each thread can store its own
+ * value in it.  Return 0 on success, -1 on failure. */
+int
+tor_threadlocal_init(tor_threadlocal_t *threadlocal)
+{
+  int err = pthread_key_create(&threadlocal->key, NULL);
+  return err ? -1 : 0;
+}
+
+/** Release all resources held by <b>threadlocal</b>.  Does not free the
+ * values that any thread stored in it. */
+void
+tor_threadlocal_destroy(tor_threadlocal_t *threadlocal)
+{
+  pthread_key_delete(threadlocal->key);
+  memset(threadlocal, 0, sizeof(tor_threadlocal_t));
+}
+
+/** Return the value that the current thread stored in <b>threadlocal</b>,
+ * or NULL if it never stored one. */
+void *
+tor_threadlocal_get(tor_threadlocal_t *threadlocal)
+{
+  return pthread_getspecific(threadlocal->key);
+}
+
+/** Set the current thread's value for <b>threadlocal</b> to
+ * <b>value</b>. */
+void
+tor_threadlocal_set(tor_threadlocal_t *threadlocal, void *value)
+{
+  int err = pthread_setspecific(threadlocal->key, value);
+  tor_assert(err == 0);
+}
+
 /* Conditions. */
 
 /** Initialize an already-allocated condition variable. */
@@ -11,6 +11,7 @@
  * a digest-to-void* map.
  **/
 
+#define CONTAINER_PRIVATE
 #include "compat.h"
 #include "util.h"
 #include "torlog.h"
@@ -20,6 +21,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "ht.h"
 
@@ -1036,9 +1040,43 @@ smartlist_uniq_digests256(smartlist_t *sl)
     HT_HEAD(prefix ## impl, prefix ## entry_t) head;      \
   }
 
+/** Helper: Declare an entry type and a map type to implement a mapping from
+ * <b>keylen</b>-byte keys using the open-addressing table below.  Names are
+ * as for DEFINE_MAP_STRUCTS. */
+#define DEFINE_OPEN_MAP_STRUCTS(maptype, keydecl, prefix) \
+  typedef struct prefix ## entry_t {                      \
+    void *val;                                            \
+    keydecl;                                              \
+  } prefix ## entry_t;                                    \
+  struct maptype {                                        \
+    /** One control byte for each slot: OMAP_CTRL_EMPTY,  \
+     * OMAP_CTRL_DELETED, or 7 bits of the hash of the    \
+     * key stored there. */                               \
+    uint8_t *ctrl;                                        \
+    prefix ## entry_t *slots;                             \
+    /** Number of slots: 0, or a power of two no smaller  \
+     * than OMAP_GROUP_WIDTH. */                          \
+    unsigned n_slots;                                     \
+    /** Number of entries in the map. */                  \
+    int size;                                             \
+    /** Number of empty slots we can still fill before    \
+     * we must rebuild the table. */                      \
+    int growth_left;                                      \
+  }
+
 DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
+DEFINE_MAP_STRUCTS(digestmap_ht_t, char key[DIGEST_LEN], digestmap_ht_);
+#ifdef DIGESTMAP_USE_CHAINED_HT
 DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
+#else
+DEFINE_OPEN_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
+#endif
+#ifdef DIGEST256MAP_USE_CHAINED_HT
 DEFINE_MAP_STRUCTS(digest256map_t, uint8_t key[DIGEST256_LEN], digest256map_);
+#else
+DEFINE_OPEN_MAP_STRUCTS(digest256map_t, uint8_t key[DIGEST256_LEN],
+                        digest256map_);
+#endif
 
 /** Helper: compare strmap_entry_t objects by key value. */
 static INLINE int
@@ -1054,6 +1092,22 @@ strmap_entry_hash(const strmap_entry_t *a)
   return (unsigned) siphash24g(a->key, strlen(a->key));
 }
 
+/** Helper: compare digestmap_ht_entry_t objects by key value. */
+static INLINE int
+digestmap_ht_entries_eq(const digestmap_ht_entry_t *a,
+                        const digestmap_ht_entry_t *b)
+{
+  return tor_memeq(a->key, b->key, DIGEST_LEN);
+}
+
+/** Helper: return a hash value for a digestmap_ht_entry_t. */
+static INLINE unsigned int
+digestmap_ht_entry_hash(const digestmap_ht_entry_t *a)
+{
+  return (unsigned) siphash24g(a->key, DIGEST_LEN);
+}
+
+#ifdef DIGESTMAP_USE_CHAINED_HT
 /** Helper: compare digestmap_entry_t objects by key value. */
 static INLINE int
 digestmap_entries_eq(const digestmap_entry_t *a, const digestmap_entry_t *b)
@@ -1067,7 +1121,9 @@ digestmap_entry_hash(const digestmap_entry_t *a)
 {
   return (unsigned) siphash24g(a->key, DIGEST_LEN);
 }
+#endif
 
+#ifdef DIGEST256MAP_USE_CHAINED_HT
 /** Helper: compare digestmap_entry_t objects by key value. */
 static INLINE int
 digest256map_entries_eq(const digest256map_entry_t *a,
@@ -1082,23 +1138,34 @@ digest256map_entry_hash(const digest256map_entry_t *a)
 {
   return (unsigned) siphash24g(a->key, DIGEST256_LEN);
 }
+#endif
 
 HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
              strmap_entries_eq)
 HT_GENERATE2(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
              strmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
 
+HT_PROTOTYPE(digestmap_ht_impl, digestmap_ht_entry_t, node,
+             digestmap_ht_entry_hash, digestmap_ht_entries_eq)
+HT_GENERATE2(digestmap_ht_impl, digestmap_ht_entry_t, node,
+             digestmap_ht_entry_hash, digestmap_ht_entries_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+#ifdef DIGESTMAP_USE_CHAINED_HT
 HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
              digestmap_entries_eq)
 HT_GENERATE2(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
              digestmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
+#endif
 
+#ifdef DIGEST256MAP_USE_CHAINED_HT
 HT_PROTOTYPE(digest256map_impl, digest256map_entry_t, node,
              digest256map_entry_hash,
              digest256map_entries_eq)
 HT_GENERATE2(digest256map_impl, digest256map_entry_t, node,
              digest256map_entry_hash,
              digest256map_entries_eq, 0.6, tor_reallocarray_, tor_free_)
+#endif
 
 static INLINE void
 strmap_entry_free(strmap_entry_t *ent)
@@ -1107,46 +1174,64 @@ strmap_entry_free(strmap_entry_t *ent)
   tor_free(ent);
 }
 static INLINE void
-digestmap_entry_free(digestmap_entry_t *ent)
+digestmap_ht_entry_free(digestmap_ht_entry_t *ent)
 {
   tor_free(ent);
 }
 static INLINE void
-digest256map_entry_free(digest256map_entry_t *ent)
+strmap_assign_tmp_key(strmap_entry_t *ent, const char *key)
 {
-  tor_free(ent);
+  ent->key = (char*)key;
 }
-
 static INLINE void
-strmap_assign_tmp_key(strmap_entry_t *ent, const char *key)
+digestmap_ht_assign_tmp_key(digestmap_ht_entry_t *ent, const char *key)
 {
-  ent->key = (char*)key;
+  memcpy(ent->key, key, DIGEST_LEN);
 }
 static INLINE void
-digestmap_assign_tmp_key(digestmap_entry_t *ent, const char *key)
+strmap_assign_key(strmap_entry_t *ent, const char *key)
+{
+  ent->key = tor_strdup(key);
+}
+static INLINE void
+digestmap_ht_assign_key(digestmap_ht_entry_t *ent, const char *key)
 {
   memcpy(ent->key, key, DIGEST_LEN);
 }
+#ifdef DIGESTMAP_USE_CHAINED_HT
 static INLINE void
-digest256map_assign_tmp_key(digest256map_entry_t *ent, const uint8_t *key)
+digestmap_entry_free(digestmap_entry_t *ent)
 {
-  memcpy(ent->key, key, DIGEST256_LEN);
+  tor_free(ent);
 }
 static INLINE void
-strmap_assign_key(strmap_entry_t *ent, const char *key)
+digestmap_assign_tmp_key(digestmap_entry_t *ent, const char *key)
 {
-  ent->key = tor_strdup(key);
+  memcpy(ent->key, key, DIGEST_LEN);
 }
 static INLINE void
 digestmap_assign_key(digestmap_entry_t *ent, const char *key)
 {
   memcpy(ent->key, key, DIGEST_LEN);
 }
+#endif
+#ifdef DIGEST256MAP_USE_CHAINED_HT
+static INLINE void
+digest256map_entry_free(digest256map_entry_t *ent)
+{
+  tor_free(ent);
+}
+static INLINE void
+digest256map_assign_tmp_key(digest256map_entry_t *ent, const uint8_t *key)
+{
+  memcpy(ent->key, key, DIGEST256_LEN);
+}
 static INLINE void
 digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
 {
   memcpy(ent->key, key, DIGEST256_LEN);
 }
+#endif
 
 /**
  * Macro: implement all the functions for a map that are declared in
@@ -1261,6 +1346,16 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
     return HT_EMPTY(&map->head);                                        \
   }                                                                     \
                                                                         \
+  /** Return the approximate number of bytes used by <b>map</b>, not    \
+   * counting allocator overhead or storage for string keys. */         \
+  size_t                                                                \
+  prefix##_mem_usage(const maptype *map)                                \
+  {                                                                     \
+    return sizeof(maptype) +                                            \
+      (size_t)map->head.hth_table_length * sizeof(prefix##_entry_t *) + \
+      (size_t)HT_SIZE(&map->head) * sizeof(prefix##_entry_t);           \
+  }                                                                     \
+                                                                        \
   /** Assert that <b>map</b> is not corrupt. */                         \
   void                                                                  \
   prefix##_assert_ok(const maptype *map)                                \
@@ -1315,7 +1410,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   prefix##_iter_init(maptype *map)                                      \
   {                                                                     \
     tor_assert(map);                                                    \
-    return HT_START(prefix##_impl, &map->head);                         \
+    return (prefix##_iter_t *) HT_START(prefix##_impl, &map->head);     \
   }                                                                     \
                                                                         \
   /** Advance <b>iter</b> a single step to the next entry, and return   \
@@ -1325,21 +1420,23 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   {                                                                     \
     tor_assert(map);                                                    \
     tor_assert(iter);                                                   \
-    return HT_NEXT(prefix##_impl, &map->head, iter);                    \
+    return (prefix##_iter_t *)                                          \
+      HT_NEXT(prefix##_impl, &map->head, (prefix##_entry_t **)iter);    \
   }                                                                     \
   /** Advance <b>iter</b> a single step to the next entry, removing the \
    * current entry, and return its new value. */                        \
   prefix##_iter_t *                                                     \
   prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
   {                                                                     \
+    prefix##_entry_t **ent = (prefix##_entry_t **) iter;                \
     prefix##_entry_t *rmv;                                              \
     tor_assert(map);                                                    \
-    tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
-    rmv = *iter;                                                        \
-    iter = HT_NEXT_RMV(prefix##_impl, &map->head, iter);                \
+    tor_assert(ent);                                                    \
+    tor_assert(*ent);                                                   \
+    rmv = *ent;                                                         \
+    ent = HT_NEXT_RMV(prefix##_impl, &map->head, ent);                  \
     prefix##_entry_free(rmv);                                           \
-    return iter;                                                        \
+    return (prefix##_iter_t *) ent;                                     \
   }                                                                     \
   /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
    * to by iter. */                                                     \
@@ -1347,12 +1444,416 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   prefix##_iter_get(prefix##_iter_t *iter, const keytype *keyp,         \
                     void **valp)                                        \
   {                                                                     \
+    prefix##_entry_t **ent = (prefix##_entry_t **) iter;                \
+    tor_assert(ent);                                                    \
+    tor_assert(*ent);                                                   \
+    tor_assert(keyp);                                                   \
+    tor_assert(valp);                                                   \
+    *keyp = (*ent)->key;                                                \
+    *valp = (*ent)->val;                                                \
+  }                                                                     \
+  /** Return true iff <b>iter</b> has advanced past the last entry of   \
+   * <b>map</b>. */                                                     \
+  int                                                                   \
+  prefix##_iter_done(prefix##_iter_t *iter)                             \
+  {                                                                     \
+    return iter == NULL;                                                \
+  }
+
+/* Open-addressing maps.
+ *
+ * These maps keep their entries, with fixed-length keys stored inline, in a
+ * single array of slots, and a parallel array of control bytes.  A control
+ * byte holds 7 bits of the hash of the key in its slot, or marks the slot as
+ * empty or deleted.  Slots are probed in aligned groups of OMAP_GROUP_WIDTH,
+ * so that one comparison (a single SSE2 instruction, where we have it) finds
+ * every slot in a group whose entry might match.
+ *
+ * Removing an entry never moves other entries, so it is safe to remove
+ * entries while iterating.  As with the ht.h maps, adding entries while
+ * iterating is not safe.
+ */
+
+/** Control byte for a slot that has never held an entry. */
+#define OMAP_CTRL_EMPTY 0x80
+/** Control byte for a slot whose entry was removed. */
+#define OMAP_CTRL_DELETED 0xfe
+/** True iff the control byte <b>c</b> describes a slot holding an entry. */
+#define OMAP_CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+/** Number of slots we examine at once when probing. */
+#define OMAP_GROUP_WIDTH 16
+/** Return the largest number of slots, full or deleted, that we allow in a
+ * table of <b>n</b> slots before we rebuild it. */
+#define OMAP_MAX_USED(n) ((n) - (n) / 8)
+
+/** Return a bitmask whose <b>i</b>th bit is set iff the <b>i</b>th control
+ * byte in the OMAP_GROUP_WIDTH bytes at <b>group</b> is <b>c</b>. */
+static INLINE unsigned
+omap_group_match(const uint8_t *group, uint8_t c)
+{
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,
+                                                    _mm_set1_epi8((char)c)));
+#else
+  unsigned result = 0;
+  int i;
+  for (i = 0; i < OMAP_GROUP_WIDTH; ++i)
+    result |= (unsigned)(group[i] == c) << i;
+  return result;
+#endif
+}
+
+/** Return a bitmask whose <b>i</b>th bit is set iff the <b>i</b>th slot in
+ * the group whose control bytes are at <b>group</b> holds no entry. */
+static INLINE unsigned
+omap_group_match_free(const uint8_t *group)
+{
+#ifdef __SSE2__
+  return (unsigned) _mm_movemask_epi8(
+                      _mm_loadu_si128((const __m128i *)group));
+#else
+  unsigned result = 0;
+  int i;
+  for (i = 0; i < OMAP_GROUP_WIDTH; ++i)
+    result |= (unsigned)(group[i] >> 7) << i;
+  return result;
+#endif
+}
+
+/** Return the index of the lowest set bit in <b>x</b>, which must not be
+ * 0. */
+static INLINE unsigned
+omap_lowest_bit(unsigned x)
+{
+#ifdef __GNUC__
+  return (unsigned) __builtin_ctz(x);
+#else
+  unsigned i = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    ++i;
+  }
+  return i;
+#endif
+}
+
+/** Return the first slot to probe for a key whose hash is <b>hash</b>, in a
+ * table of <b>n_slots</b> slots. */
+#define OMAP_FIRST_GROUP(hash, n_slots) \
+  ((unsigned)((hash) >> 7) & ((n_slots) - 1) & ~(OMAP_GROUP_WIDTH - 1))
+/** Return the control byte for a key whose hash is <b>hash</b>. */
+#define OMAP_HASH_CTRL(hash) ((uint8_t)((hash) & 0x7f))
+
+/** Return the index of a slot with no entry in the table with control bytes
+ * <b>ctrl</b> and <b>n_slots</b> slots, where we would put a key whose hash
+ * is <b>hash</b>.  The table must have a free slot. */
+static INLINE unsigned
+omap_find_free_slot(const uint8_t *ctrl, unsigned n_slots, uint64_t hash)
+{
+  unsigned g = OMAP_FIRST_GROUP(hash, n_slots);
+  unsigned stride = 0;
+  for (;;) {
+    unsigned m = omap_group_match_free(ctrl + g);
+    if (m)
+      return g + omap_lowest_bit(m);
+    /* Triangular steps visit every group when the number of groups is a
+     * power of two. */
+    stride += OMAP_GROUP_WIDTH;
+    g = (g + stride) & (n_slots - 1);
+  }
+}
+
+/**
+ * Macro: implement all the functions for a map that are declared in
+ * container.h by the DECLARE_MAP_FNS() macro, for a map type declared with
+ * DEFINE_OPEN_MAP_STRUCTS() whose keys are <b>keylen</b> bytes long.
+ */
+#define IMPLEMENT_OPEN_MAP_FNS(maptype, keytype, prefix, keylen)        \
+  /** Return the index of the slot in <b>map</b> holding <b>key</b>,    \
+   * whose hash is <b>hash</b>, or -1 if there is none. */              \
+  static INLINE int                                                     \
+  prefix##_find_slot(const maptype *map, const keytype key,             \
+                     uint64_t hash)                                     \
+  {                                                                     \
+    const uint8_t c = OMAP_HASH_CTRL(hash);                             \
+    unsigned g, stride = 0;                                             \
+    if (!map->n_slots)                                                  \
+      return -1;                                                        \
+    g = OMAP_FIRST_GROUP(hash, map->n_slots);                           \
+    for (;;) {                                                          \
+      const uint8_t *group = map->ctrl + g;                             \
+      unsigned m = omap_group_match(group, c);                          \
+      while (m) {                                                       \
+        unsigned i = g + omap_lowest_bit(m);                            \
+        if (tor_memeq(map->slots[i].key, key, (keylen)))                \
+          return (int)i;                                                \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      /* A key is never placed beyond a group with an empty slot. */    \
+      if (omap_group_match(group, OMAP_CTRL_EMPTY))                     \
+        return -1;                                                      \
+      stride += OMAP_GROUP_WIDTH;                                       \
+      g = (g + stride) & (map->n_slots - 1);                            \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  /** Rebuild the table for <b>map</b> so that it has room for at least \
+   * one more entry, dropping deleted slots.  If most of the used slots \
+   * hold entries, double the size of the table too. */                 \
+  static void                                                           \
+  prefix##_rebuild(maptype *map)                                        \
+  {                                                                     \
+    uint8_t *old_ctrl = map->ctrl;                                      \
+    prefix##_entry_t *old_slots = map->slots;                           \
+    const unsigned old_n_slots = map->n_slots;                          \
+    unsigned n_slots = old_n_slots;                                     \
+    unsigned i;                                                         \
+    if (!n_slots)                                                       \
+      n_slots = OMAP_GROUP_WIDTH;                                       \
+    else if ((unsigned)map->size + 1 > OMAP_MAX_USED(n_slots) / 2)      \
+      n_slots *= 2;                                                     \
+    map->ctrl = tor_malloc(n_slots);                                    \
+    memset(map->ctrl, OMAP_CTRL_EMPTY, n_slots);                        \
+    map->slots = tor_calloc(n_slots, sizeof(prefix##_entry_t));         \
+    map->n_slots = n_slots;                                             \
+    map->growth_left = (int)OMAP_MAX_USED(n_slots) - map->size;         \
+    for (i = 0; i < old_n_slots; ++i) {                                 \
+      uint64_t hash;                                                    \
+      unsigned j;                                                       \
+      if (!OMAP_CTRL_IS_FULL(old_ctrl[i]))                              \
+        continue;                                                       \
+      hash = siphash24g(old_slots[i].key, (keylen));                    \
+      j = omap_find_free_slot(map->ctrl, n_slots, hash);                \
+      map->ctrl[j] = OMAP_HASH_CTRL(hash);                              \
+      map->slots[j] = old_slots[i];                                     \
+    }                                                                   \
+    tor_free(old_ctrl);                                                 \
+    tor_free(old_slots);                                                \
+  }                                                                     \
+                                                                        \
+  /** Remove the entry in slot <b>i</b> of <b>map</b>. */               \
+  static INLINE void                                                    \
+  prefix##_erase_slot(maptype *map, unsigned i)                         \
+  {                                                                     \
+    /* If this group has an empty slot, no probe has ever gone past it, \
+     * so this slot can be empty too. */                                \
+    const unsigned g = i & ~(OMAP_GROUP_WIDTH - 1);                     \
+    if (omap_group_match(map->ctrl + g, OMAP_CTRL_EMPTY)) {             \
+      map->ctrl[i] = OMAP_CTRL_EMPTY;                                   \
+      ++map->growth_left;                                               \
+    } else {                                                            \
+      map->ctrl[i] = OMAP_CTRL_DELETED;                                 \
+    }                                                                   \
+    --map->size;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Return the first entry in <b>map</b> at or after slot <b>i</b>,   \
+   * or NULL if there is none. */                                       \
+  static INLINE prefix##_entry_t *                                      \
+  prefix##_next_full(maptype *map, unsigned i)                          \
+  {                                                                     \
+    for ( ; i < map->n_slots; ++i) {                                    \
+      if (OMAP_CTRL_IS_FULL(map->ctrl[i]))                              \
+        return &map->slots[i];                                          \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Create and return a new empty map. */                             \
+  MOCK_IMPL(maptype *,                                                  \
+  prefix##_new,(void))                                                  \
+  {                                                                     \
+    /* We don't allocate a table until we add the first entry. */       \
+    return tor_malloc_zero(sizeof(maptype));                            \
+  }                                                                     \
+                                                                        \
+  /** Return the item from <b>map</b> whose key matches <b>key</b>, or  \
+   * NULL if no such value exists. */                                   \
+  void *                                                                \
+  prefix##_get(const maptype *map, const keytype key)                   \
+  {                                                                     \
+    int i;                                                              \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    if (!map->size)                                                     \
+      return NULL;                                                      \
+    i = prefix##_find_slot(map, key, siphash24g(key, (keylen)));        \
+    return i >= 0 ? map->slots[i].val : NULL;                           \
+  }                                                                     \
+                                                                        \
+  /** Add an entry to <b>map</b> mapping <b>key</b> to <b>val</b>;      \
+   * return the previous value, or NULL if no such value existed. */     \
+  void *                                                                \
+  prefix##_set(maptype *map, const keytype key, void *val)              \
+  {                                                                     \
+    uint64_t hash;                                                      \
+    int i;                                                              \
+    unsigned j;                                                         \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    tor_assert(val);                                                    \
+    hash = siphash24g(key, (keylen));                                   \
+    i = prefix##_find_slot(map, key, hash);                             \
+    if (i >= 0) {                                                       \
+      void *oldval = map->slots[i].val;                                 \
+      map->slots[i].val = val;                                          \
+      return oldval;                                                    \
+    }                                                                   \
+    if (map->growth_left == 0)                                          \
+      prefix##_rebuild(map);                                            \
+    j = omap_find_free_slot(map->ctrl, map->n_slots, hash);             \
+    if (map->ctrl[j] == OMAP_CTRL_EMPTY)                                \
+      --map->growth_left;                                               \
+    map->ctrl[j] = OMAP_HASH_CTRL(hash);                                \
+    memcpy(map->slots[j].key, key, (keylen));                           \
+    map->slots[j].val = val;                                            \
+    ++map->size;                                                        \
+    return NULL;                                                        \
+  }                                                                     \
+                                                                        \
+  /** Remove the value currently associated with <b>key</b> from the map. \
+   * Return the value if one was set, or NULL if there was no entry for \
+   * <b>key</b>.                                                        \
+   *                                                                    \
+   * Note: you must free any storage associated with the returned value. \
+   */                                                                   \
+  void *                                                                \
+  prefix##_remove(maptype *map, const keytype key)                      \
+  {                                                                     \
+    int i;                                                              \
+    tor_assert(map);                                                    \
+    tor_assert(key);                                                    \
+    if (!map->size)                                                     \
+      return NULL;                                                      \
+    i = prefix##_find_slot(map, key, siphash24g(key, (keylen)));        \
+    if (i < 0)                                                          \
+      return NULL;                                                      \
+    prefix##_erase_slot(map, (unsigned)i);                              \
+    return map->slots[i].val;                                           \
+  }                                                                     \
+                                                                        \
+  /** Return the number of elements in <b>map</b>. */                   \
+  int                                                                   \
+  prefix##_size(const maptype *map)                                     \
+  {                                                                     \
+    return map->size;                                                   \
+  }                                                                     \
+                                                                        \
+  /** Return true iff <b>map</b> has no entries. */                     \
+  int                                                                   \
+  prefix##_isempty(const maptype *map)                                  \
+  {                                                                     \
+    return map->size == 0;                                              \
+  }                                                                     \
+                                                                        \
+  /** Return the approximate number of bytes used by <b>map</b>, not    \
+   * counting allocator overhead. */                                    \
+  size_t                                                                \
+  prefix##_mem_usage(const maptype *map)                                \
+  {                                                                     \
+    return sizeof(maptype) +                                            \
+      (size_t)map->n_slots * (1 + sizeof(prefix##_entry_t));            \
+  }                                                                     \
+                                                                        \
+  /** Assert that <b>map</b> is not corrupt. */                         \
+  void                                                                  \
+  prefix##_assert_ok(const maptype *map)                                \
+  {                                                                     \
+    unsigned i;                                                         \
+    int n_full = 0, n_deleted = 0;                                      \
+    tor_assert(map);                                                    \
+    if (!map->n_slots) {                                                \
+      tor_assert(map->size == 0);                                       \
+      return;                                                           \
+    }                                                                   \
+    tor_assert(map->n_slots >= OMAP_GROUP_WIDTH);                       \
+    tor_assert((map->n_slots & (map->n_slots - 1)) == 0);               \
+    for (i = 0; i < map->n_slots; ++i) {                                \
+      const uint8_t c = map->ctrl[i];                                   \
+      if (OMAP_CTRL_IS_FULL(c)) {                                       \
+        const uint64_t hash = siphash24g(map->slots[i].key, (keylen));  \
+        tor_assert(c == OMAP_HASH_CTRL(hash));                          \
+        tor_assert(prefix##_find_slot(map, map->slots[i].key, hash)     \
+                   == (int)i);                                          \
+        ++n_full;                                                       \
+      } else if (c == OMAP_CTRL_DELETED) {                              \
+        ++n_deleted;                                                    \
+      } else {                                                          \
+        tor_assert(c == OMAP_CTRL_EMPTY);                               \
+      }                                                                 \
+    }                                                                   \
+    tor_assert(n_full == map->size);                                    \
+    tor_assert(map->growth_left ==                                      \
+               (int)OMAP_MAX_USED(map->n_slots) - n_full - n_deleted);  \
+  }                                                                     \
+                                                                        \
+  /** Remove all entries from <b>map</b>, and deallocate storage for    \
+   * those entries.  If free_val is provided, invoked it every value in \
+   * <b>map</b>. */                                                     \
+  MOCK_IMPL(void,                                                       \
+  prefix##_free, (maptype *map, void (*free_val)(void*)))               \
+  {                                                                     \
+    unsigned i;                                                         \
+    if (!map)                                                           \
+      return;                                                           \
+    if (free_val) {                                                     \
+      for (i = 0; i < map->n_slots; ++i) {                              \
+        if (OMAP_CTRL_IS_FULL(map->ctrl[i]))                            \
+          free_val(map->slots[i].val);                                  \
+      }                                                                 \
+    }                                                                   \
+    tor_free(map->ctrl);                                                \
+    tor_free(map->slots);                                               \
+    tor_free(map);                                                      \
+  }                                                                     \
+                                                                        \
+  /** return an <b>iterator</b> pointer to the front of a map.  See     \
+   * strmap_iter_init() for an example. */                              \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_init(maptype *map)                                      \
+  {                                                                     \
+    tor_assert(map);                                                    \
+    return (prefix##_iter_t *) prefix##_next_full(map, 0);              \
+  }                                                                     \
+                                                                        \
+  /** Advance <b>iter</b> a single step to the next entry, and return   \
+   * its new value. */                                                  \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next(maptype *map, prefix##_iter_t *iter)               \
+  {                                                                     \
+    const prefix##_entry_t *ent = (const prefix##_entry_t *) iter;      \
+    tor_assert(map);                                                    \
+    tor_assert(iter);                                                   \
+    return (prefix##_iter_t *)                                          \
+      prefix##_next_full(map, (unsigned)(ent - map->slots) + 1);        \
+  }                                                                     \
+  /** Advance <b>iter</b> a single step to the next entry, removing the \
+   * current entry, and return its new value. */                        \
+  prefix##_iter_t *                                                     \
+  prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
+  {                                                                     \
+    const prefix##_entry_t *ent = (const prefix##_entry_t *) iter;      \
+    unsigned i;                                                         \
+    tor_assert(map);                                                    \
+    tor_assert(iter);                                                   \
+    i = (unsigned)(ent - map->slots);                                   \
+    tor_assert(i < map->n_slots && OMAP_CTRL_IS_FULL(map->ctrl[i]));    \
+    prefix##_erase_slot(map, i);                                        \
+    return (prefix##_iter_t *) prefix##_next_full(map, i + 1);          \
+  }                                                                     \
+  /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
+   * to by iter. */                                                     \
+  void                                                                  \
+  prefix##_iter_get(prefix##_iter_t *iter, const keytype *keyp,         \
+                    void **valp)                                        \
+  {                                                                     \
+    prefix##_entry_t *ent = (prefix##_entry_t *) iter;                  \
     tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
     tor_assert(keyp);                                                   \
     tor_assert(valp);                                                   \
-    *keyp = (*iter)->key;                                               \
-    *valp = (*iter)->val;                                               \
+    *keyp = ent->key;                                                   \
+    *valp = ent->val;                                                   \
   }                                                                     \
   /** Return true iff <b>iter</b> has advanced past the last entry of   \
    * <b>map</b>. */                                                     \
@@ -1363,8 +1864,18 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   }
 
 IMPLEMENT_MAP_FNS(strmap_t, char *, strmap)
+IMPLEMENT_MAP_FNS(digestmap_ht_t, char *, digestmap_ht)
+#ifdef DIGESTMAP_USE_CHAINED_HT
 IMPLEMENT_MAP_FNS(digestmap_t, char *, digestmap)
+#else
+IMPLEMENT_OPEN_MAP_FNS(digestmap_t, char *, digestmap, DIGEST_LEN)
+#endif
+#ifdef DIGEST256MAP_USE_CHAINED_HT
 IMPLEMENT_MAP_FNS(digest256map_t, uint8_t *, digest256map)
+#else
+IMPLEMENT_OPEN_MAP_FNS(digest256map_t, uint8_t *, digest256map,
+                       DIGEST256_LEN)
+#endif
 
 /** Same as strmap_set, but first converts <b>key</b> to lowercase. */
 void *
@@ -341,7 +341,7 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
 
 #define DECLARE_MAP_FNS(maptype, keytype, prefix)                       \
   typedef struct maptype maptype;                                       \
-  typedef struct prefix##entry_t *prefix##iter_t;                       \
+  typedef struct prefix##iter_t prefix##iter_t;                         \
   MOCK_DECL(maptype*, prefix##new, (void));                             \
   void* prefix##set(maptype *map, keytype key, void *val);              \
   void* prefix##get(const maptype *map, keytype key);                   \
@@ -358,12 +358,26 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
 
 /* Map from const char * to void *. Implemented with a hash table. */
 DECLARE_MAP_FNS(strmap_t, const char *, strmap_);
-/* Map from const char[DIGEST_LEN] to void *. Implemented with a hash table. */
+/* Map from const char[DIGEST_LEN] to void *. Implemented with an
+ * open-addressing hash table, unless DIGESTMAP_USE_CHAINED_HT is defined. */
 DECLARE_MAP_FNS(digestmap_t, const char *, digestmap_);
-/* Map from const uint8_t[DIGEST_LEN] to void *. Implemented with a hash
- * table. */
+/* Map from const uint8_t[DIGEST_LEN] to void *. Implemented with an
+ * open-addressing hash table, unless DIGEST256MAP_USE_CHAINED_HT is
+ * defined. */
 DECLARE_MAP_FNS(digest256map_t, const uint8_t *, digest256map_);
 
+#ifdef CONTAINER_PRIVATE
+/* Map from const char[DIGEST_LEN] to void *, always implemented with the
+ * chained hash table from ht.h.  Exposed so that tests and benchmarks can
+ * compare it with digestmap_t. */
+DECLARE_MAP_FNS(digestmap_ht_t, const char *, digestmap_ht_);
+
+size_t strmap_mem_usage(const strmap_t *map);
+size_t digestmap_mem_usage(const digestmap_t *map);
+size_t digest256map_mem_usage(const digest256map_t *map);
+size_t digestmap_ht_mem_usage(const digestmap_ht_t *map);
+#endif
+
 #undef DECLARE_MAP_FNS
 
 /** Iterates over the key-value pairs in a map <b>map</b> in order.
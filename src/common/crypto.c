@@ -51,6 +51,7 @@
 
 #define CRYPTO_PRIVATE
 #include "crypto.h"
+#include "crypto_curve25519.h"
 #include "torlog.h"
 #include "aes.h"
 #include "util.h"
@@ -313,6 +314,9 @@ crypto_early_init(void)
       return -1;
     if (crypto_init_siphash_key() < 0)
       return -1;
+    crypto_fast_rng_global_init();
+    if (curve25519_init() < 0)
+      return -1;
   }
   return 0;
 }
@@ -405,6 +409,7 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 void
 crypto_thread_cleanup(void)
 {
+  destroy_thread_fast_rng();
   ERR_remove_state(0);
 }
 
@@ -2407,7 +2412,7 @@ smartlist_choose(const smartlist_t *sl)
 {
   int len = smartlist_len(sl);
   if (len)
-    return smartlist_get(sl,crypto_rand_int(len));
+    return smartlist_get(sl,crypto_fast_rand_int(len));
   return NULL; /* no elements to choose from */
 }
 
@@ -2421,7 +2426,7 @@ smartlist_shuffle(smartlist_t *sl)
      current position.  Remember to give "no swap" the same probability as
      any other swap. */
   for (i = smartlist_len(sl)-1; i > 0; --i) {
-    int j = crypto_rand_int(i+1);
+    int j = crypto_fast_rand_int(i+1);
     smartlist_swap(sl, i, j);
   }
 }
@@ -2911,6 +2916,7 @@ setup_openssl_threading(void)
 int
 crypto_global_cleanup(void)
 {
+  crypto_fast_rng_global_cleanup();
   EVP_cleanup();
   ERR_remove_state(0);
   ERR_free_strings();
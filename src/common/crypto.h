@@ -260,6 +260,24 @@ struct tor_weak_rng_t;
 void crypto_seed_weak_rng(struct tor_weak_rng_t *rng);
 int crypto_init_siphash_key(void);
 
+/* fast, buffered, per-thread random numbers; see crypto_rand_fast.c */
+typedef struct crypto_fast_rng_t crypto_fast_rng_t;
+crypto_fast_rng_t *crypto_fast_rng_new(void);
+void crypto_fast_rng_free(crypto_fast_rng_t *rng);
+void crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out,
+                              size_t n);
+unsigned crypto_fast_rng_get_uint(crypto_fast_rng_t *rng, unsigned limit);
+uint64_t crypto_fast_rng_get_uint64(crypto_fast_rng_t *rng, uint64_t limit);
+double crypto_fast_rng_get_double(crypto_fast_rng_t *rng);
+void crypto_fast_rng_global_init(void);
+void crypto_fast_rng_global_cleanup(void);
+crypto_fast_rng_t *get_thread_fast_rng(void);
+void destroy_thread_fast_rng(void);
+void crypto_fast_rand(char *to, size_t n);
+int crypto_fast_rand_int(unsigned int max);
+uint64_t crypto_fast_rand_uint64(uint64_t max);
+double crypto_fast_rand_double(void);
+
 char *crypto_random_hostname(int min_rand_len, int max_rand_len,
                              const char *prefix, const char *suffix);
 
@@ -13,6 +13,7 @@
 #include "crypto_curve25519.h"
 #include "util.h"
 #include "torlog.h"
+#include "ed25519/ref10/ed25519_ref10.h"
 
 /* ==============================
    Part 1: wrap a suitable curve25519 implementation as curve25519_impl
@@ -50,6 +51,70 @@ curve25519_impl(uint8_t *output, const uint8_t *secret,
   return r;
 }
 
+/** Compute <b>secret</b> times the curve25519 base point, and store the
+ * result in <b>output</b>.  We use ed25519's precomputed fixed-base tables
+ * for this, which is faster than running the Montgomery ladder. */
+STATIC int
+curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret)
+{
+  return ed25519_ref10_scalarmult_curve25519_basepoint(output, secret);
+}
+
+/** Return 0 if curve25519_impl() and curve25519_basepoint_impl() get the
+ * right answers for the test vectors from RFC 7748, section 6.1, and -1
+ * otherwise. */
+static int
+curve25519_selftest(void)
+{
+  static const uint8_t alice_sk[32] = {
+    0x77,0x07,0x6d,0x0a,0x73,0x18,0xa5,0x7d,0x3c,0x16,0xc1,0x72,0x51,0xb2,
+    0x66,0x45,0xdf,0x4c,0x2f,0x87,0xeb,0xc0,0x99,0x2a,0xb1,0x77,0xfb,0xa5,
+    0x1d,0xb9,0x2c,0x2a };
+  static const uint8_t alice_pk[32] = {
+    0x85,0x20,0xf0,0x09,0x89,0x30,0xa7,0x54,0x74,0x8b,0x7d,0xdc,0xb4,0x3e,
+    0xf7,0x5a,0x0d,0xbf,0x3a,0x0d,0x26,0x38,0x1a,0xf4,0xeb,0xa4,0xa9,0x8e,
+    0xaa,0x9b,0x4e,0x6a };
+  static const uint8_t bob_sk[32] = {
+    0x5d,0xab,0x08,0x7e,0x62,0x4a,0x8a,0x4b,0x79,0xe1,0x7f,0x8b,0x83,0x80,
+    0x0e,0xe6,0x6f,0x3b,0xb1,0x29,0x26,0x18,0xb6,0xfd,0x1c,0x2f,0x8b,0x27,
+    0xff,0x88,0xe0,0xeb };
+  static const uint8_t bob_pk[32] = {
+    0xde,0x9e,0xdb,0x7d,0x7b,0x7d,0xc1,0xb4,0xd3,0x5b,0x61,0xc2,0xec,0xe4,
+    0x35,0x37,0x3f,0x83,0x43,0xc8,0x5b,0x78,0x67,0x4d,0xad,0xfc,0x7e,0x14,
+    0x6f,0x88,0x2b,0x4f };
+  static const uint8_t shared[32] = {
+    0x4a,0x5d,0x9d,0x5b,0xa4,0xce,0x2d,0xe1,0x72,0x8e,0x3b,0xf4,0x80,0x35,
+    0x0f,0x25,0xe0,0x7e,0x21,0xc9,0x47,0xd1,0x9e,0x33,0x76,0xf0,0x9b,0x3c,
+    0x1e,0x16,0x17,0x42 };
+  uint8_t out[32];
+
+  if (curve25519_basepoint_impl(out, alice_sk) < 0 ||
+      tor_memneq(out, alice_pk, 32))
+    return -1;
+  if (curve25519_basepoint_impl(out, bob_sk) < 0 ||
+      tor_memneq(out, bob_pk, 32))
+    return -1;
+  if (curve25519_impl(out, alice_sk, bob_pk) < 0 ||
+      tor_memneq(out, shared, 32))
+    return -1;
+  if (curve25519_impl(out, bob_sk, alice_pk) < 0 ||
+      tor_memneq(out, shared, 32))
+    return -1;
+  return 0;
+}
+
+/** Check our curve25519 code against known answers.  Return 0 on success,
+ * or -1 if it is broken. */
+int
+curve25519_init(void)
+{
+  if (curve25519_selftest() < 0) {
+    log_warn(LD_BUG, "Our curve25519 implementation failed its self-test.");
+    return -1;
+  }
+  return 0;
+}
+
 /* ==============================
    Part 2: Wrap curve25519_impl with some convenience types and functions.
    ============================== */
@@ -113,9 +178,7 @@ void
 curve25519_public_key_generate(curve25519_public_key_t *key_out,
                                const curve25519_secret_key_t *seckey)
 {
-  static const uint8_t basepoint[32] = {9};
-
-  curve25519_impl(key_out->public_key, seckey->secret_key, basepoint);
+  curve25519_basepoint_impl(key_out->public_key, seckey->secret_key);
 }
 
 int
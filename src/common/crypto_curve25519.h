@@ -58,9 +58,12 @@ int curve25519_keypair_read_from_file(curve25519_keypair_t *keypair_out,
 
 int curve25519_rand_seckey_bytes(uint8_t *out, int extra_strong);
 
+int curve25519_init(void);
+
 #ifdef CRYPTO_CURVE25519_PRIVATE
 STATIC int curve25519_impl(uint8_t *output, const uint8_t *secret,
                            const uint8_t *basepoint);
+STATIC int curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret);
 #endif
 
 #define CURVE25519_BASE64_PADDED_LEN 44
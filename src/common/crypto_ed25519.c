@@ -119,6 +119,12 @@ ed25519_checksig(const ed25519_signature_t *signature,
  * <b>checkable</b> is valid, and to 0 otherwise.  Return 0 if every signature
  * was valid. Otherwise return -N, where N is the number of invalid
  * signatures.
+ *
+ * We check the signatures one at a time.  A multi-scalar batch equation
+ * has to be multiplied by the cofactor, so it can't see a small-order
+ * component in R or the public key that ed25519_checksig() would reject.
+ * Ruling those out takes a scalar multiplication for each R and key, which
+ * costs more than the batch saves; see bench_ed25519_batch in bench.c.
  */
 int
 ed25519_checksig_batch(int *okay_out,
@@ -137,44 +143,6 @@ ed25519_checksig_batch(int *okay_out,
       okay_out[i] = (r == 0);
   }
 
-#if 0
-  /* This is how we'd do it if we were using ed25519_donna.  I'll keep this
-   * code around here in case we ever do that. */
-  const uint8_t **ms;
-  size_t *lens;
-  const uint8_t **pks;
-  const uint8_t **sigs;
-  int *oks;
-
-  ms = tor_malloc(sizeof(uint8_t*)*n_checkable);
-  lens = tor_malloc(sizeof(size_t)*n_checkable);
-  pks = tor_malloc(sizeof(uint8_t*)*n_checkable);
-  sigs = tor_malloc(sizeof(uint8_t*)*n_checkable);
-  oks = okay_out ? okay_out : tor_malloc(sizeof(int)*n_checkable);
-
-  for (i = 0; i < n_checkable; ++i) {
-    ms[i] = checkable[i].msg;
-    lens[i] = checkable[i].len;
-    pks[i] = checkable[i].pubkey->pubkey;
-    sigs[i] = checkable[i].signature.sig;
-    oks[i] = 0;
-  }
-
-  ed25519_sign_open_batch_donna_fb(ms, lens, pks, sigs, n_checkable, oks);
-
-  res = 0;
-  for (i = 0; i < n_checkable; ++i) {
-    if (!oks[i])
-      --res;
-  }
-
-  tor_free(ms);
-  tor_free(lens);
-  tor_free(pks);
-  if (! okay_out)
-    tor_free(oks);
-#endif
-
   return res;
 }
 
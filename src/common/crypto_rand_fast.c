@@ -0,0 +1,296 @@
+/* Copyright (c) 2001, Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.c
+ *
+ * \brief A fast, buffered, per-thread random number generator.
+ *
+ * crypto_rand() goes through OpenSSL's RAND_bytes() every time, which takes
+ * a global lock and has a fair amount of per-call overhead.  That's fine
+ * for generating keys, but silly for the many places that just need a few
+ * unpredictable bytes: choosing nodes for a path, picking circuit IDs,
+ * stream IDs, DNS transaction IDs, and so on.
+ *
+ * For those, we keep a separate generator in each thread.  It runs
+ * AES-CTR to fill a buffer, hands out bytes from that buffer (erasing them
+ * as it goes), and uses the first bytes of every refill as the key for the
+ * next one, so that compromising the state later doesn't reveal earlier
+ * outputs.  Every few refills, and after every fork, we throw the key away
+ * and reseed from crypto_rand(), so OpenSSL remains our source of entropy.
+ *
+ * Don't use this for long-term keys: use crypto_rand() or
+ * crypto_strongest_rand() for those.
+ **/
+
+#include "orconfig.h"
+#include "crypto.h"
+#include "aes.h"
+#include "compat.h"
+#include "compat_threads.h"
+#include "util.h"
+#include "torlog.h"
+
+#include <limits.h>
+
+/** How many bytes of key and IV do we need to seed the generator? */
+#define FAST_RNG_SEED_LEN (CIPHER_KEY_LEN + CIPHER_IV_LEN)
+/** How many bytes of keystream do we generate at a time? */
+#define FAST_RNG_BUFLEN 4096
+/** How many times do we refill the buffer from its own output before we
+ * reseed from crypto_rand()? */
+#define FAST_RNG_RESEED_AFTER 16
+
+/** State for a fast random number generator. */
+struct crypto_fast_rng_t {
+  /** How many more refills can we do before we must reseed? */
+  int n_till_reseed;
+  /** How many unused bytes are there at the end of <b>buf</b>? */
+  uint16_t bytes_left;
+  /** Value of fast_rng_fork_generation when we last reseeded.  If it has
+   * changed, we're in a child process that shares our parent's state,
+   * and we need to reseed before we hand out anything. */
+  unsigned fork_generation;
+  /** The first FAST_RNG_SEED_LEN bytes are the key and IV for the next
+   * refill; the rest are output that we haven't handed out yet. */
+  uint8_t buf[FAST_RNG_BUFLEN];
+};
+
+/** Incremented in every child process that we fork. */
+static volatile unsigned fast_rng_fork_generation = 0;
+/** Each thread's crypto_fast_rng_t, as returned by get_thread_fast_rng. */
+static tor_threadlocal_t thread_rng;
+/** True iff thread_rng has been initialized. */
+static int thread_rng_initialized = 0;
+
+#ifdef USE_PTHREADS
+/** Called in the child after a fork(): make every generator reseed. */
+static void
+crypto_fast_rng_postfork_child(void)
+{
+  ++fast_rng_fork_generation;
+}
+#endif
+
+/** Replace the key and IV in <b>rng</b> with fresh material from
+ * crypto_rand(), and discard any output we haven't handed out yet. */
+static void
+crypto_fast_rng_reseed(crypto_fast_rng_t *rng)
+{
+  int r = crypto_rand((char*)rng->buf, FAST_RNG_SEED_LEN);
+  tor_assert(r == 0);
+  memwipe(rng->buf + FAST_RNG_SEED_LEN, 0,
+          FAST_RNG_BUFLEN - FAST_RNG_SEED_LEN);
+  rng->bytes_left = 0;
+  rng->n_till_reseed = FAST_RNG_RESEED_AFTER;
+  rng->fork_generation = fast_rng_fork_generation;
+}
+
+/** Fill <b>rng</b>'s buffer with keystream generated from its current key
+ * and IV, which get overwritten in the process. */
+static void
+crypto_fast_rng_refill(crypto_fast_rng_t *rng)
+{
+  aes_cnt_cipher_t *cipher;
+
+  if (rng->n_till_reseed-- <= 0)
+    crypto_fast_rng_reseed(rng);
+
+  cipher = aes_new_cipher((const char*)rng->buf,
+                          (const char*)rng->buf + CIPHER_KEY_LEN);
+  memset(rng->buf, 0, FAST_RNG_BUFLEN);
+  aes_crypt_inplace(cipher, (char*)rng->buf, FAST_RNG_BUFLEN);
+  aes_cipher_free(cipher);
+
+  rng->bytes_left = FAST_RNG_BUFLEN - FAST_RNG_SEED_LEN;
+}
+
+/** Allocate and return a new fast random number generator, seeded from
+ * crypto_rand(). */
+crypto_fast_rng_t *
+crypto_fast_rng_new(void)
+{
+  crypto_fast_rng_t *rng = tor_malloc_zero(sizeof(crypto_fast_rng_t));
+  crypto_fast_rng_reseed(rng);
+  crypto_fast_rng_refill(rng);
+  return rng;
+}
+
+/** Release all storage held by <b>rng</b>. */
+void
+crypto_fast_rng_free(crypto_fast_rng_t *rng)
+{
+  if (!rng)
+    return;
+  memwipe(rng, 0, sizeof(crypto_fast_rng_t));
+  tor_free(rng);
+}
+
+/** Write <b>n</b> random bytes from <b>rng</b> into <b>out</b>. */
+void
+crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n)
+{
+  tor_assert(rng);
+  tor_assert(out || n == 0);
+
+  if (PREDICT_UNLIKELY(rng->fork_generation != fast_rng_fork_generation)) {
+    crypto_fast_rng_reseed(rng);
+  }
+
+  while (n) {
+    size_t take;
+    uint8_t *ptr;
+    if (rng->bytes_left == 0)
+      crypto_fast_rng_refill(rng);
+
+    take = MIN(n, rng->bytes_left);
+    ptr = rng->buf + FAST_RNG_BUFLEN - rng->bytes_left;
+    memcpy(out, ptr, take);
+    /* Never hand out the same bytes twice, and don't keep them around. */
+    memwipe(ptr, 0, take);
+    out += take;
+    n -= take;
+    rng->bytes_left -= take;
+  }
+}
+
+/** Return a random integer, chosen uniformly from the values between 0 and
+ * <b>limit</b>-1 inclusive, using <b>rng</b>.  <b>limit</b> must be between
+ * 1 and UINT_MAX, inclusive. */
+unsigned
+crypto_fast_rng_get_uint(crypto_fast_rng_t *rng, unsigned limit)
+{
+  unsigned val, cutoff;
+  tor_assert(limit > 0);
+
+  /* As in crypto_rand_int(), reject values past the last multiple of
+   * limit to avoid biasing the result. */
+  cutoff = UINT_MAX - (UINT_MAX%limit);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t*)&val, sizeof(val));
+    if (val < cutoff)
+      return val % limit;
+  }
+}
+
+/** Return a random 64-bit integer, chosen uniformly from the values between
+ * 0 and <b>limit</b>-1 inclusive, using <b>rng</b>. */
+uint64_t
+crypto_fast_rng_get_uint64(crypto_fast_rng_t *rng, uint64_t limit)
+{
+  uint64_t val, cutoff;
+  tor_assert(limit < UINT64_MAX);
+  tor_assert(limit > 0);
+
+  cutoff = UINT64_MAX - (UINT64_MAX%limit);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t*)&val, sizeof(val));
+    if (val < cutoff)
+      return val % limit;
+  }
+}
+
+/** Return a random double d, chosen uniformly from the range
+ * 0.0 <= d < 1.0, using <b>rng</b>. */
+double
+crypto_fast_rng_get_double(crypto_fast_rng_t *rng)
+{
+  uint32_t val;
+  crypto_fast_rng_getbytes(rng, (uint8_t*)&val, sizeof(val));
+  return ((double)val) / 4294967296.0;
+}
+
+/** Set up the global state for the per-thread generators.  Called from
+ * crypto_early_init(), before we start any other threads. */
+void
+crypto_fast_rng_global_init(void)
+{
+  if (thread_rng_initialized)
+    return;
+  if (tor_threadlocal_init(&thread_rng) < 0) {
+    log_err(LD_CRYPTO, "Unable to allocate thread-local storage for our "
+            "random number generator.");
+    tor_assert(0);
+  }
+#ifdef USE_PTHREADS
+  pthread_atfork(NULL, NULL, crypto_fast_rng_postfork_child);
+#endif
+  thread_rng_initialized = 1;
+}
+
+/** Release the current thread's generator and the global state for the
+ * per-thread generators. */
+void
+crypto_fast_rng_global_cleanup(void)
+{
+  if (!thread_rng_initialized)
+    return;
+  destroy_thread_fast_rng();
+  tor_threadlocal_destroy(&thread_rng);
+  thread_rng_initialized = 0;
+}
+
+/** Return the current thread's fast random number generator, creating it
+ * if necessary.  The result must not be shared with any other thread. */
+crypto_fast_rng_t *
+get_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+  if (PREDICT_UNLIKELY(!thread_rng_initialized))
+    crypto_fast_rng_global_init();
+
+  rng = tor_threadlocal_get(&thread_rng);
+  if (PREDICT_UNLIKELY(rng == NULL)) {
+    rng = crypto_fast_rng_new();
+    tor_threadlocal_set(&thread_rng, rng);
+  }
+  return rng;
+}
+
+/** Release the current thread's fast random number generator, if it has
+ * one. */
+void
+destroy_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+  if (!thread_rng_initialized)
+    return;
+  rng = tor_threadlocal_get(&thread_rng);
+  if (rng) {
+    crypto_fast_rng_free(rng);
+    tor_threadlocal_set(&thread_rng, NULL);
+  }
+}
+
+/** Write <b>n</b> bytes of random data to <b>to</b>, using this thread's
+ * fast generator.  Not for key material. */
+void
+crypto_fast_rand(char *to, size_t n)
+{
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), (uint8_t*)to, n);
+}
+
+/** As crypto_rand_int(), but use this thread's fast generator. */
+int
+crypto_fast_rand_int(unsigned int max)
+{
+  tor_assert(max <= ((unsigned int)INT_MAX)+1);
+  return (int) crypto_fast_rng_get_uint(get_thread_fast_rng(), max);
+}
+
+/** As crypto_rand_uint64(), but use this thread's fast generator. */
+uint64_t
+crypto_fast_rand_uint64(uint64_t max)
+{
+  return crypto_fast_rng_get_uint64(get_thread_fast_rng(), max);
+}
+
+/** As crypto_rand_double(), but use this thread's fast generator. */
+double
+crypto_fast_rand_double(void)
+{
+  return crypto_fast_rng_get_double(get_thread_fast_rng());
+}
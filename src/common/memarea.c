@@ -112,33 +112,67 @@ static int freelist_len=0;
 /** A linked list of unused memory area chunks.  Used to prevent us from
  * spinning in malloc/free loops. */
 static memarea_chunk_t *freelist = NULL;
+/** If set, protects freelist and freelist_len, so that we can use memareas
+ * from more than one thread at once. */
+static tor_mutex_t *freelist_mutex = NULL;
+
+/** Acquire freelist_mutex, if we have one. */
+static INLINE void
+freelist_lock(void)
+{
+  if (freelist_mutex)
+    tor_mutex_acquire(freelist_mutex);
+}
+
+/** Release freelist_mutex, if we have one. */
+static INLINE void
+freelist_unlock(void)
+{
+  if (freelist_mutex)
+    tor_mutex_release(freelist_mutex);
+}
+
+/** Make memareas safe to create and drop from more than one thread.  Call
+ * this from the main thread before starting any other threads. */
+void
+memarea_init_threads(void)
+{
+  if (!freelist_mutex)
+    freelist_mutex = tor_mutex_new();
+}
 
 /** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
 static memarea_chunk_t *
 alloc_chunk(size_t sz, int freelist_ok)
 {
+  memarea_chunk_t *res = NULL;
+  size_t chunk_size;
   tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
-    memarea_chunk_t *res = freelist;
-    freelist = res->next_chunk;
+  if (freelist_ok) {
+    freelist_lock();
+    if ((res = freelist)) {
+      freelist = res->next_chunk;
+      --freelist_len;
+    }
+    freelist_unlock();
+  }
+  if (res) {
     res->next_chunk = NULL;
-    --freelist_len;
     CHECK_SENTINEL(res);
     return res;
-  } else {
-    size_t chunk_size = freelist_ok ? CHUNK_SIZE : sz;
-    memarea_chunk_t *res;
-    chunk_size += SENTINEL_LEN;
-    res = tor_malloc(chunk_size);
-    res->next_chunk = NULL;
-    res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
-    res->next_mem = res->U_MEM;
-    tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
-               ((char*)res)+chunk_size);
-    tor_assert(realign_pointer(res->next_mem) == res->next_mem);
-    SET_SENTINEL(res);
-    return res;
   }
+
+  chunk_size = freelist_ok ? CHUNK_SIZE : sz;
+  chunk_size += SENTINEL_LEN;
+  res = tor_malloc(chunk_size);
+  res->next_chunk = NULL;
+  res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
+  res->next_mem = res->U_MEM;
+  tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
+             ((char*)res)+chunk_size);
+  tor_assert(realign_pointer(res->next_mem) == res->next_mem);
+  SET_SENTINEL(res);
+  return res;
 }
 
 /** Release <b>chunk</b> from a memarea, either by adding it to the freelist
@@ -147,14 +181,16 @@ static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
   CHECK_SENTINEL(chunk);
+  chunk->next_mem = chunk->U_MEM;
+  freelist_lock();
   if (freelist_len < MAX_FREELIST_LEN) {
     ++freelist_len;
     chunk->next_chunk = freelist;
     freelist = chunk;
-    chunk->next_mem = chunk->U_MEM;
-  } else {
-    tor_free(chunk);
+    chunk = NULL;
   }
+  freelist_unlock();
+  tor_free(chunk);
 }
 
 /** Allocate and return new memarea. */
@@ -202,12 +238,15 @@ void
 memarea_clear_freelist(void)
 {
   memarea_chunk_t *chunk, *next;
+  freelist_lock();
+  chunk = freelist;
+  freelist = NULL;
   freelist_len = 0;
-  for (chunk = freelist; chunk; chunk = next) {
+  freelist_unlock();
+  for ( ; chunk; chunk = next) {
     next = chunk->next_chunk;
     tor_free(chunk);
   }
-  freelist = NULL;
 }
 
 /** Return true iff <b>p</b> is in a range that has been returned by an
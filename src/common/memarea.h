@@ -19,6 +19,7 @@ char *memarea_strndup(memarea_t *area, const char *s, size_t n);
 void memarea_get_stats(memarea_t *area,
                        size_t *allocated_out, size_t *used_out);
 void memarea_clear_freelist(void);
+void memarea_init_threads(void);
 void memarea_assert_ok(memarea_t *area);
 
 #endif
@@ -46,6 +46,10 @@
 
 #include <zlib.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 static size_t tor_zlib_state_size_precalc(int inflate,
                                           int windowbits, int memlevel);
 
@@ -90,6 +94,93 @@ tor_zlib_get_header_version_str(void)
   return ZLIB_VERSION;
 }
 
+/** Return a string representation of the version of the currently running
+ * version of libzstd, or NULL if we weren't built with it. */
+const char *
+tor_zstd_get_version_str(void)
+{
+#ifdef HAVE_ZSTD
+  return ZSTD_versionString();
+#else
+  return NULL;
+#endif
+}
+
+/** Return a string representation of the version of libzstd used at
+ * compilation, or NULL if we weren't built with it. */
+const char *
+tor_zstd_get_header_version_str(void)
+{
+#ifdef HAVE_ZSTD
+  return ZSTD_VERSION_STRING;
+#else
+  return NULL;
+#endif
+}
+
+/** Return true iff we can compress and decompress using <b>method</b>.
+ * NO_METHOD and UNKNOWN_METHOD are never supported. */
+int
+tor_compress_supports_method(compress_method_t method)
+{
+  switch (method) {
+    case GZIP_METHOD:
+      return is_gzip_supported();
+    case ZLIB_METHOD:
+      return 1;
+    case ZSTD_METHOD:
+#ifdef HAVE_ZSTD
+      return 1;
+#else
+      return 0;
+#endif
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+    default:
+      return 0;
+  }
+}
+
+/** Table mapping HTTP content-coding names to compression methods.  The
+ * first name listed for each method is the one we send. */
+static const struct {
+  const char *name;
+  compress_method_t method;
+} compression_method_names[] = {
+  { "identity", NO_METHOD },
+  { "deflate", ZLIB_METHOD },
+  { "x-deflate", ZLIB_METHOD },
+  { "gzip", GZIP_METHOD },
+  { "x-gzip", GZIP_METHOD },
+  { "x-zstd", ZSTD_METHOD },
+};
+
+/** Return the HTTP content-coding name for <b>method</b>, or NULL if it
+ * has none. */
+const char *
+compression_method_get_name(compress_method_t method)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_names); ++i) {
+    if (compression_method_names[i].method == method)
+      return compression_method_names[i].name;
+  }
+  return NULL;
+}
+
+/** Return the compression method for the HTTP content-coding <b>name</b>,
+ * or UNKNOWN_METHOD if we don't recognize it. */
+compress_method_t
+compression_method_get_by_name(const char *name)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_names); ++i) {
+    if (!strcmp(compression_method_names[i].name, name))
+      return compression_method_names[i].method;
+  }
+  return UNKNOWN_METHOD;
+}
+
 /** Return the 'bits' value to tell zlib to use <b>method</b>.*/
 static INLINE int
 method_bits(compress_method_t method, zlib_compression_level_t level)
@@ -144,19 +235,25 @@ is_compression_bomb(size_t size_in, size_t size_out)
   return (size_out / size_in > MAX_UNCOMPRESSION_FACTOR);
 }
 
-/** Given <b>in_len</b> bytes at <b>in</b>, compress them into a newly
- * allocated buffer, using the method described in <b>method</b>.  Store the
- * compressed string in *<b>out</b>, and its length in *<b>out_len</b>.
- * Return 0 on success, -1 on failure.
- */
-int
-tor_gzip_compress(char **out, size_t *out_len,
+/** Helper for tor_gzip_compress and tor_gzip_uncompress: run all
+ * <b>in_len</b> bytes at <b>in</b> through a tor_zlib_state_t for
+ * <b>method</b>, compressing if <b>compress</b> is true, and growing the
+ * output buffer as needed.  Arguments and return value are as for
+ * tor_gzip_uncompress. */
+static int
+tor_compress_impl(int compress,
+                  char **out, size_t *out_len,
                   const char *in, size_t in_len,
-                  compress_method_t method)
+                  compress_method_t method,
+                  int complete_only,
+                  int protocol_warn_level)
 {
-  struct z_stream_s *stream = NULL;
-  size_t out_size, old_size;
-  off_t offset;
+  tor_zlib_state_t *state;
+  const size_t in_len_orig = in_len;
+  /* If we're compressing, or we need the whole input, tell the codec that
+   * there's no more input coming, so that it flushes everything. */
+  const int finish = compress || complete_only;
+  size_t out_alloc, out_used = 0;
 
   tor_assert(out);
   tor_assert(out_len);
@@ -164,107 +261,106 @@ tor_gzip_compress(char **out, size_t *out_len,
   tor_assert(in_len < UINT_MAX);
 
   *out = NULL;
-
-  if (method == GZIP_METHOD && !is_gzip_supported()) {
-    /* Old zlib version don't support gzip in deflateInit2 */
-    log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
+  if (!(state = tor_zlib_new(compress, method, HIGH_COMPRESSION)))
     goto err;
-  }
-
-  stream = tor_malloc_zero(sizeof(struct z_stream_s));
-  stream->zalloc = Z_NULL;
-  stream->zfree = Z_NULL;
-  stream->opaque = NULL;
-  stream->next_in = (unsigned char*) in;
-  stream->avail_in = (unsigned int)in_len;
-
-  if (deflateInit2(stream, Z_BEST_COMPRESSION, Z_DEFLATED,
-                   method_bits(method, HIGH_COMPRESSION),
-                   get_memlevel(HIGH_COMPRESSION),
-                   Z_DEFAULT_STRATEGY) != Z_OK) {
-    log_warn(LD_GENERAL, "Error from deflateInit2: %s",
-             stream->msg?stream->msg:"<no message>");
-    goto err;
-  }
 
   /* Guess 50% compression. */
-  out_size = in_len / 2;
-  if (out_size < 1024) out_size = 1024;
-  *out = tor_malloc(out_size);
-  stream->next_out = (unsigned char*)*out;
-  stream->avail_out = (unsigned int)out_size;
+  out_alloc = compress ? in_len / 2 : in_len * 2;
+  if (out_alloc < 1024) out_alloc = 1024;
+  if (out_alloc >= SIZE_T_CEILING)
+    goto err;
+  *out = tor_malloc(out_alloc);
 
   while (1) {
-    switch (deflate(stream, Z_FINISH))
-      {
-      case Z_STREAM_END:
-        goto done;
-      case Z_OK:
-        /* In case zlib doesn't work as I think .... */
-        if (stream->avail_out >= stream->avail_in+16)
-          break;
-      case Z_BUF_ERROR:
-        offset = stream->next_out - ((unsigned char*)*out);
-        old_size = out_size;
-        out_size *= 2;
-        if (out_size < old_size) {
-          log_warn(LD_GENERAL, "Size overflow in compression.");
+    char *next = *out + out_used;
+    /* Leave room for a NUL. */
+    size_t avail = out_alloc - out_used - 1;
+    size_t old_avail;
+    tor_zlib_output_t r;
+    /* zlib can only take an unsigned int's worth of output at once. */
+    if (avail > UINT_MAX)
+      avail = UINT_MAX;
+    old_avail = avail;
+    r = tor_zlib_process(state, &next, &avail, &in, &in_len, finish);
+    out_used += old_avail - avail;
+    switch (r) {
+      case TOR_ZLIB_DONE:
+        if (in_len == 0 || compress)
+          goto done;
+        /* There may be more compressed data here. */
+        tor_zlib_free(state);
+        if (!(state = tor_zlib_new(compress, method, HIGH_COMPRESSION)))
           goto err;
+        break;
+      case TOR_ZLIB_OK:
+        if (in_len == 0) {
+          if (complete_only && !compress) {
+            log_fn(protocol_warn_level, LD_PROTOCOL,
+                   "possible truncated or corrupt compressed data");
+            goto err;
+          }
+          goto done;
         }
-        *out = tor_realloc(*out, out_size);
-        stream->next_out = (unsigned char*)(*out + offset);
-        if (out_size - offset > UINT_MAX) {
-          log_warn(LD_BUG,  "Ran over unsigned int limit of zlib while "
-                   "uncompressing.");
+        break;
+      case TOR_ZLIB_BUF_FULL:
+        if (!compress && avail > 0) {
+          /* The codec wanted more input than we had, so the input is
+           * truncated or corrupt. */
+          log_fn(protocol_warn_level, LD_PROTOCOL,
+                 "possible truncated or corrupt compressed data");
           goto err;
         }
-        stream->avail_out = (unsigned int)(out_size - offset);
+        if (out_alloc >= SIZE_T_CEILING / 2) {
+          log_warn(LD_BUG, "Hit SIZE_T_CEILING limit while %scompressing.",
+                   compress ? "" : "un");
+          goto err;
+        }
+        out_alloc *= 2;
+        if (!compress && is_compression_bomb(in_len_orig, out_alloc)) {
+          log_warn(LD_GENERAL, "Input looks like a possible zlib bomb; "
+                   "not proceeding.");
+          goto err;
+        }
+        *out = tor_realloc(*out, out_alloc);
         break;
+      case TOR_ZLIB_ERR:
       default:
-        log_warn(LD_GENERAL, "Gzip compression didn't finish: %s",
-                 stream->msg ? stream->msg : "<no message>");
         goto err;
-      }
-  }
- done:
-  *out_len = stream->total_out;
-#ifdef OPENBSD
-  /* "Hey Rocky!  Watch me change an unsigned field to a signed field in a
-   *    third-party API!"
-   * "Oh, that trick will just make people do unsafe casts to the unsigned
-   *    type in their cross-platform code!"
-   * "Don't be foolish.  I'm _sure_ they'll have the good sense to make sure
-   *    the newly unsigned field isn't negative." */
-  tor_assert(stream->total_out >= 0);
-#endif
-  if (((size_t)stream->total_out) > out_size + 4097) {
-    /* If we're wasting more than 4k, don't. */
-    *out = tor_realloc(*out, stream->total_out + 1);
-  }
-  if (deflateEnd(stream)!=Z_OK) {
-    log_warn(LD_BUG, "Error freeing gzip structures");
-    goto err;
+    }
   }
-  tor_free(stream);
 
-  if (is_compression_bomb(*out_len, in_len)) {
+ done:
+  tor_zlib_free(state);
+  *out_len = out_used;
+  (*out)[out_used] = '\0';
+  if (compress && is_compression_bomb(out_used, in_len_orig)) {
     log_warn(LD_BUG, "We compressed something and got an insanely high "
           "compression factor; other Tors would think this was a zlib bomb.");
-    goto err;
+    tor_free(*out);
+    return -1;
   }
-
   return 0;
  err:
-  if (stream) {
-    deflateEnd(stream);
-    tor_free(stream);
-  }
+  tor_zlib_free(state);
   tor_free(*out);
   return -1;
 }
 
-/** Given zero or more zlib-compressed or gzip-compressed strings of
- * total length
+/** Given <b>in_len</b> bytes at <b>in</b>, compress them into a newly
+ * allocated buffer, using the method described in <b>method</b>.  Store the
+ * compressed string in *<b>out</b>, and its length in *<b>out_len</b>.
+ * Return 0 on success, -1 on failure.
+ */
+int
+tor_gzip_compress(char **out, size_t *out_len,
+                  const char *in, size_t in_len,
+                  compress_method_t method)
+{
+  return tor_compress_impl(1, out, out_len, in, in_len, method,
+                           1, LOG_WARN);
+}
+
+/** Given zero or more compressed strings of total length
  * <b>in_len</b> bytes at <b>in</b>, uncompress them into a newly allocated
  * buffer, using the method described in <b>method</b>.  Store the uncompressed
  * string in *<b>out</b>, and its length in *<b>out_len</b>.  Return 0 on
@@ -281,132 +377,8 @@ tor_gzip_uncompress(char **out, size_t *out_len,
                     int complete_only,
                     int protocol_warn_level)
 {
-  struct z_stream_s *stream = NULL;
-  size_t out_size, old_size;
-  off_t offset;
-  int r;
-
-  tor_assert(out);
-  tor_assert(out_len);
-  tor_assert(in);
-  tor_assert(in_len < UINT_MAX);
-
-  if (method == GZIP_METHOD && !is_gzip_supported()) {
-    /* Old zlib version don't support gzip in inflateInit2 */
-    log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
-    return -1;
-  }
-
-  *out = NULL;
-
-  stream = tor_malloc_zero(sizeof(struct z_stream_s));
-  stream->zalloc = Z_NULL;
-  stream->zfree = Z_NULL;
-  stream->opaque = NULL;
-  stream->next_in = (unsigned char*) in;
-  stream->avail_in = (unsigned int)in_len;
-
-  if (inflateInit2(stream,
-                   method_bits(method, HIGH_COMPRESSION)) != Z_OK) {
-    log_warn(LD_GENERAL, "Error from inflateInit2: %s",
-             stream->msg?stream->msg:"<no message>");
-    goto err;
-  }
-
-  out_size = in_len * 2;  /* guess 50% compression. */
-  if (out_size < 1024) out_size = 1024;
-  if (out_size >= SIZE_T_CEILING || out_size > UINT_MAX)
-    goto err;
-
-  *out = tor_malloc(out_size);
-  stream->next_out = (unsigned char*)*out;
-  stream->avail_out = (unsigned int)out_size;
-
-  while (1) {
-    switch (inflate(stream, complete_only ? Z_FINISH : Z_SYNC_FLUSH))
-      {
-      case Z_STREAM_END:
-        if (stream->avail_in == 0)
-          goto done;
-        /* There may be more compressed data here. */
-        if ((r = inflateEnd(stream)) != Z_OK) {
-          log_warn(LD_BUG, "Error freeing gzip structures");
-          goto err;
-        }
-        if (inflateInit2(stream,
-                         method_bits(method,HIGH_COMPRESSION)) != Z_OK) {
-          log_warn(LD_GENERAL, "Error from second inflateInit2: %s",
-                   stream->msg?stream->msg:"<no message>");
-          goto err;
-        }
-        break;
-      case Z_OK:
-        if (!complete_only && stream->avail_in == 0)
-          goto done;
-        /* In case zlib doesn't work as I think.... */
-        if (stream->avail_out >= stream->avail_in+16)
-          break;
-      case Z_BUF_ERROR:
-        if (stream->avail_out > 0) {
-          log_fn(protocol_warn_level, LD_PROTOCOL,
-                 "possible truncated or corrupt zlib data");
-          goto err;
-        }
-        offset = stream->next_out - (unsigned char*)*out;
-        old_size = out_size;
-        out_size *= 2;
-        if (out_size < old_size) {
-          log_warn(LD_GENERAL, "Size overflow in uncompression.");
-          goto err;
-        }
-        if (is_compression_bomb(in_len, out_size)) {
-          log_warn(LD_GENERAL, "Input looks like a possible zlib bomb; "
-                   "not proceeding.");
-          goto err;
-        }
-        if (out_size >= SIZE_T_CEILING) {
-          log_warn(LD_BUG, "Hit SIZE_T_CEILING limit while uncompressing.");
-          goto err;
-        }
-        *out = tor_realloc(*out, out_size);
-        stream->next_out = (unsigned char*)(*out + offset);
-        if (out_size - offset > UINT_MAX) {
-          log_warn(LD_BUG,  "Ran over unsigned int limit of zlib while "
-                   "uncompressing.");
-          goto err;
-        }
-        stream->avail_out = (unsigned int)(out_size - offset);
-        break;
-      default:
-        log_warn(LD_GENERAL, "Gzip decompression returned an error: %s",
-                 stream->msg ? stream->msg : "<no message>");
-        goto err;
-      }
-  }
- done:
-  *out_len = stream->next_out - (unsigned char*)*out;
-  r = inflateEnd(stream);
-  tor_free(stream);
-  if (r != Z_OK) {
-    log_warn(LD_BUG, "Error freeing gzip structures");
-    goto err;
-  }
-
-  /* NUL-terminate output. */
-  if (out_size == *out_len)
-    *out = tor_realloc(*out, out_size + 1);
-  (*out)[*out_len] = '\0';
-
-  return 0;
- err:
-  if (stream) {
-    inflateEnd(stream);
-    tor_free(stream);
-  }
-  if (*out) {
-    tor_free(*out);
-  }
-  return -1;
+  return tor_compress_impl(0, out, out_len, in, in_len, method,
+                           complete_only, protocol_warn_level);
 }
 
 /** Try to tell whether the <b>in_len</b>-byte string in <b>in</b> is likely
@@ -418,6 +390,8 @@ detect_compression_method(const char *in, size_t in_len)
 {
   if (in_len > 2 && fast_memeq(in, "\x1f\x8b", 2)) {
     return GZIP_METHOD;
+  } else if (in_len > 4 && fast_memeq(in, "\x28\xb5\x2f\xfd", 4)) {
+    return ZSTD_METHOD;
   } else if (in_len > 2 && (in[0] & 0x0f) == 8 &&
              (ntohs(get_uint16(in)) % 31) == 0) {
     return ZLIB_METHOD;
@@ -426,10 +400,37 @@ detect_compression_method(const char *in, size_t in_len)
   }
 }
 
+/** Type of a codec's function to implement tor_zlib_process(), except for
+ * the bomb check. */
+typedef tor_zlib_output_t compress_process_fn(tor_zlib_state_t *state,
+                                              char **out, size_t *out_len,
+                                              const char **in,
+                                              size_t *in_len,
+                                              int finish);
+
+/** A compression codec that a tor_zlib_state_t can use.  Each codec does the
+ * real work for one or more compress_method_t values. */
+typedef struct compress_codec_t {
+  /** Set up <b>state</b> to compress (if state-\>compress) or decompress
+   * with <b>method</b> at <b>level</b>, and set state-\>allocation.  Return
+   * 0 on success, -1 on failure. */
+  int (*init)(tor_zlib_state_t *state, compress_method_t method,
+              zlib_compression_level_t level);
+  /** Implements tor_zlib_process() for this codec. */
+  compress_process_fn *process;
+  /** Release everything held by the codec-specific part of <b>state</b>. */
+  void (*cleanup)(tor_zlib_state_t *state);
+} compress_codec_t;
+
 /** Internal state for an incremental zlib compression/decompression.  The
  * body of this struct is not exposed. */
 struct tor_zlib_state_t {
-  struct z_stream_s stream; /**< The zlib stream */
+  const compress_codec_t *codec; /**< The codec doing the work. */
+  struct z_stream_s stream; /**< The zlib stream, for zlib and gzip. */
+#ifdef HAVE_ZSTD
+  ZSTD_CStream *zstd_cstream; /**< The zstd stream, if compressing. */
+  ZSTD_DStream *zstd_dstream; /**< The zstd stream, if decompressing. */
+#endif
   int compress; /**< True if we are compressing; false if we are inflating */
 
   /** Number of bytes read so far.  Used to detect zlib bombs. */
@@ -441,70 +442,43 @@ struct tor_zlib_state_t {
   size_t allocation;
 };
 
-/** Construct and return a tor_zlib_state_t object using <b>method</b>.  If
- * <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
-tor_zlib_state_t *
-tor_zlib_new(int compress, compress_method_t method,
-             zlib_compression_level_t compression_level)
+/** Codec init function for zlib and gzip. */
+static int
+zlib_codec_init(tor_zlib_state_t *state, compress_method_t method,
+                zlib_compression_level_t level)
 {
-  tor_zlib_state_t *out;
-  int bits, memlevel;
+  int bits = method_bits(method, level);
+  int memlevel = get_memlevel(level);
 
   if (method == GZIP_METHOD && !is_gzip_supported()) {
     /* Old zlib version don't support gzip in inflateInit2 */
     log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
-    return NULL;
- }
-
- if (! compress) {
-   /* use this setting for decompression, since we might have the
-    * max number of window bits */
-   compression_level = HIGH_COMPRESSION;
- }
-
- out = tor_malloc_zero(sizeof(tor_zlib_state_t));
- out->stream.zalloc = Z_NULL;
- out->stream.zfree = Z_NULL;
- out->stream.opaque = NULL;
- out->compress = compress;
- bits = method_bits(method, compression_level);
- memlevel = get_memlevel(compression_level);
- if (compress) {
-   if (deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
-                    bits, memlevel,
-                    Z_DEFAULT_STRATEGY) != Z_OK)
-     goto err;
- } else {
-   if (inflateInit2(&out->stream, bits) != Z_OK)
-     goto err;
- }
- out->allocation = tor_zlib_state_size_precalc(!compress, bits, memlevel);
-
- total_zlib_allocation += out->allocation;
-
- return out;
+    return -1;
+  }
 
- err:
- tor_free(out);
- return NULL;
+  state->stream.zalloc = Z_NULL;
+  state->stream.zfree = Z_NULL;
+  state->stream.opaque = NULL;
+  if (state->compress) {
+    if (deflateInit2(&state->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+                     bits, memlevel,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return -1;
+  } else {
+    if (inflateInit2(&state->stream, bits) != Z_OK)
+      return -1;
+  }
+  state->allocation = tor_zlib_state_size_precalc(!state->compress,
+                                                  bits, memlevel);
+  return 0;
 }
 
-/** Compress/decompress some bytes using <b>state</b>.  Read up to
- * *<b>in_len</b> bytes from *<b>in</b>, and write up to *<b>out_len</b> bytes
- * to *<b>out</b>, adjusting the values as we go.  If <b>finish</b> is true,
- * we've reached the end of the input.
- *
- * Return TOR_ZLIB_DONE if we've finished the entire compression/decompression.
- * Return TOR_ZLIB_OK if we're processed everything from the input.
- * Return TOR_ZLIB_BUF_FULL if we're out of space on <b>out</b>.
- * Return TOR_ZLIB_ERR if the stream is corrupt.
- */
-tor_zlib_output_t
-tor_zlib_process(tor_zlib_state_t *state,
-                 char **out, size_t *out_len,
-                 const char **in, size_t *in_len,
-                 int finish)
+/** Codec process function for zlib and gzip. */
+static tor_zlib_output_t
+zlib_codec_process(tor_zlib_state_t *state,
+                   char **out, size_t *out_len,
+                   const char **in, size_t *in_len,
+                   int finish)
 {
   int err;
   tor_assert(*in_len <= UINT_MAX);
@@ -520,20 +494,11 @@ tor_zlib_process(tor_zlib_state_t *state,
     err = inflate(&state->stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
   }
 
-  state->input_so_far += state->stream.next_in - ((unsigned char*)*in);
-  state->output_so_far += state->stream.next_out - ((unsigned char*)*out);
-
   *out = (char*) state->stream.next_out;
   *out_len = state->stream.avail_out;
   *in = (const char *) state->stream.next_in;
   *in_len = state->stream.avail_in;
 
-  if (! state->compress &&
-      is_compression_bomb(state->input_so_far, state->output_so_far)) {
-    log_warn(LD_DIR, "Possible zlib bomb; abandoning stream.");
-    return TOR_ZLIB_ERR;
-  }
-
   switch (err)
     {
     case Z_STREAM_END:
@@ -553,6 +518,246 @@ tor_zlib_process(tor_zlib_state_t *state,
     }
 }
 
+/** Codec cleanup function for zlib and gzip. */
+static void
+zlib_codec_cleanup(tor_zlib_state_t *state)
+{
+  if (state->compress)
+    deflateEnd(&state->stream);
+  else
+    inflateEnd(&state->stream);
+}
+
+/** The codec we use for ZLIB_METHOD and GZIP_METHOD. */
+static const compress_codec_t zlib_codec = {
+  zlib_codec_init, zlib_codec_process, zlib_codec_cleanup
+};
+
+#ifdef HAVE_ZSTD
+/** The largest window (as a power of two) that we'll let a zstd stream
+ * use.  None of the levels we compress at need more than this, and it keeps
+ * a hostile peer from making us allocate a huge window to decompress. */
+#define ZSTD_MAX_WINDOW_LOG 22
+
+/** Return the zstd compression level to use for <b>level</b>.  Since we
+ * want zstd for its speed, even HIGH_COMPRESSION stays well below zstd's
+ * slow levels. */
+static INLINE int
+zstd_level(zlib_compression_level_t level)
+{
+  switch (level) {
+    default:
+    case HIGH_COMPRESSION: return 9;
+    case MEDIUM_COMPRESSION: return 3;
+    case LOW_COMPRESSION: return 1;
+  }
+}
+
+/** Return an approximate number of bytes used in RAM to hold a zstd state
+ * for compressing at <b>level</b>, or for decompressing if
+ * <b>level</b> is 0.  libzstd only reports its real needs through its
+ * experimental API, so assume a full window plus match tables. */
+static size_t
+tor_zstd_state_size_precalc(int level)
+{
+  int window_log;
+  if (level == 0)
+    return sizeof(tor_zlib_state_t) + (1 << ZSTD_MAX_WINDOW_LOG) +
+      ZSTD_DStreamInSize() + ZSTD_DStreamOutSize();
+  else if (level <= 1)
+    window_log = 19;
+  else if (level <= 3)
+    window_log = 21;
+  else
+    window_log = ZSTD_MAX_WINDOW_LOG;
+  /* The hash and chain tables are about the size of the window again. */
+  return sizeof(tor_zlib_state_t) + (2 << window_log) +
+    ZSTD_CStreamInSize() + ZSTD_CStreamOutSize();
+}
+
+/** Codec init function for zstd. */
+static int
+zstd_codec_init(tor_zlib_state_t *state, compress_method_t method,
+                zlib_compression_level_t level)
+{
+  size_t r;
+  (void) method;
+  if (state->compress) {
+    int zlevel = zstd_level(level);
+    if (!(state->zstd_cstream = ZSTD_createCStream()))
+      return -1;
+    r = ZSTD_initCStream(state->zstd_cstream, zlevel);
+    state->allocation = tor_zstd_state_size_precalc(zlevel);
+  } else {
+    if (!(state->zstd_dstream = ZSTD_createDStream()))
+      return -1;
+    r = ZSTD_initDStream(state->zstd_dstream);
+    if (!ZSTD_isError(r))
+      r = ZSTD_DCtx_setParameter(state->zstd_dstream, ZSTD_d_windowLogMax,
+                                 ZSTD_MAX_WINDOW_LOG);
+    state->allocation = tor_zstd_state_size_precalc(0);
+  }
+  if (ZSTD_isError(r)) {
+    log_warn(LD_GENERAL, "Error setting up zstd stream: %s",
+             ZSTD_getErrorName(r));
+    ZSTD_freeCStream(state->zstd_cstream);
+    ZSTD_freeDStream(state->zstd_dstream);
+    return -1;
+  }
+  return 0;
+}
+
+/** Codec process function for zstd. */
+static tor_zlib_output_t
+zstd_codec_process(tor_zlib_state_t *state,
+                   char **out, size_t *out_len,
+                   const char **in, size_t *in_len,
+                   int finish)
+{
+  ZSTD_inBuffer input = { *in, *in_len, 0 };
+  ZSTD_outBuffer output = { *out, *out_len, 0 };
+  size_t r;
+
+  if (state->compress) {
+    r = ZSTD_compressStream(state->zstd_cstream, &output, &input);
+    if (!ZSTD_isError(r) && finish && input.pos == input.size)
+      r = ZSTD_endStream(state->zstd_cstream, &output);
+  } else {
+    r = ZSTD_decompressStream(state->zstd_dstream, &output, &input);
+  }
+
+  *out += output.pos;
+  *out_len -= output.pos;
+  *in += input.pos;
+  *in_len -= input.pos;
+
+  if (ZSTD_isError(r)) {
+    log_warn(LD_GENERAL, "Zstd returned an error: %s", ZSTD_getErrorName(r));
+    return TOR_ZLIB_ERR;
+  }
+
+  if (state->compress) {
+    /* When finishing, r is the number of bytes still waiting to be flushed
+     * once all the input is in. */
+    if (finish && input.pos == input.size && r == 0)
+      return TOR_ZLIB_DONE;
+    if (!finish && input.pos == input.size && output.pos < output.size)
+      return TOR_ZLIB_OK;
+    return TOR_ZLIB_BUF_FULL;
+  } else {
+    /* r is 0 when we've decoded and flushed a whole frame. */
+    if (r == 0)
+      return TOR_ZLIB_DONE;
+    if (output.pos == output.size)
+      return TOR_ZLIB_BUF_FULL;
+    return TOR_ZLIB_OK;
+  }
+}
+
+/** Codec cleanup function for zstd. */
+static void
+zstd_codec_cleanup(tor_zlib_state_t *state)
+{
+  ZSTD_freeCStream(state->zstd_cstream);
+  ZSTD_freeDStream(state->zstd_dstream);
+}
+
+/** The codec we use for ZSTD_METHOD. */
+static const compress_codec_t zstd_codec = {
+  zstd_codec_init, zstd_codec_process, zstd_codec_cleanup
+};
+#endif
+
+/** Return the codec that implements <b>method</b>, or NULL if we don't
+ * support it. */
+static const compress_codec_t *
+get_codec(compress_method_t method)
+{
+  switch (method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+      return &zlib_codec;
+    case ZSTD_METHOD:
+#ifdef HAVE_ZSTD
+      return &zstd_codec;
+#else
+      return NULL;
+#endif
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+    default:
+      return NULL;
+  }
+}
+
+/** Construct and return a tor_zlib_state_t object using <b>method</b>.  If
+ * <b>compress</b>, it's for compression; otherwise it's for
+ * decompression. */
+tor_zlib_state_t *
+tor_zlib_new(int compress, compress_method_t method,
+             zlib_compression_level_t compression_level)
+{
+  tor_zlib_state_t *out;
+  const compress_codec_t *codec = get_codec(method);
+
+  if (!codec) {
+    log_warn(LD_BUG, "Unsupported compression method %d", (int)method);
+    return NULL;
+  }
+
+  if (! compress) {
+    /* use this setting for decompression, since we might have the
+     * max number of window bits */
+    compression_level = HIGH_COMPRESSION;
+  }
+
+  out = tor_malloc_zero(sizeof(tor_zlib_state_t));
+  out->codec = codec;
+  out->compress = compress;
+  if (codec->init(out, method, compression_level) < 0) {
+    tor_free(out);
+    return NULL;
+  }
+
+  total_zlib_allocation += out->allocation;
+
+  return out;
+}
+
+/** Compress/decompress some bytes using <b>state</b>.  Read up to
+ * *<b>in_len</b> bytes from *<b>in</b>, and write up to *<b>out_len</b> bytes
+ * to *<b>out</b>, adjusting the values as we go.  If <b>finish</b> is true,
+ * we've reached the end of the input.
+ *
+ * Return TOR_ZLIB_DONE if we've finished the entire compression/decompression.
+ * Return TOR_ZLIB_OK if we're processed everything from the input.
+ * Return TOR_ZLIB_BUF_FULL if we're out of space on <b>out</b>.
+ * Return TOR_ZLIB_ERR if the stream is corrupt.
+ */
+tor_zlib_output_t
+tor_zlib_process(tor_zlib_state_t *state,
+                 char **out, size_t *out_len,
+                 const char **in, size_t *in_len,
+                 int finish)
+{
+  const char *in_orig = *in;
+  const char *out_orig = *out;
+  tor_zlib_output_t rv;
+
+  rv = state->codec->process(state, out, out_len, in, in_len, finish);
+
+  state->input_so_far += *in - in_orig;
+  state->output_so_far += *out - out_orig;
+
+  if (! state->compress &&
+      is_compression_bomb(state->input_so_far, state->output_so_far)) {
+    log_warn(LD_DIR, "Possible zlib bomb; abandoning stream.");
+    return TOR_ZLIB_ERR;
+  }
+
+  return rv;
+}
+
 /** Deallocate <b>state</b>. */
 void
 tor_zlib_free(tor_zlib_state_t *state)
@@ -560,12 +765,9 @@ tor_zlib_free(tor_zlib_state_t *state)
   if (!state)
     return;
 
- total_zlib_allocation -= state->allocation;
+  total_zlib_allocation -= state->allocation;
 
-  if (state->compress)
-    deflateEnd(&state->stream);
-  else
-    inflateEnd(&state->stream);
+  state->codec->cleanup(state);
 
   tor_free(state);
 }
@@ -14,9 +14,10 @@
 /** Enumeration of what kind of compression to use.  Only ZLIB_METHOD is
  * guaranteed to be supported by the compress/uncompress functions here;
  * GZIP_METHOD may be supported if we built against zlib version 1.2 or later
- * and is_gzip_supported() returns true. */
+ * and is_gzip_supported() returns true; ZSTD_METHOD is supported if we were
+ * built with libzstd.  Use tor_compress_supports_method() to check. */
 typedef enum {
-  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, UNKNOWN_METHOD=3
+  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, ZSTD_METHOD=3, UNKNOWN_METHOD=4
 } compress_method_t;
 
 /**
@@ -40,6 +41,9 @@ tor_gzip_uncompress(char **out, size_t *out_len,
                     int protocol_warn_level);
 
 int is_gzip_supported(void);
+int tor_compress_supports_method(compress_method_t method);
+const char *compression_method_get_name(compress_method_t method);
+compress_method_t compression_method_get_by_name(const char *name);
 
 const char *
 tor_zlib_get_version_str(void);
@@ -47,6 +51,9 @@ tor_zlib_get_version_str(void);
 const char *
 tor_zlib_get_header_version_str(void);
 
+const char *tor_zstd_get_version_str(void);
+const char *tor_zstd_get_header_version_str(void);
+
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
 /** Return values from tor_zlib_process; see that function's documentation for
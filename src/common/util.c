@@ -1388,24 +1388,49 @@ esc_for_log_len(const char *chars, size_t n)
   return string_escaped;
 }
 
+/** Per-thread storage for the last value returned by escaped(), once
+ * escaped_init_threads() has been called. */
+static tor_threadlocal_t escaped_val_threadlocal;
+/** True iff escaped_val_threadlocal is initialized. */
+static int escaped_val_threadlocal_initialized = 0;
+
+/** Make escaped() safe to call from threads other than the main thread.
+ * Call this from the main thread before starting any other threads. */
+void
+escaped_init_threads(void)
+{
+  if (escaped_val_threadlocal_initialized)
+    return;
+  if (tor_threadlocal_init(&escaped_val_threadlocal) < 0) {
+    log_warn(LD_GENERAL, "Unable to allocate thread-local storage for "
+             "escaped strings.");
+    return;
+  }
+  escaped_val_threadlocal_initialized = 1;
+}
+
 /** Allocate and return a new string representing the contents of <b>s</b>,
  * surrounded by quotes and using standard C escapes.
  *
  * THIS FUNCTION IS NOT REENTRANT.  Don't call it from outside the main
- * thread.  Also, each call invalidates the last-returned value, so don't
- * try log_warn(LD_GENERAL, "%s %s", escaped(a), escaped(b));
+ * thread unless escaped_init_threads() has been called.  Also, each call
+ * invalidates the last-returned value from the same thread, so don't try
+ * log_warn(LD_GENERAL, "%s %s", escaped(a), escaped(b));
  */
 const char *
 escaped(const char *s)
 {
   static char *escaped_val_ = NULL;
-  tor_free(escaped_val_);
+  char *val = s ? esc_for_log(s) : NULL;
 
-  if (s)
-    escaped_val_ = esc_for_log(s);
-  else
-    escaped_val_ = NULL;
+  if (escaped_val_threadlocal_initialized) {
+    tor_free_(tor_threadlocal_get(&escaped_val_threadlocal));
+    tor_threadlocal_set(&escaped_val_threadlocal, val);
+    return val;
+  }
 
+  tor_free(escaped_val_);
+  escaped_val_ = val;
   return escaped_val_;
 }
 
@@ -247,6 +247,7 @@ int tor_digest_is_zero(const char *digest);
 int tor_digest256_is_zero(const char *digest);
 char *esc_for_log(const char *string) ATTR_MALLOC;
 char *esc_for_log_len(const char *chars, size_t n) ATTR_MALLOC;
+void escaped_init_threads(void);
 const char *escaped(const char *string);
 
 char *tor_escape_str_for_pt_args(const char *string,
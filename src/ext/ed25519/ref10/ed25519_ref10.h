@@ -20,6 +20,8 @@ int ed25519_ref10_sign(
 int ed25519_ref10_pubkey_from_curve25519_pubkey(unsigned char *out,
                                                 const unsigned char *inp,
                                                 int signbit);
+int ed25519_ref10_scalarmult_curve25519_basepoint(unsigned char *out,
+                                                  const unsigned char *inp);
 int ed25519_ref10_blind_secret_key(unsigned char *out,
                               const unsigned char *inp,
                               const unsigned char *param);
@@ -1,8 +1,11 @@
 /* Added to ref10 for Tor. We place this in the public domain.  Alternatively,
  * you may have it under the Creative Commons 0 "CC0" license. */
-#include "fe.h"
+#include "ge.h"
 #include "ed25519_ref10.h"
 
+#include <string.h>
+#include "crypto.h"
+
 int ed25519_ref10_pubkey_from_curve25519_pubkey(unsigned char *out,
                                                 const unsigned char *inp,
                                                 int signbit)
@@ -35,3 +38,37 @@ int ed25519_ref10_pubkey_from_curve25519_pubkey(unsigned char *out,
 
   return 0;
 }
+
+int ed25519_ref10_scalarmult_curve25519_basepoint(unsigned char *out,
+                                                  const unsigned char *inp)
+{
+  unsigned char e[32];
+  ge_p3 A;
+  fe zplusy;
+  fe zminusy;
+  fe inv_zminusy;
+  fe u;
+
+  memcpy(e, inp, 32);
+  e[0] &= 248;
+  e[31] &= 127;
+  e[31] |= 64;
+
+  /* The ed25519 base point corresponds to the curve25519 base point u=9,
+     so we can use the precomputed fixed-base tables here, and convert
+     the result with
+
+         u = (1+y)/(1-y) = (Z+Y)/(Z-Y)
+  */
+  ge_scalarmult_base(&A, e);
+  fe_add(zplusy, A.Z, A.Y);
+  fe_sub(zminusy, A.Z, A.Y);
+  fe_invert(inv_zminusy, zminusy);
+  fe_mul(u, zplusy, inv_zminusy);
+  fe_tobytes(out, u);
+
+  memwipe(e, 0, sizeof(e));
+  memwipe(&A, 0, sizeof(A));
+
+  return 0;
+}
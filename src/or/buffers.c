@@ -89,6 +89,8 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 static INLINE size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->release_fn)
+    return 0; /* Not our memory. */
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -116,6 +118,8 @@ chunk_free_unchecked(chunk_t *chunk)
   tor_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (chunk->release_fn)
+    chunk->release_fn(chunk->release_arg);
   tor_free(chunk);
 }
 static INLINE chunk_t *
@@ -131,6 +135,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
   return ch;
 }
 
@@ -175,6 +181,21 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
+/** Return a new chunk holding a copy of the data in the external chunk
+ * <b>chunk</b>, with room for at least <b>capacity</b> bytes. */
+static chunk_t *
+chunk_internalize(const chunk_t *chunk, size_t capacity)
+{
+  chunk_t *newch;
+  if (capacity < chunk->datalen)
+    capacity = chunk->datalen;
+  newch = chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+  memcpy(newch->mem, chunk->data, chunk->datalen);
+  newch->datalen = chunk->datalen;
+  newch->inserted_time = chunk->inserted_time;
+  return newch;
+}
+
 /** Collapse data from the first N chunks from <b>buf</b> into buf->head,
  * growing it as necessary, until buf->head has the first <b>bytes</b> bytes
  * of data from the buffer, or until buf->head has all the data in <b>buf</b>.
@@ -206,7 +227,16 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
       return;
   }
 
-  if (buf->head->memlen >= capacity) {
+  if (buf->head->release_fn) {
+    /* We can't write into memory that isn't ours: copy the first chunk
+     * into one of our own. */
+    chunk_t *newhead = chunk_internalize(buf->head, capacity);
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  } else if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
     if (CHUNK_REMAINING_CAPACITY(buf->head) < needed)
@@ -380,7 +410,10 @@ buf_free(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
+  chunk_t *newch;
+  if (in_chunk->release_fn)
+    return chunk_internalize(in_chunk, 0);
+  newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
   newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
@@ -810,6 +843,64 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Append the <b>string_len</b> bytes at <b>string</b> to the end of
+ * <b>buf</b> without copying them: the buffer refers to them where they
+ * are until they have been flushed or discarded, and then calls
+ * <b>release_fn</b>(<b>release_arg</b>).  The caller must keep the bytes
+ * valid and unchanged until then.  (If the bytes directly follow the
+ * external bytes at the end of <b>buf</b> with the same release function
+ * and argument, we extend that chunk instead, and release the new
+ * reference right away.)
+ *
+ * Return the new length of the buffer on success, -1 on failure.  On
+ * failure, <b>release_fn</b> has been called.
+ */
+int
+write_to_buf_external(const char *string, size_t string_len, buf_t *buf,
+                      void (*release_fn)(void *), void *release_arg)
+{
+  chunk_t *chunk;
+  struct timeval now;
+
+  tor_assert(release_fn);
+  if (!string_len || buf->datalen + string_len >= INT_MAX) {
+    release_fn(release_arg);
+    return string_len ? -1 : (int)buf->datalen;
+  }
+  check();
+
+  if (buf->tail && buf->tail->release_fn == release_fn &&
+      buf->tail->release_arg == release_arg &&
+      buf->tail->data + buf->tail->datalen == string) {
+    buf->tail->datalen += string_len;
+    buf->datalen += string_len;
+    release_fn(release_arg);
+    check();
+    return (int)buf->datalen;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)string;
+  chunk->datalen = string_len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  tor_gettimeofday_cached_monotonic(&now);
+  chunk->inserted_time = (uint32_t)tv_to_msec(&now);
+
+  if (buf->tail) {
+    tor_assert(buf->head);
+    buf->tail->next = chunk;
+  } else {
+    tor_assert(!buf->head);
+    buf->head = chunk;
+  }
+  buf->tail = chunk;
+  buf->datalen += string_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -2434,6 +2525,14 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (ch->release_fn) {
+        /* External chunk: its data isn't in mem. */
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
@@ -36,6 +36,8 @@ int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int write_to_buf_external(const char *string, size_t string_len, buf_t *buf,
+                          void (*release_fn)(void *), void *release_arg);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
@@ -113,9 +115,15 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in external memory if <b>release_fn</b> is set. */
   uint32_t inserted_time; /**< Timestamp in truncated ms since epoch
                            * when this chunk was inserted. */
+  /** If this chunk's data isn't in <b>mem</b>, but in memory that somebody
+   * else owns, a function to call with <b>release_arg</b> when we're done
+   * with that memory.  Such a chunk has no <b>mem</b> of its own. */
+  void (*release_fn)(void *);
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
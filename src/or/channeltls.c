@@ -12,6 +12,7 @@
  */
 
 #define TOR_CHANNEL_INTERNAL_
+#define CHANNELTLS_PRIVATE
 
 #include "or.h"
 #include "channel.h"
@@ -22,11 +23,14 @@
 #include "connection.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
+#include "main.h"
 #include "relay.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "scheduler.h"
+#include "workqueue.h"
 
 /** How many CELL_PADDING cells have we received, ever? */
 uint64_t stats_n_padding_cells_processed = 0;
@@ -1731,6 +1735,157 @@ channel_tls_process_netinfo_cell(cell_t *cell, channel_tls_t *chan)
   assert_connection_ok(TO_CONN(chan->conn),time(NULL));
 }
 
+static void channel_tls_finish_certs_cell(channel_tls_t *chan,
+                                          channel_tls_verify_job_t *job);
+static void channel_tls_finish_authenticate_cell(channel_tls_t *chan,
+                                            channel_tls_verify_job_t *job);
+
+/** Release all storage held in <b>job</b>. */
+static void
+channel_tls_verify_job_free(channel_tls_verify_job_t *job)
+{
+  if (!job)
+    return;
+  tor_cert_free(job->link_cert);
+  tor_cert_free(job->id_cert);
+  tor_cert_free(job->auth_cert);
+  crypto_pk_free(job->auth_key);
+  tor_free(job->signature);
+  memwipe(job, 0xE5, sizeof(*job));
+  tor_free(job);
+}
+
+/** Worker-thread half of checking a CERTS or AUTHENTICATE cell: check the
+ * signatures in <b>work_</b>, and record the result.  This doesn't touch
+ * the connection, so it's safe to run in any thread. */
+static int
+channel_tls_verify_threadfn(void *state_, void *work_)
+{
+  channel_tls_verify_job_t *job = work_;
+  (void) state_;
+
+  if (job->cell_command == CELL_CERTS) {
+    if (job->started_here) {
+      if (! tor_tls_cert_is_valid(job->severity,
+                                  job->link_cert, job->id_cert, 0))
+        job->err = "The link certificate was not valid";
+      else if (! tor_tls_cert_is_valid(job->severity,
+                                       job->id_cert, job->id_cert, 1))
+        job->err = "The ID certificate was not valid";
+    } else {
+      if (! tor_tls_cert_is_valid(job->severity,
+                                  job->auth_cert, job->id_cert, 1))
+        job->err = "The authentication certificate was not valid";
+      else if (! tor_tls_cert_is_valid(job->severity,
+                                       job->id_cert, job->id_cert, 1))
+        job->err = "The ID certificate was not valid";
+    }
+  } else {
+    size_t keysize = crypto_pk_keysize(job->auth_key);
+    char *signed_data = tor_malloc(keysize);
+    int signed_len;
+    signed_len = crypto_pk_public_checksig(job->auth_key, signed_data,
+                                           keysize, job->signature,
+                                           job->signature_len);
+    if (signed_len < 0)
+      job->err = "Signature wasn't valid";
+    else if (signed_len < DIGEST256_LEN)
+      job->err = "Not enough data was signed";
+    /* Note that we deliberately allow *more* than DIGEST256_LEN bytes here,
+     * in case they're later used to hold a SHA3 digest or something. */
+    else if (tor_memneq(signed_data, job->auth_digest, DIGEST256_LEN))
+      job->err = "Signature did not match data to be signed.";
+    tor_free(signed_data);
+  }
+
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread half of checking a CERTS or AUTHENTICATE cell: take the
+ * connection out of the verifying state, act on the answer in <b>job</b>,
+ * and free <b>job</b>.  Return 0 if the connection is still usable, and
+ * -1 if it's gone or we closed it. */
+static int
+channel_tls_finish_verify_job(channel_tls_verify_job_t *job)
+{
+  or_connection_t *conn = job->conn;
+  int r = -1;
+
+  if (conn) {
+    tor_assert(conn->handshake_state);
+    tor_assert(conn->handshake_state->verify_job == job);
+    conn->handshake_state->verify_job = NULL;
+
+    if (conn->chan && !conn->base_.marked_for_close) {
+      if (job->cell_command == CELL_CERTS)
+        channel_tls_finish_certs_cell(conn->chan, job);
+      else
+        channel_tls_finish_authenticate_cell(conn->chan, job);
+      r = conn->base_.marked_for_close ? -1 : 0;
+    }
+  }
+
+  channel_tls_verify_job_free(job);
+  return r;
+}
+
+/** Called in the main thread when a cpuworker is done with the job in
+ * <b>work_</b>. */
+static void
+channel_tls_verify_replyfn(void *work_)
+{
+  channel_tls_verify_job_t *job = work_;
+  or_connection_t *conn = job->conn;
+
+  if (channel_tls_finish_verify_job(job) == 0) {
+    /* connection_or_process_cells_from_inbuf() stopped reading while we
+     * were waiting; start again, unless we're out of bandwidth. */
+    if (!conn->base_.read_blocked_on_bw)
+      connection_start_reading(TO_CONN(conn));
+    /* Now handle any cells that arrived while we were waiting. */
+    connection_or_process_inbuf(conn);
+  }
+}
+
+/** Put <b>chan</b> into the verifying state, and start checking the
+ * signatures in <b>job</b>.  We'll pick up where we left off in
+ * channel_tls_finish_certs_cell() or channel_tls_finish_authenticate_cell()
+ * once we're done. */
+STATIC void
+channel_tls_queue_verify_job(channel_tls_t *chan,
+                             channel_tls_verify_job_t *job)
+{
+  or_connection_t *conn = chan->conn;
+
+  tor_assert(conn->handshake_state);
+  tor_assert(conn->handshake_state->verify_job == NULL);
+
+  job->conn = conn;
+  conn->handshake_state->verify_job = job;
+
+  if (cpuworker_queue_work(channel_tls_verify_threadfn,
+                           channel_tls_verify_replyfn, job)) {
+    log_debug(LD_OR, "Checking signatures from %s:%d in a cpuworker.",
+              safe_str(conn->base_.address), conn->base_.port);
+    return;
+  }
+
+  /* We have no cpuworkers, probably because we aren't a server.  Just do
+   * the work now. */
+  channel_tls_verify_threadfn(NULL, job);
+  channel_tls_finish_verify_job(job);
+}
+
+/** Called when the handshake state that's waiting for <b>job</b> is about
+ * to be freed: make sure we don't touch its connection when the job is
+ * done. */
+void
+channel_tls_abandon_verify_job(channel_tls_verify_job_t *job)
+{
+  if (job)
+    job->conn = NULL;
+}
+
 /**
  * Process a CERTS cell from a channel.
  *
@@ -1741,10 +1896,9 @@ channel_tls_process_netinfo_cell(cell_t *cell, channel_tls_t *chan)
  * malformed, or it is supposed to authenticate the TLS key but it doesn't,
  * then mark the connection.
  *
- * If the cell has a good cert chain and we're doing a v3 handshake, then
- * store the certificates in or_handshake_state.  If this is the client side
- * of the connection, we then authenticate the server or mark the connection.
- * If it's the server side, wait for an AUTHENTICATE cell.
+ * Otherwise, hand the certificates to a cpuworker to check their
+ * signatures; we continue in channel_tls_finish_certs_cell() once it's
+ * done.
  */
 
 static void
@@ -1753,9 +1907,9 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
   tor_cert_t *link_cert = NULL;
   tor_cert_t *id_cert = NULL;
   tor_cert_t *auth_cert = NULL;
+  channel_tls_verify_job_t *job = NULL;
   uint8_t *ptr;
   int n_certs, i;
-  int send_netinfo = 0;
 
   tor_assert(cell);
   tor_assert(chan);
@@ -1843,8 +1997,10 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
     ERR("It ends in the middle of a certificate");
   }
 
+  job = tor_malloc_zero(sizeof(channel_tls_verify_job_t));
+  job->cell_command = CELL_CERTS;
+
   if (chan->conn->handshake_state->started_here) {
-    int severity;
     if (! (id_cert && link_cert))
       ERR("The certs we wanted were missing");
     /* Okay. We should be able to check the certificates now. */
@@ -1856,23 +2012,77 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
     * to one. */
     if (router_digest_is_trusted_dir(
           TLS_CHAN_TO_BASE(chan)->identity_digest))
-      severity = LOG_WARN;
+      job->severity = LOG_WARN;
     else
-      severity = LOG_PROTOCOL_WARN;
+      job->severity = LOG_PROTOCOL_WARN;
+
+    job->started_here = 1;
+    job->link_cert = link_cert;
+    job->id_cert = id_cert;
+    link_cert = id_cert = NULL;
+  } else {
+    if (! (id_cert && auth_cert))
+      ERR("The certs we wanted were missing");
+
+    job->severity = LOG_PROTOCOL_WARN;
+    job->id_cert = id_cert;
+    job->auth_cert = auth_cert;
+    id_cert = auth_cert = NULL;
+  }
 
-    if (! tor_tls_cert_is_valid(severity, link_cert, id_cert, 0))
-      ERR("The link certificate was not valid");
-    if (! tor_tls_cert_is_valid(severity, id_cert, id_cert, 1))
-      ERR("The ID certificate was not valid");
+  channel_tls_queue_verify_job(chan, job);
+  job = NULL;
+
+ err:
+  channel_tls_verify_job_free(job);
+  tor_cert_free(id_cert);
+  tor_cert_free(link_cert);
+  tor_cert_free(auth_cert);
+#undef ERR
+}
 
+/**
+ * Finish processing a CERTS cell, once a cpuworker has checked the
+ * signatures on its certificates in <b>job</b>.
+ *
+ * If the cell has a good cert chain, then store the certificates in
+ * or_handshake_state.  If this is the client side of the connection, we then
+ * authenticate the server or mark the connection.  If it's the server side,
+ * wait for an AUTHENTICATE cell.
+ */
+
+static void
+channel_tls_finish_certs_cell(channel_tls_t *chan,
+                              channel_tls_verify_job_t *job)
+{
+  int send_netinfo = 0;
+
+  tor_assert(chan);
+  tor_assert(chan->conn);
+  tor_assert(job);
+
+#define ERR(s)                                                  \
+  do {                                                          \
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,                      \
+           "Received a bad CERTS cell from %s:%d: %s",          \
+           safe_str(chan->conn->base_.address),                 \
+           chan->conn->base_.port, (s));                        \
+    connection_or_close_for_error(chan->conn, 0);               \
+    return;                                                     \
+  } while (0)
+
+  if (job->err)
+    ERR(job->err);
+
+  if (job->started_here) {
     chan->conn->handshake_state->authenticated = 1;
     {
-      const digests_t *id_digests = tor_cert_get_id_digests(id_cert);
+      const digests_t *id_digests = tor_cert_get_id_digests(job->id_cert);
       crypto_pk_t *identity_rcvd;
       if (!id_digests)
         ERR("Couldn't compute digests for key in ID cert");
 
-      identity_rcvd = tor_tls_cert_get_key(id_cert);
+      identity_rcvd = tor_tls_cert_get_key(job->id_cert);
       if (!identity_rcvd)
         ERR("Internal error: Couldn't get RSA key from ID cert.");
       memcpy(chan->conn->handshake_state->authenticated_peer_id,
@@ -1890,8 +2100,8 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
              "Got some good certificates from %s:%d: Authenticated it.",
              safe_str(chan->conn->base_.address), chan->conn->base_.port);
 
-    chan->conn->handshake_state->id_cert = id_cert;
-    id_cert = NULL;
+    chan->conn->handshake_state->id_cert = job->id_cert;
+    job->id_cert = NULL;
 
     if (!public_server_mode(get_options())) {
       /* If we initiated the connection and we are not a public server, we
@@ -1900,15 +2110,6 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
       send_netinfo = 1;
     }
   } else {
-    if (! (id_cert && auth_cert))
-      ERR("The certs we wanted were missing");
-
-    /* Remember these certificates so we can check an AUTHENTICATE cell */
-    if (! tor_tls_cert_is_valid(LOG_PROTOCOL_WARN, auth_cert, id_cert, 1))
-      ERR("The authentication certificate was not valid");
-    if (! tor_tls_cert_is_valid(LOG_PROTOCOL_WARN, id_cert, id_cert, 1))
-      ERR("The ID certificate was not valid");
-
     log_info(LD_OR,
              "Got some good certificates from %s:%d: "
              "Waiting for AUTHENTICATE.",
@@ -1916,9 +2117,10 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
              chan->conn->base_.port);
     /* XXXX check more stuff? */
 
-    chan->conn->handshake_state->id_cert = id_cert;
-    chan->conn->handshake_state->auth_cert = auth_cert;
-    id_cert = auth_cert = NULL;
+    /* Remember these certificates so we can check an AUTHENTICATE cell */
+    chan->conn->handshake_state->id_cert = job->id_cert;
+    chan->conn->handshake_state->auth_cert = job->auth_cert;
+    job->id_cert = job->auth_cert = NULL;
   }
 
   chan->conn->handshake_state->received_certs_cell = 1;
@@ -1927,14 +2129,9 @@ channel_tls_process_certs_cell(var_cell_t *cell, channel_tls_t *chan)
     if (connection_or_send_netinfo(chan->conn) < 0) {
       log_warn(LD_OR, "Couldn't send netinfo cell");
       connection_or_close_for_error(chan->conn, 0);
-      goto err;
+      return;
     }
   }
-
- err:
-  tor_cert_free(id_cert);
-  tor_cert_free(link_cert);
-  tor_cert_free(auth_cert);
 #undef ERR
 }
 
@@ -2040,9 +2237,10 @@ channel_tls_process_auth_challenge_cell(var_cell_t *cell, channel_tls_t *chan)
  *
  * If it's ill-formed or we weren't supposed to get one or we're not doing a
  * v3 handshake, then mark the connection.  If it does not authenticate the
- * other side of the connection successfully (because it isn't signed right,
- * we didn't get a CERTS cell, etc) mark the connection.  Otherwise, accept
- * the identity of the router on the other side of the connection.
+ * other side of the connection successfully (because we didn't get a CERTS
+ * cell, a field doesn't match, etc) mark the connection.  Otherwise, hand
+ * the signature to a cpuworker to check; we continue in
+ * channel_tls_finish_authenticate_cell() once it's done.
  */
 
 static void
@@ -2112,40 +2310,56 @@ channel_tls_process_authenticate_cell(var_cell_t *cell, channel_tls_t *chan)
     ERR("Some field in the AUTHENTICATE cell body was not as expected");
 
   {
+    channel_tls_verify_job_t *job;
     crypto_pk_t *pk = tor_tls_cert_get_key(
                                    chan->conn->handshake_state->auth_cert);
-    char d[DIGEST256_LEN];
-    char *signed_data;
-    size_t keysize;
-    int signed_len;
 
     if (!pk)
       ERR("Internal error: couldn't get RSA key from AUTH cert.");
-    crypto_digest256(d, (char*)auth, V3_AUTH_BODY_LEN, DIGEST_SHA256);
-
-    keysize = crypto_pk_keysize(pk);
-    signed_data = tor_malloc(keysize);
-    signed_len = crypto_pk_public_checksig(pk, signed_data, keysize,
-                                           (char*)auth + V3_AUTH_BODY_LEN,
-                                           authlen - V3_AUTH_BODY_LEN);
-    crypto_pk_free(pk);
-    if (signed_len < 0) {
-      tor_free(signed_data);
-      ERR("Signature wasn't valid");
-    }
-    if (signed_len < DIGEST256_LEN) {
-      tor_free(signed_data);
-      ERR("Not enough data was signed");
-    }
-    /* Note that we deliberately allow *more* than DIGEST256_LEN bytes here,
-     * in case they're later used to hold a SHA3 digest or something. */
-    if (tor_memneq(signed_data, d, DIGEST256_LEN)) {
-      tor_free(signed_data);
-      ERR("Signature did not match data to be signed.");
-    }
-    tor_free(signed_data);
+
+    job = tor_malloc_zero(sizeof(channel_tls_verify_job_t));
+    job->cell_command = CELL_AUTHENTICATE;
+    job->auth_key = pk;
+    crypto_digest256(job->auth_digest, (char*)auth, V3_AUTH_BODY_LEN,
+                     DIGEST_SHA256);
+    job->signature_len = authlen - V3_AUTH_BODY_LEN;
+    job->signature = tor_memdup(auth + V3_AUTH_BODY_LEN, job->signature_len);
+
+    channel_tls_queue_verify_job(chan, job);
   }
 
+#undef ERR
+}
+
+/**
+ * Finish processing an AUTHENTICATE cell, once a cpuworker has checked its
+ * signature in <b>job</b>.
+ *
+ * If the signature was good, accept the identity of the router on the other
+ * side of the connection; otherwise, mark the connection.
+ */
+
+static void
+channel_tls_finish_authenticate_cell(channel_tls_t *chan,
+                                     channel_tls_verify_job_t *job)
+{
+  tor_assert(chan);
+  tor_assert(chan->conn);
+  tor_assert(job);
+
+#define ERR(s)                                                  \
+  do {                                                          \
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,                      \
+           "Received a bad AUTHENTICATE cell from %s:%d: %s",   \
+           safe_str(chan->conn->base_.address),                 \
+           chan->conn->base_.port, (s));                        \
+    connection_or_close_for_error(chan->conn, 0);               \
+    return;                                                     \
+  } while (0)
+
+  if (job->err)
+    ERR(job->err);
+
   /* Okay, we are authenticated. */
   chan->conn->handshake_state->received_authenticate = 1;
   chan->conn->handshake_state->authenticated = 1;
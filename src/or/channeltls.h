@@ -48,9 +48,53 @@ void channel_tls_handle_state_change_on_orconn(channel_tls_t *chan,
 void channel_tls_handle_var_cell(var_cell_t *var_cell,
                                  or_connection_t *conn);
 void channel_tls_update_marks(or_connection_t *conn);
+typedef struct channel_tls_verify_job_t channel_tls_verify_job_t;
+void channel_tls_abandon_verify_job(channel_tls_verify_job_t *job);
 
 /* Cleanup at shutdown */
 void channel_tls_free_all(void);
 
+#ifdef CHANNELTLS_PRIVATE
+/** The public-key work we need to do to check a CERTS or AUTHENTICATE
+ * cell.  We hand this to the cpuworkers, so that a flood of new
+ * connections doesn't keep the main thread from relaying cells. */
+struct channel_tls_verify_job_t {
+  /** The connection that got the cell, or NULL if it was freed while we
+   * were working.  Only used from the main thread. */
+  or_connection_t *conn;
+  /** Which kind of cell are we checking?  Either CELL_CERTS or
+   * CELL_AUTHENTICATE. */
+  uint8_t cell_command;
+  /** True iff we originated the connection. */
+  unsigned int started_here : 1;
+  /** How loudly should we complain about bad certificates? */
+  int severity;
+  /** Certificates from a CERTS cell.  The job holds them while we check
+   * their signatures; afterwards, the good ones go into the handshake
+   * state.
+   *
+   * @{ */
+  tor_cert_t *link_cert;
+  tor_cert_t *id_cert;
+  tor_cert_t *auth_cert;
+  /**@}*/
+  /** For an AUTHENTICATE cell: the key from the peer's AUTH cert, the
+   * digest of the authenticator body, and the signature on it.
+   *
+   * @{ */
+  crypto_pk_t *auth_key;
+  char auth_digest[DIGEST256_LEN];
+  char *signature;
+  size_t signature_len;
+  /**@}*/
+  /** Set by the worker: NULL if everything checked out, or else a
+   * description of what was wrong. */
+  const char *err;
+};
+
+STATIC void channel_tls_queue_verify_job(channel_tls_t *chan,
+                                         channel_tls_verify_job_t *job);
+#endif
+
 #endif
 
@@ -188,7 +188,7 @@ get_unique_circ_id_by_chan(channel_t *chan)
     }
 
     do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
+      crypto_fast_rand((char*) &test_circ_id, sizeof(test_circ_id));
       test_circ_id &= mask;
     } while (test_circ_id == 0);
 
@@ -1483,31 +1483,6 @@ circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
   return enough;
 }
 
-/** Return 1 if <b>node</b> can handle one or more of the ports in
- * <b>needed_ports</b>, else return 0.
- */
-static int
-node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
-{ /* XXXX MOVE */
-  int i;
-  uint16_t port;
-
-  for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
-    /* alignment issues aren't a worry for this dereference, since
-       needed_ports is explicitly a smartlist of uint16_t's */
-    port = *(uint16_t *)smartlist_get(needed_ports, i);
-    tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
-      return 1;
-  }
-  return 0;
-}
-
 /** Return true iff <b>conn</b> needs another general circuit to be
  * built. */
 static int
@@ -1544,22 +1519,22 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
   int *n_supported;
   int n_pending_connections = 0;
   smartlist_t *connections;
+  bitarray_t **pending_exits;
+  int conn_idx;
   int best_support = -1;
   int n_best_support=0;
   const or_options_t *options = get_options();
   const smartlist_t *the_nodes;
   const node_t *node=NULL;
 
-  connections = get_connection_array();
-
-  /* Count how many connections are waiting for a circuit to be built.
-   * We use this for log messages now, but in the future we may depend on it.
-   */
-  SMARTLIST_FOREACH(connections, connection_t *, conn,
+  /* Find the connections that are waiting for a circuit to be built. */
+  connections = smartlist_new();
+  SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn,
   {
     if (ap_stream_wants_exit_attention(conn))
-      ++n_pending_connections;
+      smartlist_add(connections, conn);
   });
+  n_pending_connections = smartlist_len(connections);
 //  log_fn(LOG_DEBUG, "Choosing exit node; %d connections are pending",
 //         n_pending_connections);
   /* Now we count, for each of the routers in the directory, how many
@@ -1571,6 +1546,20 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
    */
   the_nodes = nodelist_get_list();
   n_supported = tor_calloc(smartlist_len(the_nodes), sizeof(int));
+  /* For the connections whose choice of exit depends only on the exits'
+   * policies for their port, find all the nodes that might support them at
+   * once. */
+  pending_exits = tor_calloc(n_pending_connections + 1, sizeof(bitarray_t *));
+  SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
+    uint16_t port =
+      connection_ap_get_exit_port_if_policy_only(TO_ENTRY_CONN(conn));
+    if (port) {
+      pending_exits[conn_sl_idx] =
+        bitarray_init_zero(smartlist_len(the_nodes));
+      nodelist_add_exits_for_port(pending_exits[conn_sl_idx], the_nodes,
+                                  port);
+    }
+  } SMARTLIST_FOREACH_END(conn);
   SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
     const int i = node_sl_idx;
     if (router_digest_is_me(node->identity)) {
@@ -1632,9 +1621,9 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     n_supported[i] = 0;
     /* iterate over connections */
     SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
-      if (!ap_stream_wants_exit_attention(conn))
-        continue; /* Skip everything but APs in CIRCUIT_WAIT */
-      if (connection_ap_can_use_exit(TO_ENTRY_CONN(conn), node)) {
+      bitarray_t *exits = pending_exits[conn_sl_idx];
+      if (exits ? !!bitarray_is_set(exits, i) :
+          connection_ap_can_use_exit(TO_ENTRY_CONN(conn), node)) {
         ++n_supported[i];
 //        log_fn(LOG_DEBUG,"%s is supported. n_supported[%d] now %d.",
 //               router->nickname, i, n_supported[i]);
@@ -1664,6 +1653,10 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
            "Found %d servers that might support %d/%d pending connections.",
            n_best_support, best_support >= 0 ? best_support : 0,
            n_pending_connections);
+  for (conn_idx = 0; conn_idx < n_pending_connections; ++conn_idx)
+    bitarray_free(pending_exits[conn_idx]);
+  tor_free(pending_exits);
+  smartlist_free(connections);
 
   /* If any routers definitely support any pending connections, choose one
    * at random. */
@@ -1684,6 +1677,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 
     int attempt;
     smartlist_t *needed_ports, *supporting;
+    bitarray_t *handles_needed_port;
 
     if (best_support == -1) {
       if (need_uptime || need_capacity) {
@@ -1701,12 +1695,17 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     }
     supporting = smartlist_new();
     needed_ports = circuit_get_unhandled_ports(time(NULL));
+    handles_needed_port = bitarray_init_zero(smartlist_len(the_nodes));
+    SMARTLIST_FOREACH_BEGIN(needed_ports, uint16_t *, port) {
+      tor_assert(*port);
+      nodelist_add_exits_for_port(handles_needed_port, the_nodes, *port);
+    } SMARTLIST_FOREACH_END(port);
     for (attempt = 0; attempt < 2; attempt++) {
       /* try once to pick only from routers that satisfy a needed port,
        * then if there are none, pick from any that support exiting. */
       SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
         if (n_supported[node_sl_idx] != -1 &&
-            (attempt || node_handles_some_port(node, needed_ports))) {
+            (attempt || bitarray_is_set(handles_needed_port, node_sl_idx))) {
 //          log_fn(LOG_DEBUG,"Try %d: '%s' is a possibility.",
 //                 try, router->nickname);
           smartlist_add(supporting, (void*)node);
@@ -1725,6 +1724,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     SMARTLIST_FOREACH(needed_ports, uint16_t *, cp, tor_free(cp));
     smartlist_free(needed_ports);
     smartlist_free(supporting);
+    bitarray_free(handles_needed_port);
   }
 
   tor_free(n_supported);
@@ -704,10 +704,10 @@ origin_circuit_new(void)
   circ = tor_malloc_zero(sizeof(origin_circuit_t));
   circ->base_.magic = ORIGIN_CIRCUIT_MAGIC;
 
-  circ->next_stream_id = crypto_rand_int(1<<16);
+  circ->next_stream_id = crypto_fast_rand_int(1<<16);
   circ->global_identifier = n_circuits_allocated++;
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
-  circ->remaining_relay_early_cells -= crypto_rand_int(2);
+  circ->remaining_relay_early_cells -= crypto_fast_rand_int(2);
 
   init_circuit_base(TO_CIRCUIT(circ));
 
@@ -1131,7 +1131,7 @@ build_time_t
 circuit_build_times_generate_sample(circuit_build_times_t *cbt,
                                     double q_lo, double q_hi)
 {
-  double randval = crypto_rand_double();
+  double randval = crypto_fast_rand_double();
   build_time_t ret;
   double u;
 
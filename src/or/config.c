@@ -1647,6 +1647,13 @@ options_act(const or_options_t *old_options)
       revise_trackexithosts = 1;
     }
 
+    if (options->EnforceDistinctSubnets !=
+          old_options->EnforceDistinctSubnets ||
+        !config_lines_eq(options->NodeFamilies, old_options->NodeFamilies)) {
+      /* Our cached node families are out of date. */
+      nodelist_note_nodes_changed();
+    }
+
     if (!smartlist_strings_eq(old_options->TrackHostExits,
                               options->TrackHostExits))
       revise_trackexithosts = 1;
@@ -4375,6 +4382,10 @@ options_init_from_torrc(int argc, char **argv)
     printf("Zlib    \t\t%-15s\t\t%s\n",
                       tor_zlib_get_header_version_str(),
                       tor_zlib_get_version_str());
+    if (tor_zstd_get_version_str())
+      printf("Zstd    \t\t%-15s\t\t%s\n",
+                        tor_zstd_get_header_version_str(),
+                        tor_zstd_get_version_str());
     //TODO: Hex versions?
     exit(0);
   }
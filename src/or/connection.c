@@ -607,6 +607,8 @@ connection_free_(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_zlib_free(dir_conn->zlib_state);
+    connection_dirserv_detach_compress_job(dir_conn);
+    buf_free(dir_conn->spool_plaintext);
     if (dir_conn->fingerprint_stack) {
       SMARTLIST_FOREACH(dir_conn->fingerprint_stack, char *, cp, tor_free(cp));
       smartlist_free(dir_conn->fingerprint_stack);
@@ -4224,6 +4226,50 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   }
 }
 
+/** As connection_write_to_buf(), but if we can, don't copy the <b>len</b>
+ * bytes at <b>string</b>: have <b>conn</b>'s outbuf refer to them where
+ * they are.  Either way, call <b>release_fn</b>(<b>release_arg</b>) once
+ * we no longer need them; until then, the caller must keep them valid and
+ * unchanged.
+ *
+ * We only avoid the copy for connections that flush their outbuf straight
+ * to a plain socket; everybody else gets a copy, and <b>release_fn</b> is
+ * called before we return.
+ */
+void
+connection_write_to_buf_external(const char *string, size_t len,
+                                 connection_t *conn,
+                                 void (*release_fn)(void *),
+                                 void *release_arg)
+{
+  int r;
+
+  if (conn->linked || connection_speaks_cells(conn) ||
+      (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    connection_write_to_buf(string, len, conn);
+    release_fn(release_arg);
+    return;
+  }
+  IF_HAS_BUFFEREVENT(conn, {
+    connection_write_to_buf(string, len, conn);
+    release_fn(release_arg);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, r = write_to_buf_external(string, len, conn->outbuf,
+                                                   release_fn, release_arg));
+  if (r < 0) {
+    log_warn(LD_NET, "write_to_buf failed. Closing connection (fd %d).",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += len;
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
@@ -140,6 +140,10 @@ int connection_flush(connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, connection_t *conn, int zlib));
+void connection_write_to_buf_external(const char *string, size_t len,
+                                      connection_t *conn,
+                                      void (*release_fn)(void *),
+                                      void *release_arg);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
@@ -3201,6 +3201,30 @@ connection_ap_can_use_exit(const entry_connection_t *conn, const node_t *exit)
   return 1;
 }
 
+/** If whether <b>conn</b> can use an exit depends only on that exit's
+ * policy for <b>conn</b>'s port at an unknown address -- that is, if
+ * connection_ap_can_use_exit(conn, node) is true exactly when
+ * node_might_exit_to_port(node, port) is, for every node not in
+ * ExcludeExitNodesUnion_ -- return that port.  Otherwise return 0. */
+uint16_t
+connection_ap_get_exit_port_if_policy_only(const entry_connection_t *conn)
+{
+  tor_addr_t addr;
+  tor_assert(conn);
+  tor_assert(conn->socks_request);
+
+  if (conn->chosen_exit_name || conn->use_begindir ||
+      conn->socks_request->command != SOCKS_COMMAND_CONNECT ||
+      conn->socks_request->port == 0)
+    return 0;
+  /* These cases use a known address, or the exit's IPv6 policy; see
+   * connection_ap_can_use_exit(). */
+  if (0 == tor_addr_parse(&addr, conn->socks_request->address) ||
+      (!conn->entry_cfg.ipv4_traffic && conn->entry_cfg.ipv6_traffic))
+    return 0;
+  return conn->socks_request->port;
+}
+
 /** If address is of the form "y.onion" with a well-formed handle y:
  *     Put a NUL after y, lower-case it, and return ONION_HOSTNAME.
  *
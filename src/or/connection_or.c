@@ -867,7 +867,8 @@ connection_or_set_canonical(or_connection_t *or_conn,
   }
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
-  or_conn->idle_timeout = timeout_base + crypto_rand_int(timeout_base / 2);
+  or_conn->idle_timeout = timeout_base +
+    crypto_fast_rand_int(timeout_base / 2);
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -1318,8 +1319,8 @@ connection_or_close_normally(or_connection_t *orconn, int flush)
  * the error state.
  */
 
-void
-connection_or_close_for_error(or_connection_t *orconn, int flush)
+MOCK_IMPL(void,
+connection_or_close_for_error,(or_connection_t *orconn, int flush))
 {
   channel_t *chan = NULL;
 
@@ -1877,6 +1878,7 @@ or_handshake_state_free(or_handshake_state_t *state)
 {
   if (!state)
     return;
+  channel_tls_abandon_verify_job(state->verify_job);
   crypto_digest_free(state->digest_sent);
   crypto_digest_free(state->digest_received);
   tor_cert_free(state->auth_cert);
@@ -2047,6 +2049,12 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** How many bytes may pile up in an OR connection's inbuf while we wait
+ * for a cpuworker to check a handshake cell?  We stop reading while we
+ * wait, so only a read that was already underway should put anything
+ * there. */
+#define MAX_OR_INBUF_WHILE_VERIFYING (64*1024)
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -2060,6 +2068,24 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
   var_cell_t *var_cell;
 
   while (1) {
+    if (conn->handshake_state && conn->handshake_state->verify_job) {
+      /* Don't look at any more cells until we know whether the ones we've
+       * already processed were any good, and don't read any more until
+       * then either: channel_tls_verify_replyfn() turns reading back on.
+       * A bandwidth refill can turn it on early, so keep an eye on how
+       * much has piled up. */
+      if (connection_get_inbuf_len(TO_CONN(conn)) >
+          MAX_OR_INBUF_WHILE_VERIFYING) {
+        log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+               "Peer %s:%d sent too much while we were checking its "
+               "handshake. Closing.",
+               safe_str(conn->base_.address), conn->base_.port);
+        connection_or_close_for_error(conn, 0);
+        return 0;
+      }
+      connection_stop_reading(TO_CONN(conn));
+      return 0;
+    }
     log_debug(LD_OR,
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
               "(%d pending in tls object).",
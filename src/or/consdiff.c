@@ -0,0 +1,544 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply ed-style diffs between consensus documents.
+ *
+ * Consecutive consensuses differ in only a few percent of their lines, so
+ * a cache that still has the consensus a client is holding can send the
+ * client a short diff instead of the whole new document.
+ *
+ * A diff looks like this:
+ * <pre>
+ *   network-status-diff-version 1
+ *   hash [hex sha256 of base] [hex sha256 of target]
+ *   [ed commands]
+ * </pre>
+ * The commands are a subset of ed(1): "Na" (append after line N), "Nd" and
+ * "N,Md" (delete), and "Nc" and "N,Mc" (change).  Appended and changed
+ * lines follow their command and are terminated by a line holding a single
+ * ".".  Commands appear in strictly decreasing order of line number and
+ * never touch, so that each can be applied without renumbering the ones
+ * after it.
+ *
+ * To keep generation cheap, we don't run a general-purpose diff over the
+ * whole document.  Router entries are sorted by identity digest, so we
+ * line them up by identity and only diff the few lines inside each
+ * matching entry; the header and footer are small enough to diff
+ * directly.
+ **/
+
+#include "or.h"
+#include "consdiff.h"
+
+/** Largest number of cells we'll spend on a single LCS table.  Any range
+ * of lines bigger than this gets replaced wholesale. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<20)
+
+/** A single line of a document: a pointer into the document, and the
+ * length of the line not counting its newline. */
+typedef struct cdline_t {
+  const char *s;
+  size_t len;
+} cdline_t;
+
+/** A replacement of the base lines in [b0, b1) with the target lines in
+ * [t0, t1).  All indices are 0-based. */
+typedef struct cdhunk_t {
+  int b0, b1;
+  int t0, t1;
+} cdhunk_t;
+
+/** A router entry within a consensus: the lines in [start, end), and the
+ * identity digest from its "r" line. */
+typedef struct cdrouter_t {
+  int start, end;
+  char identity[DIGEST_LEN];
+} cdrouter_t;
+
+/** Split the <b>len</b>-byte document <b>s</b> into lines.  On success,
+ * return a newly allocated array of lines and set *<b>n_out</b> to its
+ * length.  Return NULL if the document doesn't end with a newline. */
+static cdline_t *
+split_lines(const char *s, size_t len, int *n_out)
+{
+  cdline_t *lines;
+  const char *cp, *end = s + len;
+  int n = 0, cap = 0;
+
+  if (len && s[len-1] != '\n')
+    return NULL;
+  cap = 16;
+  lines = tor_calloc(cap, sizeof(cdline_t));
+  for (cp = s; cp < end; ) {
+    const char *eol = memchr(cp, '\n', end - cp);
+    tor_assert(eol);
+    if (n == cap) {
+      cap *= 2;
+      lines = tor_reallocarray(lines, cap, sizeof(cdline_t));
+    }
+    lines[n].s = cp;
+    lines[n].len = eol - cp;
+    ++n;
+    cp = eol + 1;
+  }
+  *n_out = n;
+  return lines;
+}
+
+/** Return true iff the lines <b>a</b> and <b>b</b> are the same. */
+static INLINE int
+lines_eq(const cdline_t *a, const cdline_t *b)
+{
+  return a->len == b->len && fast_memeq(a->s, b->s, a->len);
+}
+
+/** Return true iff the line <b>line</b> starts with <b>prefix</b>. */
+static INLINE int
+line_startswith(const cdline_t *line, const char *prefix)
+{
+  size_t plen = strlen(prefix);
+  return line->len >= plen && fast_memeq(line->s, prefix, plen);
+}
+
+/** Add a hunk replacing base lines [b0,b1) with target lines [t0,t1) to
+ * <b>hunks</b>, merging it into the previous hunk if the two touch. */
+static void
+add_hunk(smartlist_t *hunks, int b0, int b1, int t0, int t1)
+{
+  cdhunk_t *h;
+  if (b0 == b1 && t0 == t1)
+    return;
+  h = smartlist_len(hunks) ? smartlist_get(hunks, smartlist_len(hunks)-1)
+                           : NULL;
+  if (h && h->b1 == b0 && h->t1 == t0) {
+    h->b1 = b1;
+    h->t1 = t1;
+    return;
+  }
+  h = tor_malloc_zero(sizeof(cdhunk_t));
+  h->b0 = b0;
+  h->b1 = b1;
+  h->t0 = t0;
+  h->t1 = t1;
+  smartlist_add(hunks, h);
+}
+
+/** Append to <b>hunks</b> a minimal set of hunks turning the base lines in
+ * [b0,b1) into the target lines in [t0,t1), using a longest common
+ * subsequence table.  If the ranges are too large for that, replace the
+ * whole range instead. */
+static void
+diff_range(const cdline_t *base, int b0, int b1,
+           const cdline_t *target, int t0, int t1,
+           smartlist_t *hunks)
+{
+  int nb, nt, i, j, pend_i = -1, pend_j = -1;
+  int *lcs;
+
+  while (b0 < b1 && t0 < t1 && lines_eq(&base[b0], &target[t0])) {
+    ++b0;
+    ++t0;
+  }
+  while (b0 < b1 && t0 < t1 && lines_eq(&base[b1-1], &target[t1-1])) {
+    --b1;
+    --t1;
+  }
+  nb = b1 - b0;
+  nt = t1 - t0;
+  if (nb == 0 || nt == 0 ||
+      ((uint64_t)nb+1) * ((uint64_t)nt+1) > CONSDIFF_MAX_LCS_CELLS) {
+    add_hunk(hunks, b0, b1, t0, t1);
+    return;
+  }
+
+#define LCS(i,j) lcs[(i)*(nt+1)+(j)]
+  lcs = tor_calloc((nb+1)*(nt+1), sizeof(int));
+  for (i = nb-1; i >= 0; --i) {
+    for (j = nt-1; j >= 0; --j) {
+      if (lines_eq(&base[b0+i], &target[t0+j]))
+        LCS(i,j) = LCS(i+1,j+1) + 1;
+      else
+        LCS(i,j) = MAX(LCS(i+1,j), LCS(i,j+1));
+    }
+  }
+
+  i = j = 0;
+  while (i < nb || j < nt) {
+    if (i < nb && j < nt && lines_eq(&base[b0+i], &target[t0+j])) {
+      if (pend_i >= 0) {
+        add_hunk(hunks, b0+pend_i, b0+i, t0+pend_j, t0+j);
+        pend_i = pend_j = -1;
+      }
+      ++i;
+      ++j;
+      continue;
+    }
+    if (pend_i < 0) {
+      pend_i = i;
+      pend_j = j;
+    }
+    if (j == nt || (i < nb && LCS(i+1,j) >= LCS(i,j+1)))
+      ++i;
+    else
+      ++j;
+  }
+  if (pend_i >= 0)
+    add_hunk(hunks, b0+pend_i, b0+nb, t0+pend_j, t0+nt);
+#undef LCS
+  tor_free(lcs);
+}
+
+/** Find the router entries in <b>lines</b>: set *<b>r0_out</b> to the index
+ * of the first "r" line, and *<b>r1_out</b> to the index of the first line
+ * of the footer.  Either may be <b>n</b> if the section is missing. */
+static void
+find_router_section(const cdline_t *lines, int n, int *r0_out, int *r1_out)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (line_startswith(&lines[i], "r "))
+      break;
+  }
+  *r0_out = i;
+  for ( ; i < n; ++i) {
+    if (line_startswith(&lines[i], "directory-footer") ||
+        line_startswith(&lines[i], "directory-signature "))
+      break;
+  }
+  *r1_out = i;
+}
+
+/** Split the lines in [r0,r1) into router entries, and return them in a
+ * newly allocated array, setting *<b>n_out</b> to its length.  Return NULL
+ * if any entry has an unparseable identity, or if the entries are not in
+ * strictly increasing order of identity. */
+static cdrouter_t *
+get_router_entries(const cdline_t *lines, int r0, int r1, int *n_out)
+{
+  cdrouter_t *routers;
+  int i, n = 0;
+
+  routers = tor_calloc(r1 - r0 + 1, sizeof(cdrouter_t));
+  for (i = r0; i < r1; ++i) {
+    const char *cp, *eol;
+    char b64[BASE64_DIGEST_LEN+1];
+    if (!line_startswith(&lines[i], "r ")) {
+      tor_assert(n);
+      continue;
+    }
+    if (n)
+      routers[n-1].end = i;
+    /* "r" SP nickname SP identity SP ... */
+    eol = lines[i].s + lines[i].len;
+    cp = memchr(lines[i].s + 2, ' ', eol - (lines[i].s + 2));
+    if (!cp || eol - (cp+1) < BASE64_DIGEST_LEN ||
+        (eol - (cp+1) > BASE64_DIGEST_LEN && cp[1+BASE64_DIGEST_LEN] != ' '))
+      goto err;
+    memcpy(b64, cp+1, BASE64_DIGEST_LEN);
+    b64[BASE64_DIGEST_LEN] = '\0';
+    if (digest_from_base64(routers[n].identity, b64) < 0)
+      goto err;
+    if (n && tor_memcmp(routers[n-1].identity, routers[n].identity,
+                        DIGEST_LEN) >= 0)
+      goto err;
+    routers[n].start = i;
+    ++n;
+  }
+  if (n)
+    routers[n-1].end = r1;
+  *n_out = n;
+  return routers;
+ err:
+  tor_free(routers);
+  return NULL;
+}
+
+/** Return true iff any line in <b>lines</b> would be read as the end of an
+ * appended block if we put it in a diff. */
+static int
+has_dot_line(const cdline_t *lines, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (lines[i].len == 1 && lines[i].s[0] == '.')
+      return 1;
+  }
+  return 0;
+}
+
+/** Generate and return a newly allocated diff that turns the consensus
+ * document <b>base</b> into <b>target</b>.  Return NULL if we can't
+ * express the difference as a diff. */
+char *
+consdiff_gen_diff(const char *base, const char *target)
+{
+  size_t base_len = strlen(base), target_len = strlen(target);
+  cdline_t *bl = NULL, *tl = NULL;
+  cdrouter_t *br = NULL, *tr = NULL;
+  int n_bl, n_tl, n_br = 0, n_tr = 0;
+  int b_r0, b_r1, t_r0, t_r1, bi, ti, i;
+  smartlist_t *hunks = smartlist_new();
+  smartlist_t *out = NULL;
+  char base_digest[DIGEST256_LEN], target_digest[DIGEST256_LEN];
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char *result = NULL;
+
+  if (!(bl = split_lines(base, base_len, &n_bl)) ||
+      !(tl = split_lines(target, target_len, &n_tl)))
+    goto done;
+  if (has_dot_line(tl, n_tl))
+    goto done;
+
+  find_router_section(bl, n_bl, &b_r0, &b_r1);
+  find_router_section(tl, n_tl, &t_r0, &t_r1);
+  if (!(br = get_router_entries(bl, b_r0, b_r1, &n_br)) ||
+      !(tr = get_router_entries(tl, t_r0, t_r1, &n_tr)))
+    goto done;
+
+  /* The header. */
+  diff_range(bl, 0, b_r0, tl, 0, t_r0, hunks);
+
+  /* The router entries, matched up by identity. */
+  bi = ti = 0;
+  while (bi < n_br || ti < n_tr) {
+    int c;
+    if (bi == n_br)
+      c = 1;
+    else if (ti == n_tr)
+      c = -1;
+    else
+      c = tor_memcmp(br[bi].identity, tr[ti].identity, DIGEST_LEN);
+    if (c == 0) {
+      diff_range(bl, br[bi].start, br[bi].end,
+                 tl, tr[ti].start, tr[ti].end, hunks);
+      ++bi;
+      ++ti;
+    } else if (c < 0) {
+      /* This router is gone. */
+      int tpos = ti < n_tr ? tr[ti].start : t_r1;
+      add_hunk(hunks, br[bi].start, br[bi].end, tpos, tpos);
+      ++bi;
+    } else {
+      /* This router is new. */
+      int bpos = bi < n_br ? br[bi].start : b_r1;
+      add_hunk(hunks, bpos, bpos, tr[ti].start, tr[ti].end);
+      ++ti;
+    }
+  }
+
+  /* The footer. */
+  diff_range(bl, b_r1, n_bl, tl, t_r1, n_tl, hunks);
+
+  crypto_digest256(base_digest, base, base_len, DIGEST_SHA256);
+  crypto_digest256(target_digest, target, target_len, DIGEST_SHA256);
+  base16_encode(base_hex, sizeof(base_hex), base_digest, DIGEST256_LEN);
+  base16_encode(target_hex, sizeof(target_hex), target_digest,
+                DIGEST256_LEN);
+
+  out = smartlist_new();
+  smartlist_add_asprintf(out, "%s\n", CONSDIFF_VERSION_LINE);
+  smartlist_add_asprintf(out, "hash %s %s\n", base_hex, target_hex);
+  for (i = smartlist_len(hunks)-1; i >= 0; --i) {
+    const cdhunk_t *h = smartlist_get(hunks, i);
+    int j;
+    if (h->b0 == h->b1)
+      smartlist_add_asprintf(out, "%da\n", h->b0);
+    else if (h->b1 == h->b0 + 1)
+      smartlist_add_asprintf(out, "%d%c\n", h->b1,
+                             h->t0 == h->t1 ? 'd' : 'c');
+    else
+      smartlist_add_asprintf(out, "%d,%d%c\n", h->b0+1, h->b1,
+                             h->t0 == h->t1 ? 'd' : 'c');
+    if (h->t0 == h->t1)
+      continue;
+    for (j = h->t0; j < h->t1; ++j)
+      smartlist_add(out, tor_strndup(tl[j].s, tl[j].len + 1));
+    smartlist_add(out, tor_strdup(".\n"));
+  }
+  result = smartlist_join_strings(out, "", 0, NULL);
+
+ done:
+  tor_free(bl);
+  tor_free(tl);
+  tor_free(br);
+  tor_free(tr);
+  SMARTLIST_FOREACH(hunks, cdhunk_t *, h, tor_free(h));
+  smartlist_free(hunks);
+  if (out) {
+    SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+    smartlist_free(out);
+  }
+  return result;
+}
+
+/** Parse a nonnegative line number from the start of <b>s</b>, which ends
+ * at <b>eol</b>.  On success, return the number and set *<b>next_out</b>
+ * to the first character after it.  On failure, return -1. */
+static int
+parse_line_number(const char *s, const char *eol, const char **next_out)
+{
+  int n = 0;
+  const char *cp = s;
+  while (cp < eol && TOR_ISDIGIT(*cp)) {
+    if (n > (INT_MAX - 9) / 10)
+      return -1;
+    n = n*10 + (*cp - '0');
+    ++cp;
+  }
+  if (cp == s)
+    return -1;
+  *next_out = cp;
+  return n;
+}
+
+/** Apply the diff <b>diff</b> to the consensus document <b>base</b>.
+ * Return the resulting document in a newly allocated string, or NULL if
+ * the diff is malformed, was not generated from <b>base</b>, or doesn't
+ * produce the document it promises to. */
+char *
+consdiff_apply_diff(const char *base, const char *diff)
+{
+  size_t base_len = strlen(base);
+  cdline_t *bl = NULL, *dl = NULL, *out = NULL;
+  int n_bl, n_dl, n_out = 0, i, floor, cur;
+  smartlist_t *hunks = smartlist_new();
+  char base_digest[DIGEST256_LEN], target_digest[DIGEST256_LEN];
+  char digest[DIGEST256_LEN];
+  char *result = NULL, *cp;
+  size_t result_len;
+  const char *hash_line;
+
+  if (!(dl = split_lines(diff, strlen(diff), &n_dl)) || n_dl < 2) {
+    log_info(LD_DIR, "Consensus diff was truncated.");
+    goto done;
+  }
+  if (dl[0].len != strlen(CONSDIFF_VERSION_LINE) ||
+      !fast_memeq(dl[0].s, CONSDIFF_VERSION_LINE, dl[0].len)) {
+    log_info(LD_DIR, "Consensus diff had an unrecognized version line.");
+    goto done;
+  }
+  hash_line = dl[1].s;
+  if (dl[1].len != 5 + 2*HEX_DIGEST256_LEN + 1 ||
+      !line_startswith(&dl[1], "hash ") ||
+      hash_line[5+HEX_DIGEST256_LEN] != ' ' ||
+      base16_decode(base_digest, DIGEST256_LEN, hash_line+5,
+                    HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(target_digest, DIGEST256_LEN,
+                    hash_line+5+HEX_DIGEST256_LEN+1,
+                    HEX_DIGEST256_LEN) < 0) {
+    log_info(LD_DIR, "Consensus diff had a malformed hash line.");
+    goto done;
+  }
+  crypto_digest256(digest, base, base_len, DIGEST_SHA256);
+  if (tor_memneq(digest, base_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff was not generated from the consensus "
+             "we have.");
+    goto done;
+  }
+  if (!(bl = split_lines(base, base_len, &n_bl))) {
+    log_info(LD_DIR, "Our consensus did not end with a newline.");
+    goto done;
+  }
+
+  /* Parse the commands.  Each hunk holds a range of base lines, and the
+   * range of diff lines to replace them with. */
+  floor = n_bl + 1;
+  for (i = 2; i < n_dl; ) {
+    const char *s = dl[i].s, *eol = dl[i].s + dl[i].len, *next;
+    int start, end;
+    char op;
+    cdhunk_t *h;
+
+    if ((start = parse_line_number(s, eol, &next)) < 0)
+      goto bad_command;
+    end = start;
+    if (next < eol && *next == ',') {
+      if ((end = parse_line_number(next+1, eol, &next)) < 0)
+        goto bad_command;
+      if (end <= start)
+        goto bad_command;
+    }
+    if (next+1 != eol)
+      goto bad_command;
+    op = *next;
+    if (op == 'a') {
+      if (end != start || start >= floor)
+        goto bad_command;
+      floor = start;
+    } else if (op == 'c' || op == 'd') {
+      if (start < 1 || end >= floor)
+        goto bad_command;
+      floor = start;
+      --start;
+    } else {
+      goto bad_command;
+    }
+
+    h = tor_malloc_zero(sizeof(cdhunk_t));
+    h->b0 = start;
+    h->b1 = (op == 'a') ? start : end;
+    h->t0 = h->t1 = ++i;
+    smartlist_add(hunks, h);
+    if (op == 'd')
+      continue;
+    while (i < n_dl && !(dl[i].len == 1 && dl[i].s[0] == '.'))
+      ++i;
+    if (i == n_dl) {
+      log_info(LD_DIR, "Consensus diff ended in the middle of a command.");
+      goto done;
+    }
+    h->t1 = i++;
+  }
+
+  /* Build the result, front to back. */
+  out = tor_calloc(n_bl + n_dl + 1, sizeof(cdline_t));
+  cur = 0;
+  for (i = smartlist_len(hunks)-1; i >= 0; --i) {
+    const cdhunk_t *h = smartlist_get(hunks, i);
+    int j;
+    for ( ; cur < h->b0; ++cur)
+      out[n_out++] = bl[cur];
+    for (j = h->t0; j < h->t1; ++j)
+      out[n_out++] = dl[j];
+    cur = h->b1;
+  }
+  for ( ; cur < n_bl; ++cur)
+    out[n_out++] = bl[cur];
+
+  result_len = 0;
+  for (i = 0; i < n_out; ++i)
+    result_len += out[i].len + 1;
+  cp = result = tor_malloc(result_len + 1);
+  for (i = 0; i < n_out; ++i) {
+    memcpy(cp, out[i].s, out[i].len);
+    cp += out[i].len;
+    *cp++ = '\n';
+  }
+  *cp = '\0';
+
+  crypto_digest256(digest, result, result_len, DIGEST_SHA256);
+  if (tor_memneq(digest, target_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Applying a consensus diff did not produce the "
+             "consensus it promised.");
+    tor_free(result);
+  }
+  goto done;
+
+ bad_command:
+  {
+    char *cmd = tor_strndup(dl[i].s, dl[i].len);
+    log_info(LD_DIR, "Consensus diff had a malformed or out-of-order "
+             "command %s.", escaped(cmd));
+    tor_free(cmd);
+  }
+ done:
+  tor_free(bl);
+  tor_free(dl);
+  tor_free(out);
+  SMARTLIST_FOREACH(hunks, cdhunk_t *, h, tor_free(h));
+  smartlist_free(hunks);
+  return result;
+}
+
@@ -0,0 +1,19 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef TOR_CONSDIFF_H
+#define TOR_CONSDIFF_H
+
+/** The first line of every consensus diff we generate or accept. */
+#define CONSDIFF_VERSION_LINE "network-status-diff-version 1"
+
+char *consdiff_gen_diff(const char *base, const char *target);
+char *consdiff_apply_diff(const char *base, const char *diff);
+
+#endif
+
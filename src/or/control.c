@@ -4464,12 +4464,13 @@ control_event_networkstatus_changed(smartlist_t *statuses)
 /** Called when we get a new consensus networkstatus. Sends a NEWCONSENSUS
  * event consisting of an NS-style line for each relay in the consensus. */
 int
-control_event_newconsensus(const networkstatus_t *consensus)
+control_event_newconsensus(networkstatus_t *consensus)
 {
   if (!control_event_is_interesting(EVENT_NEWCONSENSUS))
     return 0;
   return control_event_networkstatus_changed_helper(
-           consensus->routerstatus_list, EVENT_NEWCONSENSUS, "NEWCONSENSUS");
+           networkstatus_get_routerstatus_list(consensus),
+           EVENT_NEWCONSENSUS, "NEWCONSENSUS");
 }
 
 /** Called when we compute a new circuitbuildtimeout */
@@ -8,7 +8,9 @@
  * \brief Uses the workqueue/threadpool code to farm CPU-intensive activities
  * out to subprocesses.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins, for checking the signatures
+ * on the certificates in link handshakes, and for parsing large batches of
+ * directory documents.
  **/
 #include "or.h"
 #include "channel.h"
@@ -569,3 +571,153 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
   }
 }
 
+/** Queue <b>fn</b> to run on a cpuworker thread with <b>arg</b>, and then
+ * <b>reply_fn</b> to run in the main thread once it's done.  Return the
+ * queue entry on success, or NULL if we have no cpuworkers (for example,
+ * because we aren't a server) or couldn't queue the work.  In that case,
+ * the caller still owns <b>arg</b>. */
+MOCK_IMPL(struct workqueue_entry_s *,
+cpuworker_queue_work,(int (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return NULL;
+  return threadpool_queue_work(threadpool, fn, reply_fn, arg);
+}
+
+/** State for a set of independent work items that we're running on the
+ * cpuworkers and the main thread at once.  See cpuworker_run_parallel(). */
+typedef struct parallel_batch_t {
+  /** Protects every other field in this structure. */
+  tor_mutex_t lock;
+  /** Signalled when the last item is finished. */
+  tor_cond_t done_cond;
+  /** Function to call on each item, and its first argument. */
+  void (*fn)(void *, int);
+  void *arg;
+  /** Number of items in the batch. */
+  int n_items;
+  /** Index of the next item that nobody has started yet. */
+  int next_item;
+  /** Number of items that are finished. */
+  int n_done;
+  /** Number of references to this batch: one for the main thread, and one
+   * for each job we've queued for the cpuworkers. */
+  int refcnt;
+} parallel_batch_t;
+
+/** Drop a reference to <b>batch</b>, and free it if that was the last. */
+static void
+parallel_batch_decref(parallel_batch_t *batch)
+{
+  int last;
+  tor_mutex_acquire(&batch->lock);
+  last = (--batch->refcnt == 0);
+  tor_mutex_release(&batch->lock);
+  if (last) {
+    tor_cond_uninit(&batch->done_cond);
+    tor_mutex_uninit(&batch->lock);
+    tor_free(batch);
+  }
+}
+
+/** Run items from <b>batch</b> in the current thread until no unstarted
+ * items are left. */
+static void
+parallel_batch_run_items(parallel_batch_t *batch)
+{
+  while (1) {
+    void (*fn)(void *, int);
+    void *arg;
+    int idx;
+    tor_mutex_acquire(&batch->lock);
+    if (batch->next_item >= batch->n_items) {
+      tor_mutex_release(&batch->lock);
+      break;
+    }
+    idx = batch->next_item++;
+    fn = batch->fn;
+    arg = batch->arg;
+    tor_mutex_release(&batch->lock);
+
+    fn(arg, idx);
+
+    tor_mutex_acquire(&batch->lock);
+    if (++batch->n_done == batch->n_items)
+      tor_cond_signal_all(&batch->done_cond);
+    tor_mutex_release(&batch->lock);
+  }
+}
+
+/** Cpuworker side of cpuworker_run_parallel(): help with the items of the
+ * batch in <b>arg</b>, if any are left. */
+static int
+parallel_batch_threadfn(void *state, void *arg)
+{
+  (void)state;
+  parallel_batch_run_items(arg);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread side of parallel_batch_threadfn(): the cpuworker is done with
+ * the batch in <b>arg</b>. */
+static void
+parallel_batch_replyfn(void *arg)
+{
+  parallel_batch_decref(arg);
+}
+
+/** Call <b>fn</b>(<b>arg</b>, <b>idx</b>) once for each <b>idx</b> from 0
+ * up to <b>n_items</b>-1, spreading the calls over the cpuworker threads and
+ * the calling thread, and return once all of them have finished.  The calls
+ * may happen in any order and at the same time, so <b>fn</b> must be
+ * thread-safe.  If we have no cpuworkers, just make all the calls here.
+ *
+ * Only call this from the main thread.  The cpuworkers may be busy with
+ * other work; if so, the main thread does the items that they haven't
+ * started, and only waits for the ones they're already doing. */
+void
+cpuworker_run_parallel(int n_items, void (*fn)(void *, int), void *arg)
+{
+  parallel_batch_t *batch;
+  int i, n_jobs;
+
+  tor_assert(n_items >= 0);
+  tor_assert(fn);
+  if (n_items == 0)
+    return;
+
+  batch = tor_malloc_zero(sizeof(parallel_batch_t));
+  tor_mutex_init_for_cond(&batch->lock);
+  tor_cond_init(&batch->done_cond);
+  batch->fn = fn;
+  batch->arg = arg;
+  batch->n_items = n_items;
+  batch->refcnt = 1;
+
+  /* The main thread takes a share of the items too, so we need at most
+   * n_items-1 helpers. */
+  n_jobs = MIN(n_items - 1, get_num_cpus(get_options()));
+  for (i = 0; i < n_jobs; ++i) {
+    tor_mutex_acquire(&batch->lock);
+    ++batch->refcnt;
+    tor_mutex_release(&batch->lock);
+    if (!cpuworker_queue_work(parallel_batch_threadfn,
+                              parallel_batch_replyfn, batch)) {
+      parallel_batch_decref(batch);
+      break;
+    }
+  }
+
+  parallel_batch_run_items(batch);
+
+  tor_mutex_acquire(&batch->lock);
+  while (batch->n_done < batch->n_items)
+    tor_cond_wait(&batch->done_cond, &batch->lock, NULL);
+  /* Any job that starts after this point will find no items left, and
+   * won't look at fn or arg. */
+  tor_mutex_release(&batch->lock);
+
+  parallel_batch_decref(batch);
+}
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -80,6 +81,8 @@ static void dir_microdesc_download_failed(smartlist_t *failed,
                                           int status_code);
 static void note_client_request(int purpose, int compressed, size_t bytes);
 static int client_likes_consensus(networkstatus_t *v, const char *want_url);
+static cached_dir_t *get_consensus_diff_for_header(const char *flavor,
+                                                   const char *header);
 
 static void directory_initiate_command_rend(const tor_addr_t *addr,
                                             uint16_t or_port,
@@ -101,6 +104,12 @@ static void directory_initiate_command_rend(const tor_addr_t *addr,
 #define ALLOW_DIRECTORY_TIME_SKEW (30*60)
 
 #define X_ADDRESS_HEADER "X-Your-Address-Is: "
+/** Header in which a client lists the SHA256 digests of the consensuses it
+ * already has, so that we can send it a diff instead of a consensus. */
+#define X_OR_DIFF_FROM_CONSENSUS_HEADER "X-Or-Diff-From-Consensus: "
+/** Header in which a client lists the compression methods it can
+ * decode. */
+#define ACCEPT_ENCODING_HEADER "Accept-Encoding: "
 
 /** HTTP cache control: how long do we tell proxies they can cache each
  * kind of document we serve? */
@@ -1137,6 +1146,76 @@ directory_get_consensus_url(const char *resource)
   return url;
 }
 
+/** Compression methods that we'd rather use than zlib for a compressed
+ * directory response, most preferred first. */
+static const compress_method_t compression_method_preference[] = {
+  ZSTD_METHOD,
+};
+
+/** Return a newly allocated value for an Accept-Encoding header listing
+ * every compression method we can decode, most preferred first. */
+static char *
+get_accept_encoding_header_value(void)
+{
+  smartlist_t *names = smartlist_new();
+  char *result;
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_preference); ++i) {
+    compress_method_t m = compression_method_preference[i];
+    if (tor_compress_supports_method(m))
+      smartlist_add(names, (char*)compression_method_get_name(m));
+  }
+  smartlist_add(names, (char*)compression_method_get_name(ZLIB_METHOD));
+  if (tor_compress_supports_method(GZIP_METHOD))
+    smartlist_add(names, (char*)compression_method_get_name(GZIP_METHOD));
+  smartlist_add(names, (char*)compression_method_get_name(NO_METHOD));
+  result = smartlist_join_strings(names, ", ", 0, NULL);
+  smartlist_free(names);
+  return result;
+}
+
+/** Parse the value of an Accept-Encoding header in <b>h</b>, and return a
+ * bitfield with bit (1&lt;&lt;m) set for every compression method m that
+ * it lists.  We ignore quality values. */
+STATIC unsigned
+parse_accept_encoding_header(const char *h)
+{
+  unsigned result = 0;
+  smartlist_t *methods = smartlist_new();
+  smartlist_split_string(methods, h, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(methods, char *, m) {
+    compress_method_t method;
+    char *q = strchr(m, ';');
+    if (q) {
+      *q = '\0';
+      tor_strstrip(m, " \t");
+    }
+    method = compression_method_get_by_name(m);
+    if (method != UNKNOWN_METHOD)
+      result |= (1u << method);
+    tor_free(m);
+  } SMARTLIST_FOREACH_END(m);
+  smartlist_free(methods);
+  return result;
+}
+
+/** Given a bitfield of the compression methods a client accepts, as
+ * returned by parse_accept_encoding_header(), return the method we should
+ * use for a compressed response to it. */
+static compress_method_t
+choose_compression_method(unsigned accepted)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_preference); ++i) {
+    compress_method_t m = compression_method_preference[i];
+    if ((accepted & (1u << m)) && tor_compress_supports_method(m))
+      return m;
+  }
+  /* Everybody who asks for a ".z" URL can handle zlib. */
+  return ZLIB_METHOD;
+}
+
 /** Queue an appropriate HTTP command on conn-\>outbuf.  The other args
  * are as in directory_initiate_command().
  */
@@ -1175,6 +1254,27 @@ directory_send_command(dir_connection_t *conn,
     smartlist_add_asprintf(headers, "If-Modified-Since: %s\r\n", b);
   }
 
+  /* Tell the server which compression methods we can decode. */
+  {
+    char *accept_encoding = get_accept_encoding_header_value();
+    smartlist_add_asprintf(headers, ACCEPT_ENCODING_HEADER "%s\r\n",
+                           accept_encoding);
+    tor_free(accept_encoding);
+  }
+
+  /* Tell the server which consensus we have, so it can send us a diff. */
+  if (purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    int flav = resource ? networkstatus_parse_flavor_name(resource) : FLAV_NS;
+    char digest[DIGEST256_LEN];
+    if (flav >= 0 &&
+        networkstatus_get_consensus_text_digest(flav, digest) == 0) {
+      char hex[HEX_DIGEST256_LEN+1];
+      base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+      smartlist_add_asprintf(headers, X_OR_DIFF_FROM_CONSENSUS_HEADER
+                             "%s\r\n", hex);
+    }
+  }
+
   /* come up with some proxy lines, if we're using one. */
   if (direct && get_options()->HTTPProxy) {
     char *base64_authenticator=NULL;
@@ -1497,16 +1597,13 @@ parse_http_response(const char *headers, int *code, time_t *date,
       if (!strcmpstart(s, "Content-Encoding: ")) {
         enc = s+18; break;
       });
-    if (!enc || !strcmp(enc, "identity")) {
+    if (!enc) {
       *compression = NO_METHOD;
-    } else if (!strcmp(enc, "deflate") || !strcmp(enc, "x-deflate")) {
-      *compression = ZLIB_METHOD;
-    } else if (!strcmp(enc, "gzip") || !strcmp(enc, "x-gzip")) {
-      *compression = GZIP_METHOD;
     } else {
-      log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
-               escaped(enc));
-      *compression = UNKNOWN_METHOD;
+      *compression = compression_method_get_by_name(enc);
+      if (*compression == UNKNOWN_METHOD)
+        log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
+                 escaped(enc));
     }
   }
   SMARTLIST_FOREACH(parsed_headers, char *, s, tor_free(s));
@@ -1711,6 +1808,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description1 = "as deflated";
       else if (compression == GZIP_METHOD)
         description1 = "as gzipped";
+      else if (compression == ZSTD_METHOD)
+        description1 = "as zstd-compressed";
       else if (compression == NO_METHOD)
         description1 = "as uncompressed";
       else
@@ -1719,6 +1818,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description2 = "deflated";
       else if (guessed == GZIP_METHOD)
         description2 = "gzipped";
+      else if (guessed == ZSTD_METHOD)
+        description2 = "zstd-compressed";
       else if (!plausible)
         description2 = "confusing binary junk";
       else
@@ -1731,13 +1832,13 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                (compression>0 && guessed>0)?"  Trying both.":"");
     }
     /* Try declared compression first if we can. */
-    if (compression == GZIP_METHOD  || compression == ZLIB_METHOD)
+    if (tor_compress_supports_method(compression))
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, compression,
                           !allow_partial, LOG_PROTOCOL_WARN);
     /* Okay, if that didn't work, and we think that it was compressed
      * differently, try that. */
     if (!new_body &&
-        (guessed == GZIP_METHOD || guessed == ZLIB_METHOD) &&
+        tor_compress_supports_method(guessed) &&
         compression != guessed)
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, guessed,
                           !allow_partial, LOG_PROTOCOL_WARN);
@@ -1774,6 +1875,20 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->base_.address, conn->base_.port);
+    if (body && !strcmpstart(body, CONSDIFF_VERSION_LINE)) {
+      char *consensus = networkstatus_apply_consensus_diff(body, flavname);
+      if (!consensus) {
+        log_info(LD_DIR, "Unable to apply %s consensus diff downloaded from "
+                 "server '%s:%d'. I'll try again soon.",
+                 flavname, conn->base_.address, conn->base_.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      tor_free(body);
+      body = consensus;
+      body_len = strlen(body);
+    }
     if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
              "Unable to load %s consensus directory downloaded from "
@@ -2367,17 +2482,29 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
   connection_write_to_buf(tmp, strlen(tmp), TO_CONN(conn));
 }
 
+/** As write_http_response_header_impl, but sets encoding and content-typed
+ * based on the compression <b>method</b> of the response. */
+static void
+write_http_response_header_encoded(dir_connection_t *conn, ssize_t length,
+                                   compress_method_t method,
+                                   long cache_lifetime)
+{
+  const char *type =
+    method != NO_METHOD ? "application/octet-stream" : "text/plain";
+  write_http_response_header_impl(conn, length, type,
+                                  compression_method_get_name(method),
+                                  NULL, cache_lifetime);
+}
+
 /** As write_http_response_header_impl, but sets encoding and content-typed
  * based on whether the response will be <b>compressed</b> or not. */
 static void
 write_http_response_header(dir_connection_t *conn, ssize_t length,
                            int compressed, long cache_lifetime)
 {
-  write_http_response_header_impl(conn, length,
-                          compressed?"application/octet-stream":"text/plain",
-                          compressed?"deflate":"identity",
-                             NULL,
-                             cache_lifetime);
+  write_http_response_header_encoded(conn, length,
+                                     compressed ? ZLIB_METHOD : NO_METHOD,
+                                     cache_lifetime);
 }
 
 #if defined(INSTRUMENT_DOWNLOADS) || defined(RUNNING_DOXYGEN)
@@ -2556,6 +2683,37 @@ client_likes_consensus(networkstatus_t *v, const char *want_url)
   return (have >= need_at_least);
 }
 
+/** Given the value <b>header</b> of an X-Or-Diff-From-Consensus header (a
+ * comma-separated list of hex-encoded SHA256 digests of consensuses that
+ * the client already has), return a diff to our current <b>flavor</b>
+ * consensus from the first of them that we can.  The caller must release
+ * the result with cached_dir_decref().  Return NULL if we can't make a
+ * diff from any of them. */
+static cached_dir_t *
+get_consensus_diff_for_header(const char *flavor, const char *header)
+{
+  smartlist_t *digests = smartlist_new();
+  cached_dir_t *diff = NULL;
+
+  smartlist_split_string(digests, header, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(digests, const char *, hex) {
+    char digest[DIGEST256_LEN];
+    if (strlen(hex) != HEX_DIGEST256_LEN ||
+        base16_decode(digest, sizeof(digest), hex, HEX_DIGEST256_LEN) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_DIR,
+             "Failed to decode consensus digest %s.", escaped(hex));
+      continue;
+    }
+    if ((diff = dirserv_get_consensus_diff(flavor, digest)))
+      break;
+  } SMARTLIST_FOREACH_END(hex);
+
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  return diff;
+}
+
 /** Return the compression level we should use for sending a compressed
  * response of size <b>n_bytes</b>. */
 static zlib_compression_level_t
@@ -2588,6 +2746,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
   const or_options_t *options = get_options();
   time_t if_modified_since = 0;
   int compressed;
+  unsigned accepted_methods = 0;
   size_t url_len;
 
   /* We ignore the body of a GET request. */
@@ -2615,6 +2774,10 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
      * act as if no If-Modified-Since header had been given. */
     tor_free(header);
   }
+  if ((header = http_get_header(headers, ACCEPT_ENCODING_HEADER))) {
+    accepted_methods = parse_accept_encoding_header(header);
+    tor_free(header);
+  }
   log_debug(LD_DIRSERV,"rewritten url as '%s'.", escaped(url));
 
   url_mem = url;
@@ -2649,6 +2812,9 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     smartlist_t *dir_fps = smartlist_new();
     const char *request_type = NULL;
     long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+    int consensus_flav = FLAV_NS;
+    cached_dir_t *response = NULL;
+    compress_method_t method = compressed ? ZLIB_METHOD : NO_METHOD;
 
     if (1) {
       networkstatus_t *v;
@@ -2698,6 +2864,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       }
       request_type = compressed?"v3.z":"v3";
       lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
+      consensus_flav = flav;
     }
 
     if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
@@ -2721,7 +2888,35 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       goto done;
     }
 
-    dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
+    /* If the client told us which consensus it has, and we still have that
+     * one too, we can probably send a diff instead. */
+    if ((header = http_get_header(headers, X_OR_DIFF_FROM_CONSENSUS_HEADER))) {
+      response = get_consensus_diff_for_header(
+                      networkstatus_get_flavor_name(consensus_flav), header);
+      tor_free(header);
+    }
+
+    /* If the client can decode something faster than zlib, send it that
+     * instead.  We compress each consensus or diff that way only once. */
+    if (compressed &&
+        (method = choose_compression_method(accepted_methods))
+          != ZLIB_METHOD) {
+      cached_dir_t *plain = response ? response : dirserv_get_consensus(
+                      networkstatus_get_flavor_name(consensus_flav));
+      cached_dir_t *recompressed =
+        plain ? cached_dir_get_recompressed(plain, method) : NULL;
+      if (recompressed) {
+        cached_dir_decref(response);
+        response = recompressed;
+      } else {
+        method = ZLIB_METHOD;
+      }
+    }
+
+    if (response)
+      dlen = compressed ? response->dir_z_len : response->dir_len;
+    else
+      dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_debug(LD_DIRSERV,
                "Client asked for network status lists, but we've been "
@@ -2729,6 +2924,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       write_http_status_line(conn, 503, "Directory busy, try again later");
       SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
       smartlist_free(dir_fps);
+      cached_dir_decref(response);
 
       geoip_note_ns_response(GEOIP_REJECT_BUSY);
       goto done;
@@ -2755,9 +2951,16 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
 
     // note_request(request_type,dlen);
     (void) request_type;
-    write_http_response_header(conn, -1, compressed,
+    write_http_response_header_encoded(conn, -1, method,
                                smartlist_len(dir_fps) == 1 ? lifetime : 0);
     conn->fingerprint_stack = dir_fps;
+    if (response) {
+      connection_dirserv_spool_cached_dir(conn, response);
+      if (! compressed)
+        conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+      connection_dirserv_flushed_some(conn);
+      goto done;
+    }
     if (! compressed)
       conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
 
@@ -2870,6 +3073,8 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
 
   if (!strcmpstart(url, "/tor/micro/d/")) {
     smartlist_t *fps = smartlist_new();
+    cached_dir_t *response = NULL;
+    compressed_response_lookup_t *lookup = NULL;
 
     dir_split_resource_into_fingerprints(url+strlen("/tor/micro/d/"),
                                       fps, NULL,
@@ -2881,7 +3086,13 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       smartlist_free(fps);
       goto done;
     }
-    dlen = dirserv_estimate_microdesc_size(fps, compressed);
+    if (compressed)
+      response = dirserv_get_compressed_response(DIR_SPOOL_MICRODESC, fps,
+                                                 1, &lookup);
+    if (response)
+      dlen = response->dir_z_len;
+    else
+      dlen = dirserv_estimate_microdesc_size(fps, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_info(LD_DIRSERV,
                "Client asked for server descriptors, but we've been "
@@ -2889,6 +3100,8 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       write_http_status_line(conn, 503, "Directory busy, try again later");
       SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
       smartlist_free(fps);
+      cached_dir_decref(response);
+      compressed_response_lookup_free(lookup);
       goto done;
     }
 
@@ -2896,7 +3109,11 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     conn->dir_spool_src = DIR_SPOOL_MICRODESC;
     conn->fingerprint_stack = fps;
 
-    if (compressed)
+    if (lookup)
+      response = dirserv_build_compressed_response(lookup);
+    if (response)
+      connection_dirserv_spool_cached_dir(conn, response);
+    else if (compressed)
       conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
                                       choose_compression_level(dlen));
 
@@ -2912,6 +3129,8 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     const char *request_type = NULL;
     int cache_lifetime = 0;
     int is_extra = !strcmpstart(url,"/tor/extra/");
+    cached_dir_t *response = NULL;
+    compressed_response_lookup_t *lookup = NULL;
     url += is_extra ? strlen("/tor/extra/") : strlen("/tor/server/");
     conn->fingerprint_stack = smartlist_new();
     res = dirserv_get_routerdesc_fingerprints(conn->fingerprint_stack, url,
@@ -2954,18 +3173,32 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     if (res < 0)
       write_http_status_line(conn, 404, msg);
     else {
-      dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
-                                        1, compressed);
+      int encrypted = connection_dir_is_encrypted(conn);
+      if (compressed)
+        response = dirserv_get_compressed_response(conn->dir_spool_src,
+                                                   conn->fingerprint_stack,
+                                                   encrypted, &lookup);
+      if (response)
+        dlen = response->dir_z_len;
+      else
+        dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
+                                          1, compressed);
       if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
         log_info(LD_DIRSERV,
                  "Client asked for server descriptors, but we've been "
                  "writing too many bytes lately. Sending 503 Dir busy.");
         write_http_status_line(conn, 503, "Directory busy, try again later");
         conn->dir_spool_src = DIR_SPOOL_NONE;
+        cached_dir_decref(response);
+        compressed_response_lookup_free(lookup);
         goto done;
       }
       write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
+      if (lookup)
+        response = dirserv_build_compressed_response(lookup);
+      if (response)
+        connection_dirserv_spool_cached_dir(conn, response);
+      else if (compressed)
         conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
                                         choose_compression_level(dlen));
       /* Prime the connection with some data. */
@@ -127,6 +127,7 @@ STATIC int purpose_needs_anonymity(uint8_t dir_purpose,
                                    uint8_t router_purpose);
 STATIC dirinfo_type_t dir_fetch_type(int dir_purpose, int router_purpose,
                                      const char *resource);
+STATIC unsigned parse_accept_encoding_header(const char *h);
 #endif
 
 #endif
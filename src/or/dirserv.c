@@ -13,7 +13,9 @@
 #include "command.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -27,6 +29,7 @@
 #include "routerlist.h"
 #include "routerparse.h"
 #include "routerset.h"
+#include "workqueue.h"
 
 /**
  * \file dirserv.c
@@ -41,6 +44,9 @@
 /** If we're a cache, keep this many networkstatuses around from non-trusted
  * directory authorities. */
 #define MAX_UNTRUSTED_NETWORKSTATUSES 16
+/** By default, how many bytes of compressed responses to descriptor requests
+ * do we remember? */
+#define DIRSERV_COMPRESSED_CACHE_MAX_LEN (16<<20)
 
 extern time_t time_of_process_start; /* from main.c */
 
@@ -62,6 +68,9 @@ dirserv_get_status_impl(const char *fp, const char *nickname,
                         const char *platform, const char **msg,
                         int should_log);
 static void clear_cached_dir(cached_dir_t *d);
+static void consensus_diff_bases_add(const char *flavor_name,
+                                     cached_dir_t *old_consensus,
+                                     const cached_dir_t *new_consensus);
 static const signed_descriptor_t *get_signed_descriptor_by_fp(
                                                         const char *fp,
                                                         int extrainfo,
@@ -434,6 +443,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 {
   node->is_valid = (authstatus & FP_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & FP_BADEXIT) ? 1 : 0;
+  nodelist_note_nodes_changed();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -689,6 +699,7 @@ directory_remove_invalid(void)
       node->is_bad_exit = (r&FP_BADEXIT) ? 1: 0;
     }
   } SMARTLIST_FOREACH_END(node);
+  nodelist_note_nodes_changed();
 
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
@@ -803,6 +814,7 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
   }
 
   node->is_running = answer;
+  nodelist_note_nodes_changed();
 }
 
 /** Based on the routerinfo_ts in <b>routers</b>, allocate the
@@ -1103,6 +1115,28 @@ directory_too_idle_to_fetch_descriptors(const or_options_t *options,
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** How many consensuses of each flavor, besides the current one, we
+ * remember so that we can serve diffs from them. */
+#define DIRSERV_MAX_CONSENSUS_DIFF_BASES 3
+
+/** An older consensus that we can serve a diff from. */
+typedef struct consensus_diff_base_t {
+  /** SHA256 of the full text of the older consensus. */
+  char digest[DIGEST256_LEN];
+  /** The older consensus itself. */
+  cached_dir_t *consensus;
+  /** A diff from the older consensus to the current one, or NULL if we
+   * haven't made one yet. */
+  cached_dir_t *diff;
+  /** True iff we tried to make a diff to the current consensus and
+   * couldn't. */
+  unsigned int diff_failed : 1;
+} consensus_diff_base_t;
+
+/** Map from flavor name to a smartlist of consensus_diff_base_t for the
+ * consensuses we served before the current one, oldest first. */
+static strmap_t *consensus_diff_bases = NULL;
+
 /** Decrement the reference count on <b>d</b>, and free it if it no longer has
  * any references. */
 void
@@ -1131,12 +1165,53 @@ new_cached_dir(char *s, time_t published)
   return d;
 }
 
+/** Return a new reference to a cached_dir_t whose <b>dir_z</b> holds the
+ * contents of <b>d</b> compressed with <b>method</b>, compressing them if we
+ * haven't already.  The caller must release the result with
+ * cached_dir_decref().  Return NULL if we can't compress with
+ * <b>method</b>. */
+cached_dir_t *
+cached_dir_get_recompressed(cached_dir_t *d, compress_method_t method)
+{
+  cached_dir_t *r;
+  if (method == ZLIB_METHOD) {
+    ++d->refcnt;
+    return d;
+  }
+  if (d->recompressed && d->recompressed_method == method) {
+    ++d->recompressed->refcnt;
+    return d->recompressed;
+  }
+  if (!d->dir || !tor_compress_supports_method(method))
+    return NULL;
+
+  r = tor_malloc_zero(sizeof(cached_dir_t));
+  if (tor_gzip_compress(&r->dir_z, &r->dir_z_len, d->dir, d->dir_len,
+                        method) < 0) {
+    log_warn(LD_BUG, "Error compressing directory with %s",
+             compression_method_get_name(method));
+    tor_free(r);
+    return NULL;
+  }
+  r->refcnt = 1;
+  r->dir_len = d->dir_len;
+  r->published = d->published;
+  memcpy(&r->digests, &d->digests, sizeof(digests_t));
+
+  cached_dir_decref(d->recompressed);
+  d->recompressed = r;
+  d->recompressed_method = method;
+  ++r->refcnt;
+  return r;
+}
+
 /** Remove all storage held in <b>d</b>, but do not free <b>d</b> itself. */
 static void
 clear_cached_dir(cached_dir_t *d)
 {
   tor_free(d->dir);
   tor_free(d->dir_z);
+  cached_dir_decref(d->recompressed);
   memset(d, 0, sizeof(cached_dir_t));
 }
 
@@ -1171,7 +1246,123 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
   old_networkstatus = strmap_set(cached_consensuses, flavor_name,
                                  new_networkstatus);
   if (old_networkstatus)
-    cached_dir_decref(old_networkstatus);
+    consensus_diff_bases_add(flavor_name, old_networkstatus,
+                             new_networkstatus);
+}
+
+/** Free all storage held in the consensus_diff_base_t <b>b</b>. */
+static void
+consensus_diff_base_free(consensus_diff_base_t *b)
+{
+  if (!b)
+    return;
+  cached_dir_decref(b->consensus);
+  cached_dir_decref(b->diff);
+  tor_free(b);
+}
+
+/** Helper for strmap_free: free a smartlist of consensus_diff_base_t. */
+static void
+consensus_diff_bases_free_(void *bases_)
+{
+  smartlist_t *bases = bases_;
+  if (!bases)
+    return;
+  SMARTLIST_FOREACH(bases, consensus_diff_base_t *, b,
+                    consensus_diff_base_free(b));
+  smartlist_free(bases);
+}
+
+/** Called when the <b>flavor_name</b> consensus we serve changes from
+ * <b>old_consensus</b> to <b>new_consensus</b>: remember the old one as
+ * something we can serve diffs from, taking over our reference to it, and
+ * forget all the diffs we made to the old one. */
+static void
+consensus_diff_bases_add(const char *flavor_name,
+                         cached_dir_t *old_consensus,
+                         const cached_dir_t *new_consensus)
+{
+  smartlist_t *bases;
+  consensus_diff_base_t *base;
+  char new_digest[DIGEST256_LEN];
+
+  if (old_consensus->dir_len == new_consensus->dir_len &&
+      fast_memeq(old_consensus->dir, new_consensus->dir,
+                 old_consensus->dir_len)) {
+    /* Nothing changed; our diffs are still good. */
+    cached_dir_decref(old_consensus);
+    return;
+  }
+
+  if (!consensus_diff_bases)
+    consensus_diff_bases = strmap_new();
+  bases = strmap_get(consensus_diff_bases, flavor_name);
+  if (!bases) {
+    bases = smartlist_new();
+    strmap_set(consensus_diff_bases, flavor_name, bases);
+  }
+
+  crypto_digest256(new_digest, new_consensus->dir, new_consensus->dir_len,
+                   DIGEST_SHA256);
+  SMARTLIST_FOREACH_BEGIN(bases, consensus_diff_base_t *, b) {
+    if (tor_memeq(b->digest, new_digest, DIGEST256_LEN)) {
+      consensus_diff_base_free(b);
+      SMARTLIST_DEL_CURRENT_KEEPORDER(bases, b);
+      continue;
+    }
+    cached_dir_decref(b->diff);
+    b->diff = NULL;
+    b->diff_failed = 0;
+  } SMARTLIST_FOREACH_END(b);
+
+  base = tor_malloc_zero(sizeof(consensus_diff_base_t));
+  crypto_digest256(base->digest, old_consensus->dir, old_consensus->dir_len,
+                   DIGEST_SHA256);
+  base->consensus = old_consensus;
+  smartlist_add(bases, base);
+
+  while (smartlist_len(bases) > DIRSERV_MAX_CONSENSUS_DIFF_BASES) {
+    consensus_diff_base_free(smartlist_get(bases, 0));
+    smartlist_del_keeporder(bases, 0);
+  }
+}
+
+/** If we remember a <b>flavor_name</b> consensus whose full text has the
+ * SHA256 digest <b>base_digest</b>, return a diff from it to the current
+ * consensus, generating the diff if we haven't already.  The caller must
+ * release the result with cached_dir_decref().  Return NULL if we have no
+ * such consensus, or no useful diff from it. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *base_digest)
+{
+  cached_dir_t *current = dirserv_get_consensus(flavor_name);
+  smartlist_t *bases;
+
+  if (!current || !consensus_diff_bases ||
+      !(bases = strmap_get(consensus_diff_bases, flavor_name)))
+    return NULL;
+
+  SMARTLIST_FOREACH_BEGIN(bases, consensus_diff_base_t *, b) {
+    if (tor_memneq(b->digest, base_digest, DIGEST256_LEN))
+      continue;
+    if (!b->diff && !b->diff_failed) {
+      char *diff = consdiff_gen_diff(b->consensus->dir, current->dir);
+      if (diff && strlen(diff) < current->dir_len) {
+        b->diff = new_cached_dir(diff, current->published);
+      } else {
+        log_info(LD_DIRSERV, "Couldn't make a useful %s consensus diff.",
+                 flavor_name);
+        tor_free(diff);
+        b->diff_failed = 1;
+      }
+    }
+    if (!b->diff)
+      return NULL;
+    ++b->diff->refcnt;
+    return b->diff;
+  } SMARTLIST_FOREACH_END(b);
+
+  return NULL;
 }
 
 /** Return the latest downloaded consensus networkstatus in encoded, signed,
@@ -1406,6 +1597,7 @@ dirserv_compute_performance_thresholds(routerlist_t *rl,
       tor_assert(ri);
       node->is_exit = (!router_exit_policy_rejects_all(ri) &&
                        exit_policy_is_general_exit(ri->exit_policy));
+      nodelist_note_nodes_changed();
       uptimes[n_active] = (uint32_t)real_uptime(ri, now);
       mtbfs[n_active] = rep_hist_get_stability(id, now);
       tks  [n_active] = rep_hist_get_weighted_time_known(id, now);
@@ -2092,6 +2284,7 @@ set_routerstatus_from_routerinfo(routerstatus_t *rs,
 
   rs->is_bad_exit = listbadexits && node->is_bad_exit;
   node->is_hs_dir = dirserv_thinks_router_is_hs_dir(ri, node, now);
+  nodelist_note_nodes_changed();
   rs->is_hs_dir = vote_on_hsdirs && node->is_hs_dir;
 
   rs->is_named = rs->is_unnamed = 0;
@@ -3327,6 +3520,329 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
   return result;
 }
 
+/********************************************************************/
+
+/* Cache of compressed responses for descriptor requests.
+ *
+ * Many clients ask us for exactly the same set of descriptors or
+ * microdescriptors, and compressing each answer separately for every one
+ * of them is most of the CPU that a busy cache spends on directory
+ * requests.  So we remember the compressed answers to recent requests,
+ * keyed by the digests of the documents in them.  Since the key depends
+ * only on the documents' contents, an entry never goes stale: when a
+ * document changes, requests for it simply get a different key. */
+
+/** A compressed response to some request for descriptors. */
+typedef struct compressed_response_t {
+  /** Position of this entry in compressed_response_lru; the head is the
+   * least recently used. */
+  TOR_TAILQ_ENTRY(compressed_response_t) next;
+  /** SHA256 of the document type and the sorted digests of the documents in
+   * this response. */
+  uint8_t key[DIGEST256_LEN];
+  /** The compressed response, in dir_z. We hold a reference to it. */
+  cached_dir_t *dir;
+} compressed_response_t;
+
+/** One document that we're going to put in a compressed response. */
+typedef struct compressed_response_doc_t {
+  /** The digest that identifies this document. */
+  const char *digest;
+  /** The body of the document. */
+  const char *body;
+  /** The length of <b>body</b>. */
+  size_t body_len;
+} compressed_response_doc_t;
+
+/** The documents for a compressed response that wasn't in the cache, as
+ * found by dirserv_get_compressed_response(). */
+struct compressed_response_lookup_t {
+  /** The key for the compressed response holding these documents. */
+  uint8_t key[DIGEST256_LEN];
+  /** The documents, sorted by digest. */
+  compressed_response_doc_t *docs;
+  /** The number of entries in <b>docs</b>. */
+  int n_docs;
+  /** The total length of the documents' bodies. */
+  size_t body_len;
+};
+
+/** Map from compressed_response_t.key to compressed_response_t. */
+static digest256map_t *compressed_response_map = NULL;
+/** All entries in compressed_response_map, from least to most recently
+ * used. */
+static TOR_TAILQ_HEAD(compressed_response_lru_t, compressed_response_t)
+  compressed_response_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(compressed_response_lru);
+/** Total compressed length of all entries in compressed_response_map. */
+static size_t compressed_response_total_len = 0;
+/** Largest total compressed length we allow in compressed_response_map. */
+STATIC size_t compressed_response_max_len = DIRSERV_COMPRESSED_CACHE_MAX_LEN;
+
+/** When we're compressing spooled descriptors in a cpuworker, compress
+ * this many bytes of them at a time.  Compressed responses up to this big
+ * are small enough to build in the main thread. */
+STATIC size_t dirserv_compress_block_len = 64*1024;
+
+/** Length of the digests that identify the documents of type
+ * <b>spool_src</b>. */
+static INLINE size_t
+compressed_response_digest_len(dir_spool_source_t spool_src)
+{
+  return spool_src == DIR_SPOOL_MICRODESC ? DIGEST256_LEN : DIGEST_LEN;
+}
+
+/** Helper for sorting compressed_response_doc_t by SHA1 digest. */
+static int
+compare_compressed_response_docs_(const void *a, const void *b)
+{
+  const compressed_response_doc_t *da = a, *db = b;
+  return fast_memcmp(da->digest, db->digest, DIGEST_LEN);
+}
+
+/** Helper for sorting compressed_response_doc_t by SHA256 digest. */
+static int
+compare_compressed_response_docs256_(const void *a, const void *b)
+{
+  const compressed_response_doc_t *da = a, *db = b;
+  return fast_memcmp(da->digest, db->digest, DIGEST256_LEN);
+}
+
+/** Find the documents that a request for the <b>spool_src</b> documents
+ * in <b>fps</b> would send on a connection that's encrypted iff
+ * <b>encrypted</b> is set.  Return a newly allocated array of them, sorted
+ * by digest and without duplicates, and set *<b>n_out</b> to its length.
+ * Set <b>key_out</b> to the key of the compressed response holding them. */
+static compressed_response_doc_t *
+compressed_response_get_docs(dir_spool_source_t spool_src,
+                             const smartlist_t *fps, int encrypted,
+                             int *n_out, uint8_t *key_out)
+{
+  int by_fp = (spool_src == DIR_SPOOL_SERVER_BY_FP ||
+               spool_src == DIR_SPOOL_EXTRA_BY_FP);
+  int extra = (spool_src == DIR_SPOOL_EXTRA_BY_FP ||
+               spool_src == DIR_SPOOL_EXTRA_BY_DIGEST);
+  const size_t digest_len = compressed_response_digest_len(spool_src);
+  time_t publish_cutoff = time(NULL)-ROUTER_MAX_AGE_TO_PUBLISH;
+  microdesc_cache_t *cache = NULL;
+  compressed_response_doc_t *docs;
+  crypto_digest_t *d;
+  char type;
+  int i, n = 0, n_unique = 0;
+
+  docs = tor_calloc(smartlist_len(fps)+1, sizeof(compressed_response_doc_t));
+  if (spool_src == DIR_SPOOL_MICRODESC)
+    cache = get_microdesc_cache();
+
+  SMARTLIST_FOREACH_BEGIN(fps, const char *, fp) {
+    compressed_response_doc_t *doc = &docs[n];
+    if (cache) {
+      microdesc_t *md = microdesc_cache_lookup_by_digest256(cache, fp);
+      if (!md || !md->body)
+        continue;
+      doc->digest = md->digest;
+      doc->body = md->body;
+      doc->body_len = md->bodylen;
+    } else {
+      const signed_descriptor_t *sd;
+      if (by_fp) {
+        sd = get_signed_descriptor_by_fp(fp, extra, publish_cutoff);
+      } else {
+        sd = extra ? extrainfo_get_by_descriptor_digest(fp)
+          : router_get_by_descriptor_digest(fp);
+      }
+      if (!sd)
+        continue;
+      if (!encrypted && !sd->send_unencrypted)
+        continue;
+      doc->digest = sd->signed_descriptor_digest;
+      doc->body = signed_descriptor_get_body(sd);
+      doc->body_len = sd->signed_descriptor_len;
+    }
+    ++n;
+  } SMARTLIST_FOREACH_END(fp);
+
+  qsort(docs, n, sizeof(compressed_response_doc_t),
+        digest_len == DIGEST256_LEN ? compare_compressed_response_docs256_ :
+        compare_compressed_response_docs_);
+
+  d = crypto_digest256_new(DIGEST_SHA256);
+  type = cache ? 'm' : (extra ? 'e' : 's');
+  crypto_digest_add_bytes(d, &type, 1);
+  for (i = 0; i < n; ++i) {
+    if (n_unique &&
+        fast_memeq(docs[i].digest, docs[n_unique-1].digest, digest_len))
+      continue;
+    docs[n_unique++] = docs[i];
+    crypto_digest_add_bytes(d, docs[i].digest, digest_len);
+  }
+  crypto_digest_get_digest(d, (char*)key_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+
+  *n_out = n_unique;
+  return docs;
+}
+
+/** Remove the least recently used entry from the compressed response
+ * cache. */
+static void
+compressed_response_evict_one(void)
+{
+  compressed_response_t *victim = TOR_TAILQ_FIRST(&compressed_response_lru);
+  tor_assert(victim);
+  TOR_TAILQ_REMOVE(&compressed_response_lru, victim, next);
+  digest256map_remove(compressed_response_map, victim->key);
+  compressed_response_total_len -= victim->dir->dir_z_len;
+  cached_dir_decref(victim->dir);
+  tor_free(victim);
+}
+
+/** Release all storage held by <b>lookup</b>. */
+void
+compressed_response_lookup_free(compressed_response_lookup_t *lookup)
+{
+  if (!lookup)
+    return;
+  tor_free(lookup->docs);
+  tor_free(lookup);
+}
+
+/** Return a compressed response holding the <b>spool_src</b> documents
+ * listed in <b>fps</b>, as we'd send them on a connection that's encrypted
+ * iff <b>encrypted</b> is set.  The documents are in order of their
+ * digests.  The caller must release the result with cached_dir_decref().
+ *
+ * If we don't have the response in our cache, return NULL.  In that case,
+ * if <b>lookup_out</b> is provided and the response is small enough to
+ * build in the main thread, set *<b>lookup_out</b> to the documents we
+ * found, for dirserv_build_compressed_response().  Bigger responses should
+ * be spooled, so that the cpuworkers do the compression.  Also return NULL
+ * if we have none of the documents, or if we need to know which documents
+ * we serve one by one.
+ */
+cached_dir_t *
+dirserv_get_compressed_response(dir_spool_source_t spool_src,
+                                const smartlist_t *fps, int encrypted,
+                                compressed_response_lookup_t **lookup_out)
+{
+  compressed_response_doc_t *docs = NULL;
+  compressed_response_t *ent;
+  cached_dir_t *result = NULL;
+  uint8_t key[DIGEST256_LEN];
+  size_t body_len = 0;
+  int i, n = 0;
+
+  if (lookup_out)
+    *lookup_out = NULL;
+  if (spool_src != DIR_SPOOL_MICRODESC &&
+      get_options()->BridgeAuthoritativeDir) {
+    /* connection_dirserv_add_servers_to_outbuf() notes which bridge
+     * descriptors we serve. */
+    return NULL;
+  }
+  if (compressed_response_max_len == 0)
+    return NULL;
+
+  docs = compressed_response_get_docs(spool_src, fps, encrypted, &n, key);
+  if (n == 0)
+    goto done;
+
+  if (compressed_response_map &&
+      (ent = digest256map_get(compressed_response_map, key))) {
+    TOR_TAILQ_REMOVE(&compressed_response_lru, ent, next);
+    TOR_TAILQ_INSERT_TAIL(&compressed_response_lru, ent, next);
+    result = ent->dir;
+    ++result->refcnt;
+    goto done;
+  }
+  if (!lookup_out)
+    goto done;
+
+  for (i = 0; i < n; ++i)
+    body_len += docs[i].body_len;
+  /* Compressing more than a block would hold up the main thread; spool the
+   * response instead. */
+  if (body_len > dirserv_compress_block_len)
+    goto done;
+
+  *lookup_out = tor_malloc_zero(sizeof(compressed_response_lookup_t));
+  memcpy((*lookup_out)->key, key, DIGEST256_LEN);
+  (*lookup_out)->docs = docs;
+  (*lookup_out)->n_docs = n;
+  (*lookup_out)->body_len = body_len;
+  docs = NULL;
+
+ done:
+  tor_free(docs);
+  return result;
+}
+
+/** Build and remember the compressed response for the documents in
+ * <b>lookup</b>, which must come from dirserv_get_compressed_response(),
+ * and free <b>lookup</b>.  Return the response, or NULL on failure.  The
+ * caller must release the result with cached_dir_decref(). */
+cached_dir_t *
+dirserv_build_compressed_response(compressed_response_lookup_t *lookup)
+{
+  compressed_response_t *ent;
+  cached_dir_t *result = NULL;
+  char *body = NULL, *cp;
+  int i;
+
+  tor_assert(lookup);
+
+  cp = body = tor_malloc(lookup->body_len + 1);
+  for (i = 0; i < lookup->n_docs; ++i) {
+    memcpy(cp, lookup->docs[i].body, lookup->docs[i].body_len);
+    cp += lookup->docs[i].body_len;
+  }
+
+  result = tor_malloc_zero(sizeof(cached_dir_t));
+  result->refcnt = 1;
+  result->dir_len = lookup->body_len;
+  result->published = time(NULL);
+  if (tor_gzip_compress(&result->dir_z, &result->dir_z_len,
+                        body, lookup->body_len, ZLIB_METHOD) < 0) {
+    log_warn(LD_BUG, "Error compressing directory response");
+    cached_dir_decref(result);
+    result = NULL;
+    goto done;
+  }
+  /* Don't let one response push everything else out of the cache. */
+  if (result->dir_z_len > compressed_response_max_len / 2)
+    goto done;
+
+  if (!compressed_response_map)
+    compressed_response_map = digest256map_new();
+  while (compressed_response_total_len + result->dir_z_len >
+         compressed_response_max_len)
+    compressed_response_evict_one();
+
+  ent = tor_malloc_zero(sizeof(compressed_response_t));
+  memcpy(ent->key, lookup->key, DIGEST256_LEN);
+  ent->dir = result;
+  ++result->refcnt;
+  digest256map_set(compressed_response_map, ent->key, ent);
+  TOR_TAILQ_INSERT_TAIL(&compressed_response_lru, ent, next);
+  compressed_response_total_len += result->dir_z_len;
+
+ done:
+  tor_free(body);
+  compressed_response_lookup_free(lookup);
+  return result;
+}
+
+/** Remove every entry from the compressed response cache. */
+static void
+compressed_response_cache_free_all(void)
+{
+  while (!TOR_TAILQ_EMPTY(&compressed_response_lru))
+    compressed_response_evict_one();
+  digest256map_free(compressed_response_map, NULL);
+  compressed_response_map = NULL;
+  tor_assert(compressed_response_total_len == 0);
+}
+
 /** When we're spooling data onto our outbuf, add more whenever we dip
  * below this threshold. */
 #define DIRSERV_BUFFER_MIN 16384
@@ -3346,6 +3862,194 @@ connection_dirserv_finish_spooling(dir_connection_t *conn)
   return 0;
 }
 
+/** A block of spooled data that we're compressing in a cpuworker. */
+typedef struct spool_compress_job_t {
+  /** The connection that wants the compressed data, or NULL if it closed
+   * while we were compressing. */
+  dir_connection_t *conn;
+  /** The connection's compression state.  It belongs to the job while the
+   * job is running. */
+  tor_zlib_state_t *zlib_state;
+  /** The data to compress. */
+  char *input;
+  size_t input_len;
+  /** Set in the cpuworker: the compressed data. */
+  char *output;
+  size_t output_len;
+  /** True iff this is the last of the data for the connection. */
+  int finish;
+  /** Set in the cpuworker: true iff we compressed the data. */
+  int ok;
+} spool_compress_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+spool_compress_job_free(spool_compress_job_t *job)
+{
+  if (!job)
+    return;
+  tor_zlib_free(job->zlib_state);
+  tor_free(job->input);
+  tor_free(job->output);
+  tor_free(job);
+}
+
+/** Cpuworker side of spooled compression: compress the block in the
+ * spool_compress_job_t in <b>arg</b>. */
+static int
+spool_compress_threadfn(void *state, void *arg)
+{
+  spool_compress_job_t *job = arg;
+  const char *in = job->input;
+  size_t in_len = job->input_len;
+  size_t out_alloc = job->input_len / 2 + 1024;
+  int over = 0;
+  (void)state;
+
+  job->output = tor_malloc(out_alloc);
+  job->ok = 1;
+  do {
+    char *next = job->output + job->output_len;
+    size_t avail = out_alloc - job->output_len;
+    int need_more_room = 0;
+    switch (tor_zlib_process(job->zlib_state, &next, &avail, &in, &in_len,
+                             job->finish)) {
+      case TOR_ZLIB_DONE:
+        over = 1;
+        break;
+      case TOR_ZLIB_ERR:
+        job->ok = 0;
+        over = 1;
+        break;
+      case TOR_ZLIB_OK:
+        if (in_len == 0)
+          over = 1;
+        break;
+      case TOR_ZLIB_BUF_FULL:
+        need_more_room = 1;
+        break;
+    }
+    job->output_len = next - job->output;
+    if (need_more_room) {
+      out_alloc *= 2;
+      job->output = tor_realloc(job->output, out_alloc);
+    }
+  } while (!over);
+
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread side of spooled compression: the cpuworker is done with the
+ * spool_compress_job_t in <b>arg</b>.  Write its output to its connection,
+ * and go back to spooling. */
+static void
+spool_compress_replyfn(void *arg)
+{
+  spool_compress_job_t *job = arg;
+  dir_connection_t *conn = job->conn;
+
+  if (!conn) {
+    /* The connection closed while we were compressing. */
+    spool_compress_job_free(job);
+    return;
+  }
+  tor_assert(conn->compress_job == job);
+  conn->compress_job = NULL;
+
+  if (!job->ok) {
+    log_warn(LD_BUG, "Error compressing a directory response.");
+    connection_mark_for_close(TO_CONN(conn));
+    spool_compress_job_free(job);
+    return;
+  }
+
+  connection_write_to_buf(job->output, job->output_len, TO_CONN(conn));
+  if (job->finish) {
+    conn->dir_spool_src = DIR_SPOOL_NONE;
+  } else {
+    conn->zlib_state = job->zlib_state;
+    job->zlib_state = NULL;
+  }
+  spool_compress_job_free(job);
+
+  if (!TO_CONN(conn)->marked_for_close &&
+      TO_CONN(conn)->state == DIR_CONN_STATE_SERVER_WRITING)
+    connection_dirserv_flushed_some(conn);
+}
+
+/** Spooling helper: add <b>len</b> bytes of <b>data</b> to the compressed
+ * output on <b>conn</b>.  If <b>done</b> is set, this is the last of the
+ * data.  We compress the data a block at a time in a cpuworker; until we
+ * have a block, we just remember it.  If we can't use a cpuworker, we
+ * compress the block in the main thread. */
+static void
+connection_dirserv_write_compressed(dir_connection_t *conn,
+                                    const char *data, size_t len, int done)
+{
+  spool_compress_job_t *job;
+
+  tor_assert(conn->zlib_state);
+  tor_assert(!conn->compress_job);
+
+  if (!conn->spool_plaintext)
+    conn->spool_plaintext = buf_new();
+  if (len)
+    write_to_buf(data, len, conn->spool_plaintext);
+  if (!done &&
+      buf_datalen(conn->spool_plaintext) < dirserv_compress_block_len)
+    return;
+
+  job = tor_malloc_zero(sizeof(spool_compress_job_t));
+  job->input_len = buf_datalen(conn->spool_plaintext);
+  job->input = tor_malloc(job->input_len + 1);
+  fetch_from_buf(job->input, job->input_len, conn->spool_plaintext);
+  job->finish = done;
+  job->conn = conn;
+  job->zlib_state = conn->zlib_state;
+
+  if (cpuworker_queue_work(spool_compress_threadfn, spool_compress_replyfn,
+                           job)) {
+    conn->zlib_state = NULL;
+    conn->compress_job = job;
+    return;
+  }
+
+  /* No cpuworkers; do it ourselves. */
+  job->zlib_state = NULL;
+  connection_write_to_buf_zlib(job->input, job->input_len, conn, done);
+  if (done) {
+    tor_zlib_free(conn->zlib_state);
+    conn->zlib_state = NULL;
+  }
+  spool_compress_job_free(job);
+}
+
+/** Called when <b>conn</b> is about to be freed.  If we're compressing data
+ * for it in a cpuworker, make sure that the job doesn't try to use it. */
+void
+connection_dirserv_detach_compress_job(dir_connection_t *conn)
+{
+  if (conn->compress_job) {
+    conn->compress_job->conn = NULL;
+    conn->compress_job = NULL;
+  }
+}
+
+/** Spooling helper: called when we have no more descriptors to spool to
+ * <b>conn</b>.  Flushes any remaining data to be compressed, and changes the
+ * spool source to NONE once all of it is on the outbuf. */
+static void
+connection_dirserv_finish_compressed_spooling(dir_connection_t *conn)
+{
+  if (conn->zlib_state)
+    connection_dirserv_write_compressed(conn, "", 0, 1);
+  /* If we're still compressing, spool_compress_replyfn() will finish. */
+  if (!conn->compress_job)
+    conn->dir_spool_src = DIR_SPOOL_NONE;
+  smartlist_free(conn->fingerprint_stack);
+  conn->fingerprint_stack = NULL;
+}
+
 /** Spooling helper: called when we're sending a bunch of server descriptors,
  * and the outbuf has become too empty. Pulls some entries from
  * fingerprint_stack, and writes the corresponding servers onto outbuf.  If we
@@ -3364,10 +4068,12 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
   const or_options_t *options = get_options();
 
   while (smartlist_len(conn->fingerprint_stack) &&
-         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
+         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN &&
+         !conn->compress_job) {
     const char *body;
     char *fp = smartlist_pop_last(conn->fingerprint_stack);
     const signed_descriptor_t *sd = NULL;
+    store_mmap_ref_t *mmap_ref;
     if (by_fp) {
       sd = get_signed_descriptor_by_fp(fp, extra, publish_cutoff);
     } else {
@@ -3398,12 +4104,14 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
     body = signed_descriptor_get_body(sd);
     if (conn->zlib_state) {
       int last = ! smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(body, sd->signed_descriptor_len, conn,
-                                   last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
+      connection_dirserv_write_compressed(conn, body,
+                                          sd->signed_descriptor_len, last);
+    } else if ((mmap_ref = signed_descriptor_get_mmap_ref(sd))) {
+      /* Send it straight out of the store's mmap, which the reference
+       * keeps around until the bytes are flushed. */
+      connection_write_to_buf_external(body, sd->signed_descriptor_len,
+                                       TO_CONN(conn),
+                                       store_mmap_ref_release, mmap_ref);
     } else {
       connection_write_to_buf(body,
                               sd->signed_descriptor_len,
@@ -3413,14 +4121,7 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
 
   if (!smartlist_len(conn->fingerprint_stack)) {
     /* We just wrote the last one; finish up. */
-    if (conn->zlib_state) {
-      connection_write_to_buf_zlib("", 0, conn, 1);
-      tor_zlib_free(conn->zlib_state);
-      conn->zlib_state = NULL;
-    }
-    conn->dir_spool_src = DIR_SPOOL_NONE;
-    smartlist_free(conn->fingerprint_stack);
-    conn->fingerprint_stack = NULL;
+    connection_dirserv_finish_compressed_spooling(conn);
   }
   return 0;
 }
@@ -3436,7 +4137,8 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
 {
   microdesc_cache_t *cache = get_microdesc_cache();
   while (smartlist_len(conn->fingerprint_stack) &&
-         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
+         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN &&
+         !conn->compress_job) {
     char *fp256 = smartlist_pop_last(conn->fingerprint_stack);
     microdesc_t *md = microdesc_cache_lookup_by_digest256(cache, fp256);
     tor_free(fp256);
@@ -3444,24 +4146,13 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
       continue;
     if (conn->zlib_state) {
       int last = !smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(md->body, md->bodylen, conn, last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
+      connection_dirserv_write_compressed(conn, md->body, md->bodylen, last);
     } else {
       connection_write_to_buf(md->body, md->bodylen, TO_CONN(conn));
     }
   }
   if (!smartlist_len(conn->fingerprint_stack)) {
-    if (conn->zlib_state) {
-      connection_write_to_buf_zlib("", 0, conn, 1);
-      tor_zlib_free(conn->zlib_state);
-      conn->zlib_state = NULL;
-    }
-    conn->dir_spool_src = DIR_SPOOL_NONE;
-    smartlist_free(conn->fingerprint_stack);
-    conn->fingerprint_stack = NULL;
+    connection_dirserv_finish_compressed_spooling(conn);
   }
   return 0;
 }
@@ -3556,6 +4247,24 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
   return 0;
 }
 
+/** Start spooling the compressed response <b>d</b> onto <b>conn</b>,
+ * instead of whatever documents its fingerprint_stack lists.  Takes
+ * ownership of the caller's reference to <b>d</b>. */
+void
+connection_dirserv_spool_cached_dir(dir_connection_t *conn, cached_dir_t *d)
+{
+  tor_assert(!conn->zlib_state);
+  tor_assert(!conn->cached_dir);
+  if (conn->fingerprint_stack) {
+    SMARTLIST_FOREACH(conn->fingerprint_stack, char *, fp, tor_free(fp));
+    smartlist_free(conn->fingerprint_stack);
+    conn->fingerprint_stack = NULL;
+  }
+  conn->cached_dir = d;
+  conn->cached_dir_offset = 0;
+  conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+}
+
 /** Called whenever we have flushed some directory data in state
  * SERVER_WRITING. */
 int
@@ -3565,6 +4274,10 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
 
   if (connection_get_outbuf_len(TO_CONN(conn)) >= DIRSERV_BUFFER_MIN)
     return 0;
+  if (conn->compress_job) {
+    /* We'll add more when it's done. */
+    return 0;
+  }
 
   switch (conn->dir_spool_src) {
     case DIR_SPOOL_EXTRA_BY_DIGEST:
@@ -3666,6 +4379,10 @@ dirserv_free_all(void)
 
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  strmap_free(consensus_diff_bases, consensus_diff_bases_free_);
+  consensus_diff_bases = NULL;
+
+  compressed_response_cache_free_all();
 
   dirserv_clear_measured_bw_cache();
 }
@@ -33,6 +33,9 @@
 #define MAX_V_LINE_LEN 128
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+void connection_dirserv_spool_cached_dir(dir_connection_t *conn,
+                                         cached_dir_t *d);
+void connection_dirserv_detach_compress_job(dir_connection_t *conn);
 
 int dirserv_add_own_fingerprint(crypto_pk_t *pk);
 int dirserv_load_fingerprint_file(void);
@@ -62,6 +65,8 @@ int directory_too_idle_to_fetch_descriptors(const or_options_t *options,
                                             time_t now);
 
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *base_digest);
 void dirserv_set_cached_consensus_networkstatus(const char *consensus,
                                                 const char *flavor_name,
                                                 const digests_t *digests,
@@ -95,6 +100,13 @@ int dirserv_have_any_microdesc(const smartlist_t *fps);
 size_t dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
                                   int compressed);
 size_t dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed);
+typedef struct compressed_response_lookup_t compressed_response_lookup_t;
+cached_dir_t *dirserv_get_compressed_response(dir_spool_source_t spool_src,
+                                   const smartlist_t *fps, int encrypted,
+                                   compressed_response_lookup_t **lookup_out);
+cached_dir_t *dirserv_build_compressed_response(
+                                   compressed_response_lookup_t *lookup);
+void compressed_response_lookup_free(compressed_response_lookup_t *lookup);
 
 char *routerstatus_format_entry(
                               const routerstatus_t *rs, const char *platform,
@@ -103,11 +115,18 @@ char *routerstatus_format_entry(
 void dirserv_free_all(void);
 void cached_dir_decref(cached_dir_t *d);
 cached_dir_t *new_cached_dir(char *s, time_t published);
+cached_dir_t *cached_dir_get_recompressed(cached_dir_t *d,
+                                          compress_method_t method);
 
 int validate_recommended_package_line(const char *line);
 
 #ifdef DIRSERV_PRIVATE
 
+#ifdef TOR_UNIT_TESTS
+extern size_t compressed_response_max_len;
+extern size_t dirserv_compress_block_len;
+#endif
+
 /* Put the MAX_MEASUREMENT_AGE #define here so unit tests can see it */
 #define MAX_MEASUREMENT_AGE (3*24*60*60) /* 3 days */
 
@@ -54,6 +54,7 @@
 #include "routerlist.h"
 #include "routerparse.h"
 #include "scheduler.h"
+#include "sigcache.h"
 #include "statefile.h"
 #include "status.h"
 #include "util_process.h"
@@ -1997,6 +1998,13 @@ do_main_loop(void)
   /* initialize the bootstrap status events to know we're starting up */
   control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
 
+  if (server_mode(get_options())) {
+    /* launch cpuworkers. Need to do this *after* we've read the onion key.
+     * We do it before loading our cached directory information, so that we
+     * can use them to parse it. */
+    cpu_init();
+  }
+
   if (trusted_dirs_reload_certs()) {
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
@@ -2014,11 +2022,6 @@ do_main_loop(void)
   now = time(NULL);
   directory_info_has_arrived(now, 1);
 
-  if (server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-    cpu_init();
-  }
-
   /* set up once-a-second callback. */
   if (! second_timer) {
     struct timeval one_second;
@@ -2467,6 +2470,7 @@ tor_init(int argc, char *argv[])
 
   /* Initialize the history structures. */
   rep_hist_init();
+  routerparse_init();
   /* Initialize the service cache. */
   rend_cache_init();
   addressmap_init(); /* Init the client dns cache. Do it always, since it's
@@ -2668,6 +2672,7 @@ tor_free_all(int postfork)
   memarea_clear_freelist();
   nodelist_free_all();
   microdesc_free_all();
+  sigcache_free_all();
   ext_orport_free_all();
   control_free_all();
   sandbox_free_getaddrinfo_cache();
@@ -2868,6 +2873,7 @@ sandbox_init_filter(void)
   OPEN_DATADIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_DATADIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_DATADIR("cached-descriptors.tmp.tmp");
@@ -2913,6 +2919,7 @@ sandbox_init_filter(void)
   RENAME_SUFFIX("cached-microdescs", ".tmp");
   RENAME_SUFFIX("cached-microdescs", ".new");
   RENAME_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".new");
   RENAME_SUFFIX("cached-descriptors.new", ".tmp");
@@ -2934,6 +2941,7 @@ sandbox_init_filter(void)
   STAT_DATADIR("state");
   STAT_DATADIR("router-stability");
   STAT_DATADIR("cached-extrainfo.new");
+  STAT_DATADIR("cached-microdescs");
 
   {
     smartlist_t *files = smartlist_new();
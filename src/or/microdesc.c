@@ -1,6 +1,8 @@
 /* Copyright (c) 2009-2015, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define MICRODESC_PRIVATE
+
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
@@ -14,6 +16,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sandbox.h"
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
@@ -28,8 +31,15 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
+  /** Mmap'd contents of the index file, if any microdescriptors still point
+   * into it. */
+  tor_mmap_t *index_content;
+  /** True iff the index file on disk describes the current cache file. */
+  unsigned int index_is_current : 1;
   /** Number of bytes used in the journal file. */
   size_t journal_len;
   /** Number of bytes in descriptors removed as too old. */
@@ -61,6 +71,9 @@ HT_GENERATE2(microdesc_map, microdesc_t, node,
              microdesc_hash_, microdesc_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
+static smartlist_t *microdesc_cache_load_index(microdesc_cache_t *cache);
+static int microdesc_cache_write_index(microdesc_cache_t *cache);
+
 /** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
  * On success, return the total number of bytes written, and set
  * *<b>annotation_len_out</b> to the number of bytes written as
@@ -105,6 +118,571 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
   return r;
 }
 
+/* The cache index.
+ *
+ * Parsing every microdescriptor in the cache file, and computing its
+ * digest, takes a noticeable amount of CPU at startup.  So whenever we
+ * write the cache file, we also write an index file next to it.  For each
+ * microdescriptor in the cache file, the index holds its digest, location,
+ * and last-listed time, along with its fields in a form that is cheap to
+ * decode.  When we reload, we take the microdescriptors from the index
+ * without looking at their bodies, and only decode their fields once
+ * something looks them up.
+ *
+ * The index starts with a header:
+ *     MD_INDEX_MAGIC         [16 bytes]
+ *     size of cache file     [8 bytes]
+ *     mtime of cache file    [8 bytes]
+ *     number of entries      [4 bytes]
+ * Each entry is:
+ *     entry length           [4 bytes]
+ *     sha256 digest          [32 bytes]
+ *     offset of body         [8 bytes]
+ *     length of body         [4 bytes]
+ *     last-listed time       [8 bytes]
+ *     onion key length, DER-encoded onion key   [2 bytes, variable]
+ *     has ntor key, ntor key [1 byte, 0 or 32 bytes]
+ *     IPv6 address, ORPort   [16 bytes, 2 bytes]
+ *     family length, family  [2 bytes, variable]
+ *     p length, p summary    [2 bytes, variable]
+ *     p6 length, p6 summary  [2 bytes, variable]
+ * All integers are big-endian.  The index is only a cache: if it doesn't
+ * match the cache file, we ignore it and parse the cache file instead.
+ */
+
+/** Magic string at the start of the cache index, including the NUL. */
+#define MD_INDEX_MAGIC "tor-md-index-1\n"
+/** Length of MD_INDEX_MAGIC. */
+#define MD_INDEX_MAGIC_LEN 16
+/** Length of the header of the cache index. */
+#define MD_INDEX_HEADER_LEN (MD_INDEX_MAGIC_LEN + 8 + 8 + 4)
+/** Length of the fixed-size parts of an entry in the cache index. */
+#define MD_INDEX_ENTRY_MIN_LEN (4 + DIGEST256_LEN + 8 + 4 + 8 + 2 + 1 + \
+                                16 + 2 + 2 + 2 + 2)
+
+/** Store the 64-bit value <b>v</b> at <b>cp</b> in big-endian order. */
+static INLINE void
+set_uint64_be(char *cp, uint64_t v)
+{
+  set_uint32(cp, htonl((uint32_t)(v >> 32)));
+  set_uint32(cp+4, htonl((uint32_t)v));
+}
+
+/** Return the big-endian 64-bit value stored at <b>cp</b>. */
+static INLINE uint64_t
+get_uint64_be(const char *cp)
+{
+  return (((uint64_t)ntohl(get_uint32(cp))) << 32) |
+    ntohl(get_uint32(cp+4));
+}
+
+/** Write the <b>len</b>-byte string <b>str</b> at *<b>cpp</b>, preceded by
+ * its length, and advance *<b>cpp</b>. */
+static void
+md_index_put_str(char **cpp, const char *str, size_t len)
+{
+  set_uint16(*cpp, htons((uint16_t)len));
+  if (len)
+    memcpy(*cpp + 2, str, len);
+  *cpp += 2 + len;
+}
+
+/** Encode <b>md</b> as an entry in the cache index.  Return a newly
+ * allocated entry, and set *<b>len_out</b> to its length; or return NULL
+ * if <b>md</b> can't be encoded. */
+static char *
+microdesc_index_entry_encode(const microdesc_t *md, size_t *len_out)
+{
+  char key[1024];
+  int keylen;
+  char *family = NULL, *p = NULL, *p6 = NULL;
+  size_t family_len = 0, p_len = 0, p6_len = 0, len;
+  char *result = NULL, *cp;
+
+  tor_assert(!md->unparsed);
+  if (!md->onion_pkey)
+    return NULL;
+  keylen = crypto_pk_asn1_encode(md->onion_pkey, key, sizeof(key));
+  if (keylen < 0)
+    return NULL;
+
+  if (md->family) {
+    family = smartlist_join_strings(md->family, " ", 0, &family_len);
+  }
+  if (md->exit_policy) {
+    p = write_short_policy(md->exit_policy);
+    p_len = strlen(p);
+  }
+  if (md->ipv6_exit_policy) {
+    p6 = write_short_policy(md->ipv6_exit_policy);
+    p6_len = strlen(p6);
+  }
+  if (family_len > UINT16_MAX || p_len > UINT16_MAX || p6_len > UINT16_MAX)
+    goto done;
+
+  len = MD_INDEX_ENTRY_MIN_LEN + keylen + family_len + p_len + p6_len;
+  if (md->onion_curve25519_pkey)
+    len += CURVE25519_PUBKEY_LEN;
+
+  cp = result = tor_malloc_zero(len);
+  set_uint32(cp, htonl((uint32_t)len));
+  cp += 4;
+  memcpy(cp, md->digest, DIGEST256_LEN);
+  cp += DIGEST256_LEN;
+  set_uint64_be(cp, (uint64_t)md->off);
+  cp += 8;
+  set_uint32(cp, htonl((uint32_t)md->bodylen));
+  cp += 4;
+  set_uint64_be(cp, (uint64_t)md->last_listed);
+  cp += 8;
+  md_index_put_str(&cp, key, keylen);
+  if (md->onion_curve25519_pkey) {
+    *cp++ = 1;
+    memcpy(cp, md->onion_curve25519_pkey->public_key, CURVE25519_PUBKEY_LEN);
+    cp += CURVE25519_PUBKEY_LEN;
+  } else {
+    *cp++ = 0;
+  }
+  if (tor_addr_family(&md->ipv6_addr) == AF_INET6)
+    memcpy(cp, tor_addr_to_in6_addr8(&md->ipv6_addr), 16);
+  cp += 16;
+  set_uint16(cp, htons(md->ipv6_orport));
+  cp += 2;
+  md_index_put_str(&cp, family, family_len);
+  md_index_put_str(&cp, p, p_len);
+  md_index_put_str(&cp, p6, p6_len);
+  tor_assert(cp == result + len);
+  *len_out = len;
+
+ done:
+  memwipe(key, 0, sizeof(key));
+  tor_free(family);
+  tor_free(p);
+  tor_free(p6);
+  return result;
+}
+
+/** Read a length-prefixed string from *<b>cpp</b>, which has
+ * *<b>remaining</b> bytes left, into a newly allocated NUL-terminated
+ * string in *<b>out</b> (or NULL if it's empty).  Advance *<b>cpp</b>.
+ * Return 0 on success, -1 if the string runs past the end. */
+static int
+md_index_get_str(const char **cpp, size_t *remaining, char **out)
+{
+  size_t len;
+  *out = NULL;
+  if (*remaining < 2)
+    return -1;
+  len = ntohs(get_uint16(*cpp));
+  if (*remaining < 2 + len)
+    return -1;
+  if (len)
+    *out = tor_memdup_nulterm(*cpp + 2, len);
+  *cpp += 2 + len;
+  *remaining -= 2 + len;
+  return 0;
+}
+
+/** Fill in the fields of <b>md</b> from the <b>len</b>-byte cache index
+ * entry at <b>entry</b>.  Return 0 on success, -1 on failure. */
+static int
+microdesc_index_entry_decode_fields(microdesc_t *md, const char *entry,
+                                    size_t len)
+{
+  const char *cp = entry;
+  size_t remaining = len;
+  size_t keylen;
+  char *family = NULL, *p = NULL, *p6 = NULL;
+  int r = -1;
+
+  const size_t fixed_len = 4 + DIGEST256_LEN + 8 + 4 + 8;
+  if (remaining < fixed_len + 2)
+    return -1;
+  cp += fixed_len;
+  remaining -= fixed_len;
+
+  keylen = ntohs(get_uint16(cp));
+  if (remaining < 2 + keylen + 1)
+    return -1;
+  md->onion_pkey = crypto_pk_asn1_decode(cp + 2, keylen);
+  if (!md->onion_pkey)
+    goto done;
+  cp += 2 + keylen;
+  remaining -= 2 + keylen;
+
+  if (*cp) {
+    if (remaining < 1 + CURVE25519_PUBKEY_LEN)
+      goto done;
+    md->onion_curve25519_pkey =
+      tor_memdup(cp + 1, sizeof(curve25519_public_key_t));
+    cp += CURVE25519_PUBKEY_LEN;
+    remaining -= CURVE25519_PUBKEY_LEN;
+  }
+  ++cp;
+  --remaining;
+
+  if (remaining < 18)
+    goto done;
+  if (!tor_mem_is_zero(cp, 16))
+    tor_addr_from_ipv6_bytes(&md->ipv6_addr, cp);
+  md->ipv6_orport = ntohs(get_uint16(cp + 16));
+  cp += 18;
+  remaining -= 18;
+
+  if (md_index_get_str(&cp, &remaining, &family) < 0 ||
+      md_index_get_str(&cp, &remaining, &p) < 0 ||
+      md_index_get_str(&cp, &remaining, &p6) < 0 ||
+      remaining != 0)
+    goto done;
+
+  if (family) {
+    md->family = smartlist_new();
+    smartlist_split_string(md->family, family, " ",
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  }
+  if (p && !(md->exit_policy = parse_short_policy(p)))
+    goto done;
+  if (p6 && !(md->ipv6_exit_policy = parse_short_policy(p6)))
+    goto done;
+
+  r = 0;
+ done:
+  tor_free(family);
+  tor_free(p);
+  tor_free(p6);
+  return r;
+}
+
+/** Release the parsed fields of <b>md</b>, leaving its body alone. */
+static void
+microdesc_clear_fields(microdesc_t *md)
+{
+  if (md->onion_pkey)
+    crypto_pk_free(md->onion_pkey);
+  md->onion_pkey = NULL;
+  tor_free(md->onion_curve25519_pkey);
+  tor_addr_make_unspec(&md->ipv6_addr);
+  md->ipv6_orport = 0;
+  if (md->family) {
+    SMARTLIST_FOREACH(md->family, char *, cp, tor_free(cp));
+    smartlist_free(md->family);
+    md->family = NULL;
+  }
+  short_policy_free(md->exit_policy);
+  md->exit_policy = NULL;
+  short_policy_free(md->ipv6_exit_policy);
+  md->ipv6_exit_policy = NULL;
+}
+
+/** If <b>md</b> came from the cache index and we haven't filled in its
+ * fields yet, fill them in now: from the index if we can, and from its body
+ * otherwise.  Return 0 on success, and -1 if <b>md</b> is unusable. */
+int
+microdesc_parse_fields(microdesc_t *md)
+{
+  smartlist_t *parsed;
+  microdesc_t *md2;
+
+  if (PREDICT_LIKELY(!md->unparsed))
+    return 0;
+
+  if (md->index_entry) {
+    size_t len = ntohl(get_uint32(md->index_entry));
+    if (microdesc_index_entry_decode_fields(md, md->index_entry, len) == 0) {
+      md->unparsed = 0;
+      md->index_entry = NULL;
+      return 0;
+    }
+    log_info(LD_DIR, "Bad microdescriptor cache index entry; parsing the "
+             "microdescriptor instead.");
+    microdesc_clear_fields(md);
+    md->index_entry = NULL;
+  }
+
+  if (!md->body)
+    return -1;
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                        0, SAVED_NOWHERE, NULL);
+  if (smartlist_len(parsed) != 1 ||
+      tor_memneq((md2 = smartlist_get(parsed, 0))->digest, md->digest,
+                 DIGEST256_LEN)) {
+    SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+    smartlist_free(parsed);
+    return -1;
+  }
+
+  /* Steal md2's fields. */
+  md->onion_pkey = md2->onion_pkey;
+  md->onion_curve25519_pkey = md2->onion_curve25519_pkey;
+  tor_addr_copy(&md->ipv6_addr, &md2->ipv6_addr);
+  md->ipv6_orport = md2->ipv6_orport;
+  md->family = md2->family;
+  md->exit_policy = md2->exit_policy;
+  md->ipv6_exit_policy = md2->ipv6_exit_policy;
+  md2->onion_pkey = NULL;
+  md2->onion_curve25519_pkey = NULL;
+  md2->family = NULL;
+  md2->exit_policy = md2->ipv6_exit_policy = NULL;
+  microdesc_free(md2);
+  smartlist_free(parsed);
+
+  md->unparsed = 0;
+  return 0;
+}
+
+/** Return the size and modification time of <b>cache</b>'s cache file in
+ * *<b>size_out</b> and *<b>mtime_out</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+microdesc_cache_file_stat(microdesc_cache_t *cache, uint64_t *size_out,
+                          int64_t *mtime_out)
+{
+  struct stat st;
+  if (stat(sandbox_intern_string(cache->cache_fname), &st) < 0)
+    return -1;
+  *size_out = (uint64_t)st.st_size;
+  *mtime_out = (int64_t)st.st_mtime;
+  return 0;
+}
+
+/** Try to load the microdescriptors in <b>cache</b>'s cache file from the
+ * cache index.  On success, return a list of new microdescriptors whose
+ * bodies point into the cache file, but whose fields we haven't filled in.
+ * Return NULL if the index is missing, or out of date, or broken. */
+static smartlist_t *
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  tor_mmap_t *mm;
+  smartlist_t *result = NULL;
+  const char *cp, *eos;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t n_entries, i;
+  const tor_mmap_t *content = cache->cache_content;
+
+  tor_assert(content);
+  tor_assert(! cache->index_content);
+
+  mm = tor_mmap_file(cache->index_fname);
+  if (!mm)
+    return NULL;
+
+  if (mm->size < MD_INDEX_HEADER_LEN ||
+      fast_memneq(mm->data, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN)) {
+    log_info(LD_DIR, "Microdescriptor cache index was unrecognized.");
+    goto err;
+  }
+  if (microdesc_cache_file_stat(cache, &size, &mtime) < 0 ||
+      size != content->size ||
+      get_uint64_be(mm->data + MD_INDEX_MAGIC_LEN) != size ||
+      (int64_t)get_uint64_be(mm->data + MD_INDEX_MAGIC_LEN + 8) != mtime) {
+    log_info(LD_DIR, "Microdescriptor cache index was out of date.");
+    goto err;
+  }
+  n_entries = ntohl(get_uint32(mm->data + MD_INDEX_MAGIC_LEN + 16));
+
+  result = smartlist_new();
+  cp = mm->data + MD_INDEX_HEADER_LEN;
+  eos = mm->data + mm->size;
+  for (i = 0; i < n_entries; ++i) {
+    microdesc_t *md;
+    uint32_t len;
+    uint64_t off;
+    if (eos - cp < MD_INDEX_ENTRY_MIN_LEN)
+      goto truncated;
+    len = ntohl(get_uint32(cp));
+    if (len < MD_INDEX_ENTRY_MIN_LEN || len > (size_t)(eos - cp))
+      goto truncated;
+
+    md = tor_malloc_zero(sizeof(microdesc_t));
+    smartlist_add(result, md);
+    memcpy(md->digest, cp + 4, DIGEST256_LEN);
+    off = get_uint64_be(cp + 4 + DIGEST256_LEN);
+    md->bodylen = ntohl(get_uint32(cp + 4 + DIGEST256_LEN + 8));
+    md->last_listed =
+      (time_t) get_uint64_be(cp + 4 + DIGEST256_LEN + 8 + 4);
+    if (off > content->size || md->bodylen > content->size - off ||
+        md->bodylen < 9 ||
+        fast_memneq(content->data + off, "onion-key", 9)) {
+      log_info(LD_DIR, "Microdescriptor cache index didn't match the "
+               "cache.");
+      goto err;
+    }
+    md->off = (off_t) off;
+    md->body = (char*)content->data + off;
+    md->saved_location = SAVED_IN_CACHE;
+    md->unparsed = 1;
+    md->index_entry = cp;
+    cp += len;
+  }
+  if (cp != eos)
+    goto truncated;
+
+  cache->index_content = mm;
+  cache->index_is_current = 1;
+  log_info(LD_DIR, "Loaded %d microdescriptors from the cache index.",
+           smartlist_len(result));
+  return result;
+
+ truncated:
+  log_info(LD_DIR, "Microdescriptor cache index was truncated.");
+ err:
+  if (result) {
+    SMARTLIST_FOREACH(result, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(result);
+  }
+  tor_munmap_file(mm);
+  return NULL;
+}
+
+/** Return a copy of the index entry that <b>md</b> was loaded from, with
+ * its offset, length, and last-listed time brought up to date, and set
+ * *<b>len_out</b> to its length. */
+static char *
+microdesc_index_entry_copy(const microdesc_t *md, size_t *len_out)
+{
+  size_t len = ntohl(get_uint32(md->index_entry));
+  char *entry = tor_memdup(md->index_entry, len);
+  char *cp = entry + 4 + DIGEST256_LEN;
+  set_uint64_be(cp, (uint64_t)md->off);
+  set_uint32(cp + 8, htonl((uint32_t)md->bodylen));
+  set_uint64_be(cp + 8 + 4, (uint64_t)md->last_listed);
+  *len_out = len;
+  return entry;
+}
+
+/** Write a new index for <b>cache</b>'s cache file.  Return 0 on success,
+ * -1 on failure.
+ *
+ * Microdescriptors whose fields we haven't filled in yet stay that way:
+ * we copy their old index entries rather than decoding them, and point
+ * them at their entries in the new index once it's written. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  smartlist_t *chunks, *relink;
+  sized_chunk_t *header;
+  size_t *relink_off = NULL;
+  size_t offset = MD_INDEX_HEADER_LEN;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t n_entries = 0;
+  tor_mmap_t *mm = NULL;
+  int r = -1;
+
+  cache->index_is_current = 0;
+  chunks = smartlist_new();
+  relink = smartlist_new();
+
+  if (!cache->cache_content ||
+      microdesc_cache_file_stat(cache, &size, &mtime) < 0 ||
+      size != cache->cache_content->size)
+    goto done;
+
+  header = tor_malloc_zero(sizeof(sized_chunk_t) + MD_INDEX_HEADER_LEN);
+  smartlist_add(chunks, header);
+  relink_off = tor_calloc(HT_SIZE(&cache->map) + 1, sizeof(size_t));
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    sized_chunk_t *chunk;
+    char *entry;
+    size_t len;
+    if (md->saved_location != SAVED_IN_CACHE || !md->body)
+      continue;
+    if (md->unparsed) {
+      if (!md->index_entry)
+        continue;
+      entry = microdesc_index_entry_copy(md, &len);
+      /* Until the new index is mapped, use the copy. */
+      md->index_entry = entry;
+      relink_off[smartlist_len(relink)] = offset;
+      smartlist_add(relink, md);
+    } else if (!(entry = microdesc_index_entry_encode(md, &len))) {
+      continue;
+    }
+    chunk = tor_malloc(sizeof(sized_chunk_t));
+    chunk->bytes = entry;
+    chunk->len = len;
+    smartlist_add(chunks, chunk);
+    offset += len;
+    ++n_entries;
+  }
+
+  {
+    char *hdr = (char*)(header + 1);
+    memcpy(hdr, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN);
+    set_uint64_be(hdr + MD_INDEX_MAGIC_LEN, size);
+    set_uint64_be(hdr + MD_INDEX_MAGIC_LEN + 8, (uint64_t)mtime);
+    set_uint32(hdr + MD_INDEX_MAGIC_LEN + 16, htonl(n_entries));
+    header->bytes = hdr;
+    header->len = MD_INDEX_HEADER_LEN;
+  }
+
+  /* Nothing points into the old index any more, so we can let it go before
+   * we replace it. */
+  if (cache->index_content) {
+    tor_munmap_file(cache->index_content);
+    cache->index_content = NULL;
+  }
+
+  r = write_chunks_to_file(cache->index_fname, chunks, 1, 0);
+  if (r < 0) {
+    log_info(LD_DIR, "Couldn't write microdescriptor cache index.");
+  } else {
+    cache->index_is_current = 1;
+    if (smartlist_len(relink)) {
+      mm = tor_mmap_file(cache->index_fname);
+      if (mm && mm->size != offset) {
+        tor_munmap_file(mm);
+        mm = NULL;
+      }
+    }
+  }
+
+ done:
+  /* Point the unparsed microdescriptors into the new index; or if we can't,
+   * fill in their fields from our copies before we free them. */
+  SMARTLIST_FOREACH_BEGIN(relink, microdesc_t *, md) {
+    if (mm) {
+      md->index_entry = mm->data + relink_off[md_sl_idx];
+    } else {
+      microdesc_parse_fields(md);
+      md->index_entry = NULL;
+    }
+  } SMARTLIST_FOREACH_END(md);
+  if (mm)
+    cache->index_content = mm;
+
+  SMARTLIST_FOREACH_BEGIN(chunks, sized_chunk_t *, chunk) {
+    if (chunk != smartlist_get(chunks, 0)) {
+      char *entry = (char *)chunk->bytes;
+      tor_free(entry);
+    }
+    tor_free(chunk);
+  } SMARTLIST_FOREACH_END(chunk);
+  smartlist_free(chunks);
+  smartlist_free(relink);
+  tor_free(relink_off);
+  return r;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of microdescriptors in <b>cache</b> whose fields we
+ * haven't filled in yet. */
+STATIC int
+microdesc_cache_n_unparsed(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  int n = 0;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->unparsed)
+      ++n;
+  }
+  return n;
+}
+#endif
+
 /** Holds a pointer to the current microdesc_cache_t object, or NULL if no
  * such object has been allocated. */
 static microdesc_cache_t *the_microdesc_cache = NULL;
@@ -118,6 +696,7 @@ get_microdesc_cache(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->index_fname = get_datadir_fname("cached-microdescs.idx");
     microdesc_cache_reload(cache);
     the_microdesc_cache = cache;
   }
@@ -335,6 +914,11 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     }
     cache->cache_content = NULL;
   }
+  if (cache->index_content) {
+    tor_munmap_file(cache->index_content);
+    cache->index_content = NULL;
+  }
+  cache->index_is_current = 0;
   cache->total_len_seen = 0;
   cache->n_seen = 0;
   cache->bytes_dropped = 0;
@@ -355,8 +939,14 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
+    smartlist_t *indexed = microdesc_cache_load_index(cache);
+    if (indexed) {
+      added = microdescs_add_list_to_cache(cache, indexed, SAVED_IN_CACHE, 0);
+      smartlist_free(indexed);
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+    }
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
@@ -380,6 +970,8 @@ microdesc_cache_reload(microdesc_cache_t *cache)
            total);
 
   microdesc_cache_rebuild(cache, 0 /* don't force */);
+  if (cache->cache_content && !cache->index_is_current)
+    microdesc_cache_write_index(cache);
 
   return 0;
 }
@@ -426,7 +1018,7 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
         /* It's old, but it has held_by_nodes set.  That's not okay. */
         /* Let's try to diagnose and fix #7164 . */
         smartlist_t *nodes = nodelist_find_nodes_with_microdesc(*mdp);
-        const networkstatus_t *ns = networkstatus_get_latest_consensus();
+        networkstatus_t *ns = networkstatus_get_latest_consensus();
         long networkstatus_age = -1;
         const int ht_badness = HT_REP_IS_BAD_(microdesc_map, &cache->map);
         if (ns) {
@@ -457,7 +1049,8 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
             if (ns) {
               /* This should be impossible, but let's see! */
               rs_present = " RS not present in networkstatus.";
-              SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *,rs, {
+              SMARTLIST_FOREACH(networkstatus_get_routerstatus_list(ns),
+                                routerstatus_t *, rs, {
                 if (rs == node->rs) {
                   rs_present = " RS okay in networkstatus.";
                 }
@@ -652,6 +1245,9 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   smartlist_free(wrote);
 
+  cache->index_is_current = 0;
+  microdesc_cache_write_index(cache);
+
   write_str_to_file(cache->journal_fname, "", 1);
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
@@ -718,6 +1314,7 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
         if (node->md == md) {
           ++found;
           node->md = NULL;
+          nodelist_note_node_exit_policy_changed(node);
         }
       });
     if (found) {
@@ -759,6 +1356,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 }
@@ -773,6 +1371,16 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
     cache = get_microdesc_cache();
   memcpy(search.digest, d, DIGEST256_LEN);
   md = HT_FIND(microdesc_map, &cache->map, &search);
+  if (md && PREDICT_UNLIKELY(md->unparsed) &&
+      microdesc_parse_fields(md) < 0) {
+    /* We can't use it; it might as well not be there. */
+    tor_assert(md->held_by_nodes == 0);
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+    cache->bytes_dropped += md->bodylen;
+    microdesc_free(md);
+    md = NULL;
+  }
   return md;
 }
 
@@ -798,8 +1406,12 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
 {
   smartlist_t *result = smartlist_new();
   time_t now = time(NULL);
+  int i, n = networkstatus_n_routerstatuses(ns);
   tor_assert(ns->flavor == FLAV_MICRODESC);
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+  for (i = 0; i < n; ++i) {
+    routerstatus_t *rs = networkstatus_get_routerstatus_by_idx(ns, i);
+    if (!rs)
+      continue;
     if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
       continue;
     if (downloadable_only &&
@@ -814,7 +1426,7 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
      * XXXX NM Microdesc
      */
     smartlist_add(result, rs->descriptor_digest);
-  } SMARTLIST_FOREACH_END(rs);
+  }
   return result;
 }
 
@@ -871,17 +1483,22 @@ update_microdescs_from_networkstatus(time_t now)
   microdesc_t *md;
   networkstatus_t *ns =
     networkstatus_get_reasonably_live_consensus(now, FLAV_MICRODESC);
+  int i, n;
 
   if (! ns)
     return;
 
   tor_assert(ns->flavor == FLAV_MICRODESC);
 
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+  n = networkstatus_n_routerstatuses(ns);
+  for (i = 0; i < n; ++i) {
+    const routerstatus_t *rs = networkstatus_get_routerstatus_by_idx(ns, i);
+    if (!rs)
+      continue;
     md = microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
     if (md && ns->valid_after > md->last_listed)
       md->last_listed = ns->valid_after;
-  } SMARTLIST_FOREACH_END(rs);
+  }
 }
 
 /** Return true iff we should prefer to use microdescriptors rather than
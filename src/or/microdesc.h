@@ -31,6 +31,7 @@ void microdesc_cache_clear(microdesc_cache_t *cache);
 
 microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
                                                  const char *d);
+int microdesc_parse_fields(microdesc_t *md);
 
 size_t microdesc_average_size(microdesc_cache_t *cache);
 
@@ -52,5 +53,11 @@ int we_fetch_microdescriptors(const or_options_t *options);
 int we_fetch_router_descriptors(const or_options_t *options);
 int we_use_microdescriptors_for_circuits(const or_options_t *options);
 
+#ifdef MICRODESC_PRIVATE
+#ifdef TOR_UNIT_TESTS
+STATIC int microdesc_cache_n_unparsed(microdesc_cache_t *cache);
+#endif
+#endif
+
 #endif
 
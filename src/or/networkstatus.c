@@ -19,12 +19,14 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "entrynodes.h"
 #include "main.h"
+#include "memarea.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -32,6 +34,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 #include "transports.h"
 
 /** Map from lowercase nickname to identity digest of named server, if any. */
@@ -56,6 +59,11 @@ static networkstatus_t *current_ns_consensus = NULL;
  * network status. */
 static networkstatus_t *current_md_consensus = NULL;
 
+/** For each consensus flavor, the SHA256 digest of the full text of our
+ * current consensus of that flavor, or all zeros if we don't know it.  We
+ * tell directory caches about it so that they can send us diffs. */
+static char current_consensus_text_digest[N_CONSENSUS_FLAVORS][DIGEST256_LEN];
+
 /** A v3 consensus networkstatus that we've received, but which we don't
  * have enough certificates to be happy about. */
 typedef struct consensus_waiting_for_certs_t {
@@ -97,6 +105,13 @@ static int have_warned_about_old_version = 0;
 static int have_warned_about_new_version = 0;
 
 static void routerstatus_list_update_named_server_map(void);
+static char *networkstatus_get_cache_fname(const char *flavor,
+                                           int unverified);
+static void networkstatus_lazy_entries_free(
+                                  networkstatus_lazy_entries_t *lazy);
+static void networkstatus_rs_index_free(networkstatus_rs_index_t *idx);
+static routerstatus_t *networkstatus_find_by_descriptor_digest(
+                                  networkstatus_t *ns, const char *digest);
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -288,8 +303,9 @@ networkstatus_vote_free(networkstatus_t *ns)
 
     smartlist_free(ns->routerstatus_list);
   }
+  networkstatus_lazy_entries_free(ns->lazy_entries);
 
-  digestmap_free(ns->desc_digest_map, NULL);
+  networkstatus_rs_index_free(ns->rs_index);
 
   memwipe(ns, 11, sizeof(*ns));
   tor_free(ns);
@@ -321,8 +337,6 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
 {
   char key_digest[DIGEST_LEN];
   const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -342,20 +356,14 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  if (sigcache_checksig_digest(cert->signing_key,
+                               consensus->digests.d[sig->alg], dlen,
+                               sig->signature, sig->signature_len) < 0) {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
   }
-  tor_free(signed_digest);
   return 0;
 }
 
@@ -568,12 +576,246 @@ compare_digest_to_vote_routerstatus_entry(const void *_key,
   return tor_memcmp(key, vrs->status.identity_digest, DIGEST_LEN);
 }
 
+/** Release all storage held in <b>lazy</b>. */
+static void
+networkstatus_lazy_entries_free(networkstatus_lazy_entries_t *lazy)
+{
+  int i;
+  if (!lazy)
+    return;
+  for (i = 0; i < lazy->n_entries; ++i)
+    routerstatus_free(lazy->parsed[i]);
+  tor_free(lazy->parsed);
+  tor_free(lazy->body);
+  tor_free(lazy->offsets);
+  tor_free(lazy->identity_digests);
+  bitarray_free(lazy->failed);
+  if (lazy->area)
+    memarea_drop_all(lazy->area);
+  tor_free(lazy);
+}
+
+/** Return the number of router statuses in <b>ns</b>.  If some of them
+ * haven't been parsed yet, this count includes any that will turn out to
+ * be malformed. */
+int
+networkstatus_n_routerstatuses(const networkstatus_t *ns)
+{
+  if (ns->lazy_entries)
+    return ns->lazy_entries->n_entries;
+  return smartlist_len(ns->routerstatus_list);
+}
+
+/** Return the <b>idx</b>th router status in <b>ns</b>, parsing it if
+ * necessary, or NULL if it was malformed.  Entries are sorted by identity
+ * digest. */
+routerstatus_t *
+networkstatus_get_routerstatus_by_idx(networkstatus_t *ns, int idx)
+{
+  networkstatus_lazy_entries_t *lazy = ns->lazy_entries;
+  if (!lazy)
+    return smartlist_get(ns->routerstatus_list, idx);
+
+  tor_assert(idx >= 0 && idx < lazy->n_entries);
+  if (!lazy->parsed[idx] && !bitarray_is_set(lazy->failed, idx)) {
+    lazy->parsed[idx] = networkstatus_parse_lazy_entry(ns, idx);
+    if (!lazy->parsed[idx])
+      bitarray_set(lazy->failed, idx);
+    if (--lazy->n_unparsed == 0) {
+      /* We won't need the text of the entries again. */
+      tor_free(lazy->body);
+      tor_free(lazy->offsets);
+      if (lazy->area) {
+        memarea_drop_all(lazy->area);
+        lazy->area = NULL;
+      }
+    }
+  }
+  return lazy->parsed[idx];
+}
+
+/** Return the <b>idx</b>th router status in <b>ns</b> if we have already
+ * parsed it, or NULL if we haven't or if it was malformed.  Unlike
+ * networkstatus_get_routerstatus_by_idx(), this never parses anything. */
+const routerstatus_t *
+networkstatus_get_parsed_routerstatus_by_idx(const networkstatus_t *ns,
+                                             int idx)
+{
+  if (!ns->lazy_entries)
+    return smartlist_get(ns->routerstatus_list, idx);
+  tor_assert(idx >= 0 && idx < ns->lazy_entries->n_entries);
+  return ns->lazy_entries->parsed[idx];
+}
+
+/** Return true iff every router status in <b>ns</b> has been parsed (or
+ * found to be malformed). */
+static INLINE int
+networkstatus_all_routerstatuses_parsed(const networkstatus_t *ns)
+{
+  return !ns->lazy_entries || ns->lazy_entries->n_unparsed == 0;
+}
+
+/** Return the list of router statuses in <b>ns</b>, sorted by identity
+ * digest.  If <b>ns</b> was parsed lazily, parse all of its entries that we
+ * haven't parsed yet, and drop the ones that are malformed. */
+smartlist_t *
+networkstatus_get_routerstatus_list(networkstatus_t *ns)
+{
+  networkstatus_lazy_entries_t *lazy = ns->lazy_entries;
+  int i;
+  if (!lazy)
+    return ns->routerstatus_list;
+
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < lazy->n_entries; ++i) {
+    routerstatus_t *rs = networkstatus_get_routerstatus_by_idx(ns, i);
+    if (rs) {
+      smartlist_add(ns->routerstatus_list, rs);
+      lazy->parsed[i] = NULL;
+    }
+  }
+  ns->lazy_entries = NULL;
+  networkstatus_lazy_entries_free(lazy);
+  /* Dropping malformed entries renumbered the others. */
+  networkstatus_rs_index_free(ns->rs_index);
+  ns->rs_index = NULL;
+  return ns->routerstatus_list;
+}
+
+/** Release all storage held in <b>idx</b>. */
+static void
+networkstatus_rs_index_free(networkstatus_rs_index_t *idx)
+{
+  if (!idx)
+    return;
+  tor_free(idx->by_identity);
+  tor_free(idx->by_descriptor);
+  tor_free(idx);
+}
+
+/** Return the digest of the <b>i</b>th router status in <b>ns</b> that
+ * <b>table</b> is keyed on: its descriptor digest if <b>by_descriptor</b> is
+ * true, and its identity digest otherwise.  We only index descriptor
+ * digests once every entry has been parsed; return NULL for a malformed
+ * entry. */
+static INLINE const char *
+rs_index_get_key(const networkstatus_t *ns, int by_descriptor, int i)
+{
+  const routerstatus_t *rs;
+  if (ns->lazy_entries && !by_descriptor)
+    return ns->lazy_entries->identity_digests + i*DIGEST_LEN;
+  /* For a vote these are vote_routerstatus_t, which starts with a
+   * routerstatus_t. */
+  rs = networkstatus_get_parsed_routerstatus_by_idx(ns, i);
+  if (!rs)
+    return NULL;
+  return by_descriptor ? rs->descriptor_digest : rs->identity_digest;
+}
+
+/** Return the index within <b>ns</b> of the router status whose identity
+ * digest (or descriptor digest, if <b>by_descriptor</b> is true) is
+ * <b>digest</b>, according to <b>table</b>, which has <b>mask</b>+1 slots.
+ * Return -1 if there is none. */
+static int
+rs_index_lookup(const networkstatus_t *ns, const int32_t *table,
+                unsigned mask, int by_descriptor, const char *digest)
+{
+  unsigned slot = (unsigned) siphash24g(digest, DIGEST_LEN) & mask;
+  int32_t v;
+  /* The tables are never more than half full, so this terminates. */
+  while ((v = table[slot])) {
+    if (fast_memeq(rs_index_get_key(ns, by_descriptor, v - 1), digest,
+                   DIGEST_LEN))
+      return v - 1;
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+/** Add the <b>i</b>th router status in <b>ns</b> to <b>table</b>, which has
+ * <b>mask</b>+1 slots, replacing any earlier entry with the same key. */
+static void
+rs_index_insert(const networkstatus_t *ns, int32_t *table, unsigned mask,
+                int by_descriptor, int i)
+{
+  const char *digest = rs_index_get_key(ns, by_descriptor, i);
+  unsigned slot;
+  int32_t v;
+  if (!digest)
+    return;
+  slot = (unsigned) siphash24g(digest, DIGEST_LEN) & mask;
+  while ((v = table[slot])) {
+    if (fast_memeq(rs_index_get_key(ns, by_descriptor, v - 1), digest,
+                   DIGEST_LEN))
+      break;
+    slot = (slot + 1) & mask;
+  }
+  table[slot] = i + 1;
+}
+
+/** Return the hash index of the router statuses in <b>ns</b>, building it
+ * if we don't have one or if the list has changed size since we built it.
+ * Add a descriptor digest table to it once every entry has been parsed. */
+static networkstatus_rs_index_t *
+networkstatus_get_rs_index(networkstatus_t *ns)
+{
+  networkstatus_rs_index_t *idx = ns->rs_index;
+  const int n = networkstatus_n_routerstatuses(ns);
+  unsigned n_slots = 16;
+  int i;
+
+  if (!idx || idx->n_entries != n) {
+    networkstatus_rs_index_free(idx);
+    while (n_slots < 2 * (unsigned)n)
+      n_slots <<= 1;
+    idx = ns->rs_index = tor_malloc_zero(sizeof(networkstatus_rs_index_t));
+    idx->n_entries = n;
+    idx->mask = n_slots - 1;
+    idx->by_identity = tor_calloc(n_slots, sizeof(int32_t));
+    for (i = 0; i < n; ++i)
+      rs_index_insert(ns, idx->by_identity, idx->mask, 0, i);
+  }
+
+  if (!idx->by_descriptor && networkstatus_all_routerstatuses_parsed(ns)) {
+    idx->by_descriptor = tor_calloc(idx->mask + 1, sizeof(int32_t));
+    for (i = 0; i < n; ++i)
+      rs_index_insert(ns, idx->by_descriptor, idx->mask, 1, i);
+  }
+  return idx;
+}
+
+/** As networkstatus_vote_find_entry_idx(), but for a consensus that we
+ * parsed lazily. */
+static int
+networkstatus_lazy_find_entry_idx(const networkstatus_lazy_entries_t *lazy,
+                                  const char *digest, int *found_out)
+{
+  int lo = 0, hi = lazy->n_entries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = tor_memcmp(lazy->identity_digests + mid*DIGEST_LEN, digest,
+                         DIGEST_LEN);
+    if (cmp == 0) {
+      *found_out = 1;
+      return mid;
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *found_out = 0;
+  return lo;
+}
+
 /** As networkstatus_find_entry, but do not return a const pointer */
 routerstatus_t *
 networkstatus_vote_find_mutable_entry(networkstatus_t *ns, const char *digest)
 {
-  return smartlist_bsearch(ns->routerstatus_list, digest,
-                           compare_digest_to_routerstatus_entry);
+  const networkstatus_rs_index_t *rs_idx = networkstatus_get_rs_index(ns);
+  int idx = rs_index_lookup(ns, rs_idx->by_identity, rs_idx->mask, 0,
+                            digest);
+  return idx >= 0 ? networkstatus_get_routerstatus_by_idx(ns, idx) : NULL;
 }
 
 /** Return the entry in <b>ns</b> for the identity digest <b>digest</b>, or
@@ -592,11 +834,41 @@ int
 networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                   const char *digest, int *found_out)
 {
+  const networkstatus_rs_index_t *rs_idx = networkstatus_get_rs_index(ns);
+  int idx = rs_index_lookup(ns, rs_idx->by_identity, rs_idx->mask, 0,
+                            digest);
+  if (idx >= 0) {
+    *found_out = 1;
+    return idx;
+  }
+  /* Not there: find where it would go. */
+  if (ns->lazy_entries)
+    return networkstatus_lazy_find_entry_idx(ns->lazy_entries, digest,
+                                             found_out);
   return smartlist_bsearch_idx(ns->routerstatus_list, digest,
                                compare_digest_to_routerstatus_entry,
                                found_out);
 }
 
+/** Return the router status in <b>ns</b> whose descriptor digest starts
+ * with the DIGEST_LEN bytes of <b>digest</b>, or NULL if there is none. */
+static routerstatus_t *
+networkstatus_find_by_descriptor_digest(networkstatus_t *ns,
+                                        const char *digest)
+{
+  const networkstatus_rs_index_t *rs_idx;
+  int i, n, idx;
+  /* We can only index descriptor digests once we have parsed them all. */
+  if (!networkstatus_all_routerstatuses_parsed(ns)) {
+    n = networkstatus_n_routerstatuses(ns);
+    for (i = 0; i < n; ++i)
+      (void) networkstatus_get_routerstatus_by_idx(ns, i);
+  }
+  rs_idx = networkstatus_get_rs_index(ns);
+  idx = rs_index_lookup(ns, rs_idx->by_descriptor, rs_idx->mask, 1, digest);
+  return idx >= 0 ? networkstatus_get_routerstatus_by_idx(ns, idx) : NULL;
+}
+
 /** As router_get_consensus_status_by_descriptor_digest, but does not return
  * a const pointer. */
 MOCK_IMPL(routerstatus_t *,
@@ -608,15 +880,7 @@ router_get_mutable_consensus_status_by_descriptor_digest,(
     consensus = current_consensus;
   if (!consensus)
     return NULL;
-  if (!consensus->desc_digest_map) {
-    digestmap_t *m = consensus->desc_digest_map = digestmap_new();
-    SMARTLIST_FOREACH(consensus->routerstatus_list,
-                      routerstatus_t *, rs,
-     {
-       digestmap_set(m, rs->descriptor_digest, rs);
-     });
-  }
-  return digestmap_get(consensus->desc_digest_map, digest);
+  return networkstatus_find_by_descriptor_digest(consensus, digest);
 }
 
 /** Return the consensus view of the status of the router whose current
@@ -651,8 +915,7 @@ router_get_mutable_consensus_status_by_id(const char *digest)
 {
   if (!current_consensus)
     return NULL;
-  return smartlist_bsearch(current_consensus->routerstatus_list, digest,
-                           compare_digest_to_routerstatus_entry);
+  return networkstatus_vote_find_mutable_entry(current_consensus, digest);
 }
 
 /** Return the consensus view of the status of the router whose identity
@@ -1004,8 +1267,8 @@ consensus_is_waiting_for_certs(void)
 
 /** Return the most recent consensus that we have downloaded, or NULL if we
  * don't have one. */
-networkstatus_t *
-networkstatus_get_latest_consensus(void)
+MOCK_IMPL(networkstatus_t *,
+networkstatus_get_latest_consensus,(void))
 {
   return current_consensus;
 }
@@ -1059,7 +1322,7 @@ networkstatus_get_reasonably_live_consensus(time_t now, int flavor)
 
 /** Given two router status entries for the same router identity, return 1 if
  * if the contents have changed between them. Otherwise, return 0. */
-static int
+int
 routerstatus_has_changed(const routerstatus_t *a, const routerstatus_t *b)
 {
   tor_assert(tor_memeq(a->identity_digest, b->identity_digest, DIGEST_LEN));
@@ -1086,8 +1349,8 @@ routerstatus_has_changed(const routerstatus_t *a, const routerstatus_t *b)
 /** Notify controllers of any router status entries that changed between
  * <b>old_c</b> and <b>new_c</b>. */
 static void
-notify_control_networkstatus_changed(const networkstatus_t *old_c,
-                                     const networkstatus_t *new_c)
+notify_control_networkstatus_changed(networkstatus_t *old_c,
+                                     networkstatus_t *new_c)
 {
   smartlist_t *changed;
   if (old_c == new_c)
@@ -1101,14 +1364,17 @@ notify_control_networkstatus_changed(const networkstatus_t *old_c,
     return;
 
   if (!old_c) {
-    control_event_networkstatus_changed(new_c->routerstatus_list);
+    control_event_networkstatus_changed(
+                              networkstatus_get_routerstatus_list(new_c));
     return;
   }
   changed = smartlist_new();
 
   SMARTLIST_FOREACH_JOIN(
-                     old_c->routerstatus_list, const routerstatus_t *, rs_old,
-                     new_c->routerstatus_list, const routerstatus_t *, rs_new,
+                     networkstatus_get_routerstatus_list(old_c),
+                     const routerstatus_t *, rs_old,
+                     networkstatus_get_routerstatus_list(new_c),
+                     const routerstatus_t *, rs_new,
                      tor_memcmp(rs_old->identity_digest,
                             rs_new->identity_digest, DIGEST_LEN),
                      smartlist_add(changed, (void*) rs_new)) {
@@ -1126,16 +1392,26 @@ static void
 networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
                                       const networkstatus_t *old_c)
 {
+  int i, n;
   if (old_c == new_c)
     return;
-  if (!old_c || !smartlist_len(old_c->routerstatus_list))
+  if (!old_c)
     return;
 
-  SMARTLIST_FOREACH_JOIN(old_c->routerstatus_list, routerstatus_t *, rs_old,
-                         new_c->routerstatus_list, routerstatus_t *, rs_new,
-                         tor_memcmp(rs_old->identity_digest,
-                                rs_new->identity_digest, DIGEST_LEN),
-                         STMT_NIL) {
+  /* Entries in old_c that we never parsed have nothing worth copying, so
+   * only look at the ones we did parse. */
+  n = networkstatus_n_routerstatuses(old_c);
+  for (i = 0; i < n; ++i) {
+    const routerstatus_t *rs_old;
+    routerstatus_t *rs_new;
+    rs_old = networkstatus_get_parsed_routerstatus_by_idx(old_c, i);
+    if (!rs_old)
+      continue;
+    rs_new = networkstatus_vote_find_mutable_entry(new_c,
+                                                   rs_old->identity_digest);
+    if (!rs_new)
+      continue;
+
     /* Okay, so we're looking at the same identity. */
     rs_new->last_dir_503_at = rs_old->last_dir_503_at;
 
@@ -1144,7 +1420,7 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
       /* And the same descriptor too! */
       memcpy(&rs_new->dl_status, &rs_old->dl_status,sizeof(download_status_t));
     }
-  } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
+  }
 }
 
 /** Try to replace the current cached v3 networkstatus with the one in
@@ -1184,6 +1460,8 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
+  /* The consensus that 'c' replaces, if the nodelist still points into it */
+  networkstatus_t *old_usable_consensus = NULL;
   int old_ewma_enabled;
 
   if (flav < 0) {
@@ -1193,7 +1471,7 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  c = networkstatus_parse_consensus_lazily(consensus, NULL);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -1224,27 +1502,20 @@ networkstatus_set_current_consensus(const char *consensus,
     goto done;
   }
 
+  consensus_fname = networkstatus_get_cache_fname(flavor, 0);
+  unverified_fname = networkstatus_get_cache_fname(flavor, 1);
   if (!strcmp(flavor, "ns")) {
-    consensus_fname = get_datadir_fname("cached-consensus");
-    unverified_fname = get_datadir_fname("unverified-consensus");
     if (current_ns_consensus) {
       current_digests = &current_ns_consensus->digests;
       current_valid_after = current_ns_consensus->valid_after;
     }
   } else if (!strcmp(flavor, "microdesc")) {
-    consensus_fname = get_datadir_fname("cached-microdesc-consensus");
-    unverified_fname = get_datadir_fname("unverified-microdesc-consensus");
     if (current_md_consensus) {
       current_digests = &current_md_consensus->digests;
       current_valid_after = current_md_consensus->valid_after;
     }
   } else {
     cached_dir_t *cur;
-    char buf[128];
-    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
-    consensus_fname = get_datadir_fname(buf);
-    tor_snprintf(buf, sizeof(buf), "unverified-%s-consensus", flavor);
-    unverified_fname = get_datadir_fname(buf);
     cur = dirserv_get_consensus(flavor);
     if (cur) {
       current_digests = &cur->digests;
@@ -1335,7 +1606,11 @@ networkstatus_set_current_consensus(const char *consensus,
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
       networkstatus_copy_old_consensus_info(c, current_ns_consensus);
-      networkstatus_vote_free(current_ns_consensus);
+      /* The nodelist compares the old entries to the new ones. */
+      if (flav == usable_consensus_flavor())
+        old_usable_consensus = current_ns_consensus;
+      else
+        networkstatus_vote_free(current_ns_consensus);
       /* Defensive programming : we should set current_consensus very soon,
        * but we're about to call some stuff in the meantime, and leaving this
        * dangling pointer around has proven to be trouble. */
@@ -1346,7 +1621,10 @@ networkstatus_set_current_consensus(const char *consensus,
   } else if (flav == FLAV_MICRODESC) {
     if (current_md_consensus) {
       networkstatus_copy_old_consensus_info(c, current_md_consensus);
-      networkstatus_vote_free(current_md_consensus);
+      if (flav == usable_consensus_flavor())
+        old_usable_consensus = current_md_consensus;
+      else
+        networkstatus_vote_free(current_md_consensus);
       /* more defensive programming */
       current_md_consensus = NULL;
     }
@@ -1384,7 +1662,9 @@ networkstatus_set_current_consensus(const char *consensus,
     /* XXXXNM Microdescs: needs a non-ns variant. ???? NM*/
     update_consensus_networkstatus_fetch_time(now);
 
-    nodelist_set_consensus(current_consensus);
+    nodelist_set_consensus(current_consensus, old_usable_consensus);
+    networkstatus_vote_free(old_usable_consensus);
+    old_usable_consensus = NULL;
 
     dirvote_recalculate_timing(options, now);
     routerstatus_list_update_named_server_map();
@@ -1409,6 +1689,9 @@ networkstatus_set_current_consensus(const char *consensus,
         current_consensus);
   }
 
+  crypto_digest256(current_consensus_text_digest[flav], consensus,
+                   strlen(consensus), DIGEST_SHA256);
+
   if (directory_caches_dir_info(options)) {
     dirserv_set_cached_consensus_networkstatus(consensus,
                                                flavor,
@@ -1449,6 +1732,70 @@ networkstatus_set_current_consensus(const char *consensus,
   return result;
 }
 
+/** Return a newly allocated string holding the name of the file where we
+ * cache our <b>flavor</b> consensus, or our unverified <b>flavor</b>
+ * consensus if <b>unverified</b> is true. */
+static char *
+networkstatus_get_cache_fname(const char *flavor, int unverified)
+{
+  char buf[128];
+  const char *prefix = unverified ? "unverified" : "cached";
+  if (!strcmp(flavor, "ns"))
+    tor_snprintf(buf, sizeof(buf), "%s-consensus", prefix);
+  else
+    tor_snprintf(buf, sizeof(buf), "%s-%s-consensus", prefix, flavor);
+  return get_datadir_fname(buf);
+}
+
+/** If we know the SHA256 digest of the full text of our current consensus
+ * of flavor <b>flav</b>, store it in <b>digest_out</b> and return 0.
+ * Otherwise return -1. */
+int
+networkstatus_get_consensus_text_digest(int flav, char *digest_out)
+{
+  if (flav < 0 || flav >= N_CONSENSUS_FLAVORS ||
+      !networkstatus_get_latest_consensus_by_flavor(flav) ||
+      tor_mem_is_zero(current_consensus_text_digest[flav], DIGEST256_LEN))
+    return -1;
+  memcpy(digest_out, current_consensus_text_digest[flav], DIGEST256_LEN);
+  return 0;
+}
+
+/** Apply the consensus diff <b>diff</b>, which we just downloaded, to our
+ * current consensus of flavor <b>flavor</b>.  Return the resulting
+ * consensus in a newly allocated string if the diff applied cleanly and
+ * produced the consensus it promised; the caller still needs to validate
+ * it with networkstatus_set_current_consensus().  Return NULL on
+ * failure. */
+char *
+networkstatus_apply_consensus_diff(const char *diff, const char *flavor)
+{
+  int flav = networkstatus_parse_flavor_name(flavor);
+  const cached_dir_t *cached;
+  char *base = NULL, *result = NULL;
+
+  if (flav < 0)
+    return NULL;
+
+  if ((cached = dirserv_get_consensus(flavor))) {
+    result = consdiff_apply_diff(cached->dir, diff);
+  } else {
+    char *fname = networkstatus_get_cache_fname(flavor, 0);
+    base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+    tor_free(fname);
+    if (base)
+      result = consdiff_apply_diff(base, diff);
+    tor_free(base);
+  }
+
+  if (!result) {
+    /* Whatever we have, it isn't what we told the cache we had.  Don't ask
+     * for a diff again until we have a new consensus. */
+    memset(current_consensus_text_digest[flav], 0, DIGEST256_LEN);
+  }
+  return result;
+}
+
 /** Called when we have gotten more certificates: see whether we can
  * now verify a pending consensus. */
 void
@@ -1542,6 +1889,7 @@ routers_update_all_from_networkstatus(time_t now, int dir_version)
 static void
 routerstatus_list_update_named_server_map(void)
 {
+  int i, n;
   if (!current_consensus)
     return;
 
@@ -1549,16 +1897,20 @@ routerstatus_list_update_named_server_map(void)
   named_server_map = strmap_new();
   strmap_free(unnamed_server_map, NULL);
   unnamed_server_map = strmap_new();
-  SMARTLIST_FOREACH_BEGIN(current_consensus->routerstatus_list,
-                          const routerstatus_t *, rs) {
-      if (rs->is_named) {
-        strmap_set_lc(named_server_map, rs->nickname,
-                      tor_memdup(rs->identity_digest, DIGEST_LEN));
-      }
-      if (rs->is_unnamed) {
-        strmap_set_lc(unnamed_server_map, rs->nickname, (void*)1);
-      }
-  } SMARTLIST_FOREACH_END(rs);
+  n = networkstatus_n_routerstatuses(current_consensus);
+  for (i = 0; i < n; ++i) {
+    const routerstatus_t *rs =
+      networkstatus_get_routerstatus_by_idx(current_consensus, i);
+    if (!rs)
+      continue;
+    if (rs->is_named) {
+      strmap_set_lc(named_server_map, rs->nickname,
+                    tor_memdup(rs->identity_digest, DIGEST_LEN));
+    }
+    if (rs->is_unnamed) {
+      strmap_set_lc(unnamed_server_map, rs->nickname, (void*)1);
+    }
+  }
 }
 
 /** Given a list <b>routers</b> of routerinfo_t *, update each status field
@@ -1571,12 +1923,13 @@ routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
   networkstatus_t *ns = current_consensus;
-  if (!ns || !smartlist_len(ns->routerstatus_list))
+  if (!ns || !networkstatus_n_routerstatuses(ns))
     return;
 
   routers_sort_by_identity(routers);
 
-  SMARTLIST_FOREACH_JOIN(ns->routerstatus_list, routerstatus_t *, rs,
+  SMARTLIST_FOREACH_JOIN(networkstatus_get_routerstatus_list(ns),
+                         routerstatus_t *, rs,
                          routers, routerinfo_t *, router,
                          tor_memcmp(rs->identity_digest,
                                router->cache_info.identity_digest, DIGEST_LEN),
@@ -1616,15 +1969,9 @@ signed_descs_update_status_from_consensus_networkstatus(smartlist_t *descs)
   if (!ns)
     return;
 
-  if (!ns->desc_digest_map) {
-    char dummy[DIGEST_LEN];
-    /* instantiates the digest map. */
-    memset(dummy, 0, sizeof(dummy));
-    router_get_consensus_status_by_descriptor_digest(ns, dummy);
-  }
   SMARTLIST_FOREACH(descs, signed_descriptor_t *, d,
   {
-    const routerstatus_t *rs = digestmap_get(ns->desc_digest_map,
+    const routerstatus_t *rs = networkstatus_find_by_descriptor_digest(ns,
                                        d->signed_descriptor_digest);
     if (rs) {
       if (ns->valid_until > d->last_listed_as_valid_until)
@@ -1888,7 +2235,7 @@ getinfo_helper_networkstatus(control_connection_t *conn,
 
   if (!strcmp(question, "ns/all")) {
     smartlist_t *statuses = smartlist_new();
-    SMARTLIST_FOREACH(current_consensus->routerstatus_list,
+    SMARTLIST_FOREACH(networkstatus_get_routerstatus_list(current_consensus),
                       const routerstatus_t *, rs,
       {
         smartlist_add(statuses, networkstatus_getinfo_helper_single(rs));
@@ -1957,6 +2304,8 @@ networkstatus_free_all(void)
   networkstatus_vote_free(current_ns_consensus);
   networkstatus_vote_free(current_md_consensus);
   current_md_consensus = current_ns_consensus = NULL;
+  memset(current_consensus_text_digest, 0,
+         sizeof(current_consensus_text_digest));
 
   for (i=0; i < N_CONSENSUS_FLAVORS; ++i) {
     consensus_waiting_for_certs_t *waiting = &consensus_waiting_for_certs[i];
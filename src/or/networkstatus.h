@@ -18,6 +18,8 @@ void networkstatus_reset_warnings(void);
 void networkstatus_reset_download_failures(void);
 int router_reload_consensus_networkstatus(void);
 void routerstatus_free(routerstatus_t *rs);
+int routerstatus_has_changed(const routerstatus_t *a,
+                             const routerstatus_t *b);
 void networkstatus_vote_free(networkstatus_t *ns);
 networkstatus_voter_info_t *networkstatus_get_voter_by_id(
                                        networkstatus_t *vote,
@@ -37,6 +39,13 @@ routerstatus_t *networkstatus_vote_find_mutable_entry(networkstatus_t *ns,
                                               const char *digest);
 int networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                       const char *digest, int *found_out);
+int networkstatus_n_routerstatuses(const networkstatus_t *ns);
+routerstatus_t *networkstatus_get_routerstatus_by_idx(networkstatus_t *ns,
+                                                      int idx);
+const routerstatus_t *networkstatus_get_parsed_routerstatus_by_idx(
+                                                 const networkstatus_t *ns,
+                                                 int idx);
+smartlist_t *networkstatus_get_routerstatus_list(networkstatus_t *ns);
 
 MOCK_DECL(download_status_t *,router_get_dl_status_by_descriptor_digest,
           (const char *d));
@@ -64,7 +73,7 @@ void update_certificate_downloads(time_t now);
 int consensus_is_waiting_for_certs(void);
 int client_would_use_router(const routerstatus_t *rs, time_t now,
                             const or_options_t *options);
-networkstatus_t *networkstatus_get_latest_consensus(void);
+MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus,(void));
 MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus_by_flavor,
           (consensus_flavor_t f));
 networkstatus_t *networkstatus_get_live_consensus(time_t now);
@@ -78,6 +87,9 @@ networkstatus_t *networkstatus_get_reasonably_live_consensus(time_t now,
 int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags);
+int networkstatus_get_consensus_text_digest(int flav, char *digest_out);
+char *networkstatus_apply_consensus_diff(const char *diff,
+                                         const char *flavor);
 void networkstatus_note_certs_arrived(void);
 void routers_update_all_from_networkstatus(time_t now, int dir_version);
 void routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
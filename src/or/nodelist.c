@@ -24,6 +24,7 @@
 
 static void nodelist_drop_node(node_t *node, int remove_from_ht);
 static void node_free(node_t *node);
+static void node_family_bits_clear(void);
 
 /** count_usable_descriptors counts descriptors with these flag(s)
  */
@@ -33,12 +34,18 @@ typedef enum {
   /* Only descriptors with the Exit flag */
   USABLE_DESCRIPTOR_EXIT_ONLY = 1
 } usable_descriptor_t;
+/** A consensus entry that client_would_use_router() accepted, along with
+ * its node and whether we have the descriptor it lists. */
+typedef struct usable_routerstatus_t {
+  const routerstatus_t *rs;
+  const node_t *node;
+  unsigned int present:1;
+} usable_routerstatus_t;
 static void count_usable_descriptors(int *num_present,
                                      int *num_usable,
                                      smartlist_t *descs_out,
-                                     const networkstatus_t *consensus,
-                                     const or_options_t *options,
-                                     time_t now,
+                                     const usable_routerstatus_t *usable,
+                                     int n_usable, int md,
                                      routerset_t *in_set,
                                      usable_descriptor_t exit_only);
 static void update_router_have_minimum_dir_info(void);
@@ -55,8 +62,56 @@ typedef struct nodelist_t {
   /* Hash table to map from node ID digest to node. */
   HT_HEAD(nodelist_map, node_t) nodes_by_id;
 
+  /* List of exit_port_index_t for the ports we have recently looked for
+   * exits to.  Kept up to date as nodes change. */
+  smartlist_t *exit_port_index;
+  /* Number of bits allocated in each exit_port_index_t. */
+  int exit_port_index_bits;
+  /* Counter incremented each time we look up a port in exit_port_index. */
+  uint64_t exit_port_index_clock;
+
+  /* List of node_family_bits_t for the nodes whose families we have looked
+   * up recently.  Only valid while nodelist_generation is equal to
+   * family_bits_generation. */
+  smartlist_t *family_bits;
+  /* Value of nodelist_generation when we last emptied family_bits. */
+  uint64_t family_bits_generation;
+  /* Counter incremented each time we look up a node in family_bits. */
+  uint64_t family_bits_clock;
+
+  /* Dense copy of the nodes' hot fields, or NULL if we haven't built it
+   * yet.  Only valid while its generation is nodelist_generation. */
+  node_select_table_t *select_table;
 } nodelist_t;
 
+/** The largest number of families that we keep in the family cache. */
+#define MAX_FAMILY_BITS_CACHE_SIZE 64
+
+/** Records which nodes are in some node's family. */
+typedef struct node_family_bits_t {
+  /** The node whose family this is. */
+  const node_t *node;
+  /** Value of family_bits_clock when we last looked up this node. */
+  uint64_t last_used;
+  /** Bit <i>i</i> is set iff the node with nodelist_idx <i>i</i> is
+   * <b>node</b> or is in its family. */
+  bitarray_t *bits;
+} node_family_bits_t;
+
+/** The largest number of ports that we keep in the exit port index. */
+#define MAX_EXIT_PORT_INDEX_PORTS 32
+
+/** Records which nodes might be able to exit to a given port. */
+typedef struct exit_port_index_t {
+  /** The port in question. */
+  uint16_t port;
+  /** Value of exit_port_index_clock when we last looked up this port. */
+  uint64_t last_used;
+  /** Bit <i>i</i> is set iff node_might_exit_to_port() is true for the node
+   * with nodelist_idx <i>i</i>. */
+  bitarray_t *nodes;
+} exit_port_index_t;
+
 static INLINE unsigned int
 node_id_hash(const node_t *node)
 {
@@ -76,6 +131,11 @@ HT_GENERATE2(nodelist_map, node_t, ht_ent, node_id_hash, node_id_eq,
 /** The global nodelist. */
 static nodelist_t *the_nodelist=NULL;
 
+/** Incremented every time we add or remove a node, or change anything about
+ * a node that path selection looks at.  Never reset, so that a value
+ * remembered from before nodelist_free_all() can't look current. */
+static uint64_t nodelist_generation = 1;
+
 /** Create an empty nodelist if we haven't done so already. */
 static void
 init_nodelist(void)
@@ -87,6 +147,255 @@ init_nodelist(void)
   }
 }
 
+/** Return true iff <b>node</b>'s exit policy might accept a connection to
+ * <b>port</b> at an address we don't know yet. */
+int
+node_might_exit_to_port(const node_t *node, uint16_t port)
+{
+  addr_policy_result_t r = compare_tor_addr_to_node_policy(NULL, port, node);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Release all storage held by the exit port index entry <b>ent</b>. */
+static void
+exit_port_index_free(exit_port_index_t *ent)
+{
+  if (!ent)
+    return;
+  bitarray_free(ent->nodes);
+  tor_free(ent);
+}
+
+/** Make sure that every bitarray in the exit port index has room for
+ * <b>n_nodes</b> nodes. */
+static void
+exit_port_index_ensure_capacity(int n_nodes)
+{
+  int n_bits = the_nodelist->exit_port_index_bits;
+  if (n_nodes <= n_bits)
+    return;
+  while (n_bits < n_nodes)
+    n_bits = n_bits ? n_bits * 2 : 1024;
+  SMARTLIST_FOREACH(the_nodelist->exit_port_index, exit_port_index_t *, ent,
+    ent->nodes = bitarray_expand(ent->nodes,
+                                 the_nodelist->exit_port_index_bits, n_bits));
+  the_nodelist->exit_port_index_bits = n_bits;
+}
+
+/** Recompute <b>node</b>'s bit in every entry of the exit port index.  Call
+ * this whenever <b>node</b> gets a new index in the nodelist, or anything
+ * that its exit policy depends on changes. */
+static void
+exit_port_index_update_node(const node_t *node)
+{
+  if (!the_nodelist || !the_nodelist->exit_port_index ||
+      node->nodelist_idx < 0)
+    return;
+  exit_port_index_ensure_capacity(node->nodelist_idx + 1);
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_index,
+                          exit_port_index_t *, ent) {
+    if (node_might_exit_to_port(node, ent->port))
+      bitarray_set(ent->nodes, node->nodelist_idx);
+    else
+      bitarray_clear(ent->nodes, node->nodelist_idx);
+  } SMARTLIST_FOREACH_END(ent);
+}
+
+/** Return the entry for <b>port</b> in the exit port index, building it
+ * (and evicting the least recently used entry) if we don't have it. */
+static const exit_port_index_t *
+exit_port_index_get(uint16_t port)
+{
+  exit_port_index_t *ent;
+  const uint64_t now = ++the_nodelist->exit_port_index_clock;
+
+  if (!the_nodelist->exit_port_index)
+    the_nodelist->exit_port_index = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_index,
+                          exit_port_index_t *, e) {
+    if (e->port == port) {
+      e->last_used = now;
+      return e;
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  if (smartlist_len(the_nodelist->exit_port_index) >=
+      MAX_EXIT_PORT_INDEX_PORTS) {
+    exit_port_index_t *oldest = NULL;
+    SMARTLIST_FOREACH(the_nodelist->exit_port_index, exit_port_index_t *, e,
+      if (!oldest || e->last_used < oldest->last_used)
+        oldest = e);
+    smartlist_remove(the_nodelist->exit_port_index, oldest);
+    exit_port_index_free(oldest);
+  }
+
+  exit_port_index_ensure_capacity(smartlist_len(the_nodelist->nodes));
+  ent = tor_malloc_zero(sizeof(exit_port_index_t));
+  ent->port = port;
+  ent->last_used = now;
+  ent->nodes = bitarray_init_zero(the_nodelist->exit_port_index_bits);
+  SMARTLIST_FOREACH(the_nodelist->nodes, const node_t *, node,
+    if (node_might_exit_to_port(node, port))
+      bitarray_set(ent->nodes, node_sl_idx));
+  smartlist_add(the_nodelist->exit_port_index, ent);
+  return ent;
+}
+
+/** Set the bit in <b>out</b> for every node in <b>nodes</b> that might be
+ * able to exit to <b>port</b>, as node_might_exit_to_port() decides.  Bits
+ * in <b>out</b> are indexed by position in <b>nodes</b>, and <b>out</b>
+ * must have room for them all.  If <b>nodes</b> is the list from
+ * nodelist_get_list(), this uses a cached index, and takes time
+ * proportional to the number of nodes divided by the word size. */
+void
+nodelist_add_exits_for_port(bitarray_t *out, const smartlist_t *nodes,
+                            uint16_t port)
+{
+  if (the_nodelist && nodes == the_nodelist->nodes) {
+    const exit_port_index_t *ent = exit_port_index_get(port);
+    const int n_words =
+      (smartlist_len(nodes) + BITARRAY_MASK) >> BITARRAY_SHIFT;
+    int i;
+    for (i = 0; i < n_words; ++i)
+      out[i] |= ent->nodes[i];
+  } else {
+    SMARTLIST_FOREACH(nodes, const node_t *, node,
+      if (node_might_exit_to_port(node, port))
+        bitarray_set(out, node_sl_idx));
+  }
+}
+
+/** Tell the nodelist that something about <b>node</b>'s exit policy has
+ * changed without its routerinfo or microdescriptor changing. */
+void
+nodelist_note_node_exit_policy_changed(const node_t *node)
+{
+  exit_port_index_update_node(node);
+}
+
+/** Tell the nodelist that nodes have been added or removed, or that some
+ * of their flags or descriptors have changed, so that any state derived
+ * from the set of nodes is out of date. */
+void
+nodelist_note_nodes_changed(void)
+{
+  ++nodelist_generation;
+}
+
+/** Return a value that changes whenever nodelist_note_nodes_changed() is
+ * called.  Callers that cache information about the nodelist can compare it
+ * to the value they saw when they built their cache. */
+uint64_t
+nodelist_get_generation(void)
+{
+  return nodelist_generation;
+}
+
+/** Return true iff <b>node</b> is one of the nodes in the nodelist, and not
+ * (say) a temporary node_t that some caller made up.  If so, its
+ * nodelist_idx is its position in the nodelist. */
+int
+node_is_in_nodelist(const node_t *node)
+{
+  return the_nodelist && node->nodelist_idx >= 0 &&
+    node->nodelist_idx < smartlist_len(the_nodelist->nodes) &&
+    smartlist_get(the_nodelist->nodes, node->nodelist_idx) == node;
+}
+
+/** Release all storage held by <b>table</b>. */
+static void
+node_select_table_free(node_select_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->flags);
+  tor_free(table->bandwidth_kb);
+  tor_free(table->addr_ipv4h);
+  tor_free(table);
+}
+
+/** Return the NST_* flags for <b>node</b>. */
+static uint16_t
+node_get_select_flags(const node_t *node)
+{
+  uint16_t f = 0;
+  if (node->is_running)
+    f |= NST_RUNNING;
+  if (node->is_valid)
+    f |= NST_VALID;
+  if (node->is_fast)
+    f |= NST_FAST;
+  if (node->is_stable)
+    f |= NST_STABLE;
+  if (node->is_possible_guard)
+    f |= NST_GUARD;
+  if (node->is_exit)
+    f |= NST_EXIT;
+  if (node->is_bad_exit)
+    f |= NST_BAD_EXIT;
+  if (node_is_dir(node))
+    f |= NST_DIR;
+  if (node->ri || (node->rs && node->md))
+    f |= NST_HAS_DESC;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    f |= NST_NOT_GENERAL;
+  if (node->rs) {
+    f |= NST_HAS_RS;
+    if (node->rs->has_bandwidth)
+      f |= NST_HAS_BW;
+    if (node->rs->has_guardfraction)
+      f |= NST_GUARDFRACTION;
+  }
+  return f;
+}
+
+/** Return a node_select_table_t describing every node in the nodelist,
+ * rebuilding it first if the nodelist has changed since we last built it.
+ * The result stays valid until the nodelist next changes. */
+const node_select_table_t *
+nodelist_get_select_table(void)
+{
+  node_select_table_t *table;
+  int n;
+
+  init_nodelist();
+  n = smartlist_len(the_nodelist->nodes);
+  if (!the_nodelist->select_table)
+    the_nodelist->select_table = tor_malloc_zero(sizeof(node_select_table_t));
+  table = the_nodelist->select_table;
+
+  if (table->generation == nodelist_generation && table->n_nodes == n)
+    return table;
+
+  if (n > table->n_allocated) {
+    int n_alloc = n + n/8 + 16;
+    table->flags = tor_reallocarray(table->flags, n_alloc, sizeof(uint16_t));
+    table->bandwidth_kb = tor_reallocarray(table->bandwidth_kb, n_alloc,
+                                           sizeof(uint32_t));
+    table->addr_ipv4h = tor_reallocarray(table->addr_ipv4h, n_alloc,
+                                         sizeof(uint32_t));
+    table->n_allocated = n_alloc;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, const node_t *, node) {
+    tor_addr_port_t ap;
+    const uint16_t f = node_get_select_flags(node);
+    table->flags[node_sl_idx] = f;
+    table->bandwidth_kb[node_sl_idx] =
+      (f & NST_HAS_BW) ? node->rs->bandwidth_kb : 0;
+    if ((node->ri || node->rs) && node_get_prim_orport(node, &ap) == 0)
+      table->addr_ipv4h[node_sl_idx] = tor_addr_to_ipv4h(&ap.addr);
+    else
+      table->addr_ipv4h[node_sl_idx] = 0;
+  } SMARTLIST_FOREACH_END(node);
+
+  table->nodes = the_nodelist->nodes;
+  table->n_nodes = n;
+  table->generation = nodelist_generation;
+  return table;
+}
+
 /** As node_get_by_id, but returns a non-const pointer */
 node_t *
 node_get_mutable_by_id(const char *identity_digest)
@@ -128,6 +437,8 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  exit_port_index_update_node(node);
+  nodelist_note_nodes_changed();
 
   node->country = -1;
 
@@ -170,6 +481,8 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  exit_port_index_update_node(node);
+  nodelist_note_nodes_changed();
 
   if (node->country == -1)
     node_set_country(node);
@@ -206,10 +519,14 @@ nodelist_add_microdesc(microdesc_t *md)
     return NULL;
   node = node_get_mutable_by_id(rs->identity_digest);
   if (node) {
+    if (microdesc_parse_fields(md) < 0)
+      return NULL;
     if (node->md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    exit_port_index_update_node(node);
+    nodelist_note_nodes_changed();
   }
   return node;
 }
@@ -218,23 +535,81 @@ nodelist_add_microdesc(microdesc_t *md)
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * If <b>old_ns</b> is provided, it is the consensus that <b>ns</b>
+ * replaces, and it must not have been freed yet.  We use it to skip work for
+ * nodes whose entries have not changed.
+ *
+ * Every node keeps a pointer to its routerstatus, so this parses every
+ * entry of <b>ns</b> that hasn't been parsed yet.  We parse them in place,
+ * so <b>ns</b> can still drop the text of its entries afterwards.
  */
 void
-nodelist_set_consensus(networkstatus_t *ns)
+nodelist_set_consensus(networkstatus_t *ns, const networkstatus_t *old_ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
   int client = !server_mode(options);
+  const int n_old = old_ns ? networkstatus_n_routerstatuses(old_ns) : 0;
+  const routerstatus_t **prev_rs;
+  int n_prev, n_prev_with_rs = 0, n_kept_rs = 0, n_changed = 0, old_idx = 0;
+  int i, n;
+
+  /* Flags, bandwidths, and the bandwidth weights may all change. */
+  nodelist_note_nodes_changed();
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
+  /* Remember which routerstatus every node had, so we can tell which ones
+   * point into old_ns. */
+  n_prev = smartlist_len(the_nodelist->nodes);
+  prev_rs = tor_calloc(n_prev ? n_prev : 1, sizeof(routerstatus_t *));
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+    if (node->rs)
+      ++n_prev_with_rs;
+    prev_rs[node_sl_idx] = node->rs;
+    node->rs = NULL;
+  } SMARTLIST_FOREACH_END(node);
+
+  n = networkstatus_n_routerstatuses(ns);
+  for (i = 0; i < n; ++i) {
+    routerstatus_t *rs = networkstatus_get_routerstatus_by_idx(ns, i);
+    node_t *node;
+    const routerstatus_t *old_rs = NULL;
+    if (!rs)
+      continue; /* Malformed. */
+    node = node_get_or_create(rs->identity_digest);
+
+    /* Both lists are sorted by identity, so we can walk them together.  No
+     * node can be using an entry of old_ns that was never parsed. */
+    while (old_idx < n_old) {
+      const routerstatus_t *o =
+        networkstatus_get_parsed_routerstatus_by_idx(old_ns, old_idx);
+      int c;
+      if (!o) {
+        ++old_idx;
+        continue;
+      }
+      c = fast_memcmp(o->identity_digest, rs->identity_digest, DIGEST_LEN);
+      if (c > 0)
+        break;
+      ++old_idx;
+      if (c == 0) {
+        old_rs = o;
+        break;
+      }
+    }
+    /* Only trust old_rs if this node was actually using it. */
+    if (old_rs && (node->nodelist_idx >= n_prev ||
+                   prev_rs[node->nodelist_idx] != old_rs))
+      old_rs = NULL;
+    if (old_rs)
+      ++n_kept_rs;
+    if (!old_rs || routerstatus_has_changed(old_rs, rs))
+      ++n_changed;
 
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    node_t *node = node_get_or_create(rs->identity_digest);
     node->rs = rs;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
@@ -245,10 +620,13 @@ nodelist_set_consensus(networkstatus_t *ns)
                                                        rs->descriptor_digest);
         if (node->md)
           node->md->held_by_nodes++;
+        exit_port_index_update_node(node);
       }
     }
 
-    node_set_country(node);
+    /* The country only depends on the address. */
+    if (!old_rs || old_rs->addr != rs->addr)
+      node_set_country(node);
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -266,10 +644,16 @@ nodelist_set_consensus(networkstatus_t *ns)
            (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
         node->ipv6_preferred = 1;
     }
+  }
 
-  } SMARTLIST_FOREACH_END(rs);
+  tor_free(prev_rs);
+  log_info(LD_DIR, "New consensus has %d entries; %d of them are new or "
+           "changed.", n, n_changed);
 
-  nodelist_purge();
+  /* If every node that had a routerstatus still has one, no node can have
+   * become unusable, and there is nothing to purge. */
+  if (!old_ns || n_kept_rs != n_prev_with_rs)
+    nodelist_purge();
 
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -306,6 +690,8 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    exit_port_index_update_node(node);
+    nodelist_note_nodes_changed();
   }
 }
 
@@ -316,6 +702,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    exit_port_index_update_node(node);
+    nodelist_note_nodes_changed();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -340,11 +728,19 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
 
   tor_assert(node == smartlist_get(the_nodelist->nodes, idx));
   smartlist_del(the_nodelist->nodes, idx);
+  nodelist_note_nodes_changed();
   if (idx < smartlist_len(the_nodelist->nodes)) {
     tmp = smartlist_get(the_nodelist->nodes, idx);
     tmp->nodelist_idx = idx;
+    exit_port_index_update_node(tmp);
   }
   node->nodelist_idx = -1;
+  if (the_nodelist->exit_port_index) {
+    /* The last slot is empty now. */
+    idx = smartlist_len(the_nodelist->nodes);
+    SMARTLIST_FOREACH(the_nodelist->exit_port_index, exit_port_index_t *,
+                      ent, bitarray_clear(ent->nodes, idx));
+  }
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -395,6 +791,8 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      exit_port_index_update_node(node);
+      nodelist_note_nodes_changed();
     }
 
     if (node_is_usable(node)) {
@@ -422,6 +820,18 @@ nodelist_free_all(void)
   } SMARTLIST_FOREACH_END(node);
 
   smartlist_free(the_nodelist->nodes);
+  nodelist_note_nodes_changed();
+
+  node_family_bits_clear();
+  smartlist_free(the_nodelist->family_bits);
+
+  if (the_nodelist->exit_port_index) {
+    SMARTLIST_FOREACH(the_nodelist->exit_port_index, exit_port_index_t *, ent,
+                      exit_port_index_free(ent));
+    smartlist_free(the_nodelist->exit_port_index);
+  }
+
+  node_select_table_free(the_nodelist->select_table);
 
   tor_free(the_nodelist);
 }
@@ -455,8 +865,13 @@ nodelist_assert_ok(void)
 
   /* every routerstatus in ns should be in the nodelist */
   if (ns) {
-    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-      const node_t *node = node_get_by_id(rs->identity_digest);
+    int i, n = networkstatus_n_routerstatuses(ns);
+    for (i = 0; i < n; ++i) {
+      const routerstatus_t *rs = networkstatus_get_routerstatus_by_idx(ns, i);
+      const node_t *node;
+      if (!rs)
+        continue;
+      node = node_get_by_id(rs->identity_digest);
       tor_assert(node && node->rs == rs);
       tor_assert(fast_memeq(rs->identity_digest, node->identity, DIGEST_LEN));
       digestmap_set(dm, node->identity, (void*)node);
@@ -470,7 +885,7 @@ nodelist_assert_ok(void)
         if (md)
           tor_assert(md->held_by_nodes >= 1);
       }
-    } SMARTLIST_FOREACH_END(rs);
+    }
   }
 
   /* The nodelist should have no other entries, and its entries should be
@@ -480,6 +895,16 @@ nodelist_assert_ok(void)
     tor_assert(node_sl_idx == node->nodelist_idx);
   } SMARTLIST_FOREACH_END(node);
 
+  /* The exit port index should be up to date. */
+  if (the_nodelist->exit_port_index) {
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_index,
+                            exit_port_index_t *, ent) {
+      SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
+        tor_assert(!bitarray_is_set(ent->nodes, node_sl_idx) ==
+                   !node_might_exit_to_port(node, ent->port)));
+    } SMARTLIST_FOREACH_END(ent);
+  }
+
   tor_assert((long)smartlist_len(the_nodelist->nodes) ==
              (long)HT_SIZE(&the_nodelist->nodes_by_id));
 
@@ -1017,6 +1442,7 @@ nodelist_refresh_countries(void)
   smartlist_t *nodes = nodelist_get_list();
   SMARTLIST_FOREACH(nodes, node_t *, node,
                     node_set_country(node));
+  nodelist_note_nodes_changed();
 }
 
 /** Return true iff router1 and router2 have similar enough network addresses
@@ -1097,17 +1523,14 @@ nodes_in_same_family(const node_t *node1, const node_t *node2)
 
 /**
  * Add all the family of <b>node</b>, including <b>node</b> itself, to
- * the smartlist <b>sl</b>.
+ * the smartlist <b>sl</b>, without looking in our family cache.
  *
- * This is used to make sure we don't pick siblings in a single path, or
- * pick more than one relay from a family for our entry guard list.
  * Note that a node may be added to <b>sl</b> more than once if it is
  * part of <b>node</b>'s family for more than one reason.
  */
-void
-nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
+static void
+nodelist_add_node_and_family_uncached(smartlist_t *sl, const node_t *node)
 {
-  const smartlist_t *all_nodes = nodelist_get_list();
   const smartlist_t *declared_family;
   const or_options_t *options = get_options();
 
@@ -1124,15 +1547,20 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 
   /* First, add any nodes with similar network addresses. */
   if (options->EnforceDistinctSubnets) {
-    tor_addr_t node_addr;
-    node_get_addr(node, &node_addr);
-
-    SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
-      tor_addr_t a;
-      node_get_addr(node2, &a);
-      if (addrs_in_same_network_family(&a, &node_addr))
-        smartlist_add(sl, (void*)node2);
-    } SMARTLIST_FOREACH_END(node2);
+    const node_select_table_t *table = nodelist_get_select_table();
+    tor_addr_port_t node_ap;
+
+    /* Every primary ORPort address is IPv4, so comparing the top 16 bits
+     * of the addresses is the same as addrs_in_same_network_family(). */
+    if (node_get_prim_orport(node, &node_ap) == 0) {
+      const uint32_t subnet = tor_addr_to_ipv4h(&node_ap.addr) >> 16;
+      const uint32_t *addrs = table->addr_ipv4h;
+      int i;
+      for (i = 0; i < table->n_nodes; ++i) {
+        if (addrs[i] && (addrs[i] >> 16) == subnet)
+          smartlist_add(sl, smartlist_get(table->nodes, i));
+      }
+    }
   }
 
   /* Now, add all nodes in the declared_family of this node, if they
@@ -1166,6 +1594,141 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
   }
 }
 
+/** Release all the entries in the family cache. */
+static void
+node_family_bits_clear(void)
+{
+  if (!the_nodelist || !the_nodelist->family_bits)
+    return;
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->family_bits, node_family_bits_t *,
+                          ent) {
+    bitarray_free(ent->bits);
+    tor_free(ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_clear(the_nodelist->family_bits);
+}
+
+/** Return a bitarray, indexed by nodelist_idx, of the nodes in the family
+ * of <b>node</b>, including <b>node</b> itself.  Return NULL if
+ * <b>node</b> isn't in the nodelist.  The result stays valid until the
+ * nodelist next changes, or until the next call to this function. */
+static const bitarray_t *
+node_get_family_bits(const node_t *node)
+{
+  node_family_bits_t *ent = NULL;
+  smartlist_t *family;
+
+  if (!node_is_in_nodelist(node))
+    return NULL;
+
+  if (!the_nodelist->family_bits)
+    the_nodelist->family_bits = smartlist_new();
+  if (the_nodelist->family_bits_generation != nodelist_generation) {
+    node_family_bits_clear();
+    the_nodelist->family_bits_generation = nodelist_generation;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->family_bits, node_family_bits_t *,
+                          e) {
+    if (e->node == node) {
+      e->last_used = ++the_nodelist->family_bits_clock;
+      return e->bits;
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  if (smartlist_len(the_nodelist->family_bits) >=
+      MAX_FAMILY_BITS_CACHE_SIZE) {
+    /* Reuse the least recently used entry. */
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->family_bits, node_family_bits_t *,
+                            e) {
+      if (!ent || e->last_used < ent->last_used)
+        ent = e;
+    } SMARTLIST_FOREACH_END(e);
+    bitarray_free(ent->bits);
+  } else {
+    ent = tor_malloc_zero(sizeof(node_family_bits_t));
+    smartlist_add(the_nodelist->family_bits, ent);
+  }
+
+  ent->node = node;
+  ent->last_used = ++the_nodelist->family_bits_clock;
+  ent->bits = bitarray_init_zero(smartlist_len(the_nodelist->nodes));
+
+  family = smartlist_new();
+  nodelist_add_node_and_family_uncached(family, node);
+  SMARTLIST_FOREACH_BEGIN(family, const node_t *, node2) {
+    tor_assert(node2->nodelist_idx >= 0);
+    tor_assert(smartlist_get(the_nodelist->nodes, node2->nodelist_idx) ==
+               node2);
+    bitarray_set(ent->bits, node2->nodelist_idx);
+  } SMARTLIST_FOREACH_END(node2);
+  smartlist_free(family);
+
+  return ent->bits;
+}
+
+/**
+ * Add all the family of <b>node</b>, including <b>node</b> itself, to
+ * the smartlist <b>sl</b>.
+ *
+ * This is used to make sure we don't pick siblings in a single path, or
+ * pick more than one relay from a family for our entry guard list.
+ * Note that a node may be added to <b>sl</b> more than once if it is
+ * part of <b>node</b>'s family for more than one reason.
+ */
+void
+nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
+{
+  const bitarray_t *bits;
+  int n_words, i;
+
+  tor_assert(node);
+
+  if (!(bits = node_get_family_bits(node))) {
+    nodelist_add_node_and_family_uncached(sl, node);
+    return;
+  }
+
+  /* Most words are empty, so skip them quickly. */
+  n_words = (smartlist_len(the_nodelist->nodes) + BITARRAY_MASK)
+    >> BITARRAY_SHIFT;
+  for (i = 0; i < n_words; ++i) {
+    unsigned int word = bits[i];
+    int bit = 0;
+    for ( ; word; word >>= 1, ++bit) {
+      if (word & 1)
+        smartlist_add(sl, smartlist_get(the_nodelist->nodes,
+                                        (i << BITARRAY_SHIFT) + bit));
+    }
+  }
+}
+
+/** Set the bit in <b>bits</b> for every node in the family of <b>node</b>,
+ * including <b>node</b> itself.  <b>bits</b> must have at least as many
+ * bits as there are nodes in the nodelist, and is indexed by
+ * nodelist_idx. */
+void
+nodelist_mark_node_and_family(bitarray_t *bits, const node_t *node)
+{
+  const bitarray_t *family_bits;
+
+  tor_assert(node);
+
+  if (!(family_bits = node_get_family_bits(node))) {
+    smartlist_t *family = smartlist_new();
+    nodelist_add_node_and_family_uncached(family, node);
+    SMARTLIST_FOREACH(family, const node_t *, node2,
+                      bitarray_set(bits, node2->nodelist_idx));
+    smartlist_free(family);
+  } else {
+    int n_words = (smartlist_len(the_nodelist->nodes) + BITARRAY_MASK)
+      >> BITARRAY_SHIFT;
+    int i;
+    for (i = 0; i < n_words; ++i)
+      bits[i] |= family_bits[i];
+  }
+}
+
 /** Find a router that's up, that has this IP address, and
  * that allows exit to this address:port, or return NULL if there
  * isn't a good one.
@@ -1265,8 +1828,10 @@ router_set_status(const char *digest, int up)
       log_warn(LD_NET, "We just marked ourself as down. Are your external "
                "addresses reachable?");
 
-    if (bool_neq(node->is_running, up))
+    if (bool_neq(node->is_running, up)) {
       router_dir_info_changed();
+      nodelist_note_nodes_changed();
+    }
 
     node->is_running = up;
   }
@@ -1353,10 +1918,59 @@ get_dir_info_status_string(void)
   return dir_info_status;
 }
 
-/** Iterate over the servers listed in <b>consensus</b>, and count how many of
- * them seem like ones we'd use (store this in *<b>num_usable</b>), and how
- * many of <em>those</em> we have descriptors for (store this in
- * *<b>num_present</b>).
+/** Iterate over the servers listed in <b>consensus</b> and return a newly
+ * allocated array of those that seem like ones we'd use, in consensus order,
+ * noting for each whether we have the descriptor it lists.  Store the
+ * number of entries in *<b>n_out</b>.
+ *
+ * Deciding whether a server is usable and whether its descriptor is present
+ * is the expensive part of count_usable_descriptors(), so we do it once per
+ * consensus scan and let each caller filter the result.
+ */
+static usable_routerstatus_t *
+find_usable_routerstatuses(networkstatus_t *consensus,
+                           const or_options_t *options, time_t now,
+                           int *n_out)
+{
+  const int md = (consensus->flavor == FLAV_MICRODESC);
+  const int n_rs = networkstatus_n_routerstatuses(consensus);
+  usable_routerstatus_t *usable;
+  int i, n = 0;
+
+  usable = tor_calloc(n_rs + 1, sizeof(*usable));
+  for (i = 0; i < n_rs; ++i) {
+    const routerstatus_t *rs =
+      networkstatus_get_routerstatus_by_idx(consensus, i);
+    const node_t *node;
+    const char *digest;
+    if (!rs)
+      continue; /* Malformed. */
+    node = node_get_by_id(rs->identity_digest);
+    digest = rs->descriptor_digest;
+    if (!node)
+      continue; /* This would be a bug: every entry in the consensus is
+                 * supposed to have a node. */
+    if (!client_would_use_router(rs, now, options))
+      continue;
+    usable[n].rs = rs;
+    usable[n].node = node;
+    if (md)
+      usable[n].present =
+        NULL != microdesc_cache_lookup_by_digest256(NULL, digest);
+    else
+      usable[n].present = NULL != router_get_by_descriptor_digest(digest);
+    ++n;
+  }
+
+  *n_out = n;
+  return usable;
+}
+
+/** Iterate over the <b>n_usable</b> servers in <b>usable</b>, as returned by
+ * find_usable_routerstatuses(), and count how many of them match our
+ * filters (store this in *<b>num_usable</b>), and how many of <em>those</em>
+ * we have descriptors for (store this in *<b>num_present</b>).
+ * <b>md</b> is true iff the consensus is a microdesc consensus.
  *
  * If <b>in_set</b> is non-NULL, only consider those routers in <b>in_set</b>.
  * If <b>exit_only</b> is USABLE_DESCRIPTOR_EXIT_ONLY, only consider nodes
@@ -1367,41 +1981,36 @@ get_dir_info_status_string(void)
 static void
 count_usable_descriptors(int *num_present, int *num_usable,
                          smartlist_t *descs_out,
-                         const networkstatus_t *consensus,
-                         const or_options_t *options, time_t now,
+                         const usable_routerstatus_t *usable, int n_usable,
+                         int md,
                          routerset_t *in_set,
                          usable_descriptor_t exit_only)
 {
-  const int md = (consensus->flavor == FLAV_MICRODESC);
+  int i;
   *num_present = 0, *num_usable = 0;
 
-  SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list, routerstatus_t *, rs)
-    {
-       const node_t *node = node_get_by_id(rs->identity_digest);
-       if (!node)
-         continue; /* This would be a bug: every entry in the consensus is
-                    * supposed to have a node. */
-       if (exit_only == USABLE_DESCRIPTOR_EXIT_ONLY && ! rs->is_exit)
-         continue;
-       if (in_set && ! routerset_contains_routerstatus(in_set, rs, -1))
-         continue;
-       if (client_would_use_router(rs, now, options)) {
-         const char * const digest = rs->descriptor_digest;
-         int present;
-         ++*num_usable; /* the consensus says we want it. */
-         if (md)
-           present = NULL != microdesc_cache_lookup_by_digest256(NULL, digest);
-         else
-           present = NULL != router_get_by_descriptor_digest(digest);
-         if (present) {
-           /* we have the descriptor listed in the consensus. */
-           ++*num_present;
-         }
-         if (descs_out)
-           smartlist_add(descs_out, (node_t*)node);
-       }
-     }
-  SMARTLIST_FOREACH_END(rs);
+  for (i = 0; i < n_usable; ++i) {
+    const routerstatus_t *rs = usable[i].rs;
+    const node_t *node = usable[i].node;
+    if (exit_only == USABLE_DESCRIPTOR_EXIT_ONLY && ! rs->is_exit)
+      continue;
+    if (in_set) {
+      /* When the node is built from this very routerstatus, we can use the
+       * routerset's per-node cache. */
+      int in = (node->rs == rs) ?
+        routerset_contains_node(in_set, node) :
+        routerset_contains_routerstatus(in_set, rs, -1);
+      if (!in)
+        continue;
+    }
+    ++*num_usable; /* the consensus says we want it. */
+    if (usable[i].present) {
+      /* we have the descriptor listed in the consensus. */
+      ++*num_present;
+    }
+    if (descs_out)
+      smartlist_add(descs_out, (node_t*)node);
+  }
 
   log_debug(LD_DIR, "%d usable, %d present (%s%s).",
             *num_usable, *num_present,
@@ -1422,7 +2031,7 @@ count_usable_descriptors(int *num_present, int *num_usable,
  * we treat the exit fraction as 100%.
  */
 static double
-compute_frac_paths_available(const networkstatus_t *consensus,
+compute_frac_paths_available(networkstatus_t *consensus,
                              const or_options_t *options, time_t now,
                              int *num_present_out, int *num_usable_out,
                              char **status_out)
@@ -1437,12 +2046,16 @@ compute_frac_paths_available(const networkstatus_t *consensus,
   /* Used to determine whether there are any exits with descriptors */
   int nu = 0;
   const int authdir = authdir_mode_v3(options);
+  const int md = (consensus->flavor == FLAV_MICRODESC);
+  int n_usable = 0;
+  usable_routerstatus_t *usable =
+    find_usable_routerstatuses(consensus, options, now, &n_usable);
 
   count_usable_descriptors(num_present_out, num_usable_out,
-                           mid, consensus, options, now, NULL,
+                           mid, usable, n_usable, md, NULL,
                            USABLE_DESCRIPTOR_ALL);
   if (options->EntryNodes) {
-    count_usable_descriptors(&np, &nu, guards, consensus, options, now,
+    count_usable_descriptors(&np, &nu, guards, usable, n_usable, md,
                              options->EntryNodes, USABLE_DESCRIPTOR_ALL);
   } else {
     SMARTLIST_FOREACH(mid, const node_t *, node, {
@@ -1463,7 +2076,7 @@ compute_frac_paths_available(const networkstatus_t *consensus,
    * an unavoidable feature of forcing authorities to declare
    * certain nodes as exits.
    */
-  count_usable_descriptors(&np, &nu, exits, consensus, options, now,
+  count_usable_descriptors(&np, &nu, exits, usable, n_usable, md,
                            NULL, USABLE_DESCRIPTOR_EXIT_ONLY);
   log_debug(LD_NET,
             "%s: %d present, %d usable",
@@ -1512,7 +2125,7 @@ compute_frac_paths_available(const networkstatus_t *consensus,
     smartlist_t *myexits_unflagged = smartlist_new();
 
     /* All nodes with exit flag in ExitNodes option */
-    count_usable_descriptors(&np, &nu, myexits, consensus, options, now,
+    count_usable_descriptors(&np, &nu, myexits, usable, n_usable, md,
                              options->ExitNodes, USABLE_DESCRIPTOR_EXIT_ONLY);
     log_debug(LD_NET,
               "%s: %d present, %d usable",
@@ -1523,7 +2136,7 @@ compute_frac_paths_available(const networkstatus_t *consensus,
     /* Now compute the nodes in the ExitNodes option where which we don't know
      * what their exit policy is, or we know it permits something. */
     count_usable_descriptors(&np, &nu, myexits_unflagged,
-                             consensus, options, now,
+                             usable, n_usable, md,
                              options->ExitNodes, USABLE_DESCRIPTOR_ALL);
     log_debug(LD_NET,
               "%s: %d present, %d usable",
@@ -1576,6 +2189,8 @@ compute_frac_paths_available(const networkstatus_t *consensus,
       f_exit = f_myexit;
   }
 
+  tor_free(usable);
+
   /* if the consensus has no exits, treat the exit fraction as 100% */
   if (router_have_consensus_path() != CONSENSUS_PATH_EXIT) {
     f_exit = 1.0;
@@ -1609,7 +2224,7 @@ count_loading_descriptors_progress(void)
   int num_present = 0, num_usable=0;
   time_t now = time(NULL);
   const or_options_t *options = get_options();
-  const networkstatus_t *consensus =
+  networkstatus_t *consensus =
     networkstatus_get_reasonably_live_consensus(now,usable_consensus_flavor());
   double paths, fraction;
 
@@ -1653,7 +2268,7 @@ update_router_have_minimum_dir_info(void)
   time_t now = time(NULL);
   int res;
   const or_options_t *options = get_options();
-  const networkstatus_t *consensus =
+  networkstatus_t *consensus =
     networkstatus_get_reasonably_live_consensus(now,usable_consensus_flavor());
   int using_md;
 
@@ -16,12 +16,60 @@
     tor_assert((n)->ri || (n)->rs);                             \
   } STMT_END
 
+/** Bits for node_select_table_t.flags.  Each mirrors a node_t field or
+ * accessor of the same name. */
+#define NST_RUNNING         (1u<<0)
+#define NST_VALID           (1u<<1)
+#define NST_FAST            (1u<<2)
+#define NST_STABLE          (1u<<3)
+#define NST_GUARD           (1u<<4)
+#define NST_EXIT            (1u<<5)
+#define NST_BAD_EXIT        (1u<<6)
+/** node_is_dir() */
+#define NST_DIR             (1u<<7)
+/** The node has a routerinfo, or a routerstatus and a microdescriptor. */
+#define NST_HAS_DESC        (1u<<8)
+/** The node has a routerinfo whose purpose isn't ROUTER_PURPOSE_GENERAL. */
+#define NST_NOT_GENERAL     (1u<<9)
+/** The node has a routerstatus. */
+#define NST_HAS_RS          (1u<<10)
+/** The node has a routerstatus with a bandwidth. */
+#define NST_HAS_BW          (1u<<11)
+/** The node has a routerstatus with guardfraction information. */
+#define NST_GUARDFRACTION   (1u<<12)
+
+/** The fields of every node_t that path selection looks at most often,
+ * laid out as parallel arrays indexed by nodelist_idx, so that scanning
+ * the whole nodelist reads a few dense arrays instead of following
+ * pointers into every node_t and its routerstatus. */
+typedef struct node_select_table_t {
+  /** Value of nodelist_get_generation() when we built this table. */
+  uint64_t generation;
+  /** The nodelist that this table describes. */
+  const smartlist_t *nodes;
+  /** Number of entries in each array; equal to the length of
+   * <b>nodes</b>. */
+  int n_nodes;
+  /** Number of entries allocated in each array. */
+  int n_allocated;
+  /** NST_* bits for each node. */
+  uint16_t *flags;
+  /** Consensus bandwidth for each node, in kilobytes; 0 unless NST_HAS_BW
+   * is set. */
+  uint32_t *bandwidth_kb;
+  /** Host-order IPv4 address of each node's primary ORPort, or 0 if it
+   * has none.  Two nodes whose addresses agree in the top 16 bits are in
+   * the same subnet family. */
+  uint32_t *addr_ipv4h;
+} node_select_table_t;
+
 node_t *node_get_mutable_by_id(const char *identity_digest);
 MOCK_DECL(const node_t *, node_get_by_id, (const char *identity_digest));
 const node_t *node_get_by_hex_id(const char *identity_digest);
 node_t *nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out);
 node_t *nodelist_add_microdesc(microdesc_t *md);
-void nodelist_set_consensus(networkstatus_t *ns);
+void nodelist_set_consensus(networkstatus_t *ns,
+                            const networkstatus_t *old_ns);
 
 void nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md);
 void nodelist_remove_routerinfo(routerinfo_t *ri);
@@ -45,6 +93,14 @@ int node_get_purpose(const node_t *node);
   (node_get_purpose((node)) == ROUTER_PURPOSE_BRIDGE)
 int node_is_me(const node_t *node);
 int node_exit_policy_rejects_all(const node_t *node);
+int node_might_exit_to_port(const node_t *node, uint16_t port);
+void nodelist_add_exits_for_port(bitarray_t *out, const smartlist_t *nodes,
+                                 uint16_t port);
+void nodelist_note_node_exit_policy_changed(const node_t *node);
+void nodelist_note_nodes_changed(void);
+uint64_t nodelist_get_generation(void);
+int node_is_in_nodelist(const node_t *node);
+const node_select_table_t *nodelist_get_select_table(void);
 int node_exit_policy_is_exact(const node_t *node, sa_family_t family);
 smartlist_t *node_get_all_orports(const node_t *node);
 int node_allows_single_hop_exits(const node_t *node);
@@ -70,6 +126,7 @@ void node_get_addr(const node_t *node, tor_addr_t *addr_out);
 void nodelist_refresh_countries(void);
 void node_set_country(node_t *node);
 void nodelist_add_node_and_family(smartlist_t *nodes, const node_t *node);
+void nodelist_mark_node_and_family(bitarray_t *bits, const node_t *node);
 int nodes_in_same_family(const node_t *node1, const node_t *node2);
 
 const node_t *router_find_exact_exit_enclave(const char *address,
@@ -1415,6 +1415,12 @@ typedef struct or_handshake_state_t {
   /** A self-signed identity certificate */
   tor_cert_t *id_cert;
   /**@}*/
+
+  /** If we're "verifying" -- waiting for a cpuworker to check the
+   * signatures on a CERTS or AUTHENTICATE cell -- this is the job doing
+   * so.  We don't process any more cells on this connection until it's
+   * done. */
+  struct channel_tls_verify_job_t *verify_job;
 } or_handshake_state_t;
 
 /** Length of Extended ORPort connection identifier. */
@@ -1704,6 +1710,13 @@ typedef struct dir_connection_t {
   off_t cached_dir_offset;
   /** The zlib object doing on-the-fly compression for spooled data. */
   tor_zlib_state_t *zlib_state;
+  /** Spooled data that we're going to compress in a cpuworker, but haven't
+   * yet. */
+  buf_t *spool_plaintext;
+  /** If we're compressing spooled data for this connection in a cpuworker,
+   * the job that's doing it.  While it's running, the job has our
+   * zlib_state. */
+  struct spool_compress_job_t *compress_job;
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
@@ -1903,6 +1916,11 @@ typedef struct cached_dir_t {
   time_t published; /**< When was this object published. */
   digests_t digests; /**< Digests of this object (networkstatus only) */
   int refcnt; /**< Reference count for this cached_dir_t. */
+  /** If nonnull, a cached_dir_t whose <b>dir_z</b> holds <b>dir</b>
+   * compressed with <b>recompressed_method</b> rather than with zlib. */
+  struct cached_dir_t *recompressed;
+  /** The compression method used for <b>recompressed</b>. */
+  compress_method_t recompressed_method;
 } cached_dir_t;
 
 /** Enum used to remember where a signed_descriptor_t is stored and how to
@@ -1995,6 +2013,12 @@ typedef struct signed_descriptor_t {
   unsigned int extrainfo_is_bogus : 1;
   /* If true, we are willing to transmit this item unencrypted. */
   unsigned int send_unencrypted : 1;
+  /* If true, we're rebuilding the store for this item in the background,
+   * and the new store will hold it at pending_store_offset. */
+  unsigned int in_pending_store : 1;
+  /** If in_pending_store is set, the offset of this descriptor in the store
+   * that we're rebuilding. */
+  off_t pending_store_offset;
 } signed_descriptor_t;
 
 /** A signed integer representing a country code. */
@@ -2165,8 +2189,20 @@ typedef struct short_policy_entry_t {
   uint16_t min_port, max_port;
 } short_policy_entry_t;
 
-/** A short_poliy_t is the parsed version of a policy summary. */
+/** A short_poliy_t is the parsed version of a policy summary.  Short
+ * policies are interned: parse_short_policy() returns a shared, refcounted
+ * copy, which must be treated as read-only. */
 typedef struct short_policy_t {
+  /** Entry in the table of interned short policies. */
+  HT_ENTRY(short_policy_t) node;
+  /** Number of references to this policy; freed when it reaches 0. */
+  int refcnt;
+  /** The ranges in 'entries', sorted by port and with overlapping or
+   * adjacent ranges merged, so that we can binary-search them.  Points into
+   * 'entries' when they are already in that form. */
+  short_policy_entry_t *runs;
+  /** The number of values in 'runs'. */
+  int n_runs;
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
@@ -2203,9 +2239,16 @@ typedef struct microdesc_t {
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
+  /** If true, we loaded this microdescriptor from the cache index, and we
+   * haven't filled in the fields below yet: see microdesc_parse_fields(). */
+  unsigned int unparsed : 1;
+
   /** If saved_location == SAVED_IN_CACHE, this field holds the offset of the
    * microdescriptor in the cache. */
   off_t off;
+  /** If <b>unparsed</b> is true, a pointer to this microdescriptor's entry
+   * in the mmap'd cache index. */
+  const char *index_entry;
 
   /* The string containing the microdesc. */
 
@@ -2458,14 +2501,64 @@ typedef struct networkstatus_t {
 
   /** List of router statuses, sorted by identity digest.  For a vote,
    * the elements are vote_routerstatus_t; for a consensus, the elements
-   * are routerstatus_t. */
+   * are routerstatus_t.
+   *
+   * If <b>lazy_entries</b> is set, this is NULL: use
+   * networkstatus_get_routerstatus_list() or the other accessors in
+   * networkstatus.c instead. */
   smartlist_t *routerstatus_list;
 
-  /** If present, a map from descriptor digest to elements of
-   * routerstatus_list. */
-  digestmap_t *desc_digest_map;
+  /** If present, the router statuses of this consensus that we haven't
+   * parsed yet. */
+  struct networkstatus_lazy_entries_t *lazy_entries;
+
+  /** If present, a hash index of the router statuses of this document by
+   * identity digest and by descriptor digest.  Built on demand. */
+  struct networkstatus_rs_index_t *rs_index;
 } networkstatus_t;
 
+/** The router statuses of a consensus that we parsed lazily.  We parse each
+ * one the first time somebody asks for it. */
+typedef struct networkstatus_lazy_entries_t {
+  /** A copy of the router status entries from the consensus, as a
+   * NUL-terminated string. */
+  char *body;
+  /** Number of router status entries. */
+  int n_entries;
+  /** For each entry, its offset within <b>body</b>. */
+  uint32_t *offsets;
+  /** The identity digests of the entries, DIGEST_LEN bytes each, sorted. */
+  char *identity_digests;
+  /** For each entry, its parsed routerstatus_t, or NULL if we haven't
+   * parsed it yet. */
+  routerstatus_t **parsed;
+  /** For each entry, true iff we tried to parse it and failed. */
+  bitarray_t *failed;
+  /** Number of entries that we haven't tried to parse yet.  Once this
+   * reaches zero, we free <b>body</b>, <b>offsets</b>, and <b>area</b>. */
+  int n_unparsed;
+  /** Memory area to use when tokenizing entries. */
+  struct memarea_t *area;
+} networkstatus_lazy_entries_t;
+
+/** An open-addressing hash index over the router statuses of a
+ * networkstatus_t.  Each slot holds one more than the index of an entry, or
+ * 0 if the slot is empty; we compare digests against the entries themselves,
+ * so the tables stay small. */
+typedef struct networkstatus_rs_index_t {
+  /** Number of router statuses in the document when we built this index. */
+  int n_entries;
+  /** One less than the number of slots in each table, which is a power of
+   * two at least twice <b>n_entries</b>. */
+  unsigned mask;
+  /** Table of entries keyed by identity digest. */
+  int32_t *by_identity;
+  /** Table of entries keyed by (the first DIGEST_LEN bytes of) descriptor
+   * digest, or NULL if the document was parsed lazily and we haven't parsed
+   * all its entries yet. */
+  int32_t *by_descriptor;
+} networkstatus_rs_index_t;
+
 /** A set of signatures for a networkstatus consensus.  Unless otherwise
  * noted, all fields are as for networkstatus_t. */
 typedef struct ns_detached_signatures_t {
@@ -2494,6 +2587,10 @@ typedef struct desc_store_t {
   const char *description;
 
   tor_mmap_t *mmap; /**< A mmap for the main file in the store. */
+  /** If anybody outside the routerlist has a reference to <b>mmap</b>, a
+   * reference-counted handle on it; the store holds one of the
+   * references. */
+  struct store_mmap_ref_t *mmap_ref;
 
   store_type_t type; /**< What's stored in this store? */
 
@@ -2504,6 +2601,9 @@ typedef struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+  /** If we're rebuilding this store in a cpuworker, the job that's doing
+   * it. */
+  struct store_rebuild_job_t *rebuild_job;
 } desc_store_t;
 
 /** Contents of a directory of onion routers. */
@@ -39,6 +39,14 @@ static smartlist_t *reachable_or_addr_policy = NULL;
  * to directories at. */
 static smartlist_t *reachable_dir_addr_policy = NULL;
 
+/** Compiled forms of socks_policy, dir_policy, reachable_or_addr_policy and
+ * reachable_dir_addr_policy, which we check on every incoming connection or
+ * candidate relay; NULL when the corresponding policy is NULL. */
+static compiled_addr_policy_t *socks_policy_compiled = NULL;
+static compiled_addr_policy_t *dir_policy_compiled = NULL;
+static compiled_addr_policy_t *reachable_or_addr_policy_compiled = NULL;
+static compiled_addr_policy_t *reachable_dir_addr_policy_compiled = NULL;
+
 /** Element of an exit policy summary */
 typedef struct policy_summary_item_t {
     uint16_t prt_min; /**< Lowest port number to accept/reject. */
@@ -267,14 +275,20 @@ firewall_is_fascist_or(void)
 }
 
 /** Return true iff <b>policy</b> (possibly NULL) will allow a
- * connection to <b>addr</b>:<b>port</b>.
+ * connection to <b>addr</b>:<b>port</b>.  If <b>compiled</b> is provided,
+ * it must be the compiled form of <b>policy</b>, and we check against it
+ * instead.
  */
 static int
 addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
-                            smartlist_t *policy)
+                             smartlist_t *policy,
+                             const compiled_addr_policy_t *compiled)
 {
   addr_policy_result_t p;
-  p = compare_tor_addr_to_addr_policy(addr, port, policy);
+  if (compiled)
+    p = compare_tor_addr_to_compiled_policy(addr, port, compiled);
+  else
+    p = compare_tor_addr_to_addr_policy(addr, port, policy);
   switch (p) {
     case ADDR_POLICY_PROBABLY_ACCEPTED:
     case ADDR_POLICY_ACCEPTED:
@@ -298,7 +312,7 @@ addr_policy_permits_address(uint32_t addr, uint16_t port,
 {
   tor_addr_t a;
   tor_addr_from_ipv4h(&a, addr);
-  return addr_policy_permits_tor_addr(&a, port, policy);
+  return addr_policy_permits_tor_addr(&a, port, policy, NULL);
 }
 
 /** Return true iff we think our firewall will let us make an OR connection to
@@ -307,7 +321,8 @@ int
 fascist_firewall_allows_address_or(const tor_addr_t *addr, uint16_t port)
 {
   return addr_policy_permits_tor_addr(addr, port,
-                                     reachable_or_addr_policy);
+                                      reachable_or_addr_policy,
+                                      reachable_or_addr_policy_compiled);
 }
 
 /** Return true iff we think our firewall will let us make an OR connection to
@@ -343,7 +358,8 @@ int
 fascist_firewall_allows_address_dir(const tor_addr_t *addr, uint16_t port)
 {
   return addr_policy_permits_tor_addr(addr, port,
-                                      reachable_dir_addr_policy);
+                                      reachable_dir_addr_policy,
+                                      reachable_dir_addr_policy_compiled);
 }
 
 /** Return 1 if <b>addr</b> is permitted to connect to our dir port,
@@ -352,7 +368,8 @@ fascist_firewall_allows_address_dir(const tor_addr_t *addr, uint16_t port)
 int
 dir_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, dir_policy);
+  return addr_policy_permits_tor_addr(addr, 1, dir_policy,
+                                      dir_policy_compiled);
 }
 
 /** Return 1 if <b>addr</b> is permitted to connect to our socks port,
@@ -361,7 +378,8 @@ dir_policy_permits_address(const tor_addr_t *addr)
 int
 socks_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, socks_policy);
+  return addr_policy_permits_tor_addr(addr, 1, socks_policy,
+                                      socks_policy_compiled);
 }
 
 /** Return true iff the address <b>addr</b> is in a country listed in the
@@ -532,6 +550,34 @@ load_policy_from_option(config_line_t *config, const char *option_name,
   return 0;
 }
 
+/** Release the compiled forms of our configured policies. */
+static void
+policies_free_compiled(void)
+{
+  compiled_addr_policy_free(socks_policy_compiled);
+  socks_policy_compiled = NULL;
+  compiled_addr_policy_free(dir_policy_compiled);
+  dir_policy_compiled = NULL;
+  compiled_addr_policy_free(reachable_or_addr_policy_compiled);
+  reachable_or_addr_policy_compiled = NULL;
+  compiled_addr_policy_free(reachable_dir_addr_policy_compiled);
+  reachable_dir_addr_policy_compiled = NULL;
+}
+
+/** Rebuild the compiled forms of our configured policies from the
+ * policies themselves. */
+static void
+policies_compile_all(void)
+{
+  policies_free_compiled();
+  socks_policy_compiled = addr_policy_compile(socks_policy);
+  dir_policy_compiled = addr_policy_compile(dir_policy);
+  reachable_or_addr_policy_compiled =
+    addr_policy_compile(reachable_or_addr_policy);
+  reachable_dir_addr_policy_compiled =
+    addr_policy_compile(reachable_dir_addr_policy);
+}
+
 /** Set all policies based on <b>options</b>, which should have been validated
  * first by validate_addr_policies. */
 int
@@ -555,6 +601,7 @@ policies_parse_from_options(const or_options_t *options)
     ret = -1;
   if (parse_reachable_addresses() < 0)
     ret = -1;
+  policies_compile_all();
   return ret;
 }
 
@@ -609,6 +656,38 @@ typedef struct policy_map_ent_t {
 /* DOCDOC policy_root */
 static HT_HEAD(policy_map, policy_map_ent_t) policy_root = HT_INITIALIZER();
 
+/** Mutex protecting policy_root, short_policy_root, and the reference counts
+ * of the policies in them, once policies_init_threads() has been called.
+ * Descriptors and microdescriptors get parsed on worker threads, and their
+ * policies get interned from there. */
+static tor_mutex_t *policies_mutex = NULL;
+
+/** Acquire policies_mutex, if we have one. */
+static INLINE void
+policies_lock(void)
+{
+  if (policies_mutex)
+    tor_mutex_acquire(policies_mutex);
+}
+
+/** Release policies_mutex, if we have one. */
+static INLINE void
+policies_unlock(void)
+{
+  if (policies_mutex)
+    tor_mutex_release(policies_mutex);
+}
+
+/** Make the tables of interned policies safe to use from more than one
+ * thread.  Call this from the main thread before starting any other
+ * threads. */
+void
+policies_init_threads(void)
+{
+  if (!policies_mutex)
+    policies_mutex = tor_mutex_new();
+}
+
 /** Return true iff a and b are equal. */
 static INLINE int
 policy_eq(policy_map_ent_t *a, policy_map_ent_t *b)
@@ -655,6 +734,7 @@ addr_policy_get_canonical_entry(addr_policy_t *e)
     return e;
 
   search.policy = e;
+  policies_lock();
   found = HT_FIND(policy_map, &policy_root, &search);
   if (!found) {
     found = tor_malloc_zero(sizeof(policy_map_ent_t));
@@ -666,6 +746,7 @@ addr_policy_get_canonical_entry(addr_policy_t *e)
 
   tor_assert(!cmp_single_addr_policy(found->policy, e));
   ++found->policy->refcnt;
+  policies_unlock();
   return found->policy;
 }
 
@@ -802,6 +883,389 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** One node of a binary prefix trie in a compiled_addr_policy_t. */
+typedef struct policy_trie_node_t {
+  /** Index of the child for the next address bit being 0 or 1, or 0 if
+   * there is no such child.  (Node 0 is the root, so it is never a child.) */
+  uint32_t child[2];
+  /** Index of the port map in compiled_addr_policy_t.maps for addresses
+   * whose longest rule prefix ends at this node, or -1 if no rule ends
+   * here.  While compiling, this holds the first of the rules ending at
+   * this node instead. */
+  int map_idx;
+} policy_trie_node_t;
+
+/** A prefix trie over all the rules of one address family. */
+typedef struct policy_trie_t {
+  policy_trie_node_t *nodes; /**< Node 0 is the root. */
+  int n_nodes; /**< Number of nodes in use. */
+  int n_allocated; /**< Number of nodes we have room for. */
+} policy_trie_t;
+
+/** The answer a policy gives for every port, for some set of addresses.
+ * Ports from starts[i] up to starts[i+1]-1 get results[i]. */
+typedef struct compiled_port_map_t {
+  int n_runs; /**< Number of entries in starts and results. */
+  uint16_t *starts; /**< Sorted; starts[0] is always 0. */
+  addr_policy_result_t *results; /**< Result for each run of ports. */
+  /** Result when the port is unknown, as
+   * compare_known_tor_addr_to_addr_policy_noport() would give it. */
+  addr_policy_result_t noport_result;
+} compiled_port_map_t;
+
+/** An address policy, preprocessed so that we can match an address against
+ * it without looking at every rule.  We keep one prefix trie per address
+ * family: the rules whose prefix ends at a trie node have been folded,
+ * together with the rules ending at the node's ancestors, into one port map
+ * for that node.  Looking up an address is a walk down its trie to the
+ * deepest node that has a map, and a binary search over that map. */
+struct compiled_addr_policy_t {
+  policy_trie_t tries[2]; /**< Tries for IPv4 and IPv6 rules. */
+  compiled_port_map_t *maps; /**< Port maps referenced by the trie nodes. */
+  int n_maps; /**< Number of entries in maps. */
+  /** Port map to use when the address is unknown. */
+  compiled_port_map_t unknown_addr_map;
+};
+
+/** Return the index of the trie in a compiled_addr_policy_t for addresses
+ * of <b>family</b>, or -1 if we don't compile that family. */
+static INLINE int
+compiled_policy_trie_idx(sa_family_t family)
+{
+  switch (family) {
+    case AF_INET: return 0;
+    case AF_INET6: return 1;
+    default: return -1;
+  }
+}
+
+/** Return the number of address bits that a rule with <b>maskbits</b> on
+ * an address of <b>family</b> actually compares, matching
+ * tor_addr_compare_masked(). */
+static INLINE int
+compiled_policy_prefix_len(sa_family_t family, int maskbits)
+{
+  const int max_bits = (family == AF_INET) ? 32 : 128;
+  return maskbits > max_bits ? max_bits : maskbits;
+}
+
+/** Return bit number <b>bit</b> (counting from the most significant) of
+ * <b>addr</b>, which must be an IPv4 or IPv6 address. */
+static INLINE int
+compiled_policy_addr_bit(const tor_addr_t *addr, int bit)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    return (tor_addr_to_ipv4h(addr) >> (31 - bit)) & 1;
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    return (a[bit >> 3] >> (7 - (bit & 7))) & 1;
+  }
+}
+
+/** Add a new node with no children to <b>trie</b>, and return its index. */
+static uint32_t
+policy_trie_add_node(policy_trie_t *trie)
+{
+  if (trie->n_nodes == trie->n_allocated) {
+    trie->n_allocated = trie->n_allocated ? trie->n_allocated * 2 : 16;
+    trie->nodes = tor_reallocarray(trie->nodes, trie->n_allocated,
+                                   sizeof(policy_trie_node_t));
+  }
+  memset(&trie->nodes[trie->n_nodes], 0, sizeof(policy_trie_node_t));
+  trie->nodes[trie->n_nodes].map_idx = -1;
+  return trie->n_nodes++;
+}
+
+/** Helper for qsort: compare two uint32_t values. */
+static int
+compare_uint32_(const void *a, const void *b)
+{
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Return the result of the rules <b>rules</b> (<b>n_rules</b> indices into
+ * <b>policy</b>, in increasing order) for <b>port</b>.  If
+ * <b>addr_known</b>, every rule in <b>rules</b> matches the address and
+ * <b>port</b> may be 0 to get the result for an unknown port; otherwise,
+ * the address is unknown.  This follows the same logic as the
+ * compare_*_tor_addr_to_addr_policy*() functions above. */
+static addr_policy_result_t
+compiled_port_map_eval(const smartlist_t *policy, const int *rules,
+                       int n_rules, int addr_known, uint16_t port)
+{
+  int maybe_accept = 0, maybe_reject = 0;
+  int i;
+  for (i = 0; i < n_rules; ++i) {
+    const addr_policy_t *tmpe = smartlist_get(policy, rules[i]);
+    int definite;
+    if (addr_known && port == 0) {
+      definite = tmpe->prt_min <= 1 && tmpe->prt_max >= 65535;
+    } else {
+      if (port < tmpe->prt_min || port > tmpe->prt_max)
+        continue;
+      definite = addr_known || tmpe->maskbits == 0;
+    }
+    if (definite) {
+      if (tmpe->policy_type == ADDR_POLICY_ACCEPT)
+        return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+          ADDR_POLICY_ACCEPTED;
+      else
+        return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+          ADDR_POLICY_REJECTED;
+    }
+    if (tmpe->policy_type == ADDR_POLICY_REJECT)
+      maybe_reject = 1;
+    else
+      maybe_accept = 1;
+  }
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Fill in <b>map</b> with the results of the rules <b>rules</b>
+ * (<b>n_rules</b> indices into <b>policy</b>, in increasing order) for
+ * every port.  <b>addr_known</b> is as for compiled_port_map_eval(). */
+static void
+compiled_port_map_build(compiled_port_map_t *map, const smartlist_t *policy,
+                        const int *rules, int n_rules, int addr_known)
+{
+  uint32_t *bounds = tor_calloc(2 * n_rules + 1, sizeof(uint32_t));
+  int n_bounds = 0, i;
+
+  /* The result can only change at the edge of some rule's port range.  We
+   * never look up port 0 in the map, so the first run covers it too. */
+  bounds[n_bounds++] = 1;
+  for (i = 0; i < n_rules; ++i) {
+    const addr_policy_t *p = smartlist_get(policy, rules[i]);
+    bounds[n_bounds++] = p->prt_min ? p->prt_min : 1;
+    bounds[n_bounds++] = (uint32_t)p->prt_max + 1;
+  }
+  qsort(bounds, n_bounds, sizeof(uint32_t), compare_uint32_);
+
+  map->starts = tor_calloc(n_bounds, sizeof(uint16_t));
+  map->results = tor_calloc(n_bounds, sizeof(addr_policy_result_t));
+  map->n_runs = 0;
+  for (i = 0; i < n_bounds; ++i) {
+    addr_policy_result_t r;
+    if (bounds[i] > 65535)
+      break;
+    if (i && bounds[i] == bounds[i-1])
+      continue;
+    r = compiled_port_map_eval(policy, rules, n_rules, addr_known,
+                               (uint16_t)bounds[i]);
+    if (map->n_runs && map->results[map->n_runs-1] == r)
+      continue;
+    map->starts[map->n_runs] = map->n_runs ? (uint16_t)bounds[i] : 0;
+    map->results[map->n_runs] = r;
+    ++map->n_runs;
+  }
+  map->noport_result = addr_known ?
+    compiled_port_map_eval(policy, rules, n_rules, 1, 0) :
+    ADDR_POLICY_REJECTED;
+
+  tor_free(bounds);
+}
+
+/** Return the result that <b>map</b> gives for <b>port</b>. */
+static INLINE addr_policy_result_t
+compiled_port_map_lookup(const compiled_port_map_t *map, uint16_t port)
+{
+  int lo = 0, hi = map->n_runs - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (map->starts[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return map->results[lo];
+}
+
+/** Recursive helper for addr_policy_compile(): build the port maps for
+ * <b>node</b> in <b>trie</b> and for all of its descendants.  <b>path</b>
+ * holds the indices of the rules ending at the ancestors of <b>node</b>,
+ * in increasing order; <b>rule_next</b> links together the rules ending at
+ * each node. */
+static void
+compiled_policy_build_maps(compiled_addr_policy_t *c, policy_trie_t *trie,
+                           uint32_t node, const smartlist_t *policy,
+                           const int *rule_next, int *path, int *path_len)
+{
+  const int first_rule = trie->nodes[node].map_idx;
+  const int old_path_len = *path_len;
+  int r, i;
+
+  if (first_rule >= 0) {
+    /* Merge the rules ending here into the (sorted) path. */
+    for (r = first_rule; r >= 0; r = rule_next[r]) {
+      for (i = *path_len; i > 0 && path[i-1] > r; --i)
+        path[i] = path[i-1];
+      path[i] = r;
+      ++*path_len;
+    }
+    compiled_port_map_build(&c->maps[c->n_maps], policy, path, *path_len, 1);
+    trie->nodes[node].map_idx = c->n_maps++;
+  }
+
+  for (i = 0; i < 2; ++i) {
+    if (trie->nodes[node].child[i])
+      compiled_policy_build_maps(c, trie, trie->nodes[node].child[i],
+                                 policy, rule_next, path, path_len);
+  }
+
+  if (first_rule >= 0) {
+    /* Take our rules back out of the path. */
+    int j = 0;
+    for (i = 0; i < *path_len; ++i) {
+      for (r = first_rule; r >= 0; r = rule_next[r])
+        if (path[i] == r)
+          break;
+      if (r < 0)
+        path[j++] = path[i];
+    }
+    *path_len = j;
+    tor_assert(j == old_path_len);
+  }
+}
+
+/** Build and return a compiled form of <b>policy</b> that
+ * compare_tor_addr_to_compiled_policy() can check addresses against far
+ * faster than compare_tor_addr_to_addr_policy() can check them against a
+ * long policy.  The compiled policy does not refer to <b>policy</b>, and
+ * must be rebuilt if <b>policy</b> changes.  Return NULL if <b>policy</b>
+ * is NULL, or if it has rules that we can't compile (only IPv4 and IPv6
+ * rules are supported); callers should fall back to
+ * compare_tor_addr_to_addr_policy() in that case. */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t *c;
+  int *rule_next, *path, *all_rules;
+  int n_rules, path_len = 0, fam;
+
+  if (!policy)
+    return NULL;
+  n_rules = smartlist_len(policy);
+  SMARTLIST_FOREACH(policy, const addr_policy_t *, p,
+     if (compiled_policy_trie_idx(tor_addr_family(&p->addr)) < 0)
+       return NULL);
+
+  c = tor_malloc_zero(sizeof(compiled_addr_policy_t));
+  rule_next = tor_calloc(n_rules + 1, sizeof(int));
+  path = tor_calloc(n_rules + 1, sizeof(int));
+  all_rules = tor_calloc(n_rules + 1, sizeof(int));
+
+  for (fam = 0; fam < 2; ++fam)
+    policy_trie_add_node(&c->tries[fam]);
+
+  /* Insert every rule at the end of its prefix, and link it to the others
+   * ending there. */
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    const sa_family_t family = tor_addr_family(&p->addr);
+    policy_trie_t *trie = &c->tries[family == AF_INET ? 0 : 1];
+    const int len = compiled_policy_prefix_len(family, p->maskbits);
+    uint32_t node = 0;
+    int bit;
+    for (bit = 0; bit < len; ++bit) {
+      const int b = compiled_policy_addr_bit(&p->addr, bit);
+      if (!trie->nodes[node].child[b]) {
+        uint32_t child = policy_trie_add_node(trie);
+        trie->nodes[node].child[b] = child;
+      }
+      node = trie->nodes[node].child[b];
+    }
+    if (trie->nodes[node].map_idx < 0)
+      ++c->n_maps;
+    rule_next[p_sl_idx] = trie->nodes[node].map_idx;
+    trie->nodes[node].map_idx = p_sl_idx;
+    all_rules[p_sl_idx] = p_sl_idx;
+  } SMARTLIST_FOREACH_END(p);
+
+  c->maps = tor_calloc(c->n_maps + 1, sizeof(compiled_port_map_t));
+  c->n_maps = 0;
+  for (fam = 0; fam < 2; ++fam)
+    compiled_policy_build_maps(c, &c->tries[fam], 0, policy, rule_next,
+                               path, &path_len);
+  compiled_port_map_build(&c->unknown_addr_map, policy, all_rules, n_rules,
+                          0);
+
+  tor_free(rule_next);
+  tor_free(path);
+  tor_free(all_rules);
+  return c;
+}
+
+/** Release all storage held by <b>c</b>. */
+void
+compiled_addr_policy_free(compiled_addr_policy_t *c)
+{
+  int i;
+  if (!c)
+    return;
+  for (i = 0; i < c->n_maps; ++i) {
+    tor_free(c->maps[i].starts);
+    tor_free(c->maps[i].results);
+  }
+  tor_free(c->maps);
+  tor_free(c->unknown_addr_map.starts);
+  tor_free(c->unknown_addr_map.results);
+  for (i = 0; i < 2; ++i)
+    tor_free(c->tries[i].nodes);
+  tor_free(c);
+}
+
+/** As compare_tor_addr_to_addr_policy(), but check against a policy that
+ * has been compiled with addr_policy_compile(). */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_addr_policy_t *c)
+{
+  const policy_trie_t *trie;
+  const policy_trie_node_t *nodes;
+  uint32_t node = 0;
+  int map_idx, bit, n_bits, fam;
+
+  if (!c) {
+    /* no policy? accept all. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return compiled_port_map_lookup(&c->unknown_addr_map, port);
+  }
+
+  fam = compiled_policy_trie_idx(tor_addr_family(addr));
+  if (fam < 0) {
+    /* No rule we compiled can match an address of this family. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+  trie = &c->tries[fam];
+  nodes = trie->nodes;
+  n_bits = fam ? 128 : 32;
+
+  /* Find the longest rule prefix that matches addr. */
+  map_idx = nodes[0].map_idx;
+  for (bit = 0; bit < n_bits; ++bit) {
+    node = nodes[node].child[compiled_policy_addr_bit(addr, bit)];
+    if (!node)
+      break;
+    if (nodes[node].map_idx >= 0)
+      map_idx = nodes[node].map_idx;
+  }
+
+  if (map_idx < 0) {
+    /* accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (port == 0) {
+    return c->maps[map_idx].noport_result;
+  } else {
+    return compiled_port_map_lookup(&c->maps[map_idx], port);
+  }
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -1096,6 +1560,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_note_node_exit_policy_changed(node);
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -1533,8 +1998,126 @@ policy_summarize(smartlist_t *policy, sa_family_t family)
   return result;
 }
 
+/** Return true iff the short policies <b>a</b> and <b>b</b> have the same
+ * entries. */
+static INLINE int
+short_policy_eq(const short_policy_t *a, const short_policy_t *b)
+{
+  return a->is_accept == b->is_accept && a->n_entries == b->n_entries &&
+    fast_memeq(a->entries, b->entries,
+               sizeof(short_policy_entry_t) * a->n_entries);
+}
+
+/** Return a hash of the entries of the short policy <b>p</b>. */
+static INLINE unsigned
+short_policy_hash(const short_policy_t *p)
+{
+  return (unsigned) siphash24g(p->entries,
+                   sizeof(short_policy_entry_t) * p->n_entries) ^ p->is_accept;
+}
+
+/** Table of all the short policies we have parsed, so that the many nodes
+ * which share a policy summary also share one copy of it (and of its run
+ * index). */
+static HT_HEAD(short_policy_map, short_policy_t) short_policy_root =
+  HT_INITIALIZER();
+
+HT_PROTOTYPE(short_policy_map, short_policy_t, node, short_policy_hash,
+             short_policy_eq)
+HT_GENERATE2(short_policy_map, short_policy_t, node, short_policy_hash,
+             short_policy_eq, 0.6, tor_reallocarray_, tor_free_)
+
+/** Helper for qsort: compare two short_policy_entry_t by their ports. */
+static int
+compare_short_policy_entries_(const void *a_, const void *b_)
+{
+  const short_policy_entry_t *a = a_, *b = b_;
+  if (a->min_port != b->min_port)
+    return a->min_port < b->min_port ? -1 : 1;
+  if (a->max_port != b->max_port)
+    return a->max_port < b->max_port ? -1 : 1;
+  return 0;
+}
+
+/** Set the run index of the newly parsed short policy <b>p</b>. */
+static void
+short_policy_build_runs(short_policy_t *p)
+{
+  short_policy_entry_t *runs;
+  int i, n = 0, sorted = 1;
+
+  for (i = 1; i < p->n_entries; ++i) {
+    if (p->entries[i].min_port <= (int)p->entries[i-1].max_port + 1) {
+      sorted = 0;
+      break;
+    }
+  }
+  if (sorted) {
+    /* The usual case: summaries come to us sorted and disjoint. */
+    p->runs = p->entries;
+    p->n_runs = p->n_entries;
+    return;
+  }
+
+  runs = tor_memdup(p->entries, sizeof(short_policy_entry_t)*p->n_entries);
+  qsort(runs, p->n_entries, sizeof(short_policy_entry_t),
+        compare_short_policy_entries_);
+  for (i = 1; i < p->n_entries; ++i) {
+    if (runs[i].min_port <= (int)runs[n].max_port + 1) {
+      if (runs[i].max_port > runs[n].max_port)
+        runs[n].max_port = runs[i].max_port;
+    } else {
+      runs[++n] = runs[i];
+    }
+  }
+  p->runs = runs;
+  p->n_runs = n + 1;
+}
+
+/** Given a newly parsed short policy <b>p</b>, return the interned copy
+ * of it, with a new reference.  Takes ownership of <b>p</b>. */
+static short_policy_t *
+short_policy_intern(short_policy_t *p)
+{
+  short_policy_t *found;
+  policies_lock();
+  found = HT_FIND(short_policy_map, &short_policy_root, p);
+  if (found) {
+    ++found->refcnt;
+    policies_unlock();
+    tor_free(p);
+    return found;
+  }
+  short_policy_build_runs(p);
+  p->refcnt = 1;
+  HT_INSERT(short_policy_map, &short_policy_root, p);
+  policies_unlock();
+  return p;
+}
+
+/** Return true iff one of the entries of <b>policy</b> covers
+ * <b>port</b>. */
+static INLINE int
+short_policy_covers_port(const short_policy_t *policy, uint16_t port)
+{
+  int lo = 0, hi = policy->n_runs - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi) / 2;
+    const short_policy_entry_t *e = &policy->runs[mid];
+    if (port < e->min_port)
+      hi = mid - 1;
+    else if (port > e->max_port)
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
- * if the string is not well-formed. */
+ * if the string is not well-formed.  The result is shared with everybody
+ * else who has parsed the same summary: it must not be modified, and must
+ * be released with short_policy_free(). */
 short_policy_t *
 parse_short_policy(const char *summary)
 {
@@ -1628,7 +2211,7 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
-  return result;
+  return short_policy_intern(result);
 }
 
 /** Write <b>policy</b> back out into a string. Used only for unit tests
@@ -1658,10 +2241,22 @@ write_short_policy(const short_policy_t *policy)
   return answer;
 }
 
-/** Release all storage held in <b>policy</b>. */
+/** Release a reference to <b>policy</b>, and free it if that was the last
+ * one. */
 void
 short_policy_free(short_policy_t *policy)
 {
+  if (!policy)
+    return;
+  policies_lock();
+  if (--policy->refcnt > 0) {
+    policies_unlock();
+    return;
+  }
+  HT_REMOVE(short_policy_map, &short_policy_root, policy);
+  policies_unlock();
+  if (policy->runs != policy->entries)
+    tor_free(policy->runs);
   tor_free(policy);
 }
 
@@ -1673,8 +2268,6 @@ addr_policy_result_t
 compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
                                  const short_policy_t *policy)
 {
-  int i;
-  int found_match = 0;
   int accept;
 
   tor_assert(port != 0);
@@ -1686,15 +2279,7 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
       (tor_addr_is_internal(addr, 0) || tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
-    }
-  }
-
-  if (found_match)
+  if (short_policy_covers_port(policy, port))
     accept = policy->is_accept;
   else
     accept = ! policy->is_accept;
@@ -1817,11 +2402,16 @@ addr_policy_list_free(smartlist_t *lst)
 void
 addr_policy_free(addr_policy_t *p)
 {
+  int is_canonical;
   if (!p)
     return;
 
+  /* Only canonical entries are shared, so only they need the lock. */
+  is_canonical = p->is_canonical;
+  if (is_canonical)
+    policies_lock();
   if (--p->refcnt <= 0) {
-    if (p->is_canonical) {
+    if (is_canonical) {
       policy_map_ent_t search, *found;
       search.policy = p;
       found = HT_REMOVE(policy_map, &policy_root, &search);
@@ -1832,12 +2422,15 @@ addr_policy_free(addr_policy_t *p)
     }
     tor_free(p);
   }
+  if (is_canonical)
+    policies_unlock();
 }
 
 /** Release all storage held by policy variables. */
 void
 policies_free_all(void)
 {
+  policies_free_compiled();
   addr_policy_list_free(reachable_or_addr_policy);
   reachable_or_addr_policy = NULL;
   addr_policy_list_free(reachable_dir_addr_policy);
@@ -1871,5 +2464,11 @@ policies_free_all(void)
     }
   }
   HT_CLEAR(policy_map, &policy_root);
+
+  if (!HT_EMPTY(&short_policy_root)) {
+    log_warn(LD_MM, "Still had %d short policies cached at shutdown.",
+             (int)HT_SIZE(&short_policy_root));
+  }
+  HT_CLEAR(short_policy_map, &short_policy_root);
 }
 
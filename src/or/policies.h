@@ -24,6 +24,9 @@
 
 typedef int exit_policy_parser_cfg_t;
 
+/** An address policy, preprocessed for fast lookups. */
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+
 int firewall_is_fascist_or(void);
 int fascist_firewall_allows_address_or(const tor_addr_t *addr, uint16_t port);
 int fascist_firewall_allows_or(const routerinfo_t *ri);
@@ -45,6 +48,12 @@ int cmp_addr_policies(smartlist_t *a, smartlist_t *b);
 MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
     (const tor_addr_t *addr, uint16_t port, const smartlist_t *policy));
 
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                                      const tor_addr_t *addr, uint16_t port,
+                                      const compiled_addr_policy_t *c);
+void compiled_addr_policy_free(compiled_addr_policy_t *c);
+
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
@@ -74,6 +83,7 @@ int policy_write_item(char *buf, size_t buflen, addr_policy_t *item,
 
 void addr_policy_list_free(smartlist_t *p);
 void addr_policy_free(addr_policy_t *p);
+void policies_init_threads(void);
 void policies_free_all(void);
 
 char *policy_summarize(smartlist_t *policy, sa_family_t family);
@@ -2988,7 +2988,7 @@ upload_service_descriptor(rend_service_t *service)
   /* Upload descriptor? */
   if (get_options()->PublishHidServDescriptors) {
     networkstatus_t *c = networkstatus_get_latest_consensus();
-    if (c && smartlist_len(c->routerstatus_list) > 0) {
+    if (c && networkstatus_n_routerstatuses(c) > 0) {
       int seconds_valid, i, j, num_descs;
       smartlist_t *descs = smartlist_new();
       smartlist_t *client_cookies = smartlist_new();
@@ -1583,6 +1583,9 @@ router_get_advertised_dir_port(const or_options_t *options, uint16_t dirport)
 
 /** My routerinfo. */
 static routerinfo_t *desc_routerinfo = NULL;
+/** Compiled form of desc_routerinfo-\>exit_policy, which we check for every
+ * exit stream; NULL if we have no descriptor or couldn't compile it. */
+static compiled_addr_policy_t *desc_compiled_exit_policy = NULL;
 /** My extrainfo */
 static extrainfo_t *desc_extrainfo = NULL;
 /** Why did we most recently decide to regenerate our descriptor?  Used to
@@ -1663,6 +1666,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * at desc_routerinfio->ipv6_exit_policy, since that's a port summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
+    if (desc_compiled_exit_policy)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                    desc_compiled_exit_policy) != ADDR_POLICY_ACCEPTED;
     return compare_tor_addr_to_addr_policy(addr, port,
                     desc_routerinfo->exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
@@ -2026,6 +2032,8 @@ router_rebuild_descriptor(int force)
 
   routerinfo_free(desc_routerinfo);
   desc_routerinfo = ri;
+  compiled_addr_policy_free(desc_compiled_exit_policy);
+  desc_compiled_exit_policy = addr_policy_compile(ri->exit_policy);
   extrainfo_free(desc_extrainfo);
   desc_extrainfo = ei;
 
@@ -3104,6 +3112,7 @@ router_free_all(void)
   crypto_pk_free(client_identitykey);
   tor_mutex_free(key_lock);
   routerinfo_free(desc_routerinfo);
+  compiled_addr_policy_free(desc_compiled_exit_policy);
   extrainfo_free(desc_extrainfo);
   crypto_pk_free(authority_signing_key);
   authority_cert_free(authority_key_certificate);
@@ -17,6 +17,7 @@
 #include "config.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -38,6 +39,7 @@
 #include "routerparse.h"
 #include "routerset.h"
 #include "sandbox.h"
+#include "workqueue.h"
 // #define DEBUG_ROUTERLIST
 
 /****************************************************************************/
@@ -1026,16 +1028,426 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
-#define RRS_FORCE 1
-#define RRS_DONT_REMOVE_OLD 2
+/** Return a new list of all the signed_descriptor_t objects in <b>rl</b>
+ * that belong in <b>store</b>. */
+static smartlist_t *
+routerlist_get_store_descriptors(routerlist_t *rl, desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(rl->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(rl->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(rl->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(rl->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+  return signed_descriptors;
+}
+
+/** A reference-counted handle on the mmap of a desc_store_t, for anybody
+ * who needs the bytes in it to stay put for longer than the store might
+ * keep it: the store drops its reference whenever it replaces or discards
+ * its mmap, and the last reference unmaps it. */
+struct store_mmap_ref_t {
+  /** The mapping itself. */
+  tor_mmap_t *mmap;
+  /** How many references there are to this handle. */
+  int refcnt;
+};
+
+/** Return a new reference to the current mmap of <b>store</b>, or NULL if
+ * it has none.  Release it with store_mmap_ref_release(). */
+static store_mmap_ref_t *
+store_get_mmap_ref(desc_store_t *store)
+{
+  if (!store->mmap)
+    return NULL;
+  if (!store->mmap_ref) {
+    store->mmap_ref = tor_malloc_zero(sizeof(store_mmap_ref_t));
+    store->mmap_ref->mmap = store->mmap;
+    store->mmap_ref->refcnt = 1; /* The store's own reference. */
+  }
+  tor_assert(store->mmap_ref->mmap == store->mmap);
+  ++store->mmap_ref->refcnt;
+  return store->mmap_ref;
+}
+
+/** Release the reference <b>ref</b> to a store's mmap, unmapping it if it
+ * was the last.  Return 0 on success, -1 if we couldn't unmap it. */
+static int
+store_mmap_ref_release_impl(store_mmap_ref_t *ref)
+{
+  int r;
+  if (!ref || --ref->refcnt > 0)
+    return 0;
+  r = tor_munmap_file(ref->mmap);
+  tor_free(ref);
+  return r;
+}
+
+/** Release the reference <b>ref</b> to a store's mmap, as returned by
+ * signed_descriptor_get_mmap_ref(), unmapping it if it was the last.  Takes
+ * a void pointer so that it can be used as the release function for
+ * connection_write_to_buf_external(). */
+void
+store_mmap_ref_release(void *ref)
+{
+  if (store_mmap_ref_release_impl(ref) != 0)
+    log_warn(LD_FS, "Unable to munmap an old descriptor store.");
+}
+
+/** Stop using the mmap of <b>store</b>, and set it to NULL.  If anybody
+ * else still has a reference to it, it stays mapped until they release it.
+ * Return 0 on success, -1 if we couldn't unmap it. */
+static int
+store_unmap(desc_store_t *store)
+{
+  int r = 0;
+  if (store->mmap_ref) {
+    tor_assert(store->mmap_ref->mmap == store->mmap);
+    r = store_mmap_ref_release_impl(store->mmap_ref);
+    store->mmap_ref = NULL;
+  } else if (store->mmap) {
+    r = tor_munmap_file(store->mmap);
+  }
+  store->mmap = NULL;
+  return r;
+}
+
+/** If the body of <b>desc</b> is in the mmap of one of our stores, return
+ * a new reference to that mmap, which keeps the body where
+ * signed_descriptor_get_body() says it is until the reference is released
+ * with store_mmap_ref_release().  Otherwise return NULL.
+ *
+ * On Windows, always return NULL: we can't replace a file while anything
+ * still maps it, so we can't let a slow connection hold on to the store
+ * while we rebuild it.  Callers have to copy the body instead. */
+store_mmap_ref_t *
+signed_descriptor_get_mmap_ref(const signed_descriptor_t *desc)
+{
+#ifdef _WIN32
+  (void)desc;
+  return NULL;
+#else
+  desc_store_t *store;
+  if (desc->saved_location != SAVED_IN_CACHE || !routerlist)
+    return NULL;
+  store = desc_get_store(routerlist, desc);
+  if (!store)
+    return NULL;
+  return store_get_mmap_ref(store);
+#endif
+}
+
+/** A job to write a new version of a desc_store_t in a cpuworker.
+ *
+ * In the main thread, we take a snapshot of the descriptors that belong in
+ * the store, decide where each will go in the new file, and mark them
+ * in_pending_store.  The cpuworker writes the new file to a temporary name.
+ * Back in the main thread, we rename it into place, map it, and point the
+ * descriptors that are still around at it.  Meanwhile, new descriptors keep
+ * going to the journal as usual; we keep the part of the journal that we
+ * didn't include in the new store. */
+typedef struct store_rebuild_job_t {
+  /** The store we're rebuilding, or NULL if we've given up on this job. */
+  desc_store_t *store;
+  /** A reference to the store's mmap when we started.  Some of the chunks
+   * point into it, so it must stay mapped until the job is done. */
+  struct store_mmap_ref_t *old_mmap;
+  /** Set in the cpuworker: true iff we wrote the new store. */
+  int succeeded;
+  /** The name of the store, and the temporary file we write it to. */
+  char *fname;
+  char *fname_tmp;
+  /** The sized_chunk_t contents of the new store, in order. */
+  smartlist_t *chunks;
+  /** Copies we made of descriptor bodies that weren't in old_mmap, since
+   * the main thread could free those at any time. */
+  smartlist_t *copies;
+  /** The length of the new store. */
+  size_t store_len;
+  /** The store's journal_len and bytes_dropped when we started. */
+  size_t journal_len;
+  size_t bytes_dropped;
+  /** True iff the store had any descriptors when we started. */
+  int had_any;
+  /** Our entry in the cpuworker queue. */
+  struct workqueue_entry_s *entry;
+} store_rebuild_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+store_rebuild_job_free(store_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  store_mmap_ref_release(job->old_mmap);
+  tor_free(job->fname);
+  tor_free(job->fname_tmp);
+  if (job->chunks) {
+    SMARTLIST_FOREACH(job->chunks, sized_chunk_t *, c, tor_free(c));
+    smartlist_free(job->chunks);
+  }
+  if (job->copies) {
+    SMARTLIST_FOREACH(job->copies, char *, cp, tor_free(cp));
+    smartlist_free(job->copies);
+  }
+  tor_free(job);
+}
+
+/** Clear the in_pending_store flag on every descriptor in <b>store</b>. */
+static void
+store_clear_pending_flags(routerlist_t *rl, desc_store_t *store)
+{
+  smartlist_t *sds = routerlist_get_store_descriptors(rl, store);
+  SMARTLIST_FOREACH(sds, signed_descriptor_t *, sd,
+                    sd->in_pending_store = 0);
+  smartlist_free(sds);
+}
+
+/** Cpuworker side of a store rebuild: write the new store to its temporary
+ * file. */
+static int
+store_rebuild_threadfn(void *state, void *arg)
+{
+  store_rebuild_job_t *job = arg;
+  (void)state;
+  job->succeeded = (write_chunks_to_file(job->fname_tmp, job->chunks,
+                                         1, 1) == 0);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread side of a store rebuild: the cpuworker has written the new
+ * store for <b>job</b>.  Move it into place, map it, and point every
+ * descriptor that's still in it at the new mapping.  Keep the part of the
+ * journal that was written after we took our snapshot. */
+static void
+store_rebuild_finish(store_rebuild_job_t *job)
+{
+  desc_store_t *store = job->store;
+  smartlist_t *sds = NULL;
+  char *jfname = NULL, *contents = NULL;
+  size_t new_journal_len;
+  struct stat st;
+
+  tor_assert(store->journal_len >= job->journal_len);
+  new_journal_len = store->journal_len - job->journal_len;
+
+  /* Our mmap is now invalid.  The cpuworker is done reading from it, so
+   * drop the job's reference too: on Windows, we can't replace the file
+   * while we still have it mapped. */
+  store_mmap_ref_release(job->old_mmap);
+  job->old_mmap = NULL;
+  if (store_unmap(store) != 0) {
+    log_warn(LD_FS, "Unable to munmap route store in %s", job->fname);
+  }
+
+  if (replace_file(job->fname_tmp, job->fname)<0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    /* Keep using the old one. */
+    store->mmap = tor_mmap_file(job->fname);
+    store_clear_pending_flags(routerlist, store);
+    return;
+  }
+
+  errno = 0;
+  store->mmap = tor_mmap_file(job->fname);
+  if (! store->mmap) {
+    if (errno == ERANGE) {
+      /* empty store.*/
+      if (job->store_len) {
+        log_warn(LD_FS, "We wrote some bytes to a new descriptor file at '%s',"
+                 " but when we went to mmap it, it was empty!", job->fname);
+      } else if (job->had_any) {
+        log_info(LD_FS, "We just removed every descriptor in '%s'.  This is "
+                 "okay if we're just starting up after a long time. "
+                 "Otherwise, it's a bug.", job->fname);
+      }
+    } else {
+      log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",
+               job->fname);
+    }
+  }
+
+  /* Replace the journal with whatever we appended to it since we took our
+   * snapshot. */
+  jfname = get_datadir_fname_suffix(store->fname_base, ".new");
+  if (new_journal_len) {
+    contents = read_file_to_str(jfname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+    if (!contents || (size_t)st.st_size != store->journal_len ||
+        write_bytes_to_file(jfname, contents + job->journal_len,
+                            new_journal_len, 1) < 0) {
+      log_warn(LD_FS, "Couldn't keep the end of the router journal in %s. "
+               "We'll save the descriptors in it next time we rebuild the "
+               "store.", jfname);
+      new_journal_len = 0;
+    }
+  }
+  if (!new_journal_len)
+    write_str_to_file(jfname, "", 1);
+
+  log_info(LD_DIR, "Reconstructing pointers into cache");
+
+  sds = routerlist_get_store_descriptors(routerlist, store);
+  SMARTLIST_FOREACH_BEGIN(sds, signed_descriptor_t *, sd) {
+    if (sd->in_pending_store) {
+      sd->in_pending_store = 0;
+      sd->saved_location = SAVED_IN_CACHE;
+      if (store->mmap) {
+        tor_free(sd->signed_descriptor_body); // sets it to null
+        sd->saved_offset = sd->pending_store_offset;
+      }
+      signed_descriptor_get_body(sd); /* reconstruct and assert */
+    } else if (sd->saved_location == SAVED_IN_JOURNAL) {
+      if (new_journal_len && sd->saved_offset >= (off_t)job->journal_len) {
+        sd->saved_offset -= job->journal_len;
+      } else {
+        /* It's no longer in the journal; we still have its body. */
+        sd->saved_location = SAVED_NOWHERE;
+      }
+    }
+  } SMARTLIST_FOREACH_END(sd);
+  smartlist_free(sds);
+
+  store->store_len = job->store_len;
+  store->journal_len = new_journal_len;
+  if (store->bytes_dropped > job->bytes_dropped)
+    store->bytes_dropped -= job->bytes_dropped;
+  else
+    store->bytes_dropped = 0;
+
+  tor_free(contents);
+  tor_free(jfname);
+}
+
+/** Main thread side of a store rebuild: the cpuworker is done with the
+ * store_rebuild_job_t in <b>arg</b>. */
+static void
+store_rebuild_replyfn(void *arg)
+{
+  store_rebuild_job_t *job = arg;
+  job->entry = NULL;
+  if (job->store) {
+    tor_assert(job->store->rebuild_job == job);
+    job->store->rebuild_job = NULL;
+    if (job->succeeded) {
+      store_rebuild_finish(job);
+    } else {
+      log_warn(LD_FS, "Error writing router store to disk.");
+      store_clear_pending_flags(routerlist, job->store);
+    }
+  }
+  store_rebuild_job_free(job);
+}
+
+/** If we're rebuilding <b>store</b> (which belongs to <b>rl</b>) in a
+ * cpuworker, give up on it.  If the job has already started, it keeps its
+ * reference to the store's old mmap, which it may still be reading from. */
+static void
+store_rebuild_abandon(routerlist_t *rl, desc_store_t *store)
+{
+  store_rebuild_job_t *job = store->rebuild_job;
+  if (!job)
+    return;
+  store->rebuild_job = NULL;
+  store_clear_pending_flags(rl, store);
+
+  if (workqueue_entry_cancel(job->entry)) {
+    store_rebuild_job_free(job);
+    return;
+  }
+  /* It's running; store_rebuild_replyfn() will free it. */
+  job->store = NULL;
+}
+
+/** Try to write a new version of <b>store</b> to <b>fname</b> in a
+ * cpuworker, holding the descriptors in <b>signed_descriptors</b>, in
+ * order.  On success, take ownership of <b>fname</b> and
+ * <b>fname_tmp</b>, and return 0.  Return -1 if we couldn't start the
+ * job, and should rebuild the store in the main thread instead. */
+static int
+store_rebuild_launch(desc_store_t *store, smartlist_t *signed_descriptors,
+                     char *fname, char *fname_tmp, int had_any)
+{
+  store_rebuild_job_t *job = tor_malloc_zero(sizeof(store_rebuild_job_t));
+  const char *map_start = store->mmap ? store->mmap->data : NULL;
+  const char *map_end = store->mmap ? map_start + store->mmap->size : NULL;
+  size_t offset = 0;
+
+  job->store = store;
+  job->old_mmap = store_get_mmap_ref(store);
+  job->chunks = smartlist_new();
+  job->copies = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    sized_chunk_t *c;
+    const char *body;
+    size_t len;
+    if (sd->do_not_cache)
+      continue;
+    body = signed_descriptor_get_body_impl(sd, 1);
+    len = sd->signed_descriptor_len + sd->annotations_len;
+    if (!body) {
+      log_warn(LD_BUG, "No descriptor available for router.");
+      goto err;
+    }
+    if (!map_start || body < map_start || body >= map_end) {
+      char *copy = tor_memdup(body, len);
+      smartlist_add(job->copies, copy);
+      body = copy;
+    }
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->bytes = body;
+    c->len = len;
+    smartlist_add(job->chunks, c);
+    sd->in_pending_store = 1;
+    sd->pending_store_offset = offset;
+    offset += len;
+  } SMARTLIST_FOREACH_END(sd);
+
+  job->store_len = offset;
+  job->journal_len = store->journal_len;
+  job->bytes_dropped = store->bytes_dropped;
+  job->had_any = had_any;
+  job->fname = fname;
+  job->fname_tmp = fname_tmp;
+
+  job->entry = cpuworker_queue_work(store_rebuild_threadfn,
+                                    store_rebuild_replyfn, job);
+  if (!job->entry) {
+    job->fname = job->fname_tmp = NULL;
+    goto err;
+  }
+  store->rebuild_job = job;
+  return 0;
+
+ err:
+  SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
+                    sd->in_pending_store = 0);
+  store_rebuild_job_free(job);
+  return -1;
+}
 
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
  * routers currently in our routerlist, and clear the journal.  Unless
  * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
  * rebuilding the store.  Return 0 on success, -1 on failure.
+ *
+ * If we have cpuworkers, write the new store in one of them, and finish
+ * replacing it when the cpuworker is done; until then, don't start another
+ * rebuild of the same store.
  */
-static int
+STATIC int
 router_rebuild_store(int flags, desc_store_t *store)
 {
   smartlist_t *chunk_list = NULL;
@@ -1048,6 +1460,11 @@ router_rebuild_store(int flags, desc_store_t *store)
   int had_any;
   int force = flags & RRS_FORCE;
 
+  if (store->rebuild_job) {
+    /* We're already rebuilding it. */
+    r = 0;
+    goto done;
+  }
   if (!force && !router_should_rebuild_store(store)) {
     r = 0;
     goto done;
@@ -1072,28 +1489,19 @@ router_rebuild_store(int flags, desc_store_t *store)
   fname = get_datadir_fname(store->fname_base);
   fname_tmp = get_datadir_fname_suffix(store->fname_base, ".tmp");
 
-  chunk_list = smartlist_new();
-
   /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
+  signed_descriptors = routerlist_get_store_descriptors(routerlist, store);
+  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
+
+  if (store_rebuild_launch(store, signed_descriptors, fname, fname_tmp,
+                           had_any) == 0) {
+    /* The job owns the filenames now. */
+    fname = fname_tmp = NULL;
+    r = 0;
+    goto done;
   }
 
-  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
+  chunk_list = smartlist_new();
 
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
@@ -1120,12 +1528,8 @@ router_rebuild_store(int flags, desc_store_t *store)
   }
 
   /* Our mmap is now invalid. */
-  if (store->mmap) {
-    int res = tor_munmap_file(store->mmap);
-    store->mmap = NULL;
-    if (res != 0) {
-      log_warn(LD_FS, "Unable to munmap route store in %s", fname);
-    }
+  if (store_unmap(store) != 0) {
+    log_warn(LD_FS, "Unable to munmap route store in %s", fname);
   }
 
   if (replace_file(fname_tmp, fname)<0) {
@@ -1195,19 +1599,17 @@ router_reload_router_list_impl(desc_store_t *store)
   char *fname = NULL, *contents = NULL;
   struct stat st;
   int extrainfo = (store->type == EXTRAINFO_STORE);
+  if (routerlist)
+    store_rebuild_abandon(routerlist, store);
   store->journal_len = store->store_len = 0;
 
   fname = get_datadir_fname(store->fname_base);
 
-  if (store->mmap) {
-    /* get rid of it first */
-    int res = tor_munmap_file(store->mmap);
-    store->mmap = NULL;
-    if (res != 0) {
-      log_warn(LD_FS, "Failed to munmap %s", fname);
-      tor_free(fname);
-      return -1;
-    }
+  /* get rid of it first */
+  if (store_unmap(store) != 0) {
+    log_warn(LD_FS, "Failed to munmap %s", fname);
+    tor_free(fname);
+    return -1;
   }
 
   store->mmap = tor_mmap_file(fname);
@@ -1746,6 +2148,7 @@ mark_all_dirservers_up(smartlist_t *server_list)
         control_event_networkstatus_changed_single(rs);
       }
     } SMARTLIST_FOREACH_END(dir);
+    nodelist_note_nodes_changed();
   }
   router_dir_info_changed();
 }
@@ -1767,14 +2170,15 @@ router_reset_status_download_failures(void)
   mark_all_dirservers_up(fallback_dir_servers);
 }
 
-/** Given a <b>router</b>, add every node_t in its family (including the
- * node itself!) to <b>sl</b>.
+/** Given a <b>router</b>, set the bit in <b>bits</b> for every node_t in
+ * its family (including the node itself!), as nodelist_mark_node_and_family
+ * does.
  *
- * Note the type mismatch: This function takes a routerinfo, but adds nodes
- * to the smartlist!
+ * Note the type mismatch: This function takes a routerinfo, but marks
+ * nodes!
  */
 static void
-routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
+routerlist_mark_node_and_family(bitarray_t *bits, const routerinfo_t *router)
 {
   /* XXXX MOVE ? */
   node_t fake_node;
@@ -1785,7 +2189,26 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
     memcpy(fake_node.identity, router->cache_info.identity_digest, DIGEST_LEN);
     node = &fake_node;
   }
-  nodelist_add_node_and_family(sl, node);
+  nodelist_mark_node_and_family(bits, node);
+}
+
+/** Return true iff <b>node</b> is suitable for
+ * router_add_running_nodes_to_smartlist() with the given requirements. */
+static INLINE int
+node_is_running_candidate(const node_t *node, int allow_invalid,
+                          int need_uptime, int need_capacity,
+                          int need_guard, int need_desc)
+{
+  if (!node->is_running ||
+      (!node->is_valid && !allow_invalid))
+    return 0;
+  if (need_desc && !(node->ri || (node->rs && node->md)))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  return 1;
 }
 
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
@@ -1796,19 +2219,22 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_uptime, int need_capacity,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running ||
-        (!node->is_valid && !allow_invalid))
-      continue;
-    if (need_desc && !(node->ri || (node->rs && node->md)))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
+  const node_select_table_t *table = nodelist_get_select_table();
+  /* These are the checks from node_is_running_candidate(). */
+  const uint16_t need = NST_RUNNING |
+    (allow_invalid ? 0 : NST_VALID) |
+    (need_uptime ? NST_STABLE : 0) |
+    (need_capacity ? NST_FAST : 0) |
+    (need_guard ? NST_GUARD : 0) |
+    (need_desc ? NST_HAS_DESC : 0);
+  const uint16_t mask = need | NST_NOT_GENERAL;
+  const uint16_t *flags = table->flags;
+  int i;
 
-    smartlist_add(sl, (void *)node);
-  } SMARTLIST_FOREACH_END(node);
+  for (i = 0; i < table->n_nodes; ++i) {
+    if ((flags[i] & mask) == need)
+      smartlist_add(sl, smartlist_get(table->nodes, i));
+  }
 }
 
 /** Look through the routerlist until we find a router that has my key.
@@ -1816,15 +2242,11 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
 const routerinfo_t *
 routerlist_find_my_routerinfo(void)
 {
-  if (!routerlist)
+  const char *my_id = (const char *)router_get_my_id_digest();
+  if (!routerlist || !router_digest_is_me(my_id))
     return NULL;
 
-  SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
-  {
-    if (router_is_me(router))
-      return router;
-  });
-  return NULL;
+  return rimap_get(routerlist->identity_map, my_id);
 }
 
 /** Return the smaller of the router's configured BandwidthRate
@@ -1917,11 +2339,11 @@ choose_array_element_by_weight(const u64_dbl_t *entries, int n_entries)
     return -1;
 
   if (total == 0)
-    return crypto_rand_int(n_entries);
+    return crypto_fast_rand_int(n_entries);
 
   tor_assert(total < INT64_MAX);
 
-  rand_val = crypto_rand_uint64(total);
+  rand_val = crypto_fast_rand_uint64(total);
 
   for (i = 0; i < n_entries; ++i) {
     total_so_far += entries[i].u64;
@@ -1941,6 +2363,56 @@ choose_array_element_by_weight(const u64_dbl_t *entries, int n_entries)
   return i_chosen;
 }
 
+/** Pick a random index into an <b>n_entries</b>-element array, choosing
+ * each index with a probability proportional to its weight, given the
+ * running totals of those weights in <b>cumulative</b>: that is,
+ * <b>cumulative</b>[i] must be the sum of the weights of elements 0 through
+ * i, and no more than INT64_MAX.  If all weights are 0, choose an index at
+ * random.  Return -1 on error.
+ *
+ * This takes O(log n_entries) time, and like
+ * choose_array_element_by_weight(), how long it takes does not depend on
+ * which element we choose.
+ */
+STATIC int
+choose_array_element_by_cumulative_weight(const uint64_t *cumulative,
+                                          int n_entries)
+{
+  uint64_t total, rand_val;
+  int pos = -1, step = 1;
+
+  if (n_entries < 1)
+    return -1;
+
+  total = cumulative[n_entries - 1];
+  if (total == 0)
+    return crypto_fast_rand_int(n_entries);
+
+  tor_assert(total < INT64_MAX);
+
+  rand_val = crypto_fast_rand_uint64(total);
+
+  /* Find the last position whose running total is no more than rand_val;
+   * the element after it is the one whose weight covers rand_val.  We take
+   * the same number of steps no matter where that position is, and we
+   * don't branch on the comparisons. */
+  while (step <= n_entries / 2)
+    step <<= 1;
+  for ( ; step > 0; step >>= 1) {
+    const int probe = pos + step;
+    const int in_range = probe < n_entries;
+    const uint64_t val = cumulative[in_range ? probe : n_entries - 1];
+    pos += step & -(in_range & !gt_i64_timei(val, rand_val));
+  }
+  ++pos;
+
+  tor_assert(pos >= 0);
+  tor_assert(pos < n_entries);
+  tor_assert(gt_i64_timei(cumulative[pos], rand_val));
+
+  return pos;
+}
+
 /** When weighting bridges, enforce these values as lower and upper
  * bound for believable bandwidth, because there is no way for us
  * to verify a bridge's bandwidth currently. */
@@ -2021,6 +2493,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   uint64_t weighted_bw = 0;
   guardfraction_bandwidth_t guardfraction_bw;
   u64_dbl_t *bandwidths;
+  const node_select_table_t *table;
 
   /* Can't choose exit and guard at same time */
   tor_assert(rule == NO_WEIGHTING ||
@@ -2103,6 +2576,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   Wdb /= weight_scale;
 
   bandwidths = tor_calloc(smartlist_len(sl), sizeof(u64_dbl_t));
+  table = nodelist_get_select_table();
 
   // Cycle through smartlist and total the bandwidth.
   static int warned_missing_bw = 0;
@@ -2111,11 +2585,28 @@ compute_weighted_bandwidths(const smartlist_t *sl,
     double weight = 1;
     double weight_without_guard_flag = 0; /* Used for guardfraction */
     double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
+    const int idx = node->nodelist_idx;
+    const int in_table = idx >= 0 && idx < table->n_nodes &&
+      smartlist_get(table->nodes, idx) == node;
+    uint16_t f;
+    /* Read nodes from the nodelist out of its select table; look at
+     * anything else (a bridge we made up, say) directly. */
+    if (in_table) {
+      f = table->flags[idx];
+    } else {
+      f = (node->is_exit ? NST_EXIT : 0) |
+        (node->is_bad_exit ? NST_BAD_EXIT : 0) |
+        (node->is_possible_guard ? NST_GUARD : 0) |
+        (node_is_dir(node) ? NST_DIR : 0) |
+        (node->rs ? NST_HAS_RS : 0) |
+        ((node->rs && node->rs->has_bandwidth) ? NST_HAS_BW : 0) |
+        ((node->rs && node->rs->has_guardfraction) ? NST_GUARDFRACTION : 0);
+    }
+    is_exit = (f & (NST_EXIT|NST_BAD_EXIT)) == NST_EXIT;
+    is_guard = (f & NST_GUARD) != 0;
+    is_dir = (f & NST_DIR) != 0;
+    if (f & NST_HAS_RS) {
+      if (!(f & NST_HAS_BW)) {
         /* This should never happen, unless all the authorites downgrade
          * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
         if (! warned_missing_bw) {
@@ -2125,6 +2616,8 @@ compute_weighted_bandwidths(const smartlist_t *sl,
           warned_missing_bw = 1;
         }
         this_bw = 30000; /* Chosen arbitrarily */
+      } else if (in_table) {
+        this_bw = kb_to_bytes(table->bandwidth_kb[idx]);
       } else {
         this_bw = kb_to_bytes(node->rs->bandwidth_kb);
       }
@@ -2167,7 +2660,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
      *    N for position p proportionally to Wpf*B or Wpn*B, clients should
      *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
      */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
+    if ((f & NST_GUARDFRACTION) && rule != WEIGHT_FOR_GUARD) {
       /* XXX The assert should actually check for is_guard. However,
        * that crashes dirauths because of #13297. This should be
        * equivalent: */
@@ -2250,6 +2743,228 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** The CRN_* flags that decide which nodes router_choose_random_node()
+ * considers, and how it weights them. */
+#define CRN_WEIGHT_TABLE_FLAGS                                          \
+  (CRN_NEED_UPTIME|CRN_NEED_CAPACITY|CRN_NEED_GUARD|CRN_ALLOW_INVALID|  \
+   CRN_WEIGHT_AS_EXIT|CRN_NEED_DESC)
+
+/** A list of the running nodes that pass some set of CRN_* filters, along
+ * with the running totals of their bandwidth weights, so that
+ * router_choose_random_node() doesn't need to find and weight every
+ * candidate each time it is called. */
+typedef struct crn_weight_table_t {
+  /** The CRN_* flags (masked with CRN_WEIGHT_TABLE_FLAGS) this table is
+   * for. */
+  router_crn_flags_t flags;
+  /** The value of nodelist_get_generation() when we built this table. */
+  uint64_t generation;
+  /** The consensus whose bandwidth weights we used. */
+  const networkstatus_t *consensus;
+  /** The candidate nodes. */
+  smartlist_t *nodes;
+  /** The i'th element is the sum of the scaled weights of nodes 0 through
+   * i.  NULL if there are no nodes. */
+  uint64_t *cumulative;
+} crn_weight_table_t;
+
+/** How many crn_weight_table_t do we keep at once?  Circuit building only
+ * uses a handful of different flag combinations. */
+#define N_CRN_WEIGHT_TABLES 8
+
+/** Our cached crn_weight_table_t objects.  Any of them may be NULL. */
+static crn_weight_table_t *crn_weight_tables[N_CRN_WEIGHT_TABLES];
+/** Which slot in crn_weight_tables should we replace next when we need a
+ * table for a new set of flags? */
+static int crn_weight_tables_next_slot = 0;
+
+/** Scratch space for router_choose_random_node(): a bitarray indexed by
+ * nodelist_idx, with a bit set for each node that we must not choose. */
+static bitarray_t *crn_excluded_bits = NULL;
+/** How many bits have we allocated in crn_excluded_bits? */
+static int crn_excluded_bits_len = 0;
+
+/** Make sure that crn_excluded_bits has room for <b>n_nodes</b> bits, and
+ * clear all of them. */
+static void
+crn_excluded_bits_reset(int n_nodes)
+{
+  if (!crn_excluded_bits || n_nodes > crn_excluded_bits_len) {
+    /* Leave some room to grow, so we don't reallocate on every new node. */
+    int n_bits = n_nodes + n_nodes / 4 + 32;
+    bitarray_free(crn_excluded_bits);
+    crn_excluded_bits = bitarray_init_zero(n_bits);
+    crn_excluded_bits_len = n_bits;
+  } else if (crn_excluded_bits) {
+    memset(crn_excluded_bits, 0,
+           ((crn_excluded_bits_len + BITARRAY_MASK) >> BITARRAY_SHIFT) *
+           sizeof(unsigned int));
+  }
+}
+
+/** Return true iff router_choose_random_node() must not choose
+ * <b>node</b>: because its bit is set in <b>excluded_bits</b>, because it
+ * is in <b>excludedset</b>, or because it allows single hop exits and
+ * <b>exclude_single_hop</b> is set. */
+static INLINE int
+crn_node_is_excluded(const node_t *node, bitarray_t *excluded_bits,
+                     const routerset_t *excludedset, int exclude_single_hop)
+{
+  if (bitarray_is_set(excluded_bits, node->nodelist_idx))
+    return 1;
+  if (exclude_single_hop && node_allows_single_hop_exits(node))
+    return 1;
+  if (excludedset && routerset_contains_node(excludedset, node))
+    return 1;
+  return 0;
+}
+
+/** How many times will router_choose_random_node() pick from a
+ * crn_weight_table_t and get an excluded node before it gives up and
+ * builds its list of candidates from scratch? */
+#define MAX_CRN_WEIGHT_TABLE_TRIES 16
+
+/** Release all storage held in <b>table</b>. */
+static void
+crn_weight_table_free(crn_weight_table_t *table)
+{
+  if (!table)
+    return;
+  smartlist_free(table->nodes);
+  tor_free(table->cumulative);
+  tor_free(table);
+}
+
+/** Release all of our cached crn_weight_table_t objects. */
+static void
+crn_weight_tables_free_all(void)
+{
+  int i;
+  for (i = 0; i < N_CRN_WEIGHT_TABLES; ++i) {
+    crn_weight_table_free(crn_weight_tables[i]);
+    crn_weight_tables[i] = NULL;
+  }
+  crn_weight_tables_next_slot = 0;
+}
+
+/** Build and return a new crn_weight_table_t for the running nodes that
+ * pass the filters in <b>flags</b>. */
+static crn_weight_table_t *
+crn_weight_table_new(router_crn_flags_t flags)
+{
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
+  const bandwidth_weight_rule_t rule = weight_for_exit ? WEIGHT_FOR_EXIT :
+    (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
+  crn_weight_table_t *table = tor_malloc_zero(sizeof(crn_weight_table_t));
+  u64_dbl_t *bandwidths = NULL;
+  int n;
+
+  table->flags = flags;
+  table->generation = nodelist_get_generation();
+  table->consensus = networkstatus_get_latest_consensus();
+  table->nodes = smartlist_new();
+  router_add_running_nodes_to_smartlist(table->nodes,
+                                        (flags & CRN_ALLOW_INVALID) != 0,
+                                        (flags & CRN_NEED_UPTIME) != 0,
+                                        (flags & CRN_NEED_CAPACITY) != 0,
+                                        need_guard,
+                                        (flags & CRN_NEED_DESC) != 0);
+  n = smartlist_len(table->nodes);
+
+  if (n && compute_weighted_bandwidths(table->nodes, rule, &bandwidths) == 0) {
+    uint64_t total = 0;
+    int i;
+    scale_array_elements_to_u64(bandwidths, n, NULL);
+    table->cumulative = tor_calloc(n, sizeof(uint64_t));
+    for (i = 0; i < n; ++i) {
+      total += bandwidths[i].u64;
+      table->cumulative[i] = total;
+    }
+    tor_free(bandwidths);
+  } else {
+    smartlist_clear(table->nodes);
+  }
+
+  return table;
+}
+
+/** Return a crn_weight_table_t for <b>flags</b> that reflects the current
+ * nodelist and consensus, building it if we don't have one already. */
+static const crn_weight_table_t *
+crn_weight_table_get(router_crn_flags_t flags)
+{
+  const uint64_t generation = nodelist_get_generation();
+  const networkstatus_t *consensus = networkstatus_get_latest_consensus();
+  int i, slot = -1;
+
+  flags &= CRN_WEIGHT_TABLE_FLAGS;
+
+  for (i = 0; i < N_CRN_WEIGHT_TABLES; ++i) {
+    crn_weight_table_t *table = crn_weight_tables[i];
+    if (table && table->flags == flags) {
+      if (table->generation == generation && table->consensus == consensus)
+        return table;
+      slot = i;
+      break;
+    }
+  }
+
+  if (slot < 0) {
+    slot = crn_weight_tables_next_slot;
+    crn_weight_tables_next_slot = (slot + 1) % N_CRN_WEIGHT_TABLES;
+  }
+  crn_weight_table_free(crn_weight_tables[slot]);
+  crn_weight_tables[slot] = crn_weight_table_new(flags);
+  return crn_weight_tables[slot];
+}
+
+/** Helper for router_choose_random_node(): choose a node from the cached
+ * weight table for <b>flags</b>, skipping any node that
+ * crn_node_is_excluded() rejects.  Since we choose among all candidates by
+ * weight and then reject excluded choices, each acceptable node is chosen
+ * with the same probability as if we had removed the excluded ones
+ * first.
+ *
+ * Return NULL if we didn't find an acceptable node after a few tries; the
+ * caller should then build its list of candidates from scratch.
+ */
+static const node_t *
+router_choose_random_node_from_table(bitarray_t *excluded_bits,
+                                     const routerset_t *excludedset,
+                                     int exclude_single_hop,
+                                     router_crn_flags_t flags)
+{
+  const crn_weight_table_t *table = crn_weight_table_get(flags);
+  const int n = smartlist_len(table->nodes);
+  int attempt;
+
+  if (n == 0)
+    return NULL;
+
+  for (attempt = 0; attempt < MAX_CRN_WEIGHT_TABLE_TRIES; ++attempt) {
+    int idx = choose_array_element_by_cumulative_weight(table->cumulative, n);
+    const node_t *node = smartlist_get(table->nodes, idx);
+
+    /* Make sure nobody changed the node's flags behind our back. */
+    if (!node_is_running_candidate(node,
+                                   (flags & CRN_ALLOW_INVALID) != 0,
+                                   (flags & CRN_NEED_UPTIME) != 0,
+                                   (flags & CRN_NEED_CAPACITY) != 0,
+                                   (flags & CRN_NEED_GUARD) != 0,
+                                   (flags & CRN_NEED_DESC) != 0))
+      continue;
+    if (crn_node_is_excluded(node, excluded_bits, excludedset,
+                             exclude_single_hop))
+      continue;
+    return node;
+  }
+
+  log_debug(LD_CIRC, "Couldn't find an acceptable node in our cached "
+            "weight table; building the list of candidates from scratch.");
+  return NULL;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -2280,8 +2995,10 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
   const int need_desc = (flags & CRN_NEED_DESC) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  /* Exclude relays that allow single hop exit circuits, if the user
+   * wants to (such relays might be risky) */
+  const int exclude_single_hop = get_options()->ExcludeSingleHopRelays;
+  const smartlist_t *all_nodes = nodelist_get_list();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -2290,49 +3007,45 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
-  /* Exclude relays that allow single hop exit circuits, if the user
-   * wants to (such relays might be risky) */
-  if (get_options()->ExcludeSingleHopRelays) {
-    SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
-      if (node_allows_single_hop_exits(node)) {
-        smartlist_add(excludednodes, node);
-      });
-  }
+  crn_excluded_bits_reset(smartlist_len(all_nodes));
 
   if ((r = routerlist_find_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
-  router_add_running_nodes_to_smartlist(sl, allow_invalid,
-                                        need_uptime, need_capacity,
-                                        need_guard, need_desc);
-  log_debug(LD_CIRC,
-           "We found %d running nodes.",
-            smartlist_len(sl));
-
-  smartlist_subtract(sl,excludednodes);
-  log_debug(LD_CIRC,
-            "We removed %d excludednodes, leaving %d nodes.",
-            smartlist_len(excludednodes),
-            smartlist_len(sl));
+    routerlist_mark_node_and_family(crn_excluded_bits, r);
 
   if (excludedsmartlist) {
-    smartlist_subtract(sl,excludedsmartlist);
-    log_debug(LD_CIRC,
-              "We removed %d excludedsmartlist, leaving %d nodes.",
-              smartlist_len(excludedsmartlist),
-              smartlist_len(sl));
+    SMARTLIST_FOREACH_BEGIN(excludedsmartlist, const node_t *, node) {
+      const int idx = node->nodelist_idx;
+      if (idx >= 0 && idx < smartlist_len(all_nodes) &&
+          smartlist_get(all_nodes, idx) == node)
+        bitarray_set(crn_excluded_bits, idx);
+    } SMARTLIST_FOREACH_END(node);
   }
-  if (excludedset) {
-    routerset_subtract_nodes(sl,excludedset);
+
+  /* Usually, we can choose from our cached table of candidates. */
+  choice = router_choose_random_node_from_table(crn_excluded_bits,
+                                                excludedset,
+                                                exclude_single_hop, flags);
+
+  if (!choice) {
+    smartlist_t *sl = smartlist_new();
+
+    SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node) {
+      if (node_is_running_candidate(node, allow_invalid, need_uptime,
+                                    need_capacity, need_guard, need_desc) &&
+          !crn_node_is_excluded(node, crn_excluded_bits, excludedset,
+                                exclude_single_hop))
+        smartlist_add(sl, (void *)node);
+    } SMARTLIST_FOREACH_END(node);
     log_debug(LD_CIRC,
-              "We removed excludedset, leaving %d nodes.",
+              "We found %d running nodes that we didn't exclude.",
               smartlist_len(sl));
-  }
 
-  // Always weight by bandwidth
-  choice = node_sl_choose_by_bandwidth(sl, rule);
+    // Always weight by bandwidth
+    choice = node_sl_choose_by_bandwidth(sl, rule);
+
+    smartlist_free(sl);
+  }
 
-  smartlist_free(sl);
   if (!choice && (need_uptime || need_capacity || need_guard)) {
     /* try once more -- recurse but with fewer restrictions. */
     log_info(LD_CIRC,
@@ -2345,7 +3058,6 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
     choice = router_choose_random_node(
                      excludedsmartlist, excludedset, flags);
   }
-  smartlist_free(excludednodes);
   if (!choice) {
     log_warn(LD_CIRC,
              "No available nodes when trying to choose node. Failing.");
@@ -2727,6 +3439,8 @@ routerlist_free(routerlist_t *rl)
 {
   if (!rl)
     return;
+  store_rebuild_abandon(rl, &rl->desc_store);
+  store_rebuild_abandon(rl, &rl->extrainfo_store);
   rimap_free(rl->identity_map, NULL);
   sdmap_free(rl->desc_digest_map, NULL);
   sdmap_free(rl->desc_by_eid_map, NULL);
@@ -2737,17 +3451,11 @@ routerlist_free(routerlist_t *rl)
                     signed_descriptor_free(sd));
   smartlist_free(rl->routers);
   smartlist_free(rl->old_routers);
-  if (rl->desc_store.mmap) {
-    int res = tor_munmap_file(routerlist->desc_store.mmap);
-    if (res != 0) {
-      log_warn(LD_FS, "Failed to munmap routerlist->desc_store.mmap");
-    }
+  if (store_unmap(&rl->desc_store) != 0) {
+    log_warn(LD_FS, "Failed to munmap routerlist->desc_store.mmap");
   }
-  if (rl->extrainfo_store.mmap) {
-    int res = tor_munmap_file(routerlist->extrainfo_store.mmap);
-    if (res != 0) {
-      log_warn(LD_FS, "Failed to munmap routerlist->extrainfo_store.mmap");
-    }
+  if (store_unmap(&rl->extrainfo_store) != 0) {
+    log_warn(LD_FS, "Failed to munmap routerlist->extrainfo_store.mmap");
   }
   tor_free(rl);
 
@@ -3210,6 +3918,10 @@ routerlist_free_all(void)
 {
   routerlist_free(routerlist);
   routerlist = NULL;
+  crn_weight_tables_free_all();
+  bitarray_free(crn_excluded_bits);
+  crn_excluded_bits = NULL;
+  crn_excluded_bits_len = 0;
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -3587,7 +4299,7 @@ routerlist_remove_old_routers(void)
   routerinfo_t *router;
   signed_descriptor_t *sd;
   digestset_t *retain;
-  const networkstatus_t *consensus = networkstatus_get_latest_consensus();
+  networkstatus_t *consensus = networkstatus_get_latest_consensus();
 
   trusted_dirs_remove_old_certs();
 
@@ -3602,16 +4314,20 @@ routerlist_remove_old_routers(void)
   */
   {
     /* We'll probably retain everything in the consensus. */
-    int n_max_retain = smartlist_len(consensus->routerstatus_list);
+    int n_max_retain = networkstatus_n_routerstatuses(consensus);
     retain = digestset_new(n_max_retain);
   }
 
   cutoff = now - OLD_ROUTER_DESC_MAX_AGE;
   /* Retain anything listed in the consensus. */
   if (consensus) {
-    SMARTLIST_FOREACH(consensus->routerstatus_list, routerstatus_t *, rs,
-        if (rs->published_on >= cutoff)
-          digestset_add(retain, rs->descriptor_digest));
+    int n = networkstatus_n_routerstatuses(consensus);
+    for (i = 0; i < n; ++i) {
+      const routerstatus_t *rs =
+        networkstatus_get_routerstatus_by_idx(consensus, i);
+      if (rs && rs->published_on >= cutoff)
+        digestset_add(retain, rs->descriptor_digest);
+    }
   }
 
   /* If we have a consensus, we should consider pruning current routers that
@@ -4532,7 +5248,8 @@ update_consensus_router_descriptor_downloads(time_t now, int is_vote,
 
   map = digestmap_new();
   list_pending_descriptor_downloads(map, 0);
-  SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list, void *, rsp) {
+  SMARTLIST_FOREACH_BEGIN(networkstatus_get_routerstatus_list(consensus),
+                          void *, rsp) {
       routerstatus_t *rs =
         is_vote ? &(((vote_routerstatus_t *)rsp)->status) : rsp;
       signed_descriptor_t *sd;
@@ -5118,25 +5835,25 @@ int
 hid_serv_get_responsible_directories(smartlist_t *responsible_dirs,
                                      const char *id)
 {
-  int start, found, n_added = 0, i;
+  int start, found, n_added = 0, i, n;
   networkstatus_t *c = networkstatus_get_latest_consensus();
-  if (!c || !smartlist_len(c->routerstatus_list)) {
+  if (!c || !(n = networkstatus_n_routerstatuses(c))) {
     log_warn(LD_REND, "We don't have a consensus, so we can't perform v2 "
              "rendezvous operations.");
     return -1;
   }
   tor_assert(id);
   start = networkstatus_vote_find_entry_idx(c, id, &found);
-  if (start == smartlist_len(c->routerstatus_list)) start = 0;
+  if (start == n) start = 0;
   i = start;
   do {
-    routerstatus_t *r = smartlist_get(c->routerstatus_list, i);
-    if (r->is_hs_dir) {
+    routerstatus_t *r = networkstatus_get_routerstatus_by_idx(c, i);
+    if (r && r->is_hs_dir) {
       smartlist_add(responsible_dirs, r);
       if (++n_added == REND_NUMBER_OF_CONSECUTIVE_REPLICAS)
         return 0;
     }
-    if (++i == smartlist_len(c->routerstatus_list))
+    if (++i == n)
       i = 0;
   } while (i != start);
 
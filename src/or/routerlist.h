@@ -90,6 +90,10 @@ MOCK_DECL(signed_descriptor_t *,router_get_by_extrainfo_digest,
           (const char *digest));
 signed_descriptor_t *extrainfo_get_by_descriptor_digest(const char *digest);
 const char *signed_descriptor_get_body(const signed_descriptor_t *desc);
+typedef struct store_mmap_ref_t store_mmap_ref_t;
+store_mmap_ref_t *signed_descriptor_get_mmap_ref(
+                                         const signed_descriptor_t *desc);
+void store_mmap_ref_release(void *ref);
 const char *signed_descriptor_get_annotations(const signed_descriptor_t *desc);
 routerlist_t *router_get_routerlist(void);
 void routerinfo_free(routerinfo_t *router);
@@ -215,6 +219,14 @@ int hex_digest_nickname_matches(const char *hexdigest,
                                 const char *nickname, int is_named);
 
 #ifdef ROUTERLIST_PRIVATE
+/** Flag for router_rebuild_store: rebuild the store even if its journal is
+ * small. */
+#define RRS_FORCE 1
+/** Flag for router_rebuild_store: don't remove expired routers first. */
+#define RRS_DONT_REMOVE_OLD 2
+
+STATIC int router_rebuild_store(int flags, desc_store_t *store);
+
 /** Helper type for choosing routers by bandwidth: contains a union of
  * double and uint64_t. Before we call scale_array_elements_to_u64, it holds
  * a double; after, it holds a uint64_t. */
@@ -225,6 +237,9 @@ typedef union u64_dbl_t {
 
 STATIC int choose_array_element_by_weight(const u64_dbl_t *entries,
                                           int n_entries);
+STATIC int choose_array_element_by_cumulative_weight(
+                                          const uint64_t *cumulative,
+                                          int n_entries);
 STATIC void scale_array_elements_to_u64(u64_dbl_t *entries, int n_entries,
                                         uint64_t *total_out);
 
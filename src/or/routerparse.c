@@ -14,6 +14,7 @@
 #include "or.h"
 #include "config.h"
 #include "circuitstats.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "policies.h"
@@ -24,6 +25,7 @@
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "rephist.h"
+#include "sigcache.h"
 #include "routerparse.h"
 #include "entrynodes.h"
 #undef log
@@ -501,6 +503,24 @@ static token_rule_t microdesc_token_table[] = {
 #undef T
 
 /* static function prototypes */
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                             int cache_copy,
+                                             int allow_annotations,
+                                             const char *prepend_annotations,
+                                             int *can_dl_again_out,
+                                             memarea_t *reuse_area);
+static void router_parse_list_range(const char **s, const char *eos,
+                                    const char *start, smartlist_t *dest,
+                                    saved_location_t saved_location,
+                                    int want_extrainfo,
+                                    int allow_annotations,
+                                    const char *prepend_annotations,
+                                    smartlist_t *invalid_digests_out);
+static smartlist_t *microdescs_parse_range(const char *s, const char *eos,
+                                           const char *start,
+                                           int allow_annotations,
+                                           saved_location_t where,
+                                           smartlist_t *invalid_digests_out);
 static int router_add_exit_policy(routerinfo_t *router,directory_token_t *tok);
 static addr_policy_t *router_parse_addr_policy(directory_token_t *tok,
                                                unsigned fmt_flags);
@@ -532,10 +552,14 @@ static int tokenize_string(memarea_t *area,
                            smartlist_t *out,
                            token_rule_t *table,
                            int flags);
+struct token_table_index_t;
+static const struct token_table_index_t *token_table_get_index(
+                                                const token_rule_t *table);
 static directory_token_t *get_next_token(memarea_t *area,
                                          const char **s,
                                          const char *eos,
-                                         token_rule_t *table);
+                                         token_rule_t *table,
+                                      const struct token_table_index_t *index);
 #define CST_CHECK_AUTHORITY   (1<<0)
 #define CST_NO_CHECK_OBJTYPE  (1<<1)
 static int check_signature_token(const char *digest,
@@ -561,6 +585,29 @@ static int check_signature_token(const char *digest,
 /** Last time we dumped a descriptor to disk. */
 static time_t last_desc_dumped = 0;
 
+/** If set, protects the global state that we touch while parsing router
+ * descriptors and microdescriptors, so that we can parse them in more than
+ * one thread at once.  That's last_desc_dumped and the public key
+ * operation counters.  (policies.c locks its own tables of interned
+ * policies.) */
+static tor_mutex_t *routerparse_mutex = NULL;
+
+/** Acquire routerparse_mutex, if we have one. */
+static INLINE void
+routerparse_lock(void)
+{
+  if (routerparse_mutex)
+    tor_mutex_acquire(routerparse_mutex);
+}
+
+/** Release routerparse_mutex, if we have one. */
+static INLINE void
+routerparse_unlock(void)
+{
+  if (routerparse_mutex)
+    tor_mutex_release(routerparse_mutex);
+}
+
 /** For debugging purposes, dump unparseable descriptor *<b>desc</b> of
  * type *<b>type</b> to file $DATADIR/unparseable-desc. Do not write more
  * than one descriptor to disk per minute. If there is already such a
@@ -571,6 +618,7 @@ dump_desc(const char *desc, const char *type)
   time_t now = time(NULL);
   tor_assert(desc);
   tor_assert(type);
+  routerparse_lock();
   if (!last_desc_dumped || last_desc_dumped + 60 < now) {
     char *debugfile = get_datadir_fname("unparseable-desc");
     size_t filelen = 50 + strlen(type) + strlen(desc);
@@ -584,6 +632,7 @@ dump_desc(const char *desc, const char *type)
     tor_free(debugfile);
     last_desc_dumped = now;
   }
+  routerparse_unlock();
 }
 
 /** Set <b>digest</b> to the SHA-1 digest of the hash of the directory in
@@ -825,8 +874,6 @@ check_signature_token(const char *digest,
                       int flags,
                       const char *doctype)
 {
-  char *signed_digest;
-  size_t keysize;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
@@ -848,24 +895,18 @@ check_signature_token(const char *digest,
     }
   }
 
-  keysize = crypto_pk_keysize(pkey);
-  signed_digest = tor_malloc(keysize);
-  if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
-                                tok->object_body, tok->object_size)
-      < digest_len) {
-    log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
-    tor_free(signed_digest);
-    return -1;
-  }
-//  log_debug(LD_DIR,"Signed %s hash starts %s", doctype,
-//            hex_str(signed_digest,4));
-  if (tor_memneq(digest, signed_digest, digest_len)) {
-    log_warn(LD_DIR, "Error reading %s: signature does not match.", doctype);
-    tor_free(signed_digest);
-    return -1;
+  switch (sigcache_checksig_digest(pkey, digest, digest_len,
+                                   tok->object_body, tok->object_size)) {
+    case 0:
+      return 0;
+    case -2:
+      log_warn(LD_DIR, "Error reading %s: signature does not match.",
+               doctype);
+      return -1;
+    default:
+      log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
+      return -1;
   }
-  tor_free(signed_digest);
-  return 0;
 }
 
 /** Helper: move *<b>s_ptr</b> ahead to the next router, the next extra-info,
@@ -906,6 +947,176 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** Helper: <b>s</b> points to the start of a line in a batch of documents
+ * that begins at <b>start</b>.  If the lines just before <b>s</b> are
+ * annotations, return the first of them; otherwise return <b>s</b>. */
+static const char *
+back_up_over_annotations(const char *start, const char *s)
+{
+  while (s > start) {
+    /* Find the start of the previous line. */
+    const char *line = s - 1;
+    while (line > start && line[-1] != '\n')
+      --line;
+    if (*line != '@')
+      break;
+    s = line;
+  }
+  return s;
+}
+
+/** Helper for splitting a batch of router descriptors: return the start of
+ * the first router or extra-info document (or of the annotations before it)
+ * at or after the start of the line <b>s</b>, or NULL if there is none
+ * before <b>eos</b>. */
+static const char *
+find_start_of_router_from_line(const char *s, const char *eos)
+{
+  int is_extrainfo;
+  if (find_start_of_next_router_or_extrainfo(&s, eos, &is_extrainfo) < 0)
+    return NULL;
+  return s;
+}
+
+/** Don't bother splitting a batch of router descriptors or microdescriptors
+ * between threads unless it's at least this many bytes long. */
+STATIC size_t dirparse_parallel_min_len = 256*1024;
+/** When we do split a batch, make each range about this many bytes long. */
+STATIC size_t dirparse_parallel_range_len = 64*1024;
+
+/** One range of a batch of router descriptors or microdescriptors that
+ * we're parsing in parallel. */
+typedef struct dirparse_range_t {
+  /** The part of the batch that we parse for this range. */
+  const char *s;
+  const char *eos;
+  /** For router descriptors: where we stopped parsing. */
+  const char *next;
+  /** The routerinfo_t or microdesc_t objects that we parsed from this
+   * range, in order. */
+  smartlist_t *parsed;
+  /** Digests of the documents in this range that we couldn't parse, or NULL
+   * if our caller doesn't want them. */
+  smartlist_t *invalid_digests;
+} dirparse_range_t;
+
+/** A batch of router descriptors or microdescriptors that we're splitting
+ * into independent ranges, and parsing on the cpuworkers and the main thread
+ * at once.  Only the parsing happens in parallel: our caller adds the
+ * results to the routerlist or microdescriptor cache in the main thread, as
+ * before. */
+typedef struct dirparse_batch_t {
+  /** The start of the whole batch: we compute offsets from here. */
+  const char *start;
+  /** True if the batch holds microdescriptors; false if it holds router
+   * descriptors. */
+  int is_microdescs;
+  /** Arguments for router_parse_list_from_string() or
+   * microdescs_parse_from_string(). */
+  saved_location_t where;
+  int allow_annotations;
+  const char *prepend_annotations;
+  /** The ranges we've split the batch into. */
+  int n_ranges;
+  dirparse_range_t *ranges;
+} dirparse_batch_t;
+
+/** Split the documents from <b>batch</b>-&gt;start up to <b>eos</b> into
+ * ranges of about dirparse_parallel_range_len bytes.  Use
+ * <b>find_next</b> to find the start of the next document after the start
+ * of a line, so that every range begins at the start of a document
+ * (including any annotations before it).  If <b>want_digests</b>, allocate
+ * a list for each range's invalid digests. */
+static void
+dirparse_batch_split(dirparse_batch_t *batch, const char *eos,
+                     const char *(*find_next)(const char *, const char *),
+                     int want_digests)
+{
+  smartlist_t *starts = smartlist_new();
+  const char *cp = batch->start;
+  int i;
+
+  smartlist_add(starts, (char*)cp);
+  while ((size_t)(eos - cp) > dirparse_parallel_range_len) {
+    const char *next = cp + dirparse_parallel_range_len;
+    if (!(next = memchr(next, '\n', eos - next)))
+      break;
+    if (!(next = find_next(next + 1, eos)))
+      break;
+    next = back_up_over_annotations(batch->start, next);
+    if (next <= cp)
+      break;
+    smartlist_add(starts, (char*)next);
+    cp = next;
+  }
+
+  batch->n_ranges = smartlist_len(starts);
+  batch->ranges = tor_calloc(batch->n_ranges, sizeof(dirparse_range_t));
+  for (i = 0; i < batch->n_ranges; ++i) {
+    dirparse_range_t *range = &batch->ranges[i];
+    range->s = smartlist_get(starts, i);
+    range->eos = (i+1 < batch->n_ranges) ? smartlist_get(starts, i+1) : eos;
+    if (want_digests)
+      range->invalid_digests = smartlist_new();
+  }
+  smartlist_free(starts);
+}
+
+/** Parse the <b>idx</b>th range of the dirparse_batch_t in <b>arg</b>.  This
+ * runs in a cpuworker or in the main thread, via cpuworker_run_parallel(),
+ * so it must only touch global state that the parsing code protects. */
+static void
+dirparse_batch_parse_range(void *arg, int idx)
+{
+  dirparse_batch_t *batch = arg;
+  dirparse_range_t *range = &batch->ranges[idx];
+
+  if (batch->is_microdescs) {
+    range->parsed = microdescs_parse_range(range->s, range->eos,
+                                           batch->start,
+                                           batch->allow_annotations,
+                                           batch->where,
+                                           range->invalid_digests);
+  } else {
+    range->parsed = smartlist_new();
+    range->next = range->s;
+    router_parse_list_range(&range->next, range->eos, batch->start,
+                            range->parsed, batch->where, 0,
+                            batch->allow_annotations,
+                            batch->prepend_annotations,
+                            range->invalid_digests);
+  }
+}
+
+/** Parse every range in <b>batch</b> in parallel, and append the results to
+ * <b>dest</b> and the digests of any unparseable documents to
+ * <b>invalid_digests_out</b> (if provided), in the order they appeared in
+ * the batch.  Return the point where we stopped parsing the last range.
+ * Release all storage held by the ranges in <b>batch</b>. */
+static const char *
+dirparse_batch_run(dirparse_batch_t *batch, smartlist_t *dest,
+                   smartlist_t *invalid_digests_out)
+{
+  const char *next = NULL;
+  int i;
+
+  cpuworker_run_parallel(batch->n_ranges, dirparse_batch_parse_range, batch);
+
+  for (i = 0; i < batch->n_ranges; ++i) {
+    dirparse_range_t *range = &batch->ranges[i];
+    smartlist_add_all(dest, range->parsed);
+    smartlist_free(range->parsed);
+    if (range->invalid_digests) {
+      smartlist_add_all(invalid_digests_out, range->invalid_digests);
+      smartlist_free(range->invalid_digests);
+    }
+    next = range->next;
+  }
+  tor_free(batch->ranges);
+  batch->n_ranges = 0;
+  return next;
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
  * them and stores the result in <b>dest</b>.  All routers are marked running
@@ -916,6 +1127,9 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
  * isn't SAVED_NOWHERE, remember the offset of each descriptor.
  *
+ * If there are a lot of router descriptors, split them into ranges and parse
+ * those on the cpuworkers and in the main thread at once.
+ *
  * Returns 0 on success and -1 on failure.  Adds a digest to
  * <b>invalid_digests_out</b> for every entry that was unparseable or
  * invalid. (This may cause duplicate entries.)
@@ -929,23 +1143,55 @@ router_parse_list_from_string(const char **s, const char *eos,
                               const char *prepend_annotations,
                               smartlist_t *invalid_digests_out)
 {
-  routerinfo_t *router;
-  extrainfo_t *extrainfo;
-  signed_descriptor_t *signed_desc = NULL;
-  void *elt;
-  const char *end, *start;
-  int have_extrainfo;
-
   tor_assert(s);
   tor_assert(*s);
   tor_assert(dest);
 
-  start = *s;
   if (!eos)
     eos = *s + strlen(*s);
 
   tor_assert(eos >= *s);
 
+  if (!want_extrainfo && (size_t)(eos - *s) >= dirparse_parallel_min_len) {
+    dirparse_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.start = *s;
+    batch.where = saved_location;
+    batch.allow_annotations = allow_annotations;
+    batch.prepend_annotations = prepend_annotations;
+    dirparse_batch_split(&batch, eos, find_start_of_router_from_line,
+                         invalid_digests_out != NULL);
+    *s = dirparse_batch_run(&batch, dest, invalid_digests_out);
+    return 0;
+  }
+
+  router_parse_list_range(s, eos, *s, dest, saved_location, want_extrainfo,
+                          allow_annotations, prepend_annotations,
+                          invalid_digests_out);
+  return 0;
+}
+
+/** Helper for router_parse_list_from_string(): parse the router descriptors
+ * or extra-info documents from *<b>s</b> up to <b>eos</b>, computing saved
+ * offsets from <b>start</b>.  Advance *<b>s</b> past the last one.  Only
+ * touches global state that is safe to use from a cpuworker. */
+static void
+router_parse_list_range(const char **s, const char *eos,
+                        const char *start, smartlist_t *dest,
+                        saved_location_t saved_location,
+                        int want_extrainfo,
+                        int allow_annotations,
+                        const char *prepend_annotations,
+                        smartlist_t *invalid_digests_out)
+{
+  routerinfo_t *router;
+  extrainfo_t *extrainfo;
+  signed_descriptor_t *signed_desc = NULL;
+  void *elt;
+  const char *end;
+  int have_extrainfo;
+  memarea_t *area = NULL;
+
   while (1) {
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
@@ -976,13 +1222,17 @@ router_parse_list_from_string(const char **s, const char *eos,
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      if (!area)
+        area = memarea_new();
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       area);
       if (router) {
+        char desc[NODE_DESC_BUF_LEN];
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
-                  router_describe(router),
+                  router_get_description(desc, router),
                   router_purpose_to_string(router->purpose));
         signed_desc = &router->cache_info;
         elt = router;
@@ -1004,7 +1254,8 @@ router_parse_list_from_string(const char **s, const char *eos,
     smartlist_add(dest, elt);
   }
 
-  return 0;
+  if (area)
+    memarea_drop_all(area);
 }
 
 /* For debugging: define to count every descriptor digest we've seen so we
@@ -1095,6 +1346,21 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out,
+                                 NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>reuse_area</b> is
+ * provided, tokenize the descriptor into it instead of into a new memory
+ * area, and clear it afterwards. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        memarea_t *reuse_area)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1119,7 +1385,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   while (end > s+2 && *(end-1) == '\n' && *(end-2) == '\n')
     --end;
 
-  area = memarea_new();
+  area = reuse_area ? reuse_area : memarea_new();
   tokens = smartlist_new();
   if (prepend_annotations) {
     if (tokenize_string(area,prepend_annotations,NULL,tokens,
@@ -1354,12 +1620,21 @@ router_parse_entry_from_string(const char *s, const char *end,
     log_warn(LD_DIR, "No exit policy tokens in descriptor.");
     goto err;
   }
-  SMARTLIST_FOREACH(exit_policy_tokens, directory_token_t *, t,
-                    if (router_add_exit_policy(router,t)<0) {
-                      log_warn(LD_DIR,"Error in exit policy");
-                      goto err;
-                    });
-  policy_expand_private(&router->exit_policy);
+  {
+    int policy_ok = 1;
+    SMARTLIST_FOREACH_BEGIN(exit_policy_tokens, directory_token_t *, t) {
+      if (router_add_exit_policy(router,t)<0) {
+        policy_ok = 0;
+        break;
+      }
+    } SMARTLIST_FOREACH_END(t);
+    if (policy_ok)
+      policy_expand_private(&router->exit_policy);
+    if (!policy_ok) {
+      log_warn(LD_DIR,"Error in exit policy");
+      goto err;
+    }
+  }
 
   if ((tok = find_opt_by_keyword(tokens, K_IPV6_POLICY)) && tok->n_args) {
     router->ipv6_exit_policy = parse_short_policy(tok->args[0]);
@@ -1408,7 +1683,9 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
 
   tok = find_by_keyword(tokens, K_ROUTER_SIGNATURE);
+  routerparse_lock();
   note_crypto_pk_op(VERIFY_RTR);
+  routerparse_unlock();
 #ifdef COUNT_DISTINCT_DIGESTS
   if (!verified_digests)
     verified_digests = digestmap_new();
@@ -1433,7 +1710,10 @@ router_parse_entry_from_string(const char *s, const char *end,
 
  err:
   dump_desc(s_dup, "router descriptor");
+  /* Freeing the exit policy changes the table of canonical entries. */
+  routerparse_lock();
   routerinfo_free(router);
+  routerparse_unlock();
   router = NULL;
  done:
   if (tokens) {
@@ -1443,7 +1723,10 @@ router_parse_entry_from_string(const char *s, const char *end,
   smartlist_free(exit_policy_tokens);
   if (area) {
     DUMP_AREA(area, "routerinfo");
-    memarea_drop_all(area);
+    if (area == reuse_area)
+      memarea_clear(area);
+    else
+      memarea_drop_all(area);
   }
   if (can_dl_again_out)
     *can_dl_again_out = can_dl_again;
@@ -2528,11 +2811,120 @@ networkstatus_verify_bw_weights(networkstatus_t *ns, int consensus_method)
   return valid;
 }
 
+/** Helper for networkstatus_parse_vote_impl(): scan the router status
+ * entries of the consensus <b>ns</b>, starting at *<b>s</b>, without
+ * parsing them.  Record where each one starts and its identity digest in a
+ * new networkstatus_lazy_entries_t, so that we can parse them later with
+ * networkstatus_parse_lazy_entry().  Advance *<b>s</b> past the entries.
+ * Return 0 on success, -1 on failure. */
+static int
+networkstatus_scan_lazy_entries(networkstatus_t *ns, const char **s)
+{
+  const char *start = *s, *cp = *s;
+  networkstatus_lazy_entries_t *lazy;
+  int n = 0, capacity = 1024;
+  uint32_t *offsets = tor_calloc(capacity, sizeof(uint32_t));
+  char *digests = tor_calloc(capacity, DIGEST_LEN);
+
+  while (!strcmpstart(cp, "r ")) {
+    const char *eos = find_start_of_next_routerstatus(cp);
+    const char *eol = memchr(cp, '\n', eos - cp);
+    const char *id, *id_end;
+    char id_b64[BASE64_DIGEST_LEN+1];
+    char digest[DIGEST_LEN];
+
+    if (!eol)
+      eol = eos;
+    /* "r" SP nickname SP identity SP ... */
+    id = memchr(cp + 2, ' ', eol - (cp + 2));
+    id_end = id ? memchr(id + 1, ' ', eol - (id + 1)) : NULL;
+    if (!id_end || id_end - (id + 1) != BASE64_DIGEST_LEN) {
+      log_warn(LD_DIR, "Malformed r line in router status; skipping.");
+      goto next;
+    }
+    memcpy(id_b64, id + 1, BASE64_DIGEST_LEN);
+    id_b64[BASE64_DIGEST_LEN] = '\0';
+    if (digest_from_base64(digest, id_b64)) {
+      log_warn(LD_DIR, "Error decoding identity digest %s",
+               escaped(id_b64));
+      goto next;
+    }
+    if (n && fast_memcmp(digests + (n-1)*DIGEST_LEN, digest, DIGEST_LEN)
+        >= 0) {
+      log_warn(LD_DIR, "Vote networkstatus entries not sorted by identity "
+               "digest");
+      tor_free(offsets);
+      tor_free(digests);
+      return -1;
+    }
+    if (n == capacity) {
+      capacity *= 2;
+      offsets = tor_reallocarray(offsets, capacity, sizeof(uint32_t));
+      digests = tor_reallocarray(digests, capacity, DIGEST_LEN);
+    }
+    offsets[n] = (uint32_t)(cp - start);
+    memcpy(digests + n*DIGEST_LEN, digest, DIGEST_LEN);
+    ++n;
+  next:
+    cp = eos;
+  }
+
+  lazy = tor_malloc_zero(sizeof(networkstatus_lazy_entries_t));
+  lazy->body = tor_memdup_nulterm(start, cp - start);
+  lazy->n_entries = n;
+  lazy->offsets = offsets;
+  lazy->identity_digests = digests;
+  lazy->parsed = tor_calloc(n ? n : 1, sizeof(routerstatus_t *));
+  lazy->failed = bitarray_init_zero(n);
+  lazy->n_unparsed = n;
+  ns->lazy_entries = lazy;
+  *s = cp;
+  return 0;
+}
+
+/** Parse and return the <b>idx</b>th router status entry in the lazily
+ * parsed consensus <b>ns</b>.  Return NULL if the entry is malformed.
+ * The caller must hold the result in ns->lazy_entries->parsed. */
+routerstatus_t *
+networkstatus_parse_lazy_entry(networkstatus_t *ns, int idx)
+{
+  networkstatus_lazy_entries_t *lazy = ns->lazy_entries;
+  const char *s;
+  smartlist_t *tokens;
+  routerstatus_t *rs;
+
+  tor_assert(lazy);
+  tor_assert(idx >= 0 && idx < lazy->n_entries);
+
+  if (!lazy->area)
+    lazy->area = memarea_new();
+  tokens = smartlist_new();
+  s = lazy->body + lazy->offsets[idx];
+  rs = routerstatus_parse_entry_from_string(lazy->area, &s, tokens,
+                                            NULL, NULL,
+                                            ns->consensus_method,
+                                            ns->flavor);
+  smartlist_free(tokens);
+  if (rs && tor_memneq(rs->identity_digest,
+                       lazy->identity_digests + idx*DIGEST_LEN,
+                       DIGEST_LEN)) {
+    log_warn(LD_BUG, "Router status entry changed its identity digest "
+             "while we weren't looking.");
+    routerstatus_free(rs);
+    rs = NULL;
+  }
+  return rs;
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
-                                     networkstatus_type_t ns_type)
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure.
+ *
+ * If <b>lazy</b> is true, <b>ns_type</b> must be NS_TYPE_CONSENSUS: don't
+ * parse the router status entries yet, but make a lazy_entries for them
+ * instead. */
+static networkstatus_t *
+networkstatus_parse_vote_impl(const char *s, const char **eos_out,
+                              networkstatus_type_t ns_type, int lazy)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -2874,9 +3266,16 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   rs_tokens = smartlist_new();
   rs_area = memarea_new();
   s = end_of_header;
-  ns->routerstatus_list = smartlist_new();
 
-  while (!strcmpstart(s, "r ")) {
+  if (lazy) {
+    tor_assert(ns->type == NS_TYPE_CONSENSUS);
+    if (networkstatus_scan_lazy_entries(ns, &s) < 0)
+      goto err;
+  } else {
+    ns->routerstatus_list = smartlist_new();
+  }
+
+  while (!lazy && !strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
       if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
@@ -2895,7 +3294,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
         smartlist_add(ns->routerstatus_list, rs);
     }
   }
-  for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
+  for (i = 1; !lazy && i < smartlist_len(ns->routerstatus_list); ++i) {
     routerstatus_t *rs1, *rs2;
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *a = smartlist_get(ns->routerstatus_list, i-1);
@@ -3117,6 +3516,24 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   return ns;
 }
 
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_impl(s, eos_out, ns_type, 0);
+}
+
+/** As networkstatus_parse_vote_from_string(), but parse a consensus, and
+ * leave its router status entries to be parsed one by one when they are
+ * needed.  See networkstatus_get_routerstatus_list() and friends. */
+networkstatus_t *
+networkstatus_parse_consensus_lazily(const char *s, const char **eos_out)
+{
+  return networkstatus_parse_vote_impl(s, eos_out, NS_TYPE_CONSENSUS, 1);
+}
+
 /** Return the digests_t that holds the digests of the
  * <b>flavor_name</b>-flavored networkstatus according to the detached
  * signatures document <b>sigs</b>, allocating a new digests_t as neeeded. */
@@ -3382,7 +3799,8 @@ router_parse_addr_policy_item_from_string,(const char *s, int assume_action))
 
   eos = cp + strlen(cp);
   area = memarea_new();
-  tok = get_next_token(area, &cp, eos, routerdesc_token_table);
+  tok = get_next_token(area, &cp, eos, routerdesc_token_table,
+                       token_table_get_index(routerdesc_token_table));
   if (tok->tp == ERR_) {
     log_warn(LD_DIR, "Error reading address policy: %s", tok->error);
     goto err;
@@ -3637,13 +4055,176 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #undef MAX_ARGS
 }
 
+/** Number of buckets in a token_table_index_t.  Must be a power of two,
+ * and much larger than the number of keywords in any token table. */
+#define TOKEN_INDEX_BUCKETS 256
+
+/** A perfect hash from the keywords of a token table to their positions in
+ * the table, so that get_next_token() doesn't need to scan the table. */
+typedef struct token_table_index_t {
+  /** The table that we're indexing. */
+  const token_rule_t *table;
+  /** A seed for token_keyword_hash() under which no two different keywords
+   * in <b>table</b> land in the same bucket. */
+  uint32_t seed;
+  /** For each bucket, one more than the position in <b>table</b> of the
+   * keyword that hashes to it, or 0 if there is none. */
+  uint8_t bucket[TOKEN_INDEX_BUCKETS];
+} token_table_index_t;
+
+/** Number of token tables that we index. */
+#define N_TOKEN_TABLES 12
+/** Indices for our token tables.  We build these once, before we start any
+ * threads, and never change them afterwards. */
+static token_table_index_t token_table_indices[N_TOKEN_TABLES];
+/** Number of entries in token_table_indices that we've built. */
+static int n_token_table_indices = 0;
+
+/** Return the bucket-selecting hash of the <b>len</b>-byte keyword
+ * <b>kwd</b> under <b>seed</b>. */
+static INLINE uint32_t
+token_keyword_hash(uint32_t seed, const char *kwd, size_t len)
+{
+  /* FNV-1a, with a seed. */
+  uint32_t h = 2166136261u ^ seed;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    h ^= (uint8_t) kwd[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+/** Try to find a seed under which the keywords of <b>table</b> don't
+ * collide, and fill in <b>index</b> with it.  Return 0 on success, -1 if we
+ * couldn't find one. */
+static int
+token_table_build_index(token_table_index_t *index,
+                        const token_rule_t *table)
+{
+  uint32_t seed;
+  int i;
+
+  for (i = 0; table[i].t; ++i)
+    ;
+  if (i >= TOKEN_INDEX_BUCKETS / 2)
+    return -1;
+
+  for (seed = 0; seed < 65536; ++seed) {
+    memset(index->bucket, 0, sizeof(index->bucket));
+    for (i = 0; table[i].t; ++i) {
+      const char *kwd = table[i].t;
+      uint32_t b = token_keyword_hash(seed, kwd, strlen(kwd)) &
+        (TOKEN_INDEX_BUCKETS - 1);
+      if (!index->bucket[b]) {
+        index->bucket[b] = (uint8_t)(i + 1);
+      } else if (strcmp(table[index->bucket[b] - 1].t, kwd)) {
+        break; /* A collision: try another seed. */
+      }
+      /* Otherwise, it's a second entry for the same keyword; as with a
+       * linear scan, the first one wins. */
+    }
+    if (!table[i].t) {
+      index->table = table;
+      index->seed = seed;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Build the keyword indices for all of our token tables, and make it safe
+ * to parse router descriptors and microdescriptors in more than one thread
+ * at once.  This must be called before we start any threads that parse
+ * directory documents; until it's called, we look up keywords by scanning
+ * the tables. */
+void
+routerparse_init(void)
+{
+  token_rule_t *tables[N_TOKEN_TABLES] = {
+    routerdesc_token_table,
+    extrainfo_token_table,
+    rtrstatus_token_table,
+    dir_key_certificate_table,
+    desc_token_table,
+    ipo_token_table,
+    client_keys_token_table,
+    networkstatus_token_table,
+    networkstatus_consensus_token_table,
+    networkstatus_vote_footer_token_table,
+    networkstatus_detached_signature_token_table,
+    microdesc_token_table,
+  };
+  int i;
+
+  if (!routerparse_mutex)
+    routerparse_mutex = tor_mutex_new();
+  sigcache_init_threads();
+  memarea_init_threads();
+  policies_init_threads();
+  escaped_init_threads();
+
+  if (n_token_table_indices)
+    return;
+  for (i = 0; i < N_TOKEN_TABLES; ++i) {
+    token_table_index_t *index = &token_table_indices[n_token_table_indices];
+    if (token_table_build_index(index, tables[i]) < 0) {
+      log_warn(LD_BUG, "Couldn't build a keyword index for token table %d.",
+               i);
+      continue;
+    }
+    ++n_token_table_indices;
+  }
+}
+
+/** Return the keyword index for <b>table</b>, or NULL if there isn't one. */
+static const token_table_index_t *
+token_table_get_index(const token_rule_t *table)
+{
+  int i;
+  for (i = 0; i < n_token_table_indices; ++i) {
+    if (token_table_indices[i].table == table)
+      return &token_table_indices[i];
+  }
+  return NULL;
+}
+
+/** Return the position in <b>table</b> of the <b>len</b>-byte keyword
+ * <b>kwd</b>, or -1 if it isn't there.  Use <b>index</b> if it's
+ * provided. */
+static INLINE int
+token_table_find_keyword(const token_rule_t *table,
+                         const token_table_index_t *index,
+                         const char *kwd, size_t len)
+{
+  int i;
+  if (index) {
+    uint32_t b = token_keyword_hash(index->seed, kwd, len) &
+      (TOKEN_INDEX_BUCKETS - 1);
+    i = index->bucket[b] - 1;
+    if (i >= 0 && !strcmp_len(kwd, table[i].t, len))
+      return i;
+    return -1;
+  }
+
+  /* Search the table for the appropriate entry.  (I tried a binary search
+   * instead, but it wasn't any faster.) */
+  for (i = 0; table[i].t ; ++i) {
+    if (!strcmp_len(kwd, table[i].t, len))
+      return i;
+  }
+  return -1;
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
- * of tokens in <b>table</b>.
+ * of tokens in <b>table</b>, whose keyword index is <b>index</b> (or NULL if
+ * it has none).
  */
 static directory_token_t *
 get_next_token(memarea_t *area,
-               const char **s, const char *eos, token_rule_t *table)
+               const char **s, const char *eos, token_rule_t *table,
+               const token_table_index_t *index)
 {
   /** Reject any object at least this big; it is probably an overflow, an
    * attack, a bug, or some other nonsense. */
@@ -3684,38 +4265,34 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  i = token_table_find_keyword(table, index, *s, next-*s);
+  if (i >= 0) {
+    /* We've found the keyword. */
+    kwd = table[i].t;
+    tok->tp = table[i].v;
+    o_syn = table[i].os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (table[i].concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < table[i].min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > table[i].max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
@@ -3812,6 +4389,7 @@ tokenize_string(memarea_t *area,
 {
   const char **s;
   directory_token_t *tok = NULL;
+  const token_table_index_t *index = token_table_get_index(table);
   int counts[NIL_];
   int i;
   int first_nonannotation;
@@ -3834,7 +4412,7 @@ tokenize_string(memarea_t *area,
   SMARTLIST_FOREACH(out, const directory_token_t *, t, ++counts[t->tp]);
 
   while (*s < end && (!tok || tok->tp != EOF_)) {
-    tok = get_next_token(area, s, end, table);
+    tok = get_next_token(area, s, end, table, index);
     if (tok->tp == ERR_) {
       log_warn(LD_DIR, "parse error: %s", tok->error);
       token_clear(tok);
@@ -4122,6 +4700,9 @@ find_start_of_next_microdesc(const char *s, const char *eos)
  * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
  * descriptor in the body field of each microdesc_t.
  *
+ * If there are a lot of microdescriptors, split them into ranges and parse
+ * those on the cpuworkers and in the main thread at once.
+ *
  * Return all newly parsed microdescriptors in a newly allocated
  * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
  * microdesc digest to it for every microdesc that we found to be badly
@@ -4131,21 +4712,48 @@ microdescs_parse_from_string(const char *s, const char *eos,
                              int allow_annotations,
                              saved_location_t where,
                              smartlist_t *invalid_digests_out)
+{
+  if (!eos)
+    eos = s + strlen(s);
+
+  if ((size_t)(eos - s) >= dirparse_parallel_min_len) {
+    dirparse_batch_t batch;
+    smartlist_t *result = smartlist_new();
+    memset(&batch, 0, sizeof(batch));
+    batch.start = s;
+    batch.is_microdescs = 1;
+    batch.where = where;
+    batch.allow_annotations = allow_annotations;
+    dirparse_batch_split(&batch, eos, find_start_of_next_microdesc,
+                         invalid_digests_out != NULL);
+    dirparse_batch_run(&batch, result, invalid_digests_out);
+    return result;
+  }
+
+  return microdescs_parse_range(s, eos, s, allow_annotations, where,
+                                invalid_digests_out);
+}
+
+/** Helper for microdescs_parse_from_string(): parse the microdescriptors
+ * from <b>s</b> up to <b>eos</b>, computing their offsets from
+ * <b>start</b>.  Only touches global state that is safe to use from a
+ * cpuworker. */
+static smartlist_t *
+microdescs_parse_range(const char *s, const char *eos, const char *start,
+                       int allow_annotations,
+                       saved_location_t where,
+                       smartlist_t *invalid_digests_out)
 {
   smartlist_t *tokens;
   smartlist_t *result;
   microdesc_t *md = NULL;
   memarea_t *area;
-  const char *start = s;
   const char *start_of_next_microdesc;
   int flags = allow_annotations ? TS_ANNOTATIONS_OK : 0;
   const int copy_body = (where != SAVED_IN_CACHE);
 
   directory_token_t *tok;
 
-  if (!eos)
-    eos = s + strlen(s);
-
   s = eat_whitespace_eos(s, eos);
   area = memarea_new();
   result = smartlist_new();
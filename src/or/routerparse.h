@@ -12,6 +12,8 @@
 #ifndef TOR_ROUTERPARSE_H
 #define TOR_ROUTERPARSE_H
 
+void routerparse_init(void);
+
 int router_get_router_hash(const char *s, size_t s_len, char *digest);
 int router_get_dir_hash(const char *s, char *digest);
 int router_get_networkstatus_v3_hashes(const char *s, digests_t *digests);
@@ -57,6 +59,9 @@ int networkstatus_verify_bw_weights(networkstatus_t *ns, int);
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                                  const char **eos_out,
                                                  networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_consensus_lazily(const char *s,
+                                                 const char **eos_out);
+routerstatus_t *networkstatus_parse_lazy_entry(networkstatus_t *ns, int idx);
 ns_detached_signatures_t *networkstatus_parse_detached_signatures(
                                           const char *s, const char *eos);
 
@@ -85,6 +90,10 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
 
 #ifdef ROUTERPARSE_PRIVATE
+#ifdef TOR_UNIT_TESTS
+extern size_t dirparse_parallel_min_len;
+extern size_t dirparse_parallel_range_len;
+#endif
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
                                             networkstatus_t *vote,
                                             vote_routerstatus_t *vote_rs,
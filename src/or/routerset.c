@@ -42,6 +42,14 @@ routerset_get_countryname(const char *c)
   return country;
 }
 
+/** Forget everything we have cached about which nodes are in
+ * <b>set</b>. */
+static void
+routerset_forget_node_results(routerset_t *set)
+{
+  set->node_results_generation = 0;
+}
+
 /** Update the routerset's <b>countries</b> bitarray_t. Called whenever
  * the GeoIP IPv4 database is reloaded.
  */
@@ -50,6 +58,7 @@ routerset_refresh_countries(routerset_t *target)
 {
   int cc;
   bitarray_free(target->countries);
+  routerset_forget_node_results(target);
 
   if (!geoip_is_loaded(AF_INET)) {
     target->countries = NULL;
@@ -118,6 +127,10 @@ routerset_parse(routerset_t *target, const char *s, const char *description)
       }
   } SMARTLIST_FOREACH_END(nick);
   policy_expand_unspec(&target->policies);
+  compiled_addr_policy_free(target->compiled_policies);
+  target->compiled_policies = smartlist_len(target->policies) ?
+    addr_policy_compile(target->policies) : NULL;
+  routerset_forget_node_results(target);
   smartlist_add_all(target->list, list);
   smartlist_free(list);
   if (added_countries)
@@ -181,9 +194,14 @@ routerset_contains(const routerset_t *set, const tor_addr_t *addr,
     return 4;
   if (id_digest && digestmap_get(set->digests, id_digest))
     return 4;
-  if (addr && compare_tor_addr_to_addr_policy(addr, orport, set->policies)
-      == ADDR_POLICY_REJECTED)
-    return 3;
+  if (addr) {
+    addr_policy_result_t r = set->compiled_policies ?
+      compare_tor_addr_to_compiled_policy(addr, orport,
+                                          set->compiled_policies) :
+      compare_tor_addr_to_addr_policy(addr, orport, set->policies);
+    if (r == ADDR_POLICY_REJECTED)
+      return 3;
+  }
   if (set->countries) {
     if (country < 0 && addr)
       country = geoip_get_country_by_addr(addr);
@@ -279,9 +297,10 @@ routerset_contains_routerstatus(const routerset_t *set,
                             country);
 }
 
-/** Return true iff <b>node</b> is in <b>set</b>. */
-int
-routerset_contains_node(const routerset_t *set, const node_t *node)
+/** Helper for routerset_contains_node(): return true iff <b>node</b> is in
+ * <b>set</b>, without looking at the cache. */
+static int
+routerset_contains_node_uncached(const routerset_t *set, const node_t *node)
 {
   if (node->rs)
     return routerset_contains_routerstatus(set, node->rs, node->country);
@@ -291,6 +310,46 @@ routerset_contains_node(const routerset_t *set, const node_t *node)
     return 0;
 }
 
+/** Return true iff <b>node</b> is in <b>set</b>.
+ *
+ * For nodes in the nodelist, we remember the answer until the nodelist
+ * changes, or until <b>set</b> does. */
+int
+routerset_contains_node(const routerset_t *set, const node_t *node)
+{
+  /* The cache is the only part of the set that we change here. */
+  routerset_t *mutable_set = (routerset_t *)set;
+  const uint64_t generation = nodelist_get_generation();
+  int idx, r;
+
+  if (!set || !set->list)
+    return 0;
+  if (!node_is_in_nodelist(node))
+    return routerset_contains_node_uncached(set, node);
+
+  idx = node->nodelist_idx;
+  if (set->node_results_generation != generation) {
+    if (set->node_results)
+      memset(set->node_results, 0, set->n_node_results);
+    mutable_set->node_results_generation = generation;
+  }
+  if (idx >= set->n_node_results) {
+    int n = idx + 1 + idx / 4 + 32;
+    mutable_set->node_results = tor_realloc(set->node_results, n);
+    memset(set->node_results + set->n_node_results, 0,
+           n - set->n_node_results);
+    mutable_set->n_node_results = n;
+  }
+
+  if (set->node_results[idx])
+    return set->node_results[idx] - 1;
+
+  r = routerset_contains_node_uncached(set, node);
+  tor_assert(r >= 0 && r < 255);
+  set->node_results[idx] = (uint8_t)(r + 1);
+  return r;
+}
+
 /** Add every known node_t that is a member of <b>routerset</b> to
  * <b>out</b>, but never add any that are part of <b>excludeset</b>.
  * If <b>running_only</b>, only add the running ones. */
@@ -391,12 +450,14 @@ routerset_free(routerset_t *routerset)
   SMARTLIST_FOREACH(routerset->policies, addr_policy_t *, p,
                     addr_policy_free(p));
   smartlist_free(routerset->policies);
+  compiled_addr_policy_free(routerset->compiled_policies);
   SMARTLIST_FOREACH(routerset->country_names, char *, cp, tor_free(cp));
   smartlist_free(routerset->country_names);
 
   strmap_free(routerset->names, NULL);
   digestmap_free(routerset->digests, NULL);
   bitarray_free(routerset->countries);
+  tor_free(routerset->node_results);
   tor_free(routerset);
 }
 
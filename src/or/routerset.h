@@ -63,6 +63,9 @@ struct routerset_t {
   /** An address policy for routers in the set.  For implementation reasons,
    * a router belongs to the set if it is _rejected_ by this policy. */
   smartlist_t *policies;
+  /** <b>policies</b>, compiled for fast lookups; or NULL if there are no
+   * policies, or if we couldn't compile them. */
+  struct compiled_addr_policy_t *compiled_policies;
 
   /** A human-readable description of what this routerset is for.  Used in
    * log messages. */
@@ -77,6 +80,18 @@ struct routerset_t {
    * routerset_refresh_countries() whenever the geoip country list is
    * reloaded. */
   bitarray_t *countries;
+
+  /** Cache of routerset_contains_node() results for the nodes in the
+   * nodelist: element <i>i</i> is 0 if we don't know the answer for the
+   * node with nodelist_idx <i>i</i>, and 1 more than the answer otherwise.
+   * Only valid while nodelist_get_generation() is equal to
+   * <b>node_results_generation</b>. */
+  uint8_t *node_results;
+  /** Number of elements allocated in <b>node_results</b>. */
+  int n_node_results;
+  /** Value of nodelist_get_generation() when we last cleared
+   * <b>node_results</b>, or 0 if we need to clear it before using it. */
+  uint64_t node_results_generation;
 };
 #endif
 #endif
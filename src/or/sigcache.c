@@ -0,0 +1,243 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.c
+ * \brief Remember which RSA signatures on directory documents we have
+ * already verified.
+ *
+ * We see the same signed objects over and over: the same router
+ * descriptor arrives from several caches, we reload our cached
+ * descriptors, certificates and consensus at startup, and we re-check
+ * the same consensus signatures.  Each of those checks would otherwise
+ * cost a public-key operation.  Instead, we keep a bounded LRU set of
+ * (signing key digest, document digest, signature digest) triples that
+ * we have already seen verify correctly, so that checking one of them
+ * again costs only a hash.
+ *
+ * We only remember good signatures: there's no point in making it
+ * cheaper for somebody to send us the same bad signature twice.
+ **/
+
+#define SIGCACHE_PRIVATE
+#include "or.h"
+#include "sigcache.h"
+
+/** An entry in the verified-signature cache. */
+typedef struct sigcache_entry_t {
+  /** Position of this entry in sigcache_lru; the head is the least
+   * recently used. */
+  TOR_TAILQ_ENTRY(sigcache_entry_t) next;
+  /** SHA256 of the signing key's digest, the signed digest, and the
+   * signature. */
+  uint8_t key[DIGEST256_LEN];
+} sigcache_entry_t;
+
+/** Map from sigcache_entry_t.key to the corresponding sigcache_entry_t. */
+static digest256map_t *sigcache_map = NULL;
+/** All entries in sigcache_map, from least to most recently used. */
+static TOR_TAILQ_HEAD(sigcache_lru_t, sigcache_entry_t) sigcache_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(sigcache_lru);
+/** Number of entries in sigcache_map. */
+static int sigcache_n_entries = 0;
+/** Largest number of entries we allow in sigcache_map. */
+static int sigcache_max_entries = SIGCACHE_MAX_ENTRIES;
+/** How many times have we answered a signature check from the cache? */
+static uint64_t sigcache_n_hits = 0;
+/** If set, protects all of the above, so that we can check signatures
+ * from more than one thread at once. */
+static tor_mutex_t *sigcache_mutex = NULL;
+
+/** Acquire sigcache_mutex, if we have one. */
+static INLINE void
+sigcache_lock(void)
+{
+  if (sigcache_mutex)
+    tor_mutex_acquire(sigcache_mutex);
+}
+
+/** Release sigcache_mutex, if we have one. */
+static INLINE void
+sigcache_unlock(void)
+{
+  if (sigcache_mutex)
+    tor_mutex_release(sigcache_mutex);
+}
+
+/** Make the verified-signature cache safe to use from more than one thread.
+ * Call this from the main thread before starting any other threads. */
+void
+sigcache_init_threads(void)
+{
+  if (!sigcache_mutex)
+    sigcache_mutex = tor_mutex_new();
+}
+
+/** Compute the cache key for a <b>sig_len</b>-byte signature <b>sig</b> by
+ * the key whose digest is <b>key_digest</b> over the <b>digest_len</b>-byte
+ * <b>digest</b>, and store it in <b>key_out</b>. */
+static void
+sigcache_compute_key(uint8_t *key_out, const char *key_digest,
+                     const char *digest, size_t digest_len,
+                     const char *sig, size_t sig_len)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  const char dlen = (char)digest_len;
+  crypto_digest_add_bytes(d, key_digest, DIGEST_LEN);
+  /* Include the length, so that a SHA1 digest can never collide with the
+   * prefix of a SHA256 one. */
+  crypto_digest_add_bytes(d, &dlen, 1);
+  crypto_digest_add_bytes(d, digest, digest_len);
+  crypto_digest_add_bytes(d, sig, sig_len);
+  crypto_digest_get_digest(d, (char*)key_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Remove the least recently used entry from the cache. */
+static void
+sigcache_evict_one(void)
+{
+  sigcache_entry_t *victim = TOR_TAILQ_FIRST(&sigcache_lru);
+  tor_assert(victim);
+  TOR_TAILQ_REMOVE(&sigcache_lru, victim, next);
+  digest256map_remove(sigcache_map, victim->key);
+  --sigcache_n_entries;
+  tor_free(victim);
+}
+
+/** If <b>key</b> is in the cache, mark it as the most recently used entry
+ * and return 1.  Otherwise return 0.  The caller must hold
+ * sigcache_mutex. */
+static int
+sigcache_touch(const uint8_t *key)
+{
+  sigcache_entry_t *ent;
+  if (!sigcache_map || !(ent = digest256map_get(sigcache_map, key)))
+    return 0;
+  TOR_TAILQ_REMOVE(&sigcache_lru, ent, next);
+  TOR_TAILQ_INSERT_TAIL(&sigcache_lru, ent, next);
+  return 1;
+}
+
+/** Add <b>key</b> to the cache as a known-good signature, evicting the
+ * least recently used entries as needed.  If another thread checked the
+ * same signature while we were checking it, <b>key</b> may already be
+ * there; then we just mark it as used.  The caller must hold
+ * sigcache_mutex. */
+STATIC void
+sigcache_add(const uint8_t *key)
+{
+  sigcache_entry_t *ent;
+
+  if (sigcache_max_entries <= 0)
+    return;
+  if (sigcache_touch(key))
+    return;
+  if (!sigcache_map)
+    sigcache_map = digest256map_new();
+
+  while (sigcache_n_entries >= sigcache_max_entries)
+    sigcache_evict_one();
+
+  ent = tor_malloc_zero(sizeof(sigcache_entry_t));
+  memcpy(ent->key, key, DIGEST256_LEN);
+  digest256map_set(sigcache_map, ent->key, ent);
+  TOR_TAILQ_INSERT_TAIL(&sigcache_lru, ent, next);
+  ++sigcache_n_entries;
+}
+
+/** Check whether <b>sig</b> is a good <b>sig_len</b>-byte signature by
+ * <b>pkey</b> on the <b>digest_len</b>-byte <b>digest</b>, consulting and
+ * updating the cache of signatures we've already verified.  Return 0 if
+ * the signature is good, -1 if it could not be checked at all, and -2 if
+ * it was made over some other digest.
+ */
+int
+sigcache_checksig_digest(crypto_pk_t *pkey,
+                         const char *digest, size_t digest_len,
+                         const char *sig, size_t sig_len)
+{
+  char key_digest[DIGEST_LEN];
+  uint8_t key[DIGEST256_LEN];
+  char *signed_digest;
+  size_t keysize;
+  int r;
+
+  tor_assert(pkey);
+  tor_assert(digest);
+  tor_assert(sig);
+  tor_assert(digest_len <= DIGEST256_LEN);
+
+  if (crypto_pk_get_digest(pkey, key_digest) < 0)
+    return -1;
+  sigcache_compute_key(key, key_digest, digest, digest_len, sig, sig_len);
+
+  sigcache_lock();
+  if (sigcache_touch(key)) {
+    ++sigcache_n_hits;
+    sigcache_unlock();
+    return 0;
+  }
+  sigcache_unlock();
+
+  /* Don't hold the lock while we do the public-key operation, or only one
+   * thread at a time could check signatures.  Two threads may both miss on
+   * the same signature and both check it; sigcache_add() copes with that. */
+
+  keysize = crypto_pk_keysize(pkey);
+  signed_digest = tor_malloc(keysize);
+  r = crypto_pk_public_checksig(pkey, signed_digest, keysize, sig, sig_len);
+  if (r < (int)digest_len) {
+    r = -1;
+  } else if (tor_memneq(digest, signed_digest, digest_len)) {
+    r = -2;
+  } else {
+    sigcache_lock();
+    sigcache_add(key);
+    sigcache_unlock();
+    r = 0;
+  }
+  tor_free(signed_digest);
+  return r;
+}
+
+/** Release all storage held by the verified-signature cache. */
+void
+sigcache_free_all(void)
+{
+  sigcache_entry_t *ent;
+  while ((ent = TOR_TAILQ_FIRST(&sigcache_lru))) {
+    TOR_TAILQ_REMOVE(&sigcache_lru, ent, next);
+    tor_free(ent);
+  }
+  digest256map_free(sigcache_map, NULL);
+  sigcache_map = NULL;
+  sigcache_n_entries = 0;
+  sigcache_n_hits = 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of signatures currently in the cache. */
+int
+sigcache_get_n_entries(void)
+{
+  return sigcache_n_entries;
+}
+
+/** Change the largest number of signatures we keep in the cache to
+ * <b>n</b>, evicting entries as needed. */
+void
+sigcache_set_max_entries(int n)
+{
+  sigcache_max_entries = n;
+  while (sigcache_n_entries > 0 && sigcache_n_entries > n)
+    sigcache_evict_one();
+}
+
+/** Return the number of signature checks we've answered from the cache. */
+uint64_t
+sigcache_get_n_hits(void)
+{
+  return sigcache_n_hits;
+}
+#endif
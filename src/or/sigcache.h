@@ -0,0 +1,31 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.h
+ * \brief Header file for sigcache.c.
+ **/
+
+#ifndef TOR_SIGCACHE_H
+#define TOR_SIGCACHE_H
+
+int sigcache_checksig_digest(crypto_pk_t *pkey,
+                             const char *digest, size_t digest_len,
+                             const char *sig, size_t sig_len);
+void sigcache_init_threads(void);
+void sigcache_free_all(void);
+
+/** Largest number of verified signatures that we remember at once. */
+#define SIGCACHE_MAX_ENTRIES 16384
+
+#ifdef SIGCACHE_PRIVATE
+STATIC void sigcache_add(const uint8_t *key);
+#endif
+
+#ifdef TOR_UNIT_TESTS
+int sigcache_get_n_entries(void);
+void sigcache_set_max_entries(int n);
+uint64_t sigcache_get_n_hits(void);
+#endif
+
+#endif
@@ -14,6 +14,7 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define CONTAINER_PRIVATE
 #include "or.h"
 #include "onion_tap.h"
 #include "relay.h"
@@ -25,7 +26,13 @@ const char tor_git_revision[] = "";
 #include <openssl/obj_mac.h>
 #endif
 
+#include "buffers.h"
 #include "config.h"
+#include "confparse.h"
+#include "networkstatus.h"
+#include "policies.h"
+#include "routerlist.h"
+#include "routerparse.h"
 #include "crypto_curve25519.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
@@ -236,6 +243,46 @@ bench_onion_ntor(void)
   dimap_free(keymap, NULL);
 }
 
+static void
+bench_curve25519(void)
+{
+  uint64_t start, end;
+  const int iters = 1<<10;
+  int i;
+  curve25519_keypair_t kp1, kp2;
+  curve25519_public_key_t basepoint;
+  uint8_t output[CURVE25519_OUTPUT_LEN];
+
+  memset(&basepoint, 0, sizeof(basepoint));
+  basepoint.public_key[0] = 9;
+  curve25519_keypair_generate(&kp2, 0);
+  curve25519_secret_key_generate(&kp1.seckey, 0);
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    curve25519_public_key_generate(&kp1.pubkey, &kp1.seckey);
+  }
+  end = perftime();
+  printf("Generate public key (fixed-base): %.2f usec\n",
+         MICROCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    curve25519_handshake(output, &kp1.seckey, &basepoint);
+  }
+  end = perftime();
+  printf("Generate public key (ladder): %.2f usec\n",
+         MICROCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    curve25519_handshake(output, &kp1.seckey, &kp2.pubkey);
+  }
+  end = perftime();
+  printf("Handshake: %.2f usec\n", MICROCOUNT(start, end, iters));
+}
+
 static void
 bench_ed25519(void)
 {
@@ -293,6 +340,39 @@ bench_ed25519(void)
          MICROCOUNT(start, end, iters));
 }
 
+static void
+bench_ed25519_batch(void)
+{
+  uint64_t start, end;
+  const int iters = 1<<10;
+  const int batch_sizes[] = { 1, 2, 8, 32, 64 };
+  const uint8_t msg[] = "but leaving, could not tell what they had heard";
+  ed25519_keypair_t kp[4];
+  ed25519_checkable_t ch[64];
+  unsigned j;
+  int i;
+
+  for (i = 0; i < 4; ++i)
+    ed25519_keypair_generate(&kp[i], 0);
+  for (i = 0; i < 64; ++i) {
+    ch[i].pubkey = &kp[i % 4].pubkey;
+    ch[i].msg = msg;
+    ch[i].len = sizeof(msg);
+    ed25519_sign(&ch[i].signature, msg, sizeof(msg), &kp[i % 4]);
+  }
+
+  for (j = 0; j < ARRAY_LENGTH(batch_sizes); ++j) {
+    const int n = batch_sizes[j];
+    start = perftime();
+    for (i = 0; i < iters; i += n) {
+      ed25519_checksig_batch(NULL, ch, n);
+    }
+    end = perftime();
+    printf("Verify signatures, batches of %d: %.2f usec/signature\n",
+           n, MICROCOUNT(start, end, iters));
+  }
+}
+
 static void
 bench_cell_aes(void)
 {
@@ -321,6 +401,44 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Return the index of the <b>i</b>th key to look up in a benchmark with
+ * <b>n</b> keys.  We don't look keys up in the order we added them, since
+ * that would favor maps that allocate entries in order. */
+#define BENCH_DMAP_IDX(i, n) ((int)(((uint64_t)(i) * 7919) % (n)))
+
+/** Define a function to time setting, finding, and failing to find
+ * <b>n</b> keys in a map whose functions start with <b>prefix</b>.
+ * <b>keys</b> and <b>misses</b> each hold <b>n</b> DIGEST_LEN-byte keys. */
+#define DEFINE_BENCH_DMAP_SIZE(prefix)                                  \
+  static void                                                           \
+  bench_dmap_size_##prefix(const char *keys, const char *misses, int n) \
+  {                                                                     \
+    prefix##t *map = prefix##new();                                     \
+    uint64_t start, pt2, pt3, end;                                      \
+    int i, found = 0;                                                   \
+    start = perftime();                                                 \
+    for (i = 0; i < n; ++i)                                             \
+      prefix##set(map, keys + i*DIGEST_LEN, (void*)1);                  \
+    pt2 = perftime();                                                   \
+    for (i = 0; i < n; ++i)                                             \
+      found += prefix##get(map, keys + BENCH_DMAP_IDX(i, n)*DIGEST_LEN)  \
+        != NULL;                                                        \
+    pt3 = perftime();                                                   \
+    for (i = 0; i < n; ++i)                                             \
+      found += prefix##get(map, misses + BENCH_DMAP_IDX(i, n)*DIGEST_LEN) \
+        != NULL;                                                        \
+    end = perftime();                                                   \
+    printf("%-13s %8d entries: set %6.2f ns, hit %6.2f ns, "            \
+           "miss %6.2f ns, %6.2f bytes per entry (found %d)\n",         \
+           #prefix, n, NANOCOUNT(start, pt2, n), NANOCOUNT(pt2, pt3, n), \
+           NANOCOUNT(pt3, end, n),                                      \
+           prefix##mem_usage(map) / (double)n, found);                  \
+    prefix##free(map, NULL);                                            \
+  }
+
+DEFINE_BENCH_DMAP_SIZE(digestmap_)
+DEFINE_BENCH_DMAP_SIZE(digestmap_ht_)
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -388,6 +506,24 @@ bench_dmap(void)
   printf("False positive rate on digestset: %.2f%%\n",
          (fp/(double)fpostests)*100);
 
+  /* Compare digestmap_t with the chained hash table at larger sizes.  The
+   * byte counts don't include allocator overhead, which the chained table
+   * pays once per entry. */
+  {
+    const int sizes[] = { 10000, 100000, 1000000, -1 };
+    for (i = 0; sizes[i] > 0; ++i) {
+      const int n_keys = sizes[i];
+      char *keys = tor_malloc((size_t)n_keys * DIGEST_LEN);
+      char *misses = tor_malloc((size_t)n_keys * DIGEST_LEN);
+      crypto_rand(keys, (size_t)n_keys * DIGEST_LEN);
+      crypto_rand(misses, (size_t)n_keys * DIGEST_LEN);
+      bench_dmap_size_digestmap_(keys, misses, n_keys);
+      bench_dmap_size_digestmap_ht_(keys, misses, n_keys);
+      tor_free(keys);
+      tor_free(misses);
+    }
+  }
+
   digestmap_free(dm, NULL);
   digestset_free(ds);
   SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
@@ -418,6 +554,343 @@ bench_siphash(void)
   }
 }
 
+static void
+bench_rand(void)
+{
+  char buf[512];
+  int lens[] = { 4, 8, 16, 32, 128, 509, -1 };
+  int i, j;
+  uint64_t start, end;
+  const int N = 100000;
+  volatile int sink = 0;
+
+  for (i = 0; lens[i] > 0; ++i) {
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < N; ++j) {
+      crypto_rand(buf, lens[i]);
+    }
+    end = perftime();
+    printf("crypto_rand(%d): %.2f ns per call\n",
+           lens[i], NANOCOUNT(start,end,N));
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < N; ++j) {
+      crypto_fast_rand(buf, lens[i]);
+    }
+    end = perftime();
+    printf("crypto_fast_rand(%d): %.2f ns per call\n",
+           lens[i], NANOCOUNT(start,end,N));
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    sink += crypto_rand_int(7000);
+  }
+  end = perftime();
+  printf("crypto_rand_int(): %.2f ns per call\n", NANOCOUNT(start,end,N));
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    sink += crypto_fast_rand_int(7000);
+  }
+  end = perftime();
+  printf("crypto_fast_rand_int(): %.2f ns per call\n",
+         NANOCOUNT(start,end,N));
+  (void)sink;
+}
+
+#include "test_descriptors.inc"
+
+/** Return a newly allocated consensus-shaped document with <b>n</b> router
+ * status entries.  Its signature is garbage, but it parses. */
+static char *
+make_fake_consensus(int n)
+{
+  smartlist_t *chunks = smartlist_new();
+  char voter_hex[HEX_DIGEST_LEN+1];
+  char sig[256], sig_b64[512];
+  char *result;
+  int i;
+
+  memset(voter_hex, 'A', HEX_DIGEST_LEN);
+  voter_hex[HEX_DIGEST_LEN] = '\0';
+  smartlist_add_asprintf(chunks,
+      "network-status-version 3\n"
+      "vote-status consensus\n"
+      "consensus-method 20\n"
+      "valid-after 2015-05-01 00:00:00\n"
+      "fresh-until 2015-05-01 01:00:00\n"
+      "valid-until 2015-05-01 03:00:00\n"
+      "voting-delay 300 300\n"
+      "known-flags Authority Exit Fast Guard HSDir Running Stable V2Dir "
+      "Valid\n"
+      "dir-source bench %s 127.0.0.1 127.0.0.1 80 443\n"
+      "contact nobody\n"
+      "vote-digest %s\n", voter_hex, voter_hex);
+
+  for (i = 0; i < n; ++i) {
+    char id[DIGEST_LEN], d[DIGEST_LEN];
+    char id_b64[BASE64_DIGEST_LEN+1], d_b64[BASE64_DIGEST_LEN+1];
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    crypto_rand(d, sizeof(d));
+    digest_to_base64(id_b64, id);
+    digest_to_base64(d_b64, d);
+    smartlist_add_asprintf(chunks,
+        "r relay%d %s %s 2015-04-30 12:34:56 10.%d.%d.%d 9001 9030\n"
+        "s Exit Fast Guard HSDir Running Stable V2Dir Valid\n"
+        "v Tor 0.2.6.7\n"
+        "w Bandwidth=%d\n"
+        "p accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464,531\n",
+        i, id_b64, d_b64, (i>>16)&255, (i>>8)&255, i&255, 100 + i);
+  }
+
+  crypto_rand(sig, sizeof(sig));
+  base64_encode(sig_b64, sizeof(sig_b64), sig, sizeof(sig));
+  smartlist_add_asprintf(chunks,
+      "directory-footer\n"
+      "directory-signature %s %s\n"
+      "-----BEGIN SIGNATURE-----\n"
+      "%s"
+      "-----END SIGNATURE-----\n", voter_hex, voter_hex, sig_b64);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper for bench_dirparse: time parsing the documents we care about. */
+static void
+bench_dirparse_impl(const char *consensus, int n_entries)
+{
+  const int iters = 20;
+  int i;
+  uint64_t start, end;
+  smartlist_t *routers = smartlist_new();
+  int n_routers = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const char *cp = TEST_DESCRIPTORS;
+    router_parse_list_from_string(&cp, NULL, routers, SAVED_NOWHERE,
+                                  0, 1, NULL, NULL);
+    n_routers = smartlist_len(routers);
+    SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(routers);
+  }
+  end = perftime();
+  printf("  router descriptors: %.2f usec per descriptor\n",
+         NANOCOUNT(start, end, iters * n_routers) / 1e3);
+  smartlist_free(routers);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns = networkstatus_parse_vote_from_string(
+                                     consensus, NULL, NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+    tor_assert(smartlist_len(ns->routerstatus_list) == n_entries);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("  consensus: %.2f msec per %d-entry consensus\n",
+         NANOCOUNT(start, end, iters) / 1e6, n_entries);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns = networkstatus_parse_consensus_lazily(consensus,
+                                                               NULL);
+    tor_assert(ns);
+    tor_assert(networkstatus_n_routerstatuses(ns) == n_entries);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("  consensus, lazily: %.2f msec per %d-entry consensus\n",
+         NANOCOUNT(start, end, iters) / 1e6, n_entries);
+}
+
+static void
+bench_dirparse(void)
+{
+  const int n_entries = 7000;
+  char *consensus = make_fake_consensus(n_entries);
+
+  printf("Scanning token tables:\n");
+  bench_dirparse_impl(consensus, n_entries);
+  routerparse_init();
+  printf("Using keyword indices:\n");
+  bench_dirparse_impl(consensus, n_entries);
+
+  tor_free(consensus);
+}
+
+/** Helper for bench_compression: time compressing and uncompressing
+ * <b>doc</b> with <b>method</b>. */
+static void
+bench_compression_impl(const char *name, const char *doc,
+                       compress_method_t method)
+{
+  const int iters = 10;
+  const size_t doc_len = strlen(doc);
+  const zlib_compression_level_t levels[] = {
+    HIGH_COMPRESSION, MEDIUM_COMPRESSION, LOW_COMPRESSION
+  };
+  const char *level_names[] = { "high", "medium", "low" };
+  char *compressed = NULL, *out = NULL;
+  size_t compressed_len = 0, out_len;
+  uint64_t start, end;
+  unsigned lvl;
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_free(compressed);
+    tor_assert(!tor_gzip_compress(&compressed, &compressed_len, doc, doc_len,
+                                  method));
+  }
+  end = perftime();
+  printf("  %s, %s: %lu -> %lu bytes; compress: %.2f msec\n",
+         name, compression_method_get_name(method),
+         (unsigned long)doc_len, (unsigned long)compressed_len,
+         NANOCOUNT(start, end, iters) / 1e6);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_assert(!tor_gzip_uncompress(&out, &out_len, compressed,
+                                    compressed_len, method, 1, LOG_WARN));
+    tor_assert(out_len == doc_len);
+    tor_free(out);
+  }
+  end = perftime();
+  printf("    uncompress: %.2f msec\n", NANOCOUNT(start, end, iters) / 1e6);
+
+  /* This is what we do when compressing a response on the fly. */
+  for (lvl = 0; lvl < ARRAY_LENGTH(levels); ++lvl) {
+    buf_t *buf = buf_new();
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      tor_zlib_state_t *state = tor_zlib_new(1, method, levels[lvl]);
+      size_t off;
+      tor_assert(state);
+      for (off = 0; off < doc_len; off += 8192) {
+        size_t n = MIN(8192, doc_len - off);
+        write_to_buf_zlib(buf, state, doc + off, n, 0);
+      }
+      write_to_buf_zlib(buf, state, "", 0, 1);
+      compressed_len = buf_datalen(buf);
+      buf_clear(buf);
+      tor_zlib_free(state);
+    }
+    end = perftime();
+    printf("    streaming, %s compression: %lu bytes; %.2f msec\n",
+           level_names[lvl], (unsigned long)compressed_len,
+           NANOCOUNT(start, end, iters) / 1e6);
+    buf_free(buf);
+  }
+
+  tor_free(compressed);
+}
+
+static void
+bench_compression(void)
+{
+  const compress_method_t methods[] = {
+    ZLIB_METHOD, GZIP_METHOD, ZSTD_METHOD
+  };
+  char *consensus = make_fake_consensus(7000);
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(methods); ++i) {
+    if (!tor_compress_supports_method(methods[i])) {
+      printf("%s: not supported\n", compression_method_get_name(methods[i]));
+      continue;
+    }
+    bench_compression_impl("7000-entry consensus", consensus, methods[i]);
+    bench_compression_impl("router descriptors", TEST_DESCRIPTORS,
+                           methods[i]);
+  }
+
+  tor_free(consensus);
+}
+
+/** Benchmark compare_tor_addr_to_addr_policy() against
+ * compare_tor_addr_to_compiled_policy() for an exit policy with a long
+ * blocklist in front of the default policy. */
+static void
+bench_policy(void)
+{
+  const int n_blocked = 2000, iters = 100000;
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *compiled;
+  config_line_t *lines = NULL, **next = &lines;
+  tor_addr_t *addrs;
+  uint16_t *ports;
+  uint64_t start, end;
+  int i, n_accepted = 0;
+
+  for (i = 0; i < n_blocked; ++i) {
+    *next = tor_malloc_zero(sizeof(config_line_t));
+    (*next)->key = tor_strdup("ExitPolicy");
+    tor_asprintf(&(*next)->value, "reject %d.%d.%d.0/24:*",
+                 1 + crypto_rand_int(223), crypto_rand_int(256),
+                 crypto_rand_int(256));
+    next = &(*next)->next;
+  }
+  tor_assert(!policies_parse_exit_policy(lines, &policy,
+                                         EXIT_POLICY_IPV6_ENABLED |
+                                         EXIT_POLICY_ADD_DEFAULT, 0));
+  config_free_lines(lines);
+
+  addrs = tor_calloc(1024, sizeof(tor_addr_t));
+  ports = tor_calloc(1024, sizeof(uint16_t));
+  for (i = 0; i < 1024; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(INT_MAX) | 0x01000000);
+    ports[i] = (i & 1) ? 443 : 1 + crypto_rand_int(65535);
+  }
+
+  reset_perftime();
+  start = perftime();
+  compiled = addr_policy_compile(policy);
+  end = perftime();
+  tor_assert(compiled);
+  printf("Compiling a %d-entry policy: %.2f msec\n",
+         smartlist_len(policy), NANOCOUNT(start, end, 1) / 1e6);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    n_accepted += compare_tor_addr_to_addr_policy(&addrs[i & 1023],
+                            ports[i & 1023], policy) == ADDR_POLICY_ACCEPTED;
+  }
+  end = perftime();
+  printf("Linear lookup: %.2f nsec per address\n",
+         NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    n_accepted -= compare_tor_addr_to_compiled_policy(&addrs[i & 1023],
+                            ports[i & 1023], compiled) == ADDR_POLICY_ACCEPTED;
+  }
+  end = perftime();
+  printf("Compiled lookup: %.2f nsec per address\n",
+         NANOCOUNT(start, end, iters));
+  tor_assert(n_accepted == 0);
+
+  compiled_addr_policy_free(compiled);
+  addr_policy_list_free(policy);
+  tor_free(addrs);
+  tor_free(ports);
+}
+
 static void
 bench_cell_ops(void)
 {
@@ -569,10 +1042,16 @@ typedef struct benchmark_t {
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(siphash),
+  ENT(rand),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
+  ENT(curve25519),
   ENT(ed25519),
+  ENT(ed25519_batch),
+  ENT(dirparse),
+  ENT(compression),
+  ENT(policy),
 
   ENT(cell_aes),
   ENT(cell_ops),
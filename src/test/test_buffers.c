@@ -510,6 +510,112 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+/** Release function for test_buffer_external: count the releases. */
+static void
+count_release(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffer_external(void *arg)
+{
+  char *ext = tor_malloc(4000);
+  char *expected = tor_malloc(4100);
+  char *out = tor_malloc(4100);
+  buf_t *buf = NULL, *buf2 = NULL;
+  size_t flushlen;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  int n_released = 0, n_released2 = 0;
+  (void)arg;
+
+  crypto_rand(ext, 4000);
+  memcpy(expected, "hello ", 6);
+  memcpy(expected+6, ext, 3000);
+  memcpy(expected+3006, "world", 5);
+
+  buf = buf_new();
+  write_to_buf("hello ", 6, buf);
+  tt_int_op(1006, OP_EQ,
+            write_to_buf_external(ext, 1000, buf, count_release,
+                                  &n_released));
+  /* This one directly follows the last, so it extends the same chunk. */
+  tt_int_op(3006, OP_EQ,
+            write_to_buf_external(ext+1000, 2000, buf, count_release,
+                                  &n_released));
+  tt_int_op(n_released, OP_EQ, 1);
+  /* Nothing gets written into the external chunk. */
+  tt_int_op(buf_slack(buf), OP_EQ, 0);
+  write_to_buf("world", 5, buf);
+  assert_buf_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, 3011);
+  tt_int_op(buf_allocation(buf), OP_LT, 3*4096);
+
+  /* A copy gets its own memory. */
+  buf2 = buf_copy(buf);
+  assert_buf_ok(buf2);
+  tt_int_op(n_released, OP_EQ, 1);
+  fetch_from_buf(out, 3011, buf2);
+  tt_mem_op(out, OP_EQ, expected, 3011);
+  buf_free(buf2);
+  buf2 = NULL;
+  tt_int_op(n_released, OP_EQ, 1);
+
+  /* Pulling up copies out of the external chunk, but doesn't release it
+   * until we've removed all of its bytes. */
+  buf_pullup(buf, 100, 0);
+  assert_buf_ok(buf);
+  tt_int_op(n_released, OP_EQ, 1);
+  fetch_from_buf(out, 3000, buf);
+  tt_mem_op(out, OP_EQ, expected, 3000);
+  tt_int_op(n_released, OP_EQ, 1);
+  fetch_from_buf(out, 11, buf);
+  tt_mem_op(out, OP_EQ, expected+3000, 11);
+  tt_int_op(n_released, OP_EQ, 2);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+  /* An external chunk at the front gets replaced by a copy if we need to
+   * pull up past it. */
+  write_to_buf_external(ext, 1000, buf, count_release, &n_released);
+  write_to_buf("world", 5, buf);
+  buf_pullup(buf, 1005, 0);
+  assert_buf_ok(buf);
+  tt_int_op(n_released, OP_EQ, 3);
+  fetch_from_buf(out, 1005, buf);
+  tt_mem_op(out, OP_EQ, ext, 1000);
+  tt_mem_op(out+1000, OP_EQ, "world", 5);
+
+  /* Flushing to a socket releases the bytes once they're written. */
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  write_to_buf("hello ", 6, buf);
+  write_to_buf_external(ext, 3000, buf, count_release, &n_released2);
+  write_to_buf("world", 5, buf);
+  flushlen = buf_datalen(buf);
+  tt_int_op(3011, OP_EQ, flush_buf(fds[0], buf, flushlen, &flushlen));
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(n_released2, OP_EQ, 1);
+  tt_int_op(3011, OP_EQ, tor_socket_recv(fds[1], out, 4100, 0));
+  tt_mem_op(out, OP_EQ, expected, 3011);
+
+  /* Freeing the buffer releases whatever's left. */
+  write_to_buf_external(ext, 3000, buf, count_release, &n_released2);
+  buf_free(buf);
+  buf = NULL;
+  tt_int_op(n_released2, OP_EQ, 2);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  tor_free(ext);
+  tor_free(expected);
+  tor_free(out);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -706,6 +812,7 @@ struct testcase_t buffer_tests[] = {
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
+  { "external", test_buffer_external, TT_FORK, NULL, NULL },
   { "zlib", test_buffers_zlib, TT_FORK, NULL, NULL },
   { "zlib_fin_with_nil", test_buffers_zlib_fin_with_nil, TT_FORK, NULL, NULL },
   { "zlib_fin_at_chunk_end", test_buffers_zlib_fin_at_chunk_end, TT_FORK,
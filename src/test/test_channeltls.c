@@ -4,6 +4,7 @@
 #include <math.h>
 
 #define TOR_CHANNEL_INTERNAL_
+#define CHANNELTLS_PRIVATE
 #include "or.h"
 #include "address.h"
 #include "buffers.h"
@@ -11,6 +12,8 @@
 #include "channeltls.h"
 #include "connection_or.h"
 #include "config.h"
+#include "cpuworker.h"
+#include "main.h"
 /* For init/free stuff */
 #include "scheduler.h"
 #include "tortls.h"
@@ -18,11 +21,15 @@
 /* Test suite stuff */
 #include "test.h"
 #include "fakechans.h"
+#include "test_helpers.h"
 
 /* The channeltls unit tests */
 static void test_channeltls_create(void *arg);
 static void test_channeltls_num_bytes_queued(void *arg);
 static void test_channeltls_overhead_estimate(void *arg);
+static void test_channeltls_verify_holds_cells(void *arg);
+static void test_channeltls_verify_inbuf_limit(void *arg);
+static void test_channeltls_verify_conn_freed(void *arg);
 
 /* Mocks used by channeltls unit tests */
 static size_t tlschan_buf_datalen_mock(const buf_t *buf);
@@ -32,6 +39,11 @@ static or_connection_t * tlschan_connection_or_connect_mock(
     const char *digest,
     channel_tls_t *tlschan);
 static int tlschan_is_local_addr_mock(const tor_addr_t *addr);
+static void tlschan_connection_stop_reading_mock(connection_t *conn);
+static void tlschan_connection_start_reading_mock(connection_t *conn);
+static void tlschan_connection_or_close_for_error_mock(
+    or_connection_t *orconn,
+    int flush);
 
 /* Fake close method */
 static void tlschan_fake_close_method(channel_t *chan);
@@ -41,6 +53,10 @@ static int tlschan_local = 0;
 static const buf_t * tlschan_buf_datalen_mock_target = NULL;
 static size_t tlschan_buf_datalen_mock_size = 0;
 
+static int tlschan_n_stop_reading = 0;
+static int tlschan_n_start_reading = 0;
+static int tlschan_n_close_for_error = 0;
+
 /* Thing to cast to fake tor_tls_t * to appease assert_connection_ok() */
 static int fake_tortls = 0; /* Bleh... */
 
@@ -251,6 +267,224 @@ test_channeltls_overhead_estimate(void *arg)
   return;
 }
 
+/* Make a fake channel whose orconn is partway through a v3 handshake, as
+ * the responder, with an empty inbuf. */
+static channel_t *
+tlschan_new_handshaking_chan(void)
+{
+  tor_addr_t test_addr;
+  channel_t *ch = NULL;
+  or_connection_t *conn;
+  const char test_digest[DIGEST_LEN] = {
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+    0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14 };
+
+  test_addr.family = AF_INET;
+  test_addr.addr.in_addr.s_addr = htonl(0x01020304);
+
+  tlschan_local = 0;
+  MOCK(is_local_addr, tlschan_is_local_addr_mock);
+  MOCK(connection_or_connect, tlschan_connection_or_connect_mock);
+  ch = channel_tls_connect(&test_addr, 567, test_digest);
+  UNMOCK(connection_or_connect);
+  UNMOCK(is_local_addr);
+  if (!ch)
+    return NULL;
+
+  conn = BASE_CHAN_TO_TLS(ch)->conn;
+  conn->base_.state = OR_CONN_STATE_OR_HANDSHAKING_V3;
+  conn->base_.inbuf = buf_new();
+  conn->link_proto = 3;
+  conn->handshake_state = tor_malloc_zero(sizeof(or_handshake_state_t));
+  conn->handshake_state->started_here = 0;
+
+  return ch;
+}
+
+/* Free a channel from tlschan_new_handshaking_chan(). */
+static void
+tlschan_free_handshaking_chan(channel_t *ch)
+{
+  or_connection_t *conn;
+
+  if (!ch)
+    return;
+
+  conn = BASE_CHAN_TO_TLS(ch)->conn;
+  or_handshake_state_free(conn->handshake_state);
+  conn->handshake_state = NULL;
+  buf_free(conn->base_.inbuf);
+  conn->base_.inbuf = NULL;
+
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  ch->close = tlschan_fake_close_method;
+  channel_mark_for_close(ch);
+  free_fake_channel(ch);
+  UNMOCK(scheduler_release_channel);
+}
+
+/* Add <b>n</b> empty VPADDING cells to <b>conn</b>'s inbuf. */
+static void
+tlschan_add_vpadding_cells(or_connection_t *conn, int n)
+{
+  /* circid (2 bytes at link protocol 3), command, length, payload */
+  static const char cell[] = { 0x00, 0x00, (char)CELL_VPADDING,
+                               0x00, 0x04, 'a', 'b', 'c', 'd' };
+  while (n--)
+    write_to_buf(cell, sizeof(cell), conn->base_.inbuf);
+}
+
+/* Start a fake check of an empty CERTS cell on <b>ch</b>, and hold on to
+ * it in the cpuworker mock. */
+static void
+tlschan_queue_fake_certs_job(channel_t *ch)
+{
+  channel_tls_verify_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->cell_command = CELL_CERTS;
+  job->started_here = 0;
+  job->severity = LOG_PROTOCOL_WARN;
+  channel_tls_queue_verify_job(BASE_CHAN_TO_TLS(ch), job);
+}
+
+static void
+tlschan_install_verify_mocks(void)
+{
+  tlschan_n_stop_reading = tlschan_n_start_reading = 0;
+  tlschan_n_close_for_error = 0;
+  mock_cpuworker_reset();
+  mock_cpuworker_defer = 1;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(connection_stop_reading, tlschan_connection_stop_reading_mock);
+  MOCK(connection_start_reading, tlschan_connection_start_reading_mock);
+  MOCK(connection_or_close_for_error,
+       tlschan_connection_or_close_for_error_mock);
+}
+
+static void
+tlschan_remove_verify_mocks(void)
+{
+  mock_cpuworker_reset();
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_or_close_for_error);
+}
+
+static void
+test_channeltls_verify_holds_cells(void *arg)
+{
+  channel_t *ch = NULL;
+  or_connection_t *conn;
+  size_t inbuf_len;
+
+  (void)arg;
+
+  tlschan_install_verify_mocks();
+  ch = tlschan_new_handshaking_chan();
+  tt_assert(ch);
+  conn = BASE_CHAN_TO_TLS(ch)->conn;
+
+  /* Handing off the job puts the connection in the verifying state. */
+  tlschan_queue_fake_certs_job(ch);
+  tt_int_op(mock_cpuworker_n_queued, ==, 1);
+  tt_assert(conn->handshake_state->verify_job);
+  tt_int_op(conn->handshake_state->received_certs_cell, ==, 0);
+
+  /* Cells that arrive now stay in the inbuf, and we stop reading. */
+  tlschan_add_vpadding_cells(conn, 2);
+  inbuf_len = buf_datalen(conn->base_.inbuf);
+  tt_int_op(connection_or_process_inbuf(conn), ==, 0);
+  tt_int_op(buf_datalen(conn->base_.inbuf), ==, inbuf_len);
+  tt_int_op(tlschan_n_stop_reading, ==, 1);
+  tt_int_op(tlschan_n_start_reading, ==, 0);
+
+  /* Once the answer comes back, we take the certificates, start reading
+   * again, and process the cells that were waiting. */
+  tt_int_op(mock_cpuworker_run_deferred(0), ==, 1);
+  tt_ptr_op(conn->handshake_state->verify_job, ==, NULL);
+  tt_int_op(conn->handshake_state->received_certs_cell, ==, 1);
+  tt_int_op(tlschan_n_start_reading, ==, 1);
+  tt_int_op(buf_datalen(conn->base_.inbuf), ==, 0);
+  tt_int_op(tlschan_n_close_for_error, ==, 0);
+  tt_int_op(conn->base_.marked_for_close, ==, 0);
+
+ done:
+  tlschan_free_handshaking_chan(ch);
+  tlschan_remove_verify_mocks();
+}
+
+static void
+test_channeltls_verify_inbuf_limit(void *arg)
+{
+  channel_t *ch = NULL;
+  or_connection_t *conn;
+
+  (void)arg;
+
+  tlschan_install_verify_mocks();
+  ch = tlschan_new_handshaking_chan();
+  tt_assert(ch);
+  conn = BASE_CHAN_TO_TLS(ch)->conn;
+
+  tlschan_queue_fake_certs_job(ch);
+  tt_assert(conn->handshake_state->verify_job);
+
+  /* A little data while we wait is fine... */
+  tlschan_add_vpadding_cells(conn, 100);
+  connection_or_process_inbuf(conn);
+  tt_int_op(tlschan_n_close_for_error, ==, 0);
+
+  /* ...but a peer that keeps sending gets cut off. */
+  tlschan_add_vpadding_cells(conn, 10000);
+  connection_or_process_inbuf(conn);
+  tt_int_op(tlschan_n_close_for_error, ==, 1);
+  tt_int_op(conn->base_.marked_for_close, ==, 1);
+
+  /* When the answer arrives, we don't resume a closed connection. */
+  tt_int_op(mock_cpuworker_run_deferred(0), ==, 1);
+  tt_ptr_op(conn->handshake_state->verify_job, ==, NULL);
+  tt_int_op(conn->handshake_state->received_certs_cell, ==, 0);
+  tt_int_op(tlschan_n_start_reading, ==, 0);
+
+ done:
+  tlschan_free_handshaking_chan(ch);
+  tlschan_remove_verify_mocks();
+}
+
+static void
+test_channeltls_verify_conn_freed(void *arg)
+{
+  channel_t *ch = NULL;
+  or_connection_t *conn;
+
+  (void)arg;
+
+  tlschan_install_verify_mocks();
+  ch = tlschan_new_handshaking_chan();
+  tt_assert(ch);
+  conn = BASE_CHAN_TO_TLS(ch)->conn;
+
+  tlschan_queue_fake_certs_job(ch);
+  tt_assert(conn->handshake_state->verify_job);
+  tlschan_add_vpadding_cells(conn, 2);
+  connection_or_process_inbuf(conn);
+
+  /* Freeing the connection frees its handshake state, which has to tell
+   * the job not to come back to it. */
+  or_handshake_state_free(conn->handshake_state);
+  conn->handshake_state = NULL;
+
+  /* The reply handler just throws the answer away. */
+  tt_int_op(mock_cpuworker_run_deferred(0), ==, 1);
+  tt_int_op(tlschan_n_start_reading, ==, 0);
+  tt_int_op(tlschan_n_close_for_error, ==, 0);
+  tt_int_op(buf_datalen(conn->base_.inbuf), ==, 18);
+
+ done:
+  tlschan_free_handshaking_chan(ch);
+  tlschan_remove_verify_mocks();
+}
+
 static size_t
 tlschan_buf_datalen_mock(const buf_t *buf)
 {
@@ -313,6 +547,29 @@ tlschan_fake_close_method(channel_t *chan)
   return;
 }
 
+static void
+tlschan_connection_stop_reading_mock(connection_t *conn)
+{
+  (void)conn;
+  ++tlschan_n_stop_reading;
+}
+
+static void
+tlschan_connection_start_reading_mock(connection_t *conn)
+{
+  (void)conn;
+  ++tlschan_n_start_reading;
+}
+
+static void
+tlschan_connection_or_close_for_error_mock(or_connection_t *orconn,
+                                           int flush)
+{
+  (void)flush;
+  orconn->base_.marked_for_close = 1;
+  ++tlschan_n_close_for_error;
+}
+
 static int
 tlschan_is_local_addr_mock(const tor_addr_t *addr)
 {
@@ -328,6 +585,12 @@ struct testcase_t channeltls_tests[] = {
     TT_FORK, NULL, NULL },
   { "overhead_estimate", test_channeltls_overhead_estimate,
     TT_FORK, NULL, NULL },
+  { "verify_holds_cells", test_channeltls_verify_holds_cells,
+    TT_FORK, NULL, NULL },
+  { "verify_inbuf_limit", test_channeltls_verify_inbuf_limit,
+    TT_FORK, NULL, NULL },
+  { "verify_conn_freed", test_channeltls_verify_conn_freed,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,317 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "consdiff.h"
+#include "dirserv.h"
+#include "test.h"
+
+/** Return a newly allocated consensus-like document, valid after
+ * <b>valid_after</b>, with one router entry for each of the <b>n_ids</b>
+ * identity bytes in <b>ids</b>, which must be in increasing order.  The
+ * router whose identity byte is <b>stable_id</b> gets the Stable flag, and
+ * the footer holds the signature <b>sig</b>. */
+static char *
+make_consensus(const char *valid_after, const int *ids, int n_ids,
+               int stable_id, const char *sig)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3\n"
+                         "vote-status consensus\n"
+                         "consensus-method 20\n"
+                         "valid-after %s\n"
+                         "known-flags Fast Running Stable Valid\n",
+                         valid_after);
+  for (i = 0; i < n_ids; ++i) {
+    char digest[DIGEST_LEN], b64[BASE64_DIGEST_LEN+1];
+    memset(digest, ids[i], sizeof(digest));
+    digest_to_base64(b64, digest);
+    smartlist_add_asprintf(chunks,
+                  "r router%d %s AAAAAAAAAAAAAAAAAAAAAAAAAAA "
+                  "2015-05-01 00:00:00 10.0.0.%d 9001 0\n"
+                  "s Fast Running%s Valid\n"
+                  "v Tor 0.2.6.7\n"
+                  "w Bandwidth=%d\n"
+                  "p reject 1-65535\n",
+                  ids[i], b64, ids[i], ids[i] == stable_id ? " Stable" : "",
+                  ids[i] * 10);
+  }
+  smartlist_add_asprintf(chunks,
+                         "directory-footer\n"
+                         "bandwidth-weights Wbd=0 Wbe=0\n"
+                         "directory-signature AAAA BBBB\n"
+                         "-----BEGIN SIGNATURE-----\n"
+                         "%s\n"
+                         "-----END SIGNATURE-----\n", sig);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static const int base_ids[] = { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19 };
+static const int target_ids[] = { 1, 3, 6, 7, 9, 11, 13, 15, 17, 19, 21 };
+
+static void
+test_consdiff_gen_apply(void *arg)
+{
+  char *base = NULL, *target = NULL, *diff = NULL, *result = NULL;
+  (void)arg;
+
+  base = make_consensus("2015-05-01 00:00:00", base_ids,
+                        ARRAY_LENGTH(base_ids), 9, "c2lnMQ==");
+  target = make_consensus("2015-05-01 01:00:00", target_ids,
+                          ARRAY_LENGTH(target_ids), 11, "c2lnMg==");
+
+  /* A router left, two arrived, two changed flags, and the header and
+   * footer changed: the diff should hold only those changes. */
+  diff = consdiff_gen_diff(base, target);
+  tt_assert(diff);
+  tt_assert(!strcmpstart(diff, CONSDIFF_VERSION_LINE "\nhash "));
+  tt_int_op(strlen(diff), OP_LT, strlen(target) / 2);
+  tt_assert(!strstr(diff, "router3 "));
+  tt_assert(strstr(diff, "router6 "));
+  tt_assert(strstr(diff, "router21 "));
+  tt_assert(!strstr(diff, "router5 "));
+
+  result = consdiff_apply_diff(base, diff);
+  tt_str_op(result, OP_EQ, target);
+  tor_free(result);
+  tor_free(diff);
+
+  /* The reverse works too. */
+  diff = consdiff_gen_diff(target, base);
+  tt_assert(diff);
+  result = consdiff_apply_diff(target, diff);
+  tt_str_op(result, OP_EQ, base);
+  tor_free(result);
+  tor_free(diff);
+
+  /* A diff between identical documents has no commands. */
+  diff = consdiff_gen_diff(base, base);
+  tt_assert(diff);
+  tt_int_op(strlen(diff), OP_EQ,
+            strlen(CONSDIFF_VERSION_LINE "\nhash  \n") +
+            2*HEX_DIGEST256_LEN);
+  result = consdiff_apply_diff(base, diff);
+  tt_str_op(result, OP_EQ, base);
+
+ done:
+  tor_free(base);
+  tor_free(target);
+  tor_free(diff);
+  tor_free(result);
+}
+
+static void
+test_consdiff_gen_failures(void *arg)
+{
+  static const int unsorted_ids[] = { 1, 5, 3 };
+  char *base = NULL, *target = NULL, *diff = NULL;
+  (void)arg;
+
+  base = make_consensus("2015-05-01 00:00:00", base_ids,
+                        ARRAY_LENGTH(base_ids), 9, "c2lnMQ==");
+
+  /* Routers out of order. */
+  target = make_consensus("2015-05-01 01:00:00", unsorted_ids,
+                          ARRAY_LENGTH(unsorted_ids), 0, "c2lnMg==");
+  tt_ptr_op(NULL, OP_EQ, consdiff_gen_diff(base, target));
+  tor_free(target);
+
+  /* A target line we couldn't put in a diff. */
+  target = make_consensus("2015-05-01 01:00:00", base_ids,
+                          ARRAY_LENGTH(base_ids), 9, ".");
+  tt_ptr_op(NULL, OP_EQ, consdiff_gen_diff(base, target));
+  tor_free(target);
+
+  /* No final newline. */
+  target = tor_strndup(base, strlen(base) - 1);
+  tt_ptr_op(NULL, OP_EQ, consdiff_gen_diff(base, target));
+
+ done:
+  tor_free(base);
+  tor_free(target);
+  tor_free(diff);
+}
+
+/** Return a newly allocated diff from <b>base</b>, claiming to produce a
+ * document with the hex SHA256 digest <b>target_hex</b>, with the ed
+ * commands <b>commands</b>. */
+static char *
+make_diff(const char *base, const char *target_hex, const char *commands)
+{
+  char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1];
+  char *diff;
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, sizeof(digest));
+  tor_asprintf(&diff, "%s\nhash %s %s\n%s", CONSDIFF_VERSION_LINE,
+               hex, target_hex, commands);
+  return diff;
+}
+
+static void
+test_consdiff_apply_failures(void *arg)
+{
+  const char *base = "one\ntwo\nthree\nfour\n";
+  char *other = NULL, *diff = NULL, *result = NULL, *cp;
+  char digest[DIGEST256_LEN], target_hex[HEX_DIGEST256_LEN+1];
+  (void)arg;
+
+  crypto_digest256(digest, "one\n2\nthree\nfive\n",
+                   strlen("one\n2\nthree\nfive\n"), DIGEST_SHA256);
+  base16_encode(target_hex, sizeof(target_hex), digest, sizeof(digest));
+
+  /* The well-formed diff works. */
+  diff = make_diff(base, target_hex, "4c\nfive\n.\n2c\n2\n.\n");
+  result = consdiff_apply_diff(base, diff);
+  tt_str_op(result, OP_EQ, "one\n2\nthree\nfive\n");
+  tor_free(result);
+
+  /* But not against some other document. */
+  other = tor_strdup("one\ntwo\nthree\nfour\nfive\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(other, diff));
+
+  /* Or if it doesn't produce what it promised. */
+  cp = strstr(diff, "five");
+  tt_assert(cp);
+  cp[0] = 'F';
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+  /* Commands in the wrong order, or touching. */
+  diff = make_diff(base, target_hex, "2c\n2\n.\n4c\nfive\n.\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "3d\n2,3d\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "2a\nx\n.\n2a\ny\n.\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+  /* Malformed commands. */
+  diff = make_diff(base, target_hex, "5d\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "0d\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "3,2d\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "2x\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "+2d\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "2c\nfoo\n");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "2d");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+  /* Malformed headers. */
+  diff = make_diff(base, "ABCD", "");
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  diff = make_diff(base, target_hex, "2d\n");
+  diff[strlen(CONSDIFF_VERSION_LINE)-1] = '2';
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+
+ done:
+  tor_free(other);
+  tor_free(diff);
+  tor_free(result);
+}
+
+static void
+test_consdiff_dirserv(void *arg)
+{
+  char *docs[6];
+  char digest[DIGEST256_LEN];
+  digests_t digests;
+  cached_dir_t *d = NULL;
+  char *result = NULL;
+  int i;
+  (void)arg;
+
+  memset(docs, 0, sizeof(docs));
+  memset(&digests, 0, sizeof(digests));
+  for (i = 0; i < 6; ++i) {
+    char va[ISO_TIME_LEN+1];
+    format_iso_time(va, 1430438400 + i*3600);
+    docs[i] = make_consensus(va, base_ids, ARRAY_LENGTH(base_ids),
+                             base_ids[i], "c2lnMQ==");
+  }
+
+  /* Nothing to diff from yet. */
+  dirserv_set_cached_consensus_networkstatus(docs[0], "ns", &digests, 0);
+  crypto_digest256(digest, docs[0], strlen(docs[0]), DIGEST_SHA256);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", digest));
+
+  /* Once a new consensus arrives, we can diff from the old one. */
+  dirserv_set_cached_consensus_networkstatus(docs[1], "ns", &digests, 0);
+  d = dirserv_get_consensus_diff("ns", digest);
+  tt_assert(d);
+  tt_assert(d->dir_z);
+  result = consdiff_apply_diff(docs[0], d->dir);
+  tt_str_op(result, OP_EQ, docs[1]);
+  tor_free(result);
+  /* The second time, we get the same diff back. */
+  tt_ptr_op(d, OP_EQ, dirserv_get_consensus_diff("ns", digest));
+  cached_dir_decref(d);
+  cached_dir_decref(d);
+  d = NULL;
+
+  /* Not for other flavors, or a consensus we never had. */
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("microdesc", digest));
+  crypto_digest256(digest, docs[5], strlen(docs[5]), DIGEST_SHA256);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", digest));
+  /* Or from the current consensus to itself. */
+  crypto_digest256(digest, docs[1], strlen(docs[1]), DIGEST_SHA256);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", digest));
+
+  /* When the consensus changes again, our diffs go to the new one. */
+  for (i = 2; i < 6; ++i)
+    dirserv_set_cached_consensus_networkstatus(docs[i], "ns", &digests, 0);
+  crypto_digest256(digest, docs[2], strlen(docs[2]), DIGEST_SHA256);
+  d = dirserv_get_consensus_diff("ns", digest);
+  tt_assert(d);
+  result = consdiff_apply_diff(docs[2], d->dir);
+  tt_str_op(result, OP_EQ, docs[5]);
+  tor_free(result);
+  cached_dir_decref(d);
+  d = NULL;
+
+  /* ... and we've forgotten the oldest ones. */
+  crypto_digest256(digest, docs[1], strlen(docs[1]), DIGEST_SHA256);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", digest));
+
+ done:
+  cached_dir_decref(d);
+  tor_free(result);
+  for (i = 0; i < 6; ++i)
+    tor_free(docs[i]);
+  dirserv_free_all();
+}
+
+#define CONSDIFF_TEST(name, flags)                          \
+  { #name, test_consdiff_ ## name, (flags), NULL, NULL }
+
+struct testcase_t consdiff_tests[] = {
+  CONSDIFF_TEST(gen_apply, 0),
+  CONSDIFF_TEST(gen_failures, 0),
+  CONSDIFF_TEST(apply_failures, 0),
+  CONSDIFF_TEST(dirserv, TT_FORK),
+  END_OF_TESTCASES
+};
+
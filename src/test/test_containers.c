@@ -4,6 +4,7 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define CONTAINER_PRIVATE
 #include "or.h"
 #include "fp_pair.h"
 #include "test.h"
@@ -845,6 +846,126 @@ test_container_strmap(void *arg)
   tor_free(v105);
 }
 
+/** Run unit tests for digest-to-void* map functions, checking them against
+ * the chained hash table implementation. */
+static void
+test_container_digestmap(void *arg)
+{
+  digestmap_t *map = digestmap_new();
+  digestmap_ht_t *ref = digestmap_ht_new();
+  digest256map_t *map256 = digest256map_new();
+  digestmap_iter_t *iter;
+  smartlist_t *keys = smartlist_new();
+  char d[DIGEST_LEN];
+  uint8_t d256[DIGEST256_LEN];
+  const char *k;
+  void *v;
+  int i, n_seen;
+  const int n_keys = 2000;
+  (void)arg;
+
+  tt_int_op(digestmap_size(map), OP_EQ, 0);
+  tt_assert(digestmap_isempty(map));
+  memset(d, 7, sizeof(d));
+  tt_ptr_op(digestmap_get(map, d), OP_EQ, NULL);
+  tt_ptr_op(digestmap_remove(map, d), OP_EQ, NULL);
+  digestmap_assert_ok(map);
+
+  /* Keys that share their first bytes, and therefore all of their hash
+   * bits if the hash were weak, plus random ones. */
+  for (i = 0; i < n_keys; ++i) {
+    if (i < n_keys / 4) {
+      memset(d, 'x', sizeof(d));
+      set_uint32(d + DIGEST_LEN - 4, i);
+    } else {
+      crypto_rand(d, sizeof(d));
+    }
+    smartlist_add(keys, tor_memdup(d, DIGEST_LEN));
+  }
+
+  /* Mix sets, overwrites, and removes, and check against the reference. */
+  for (i = 0; i < 20000; ++i) {
+    const char *key = smartlist_get(keys, crypto_rand_int(n_keys));
+    void *val = (void*)(uintptr_t)(i + 1);
+    switch (crypto_rand_int(3)) {
+      case 0:
+      case 1:
+        tt_ptr_op(digestmap_set(map, key, val), OP_EQ,
+                  digestmap_ht_set(ref, key, val));
+        break;
+      case 2:
+        tt_ptr_op(digestmap_remove(map, key), OP_EQ,
+                  digestmap_ht_remove(ref, key));
+        break;
+    }
+    if ((i % 1000) == 0)
+      digestmap_assert_ok(map);
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, digestmap_ht_size(ref));
+  SMARTLIST_FOREACH(keys, const char *, key,
+    tt_ptr_op(digestmap_get(map, key), OP_EQ, digestmap_ht_get(ref, key)));
+
+  /* Iterate, removing every other entry: we should see each entry once. */
+  n_seen = 0;
+  for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter); ) {
+    digestmap_iter_get(iter, &k, &v);
+    tt_ptr_op(v, OP_EQ, digestmap_ht_get(ref, k));
+    tt_ptr_op(v, OP_NE, NULL);
+    if (n_seen++ & 1) {
+      digestmap_ht_set(ref, k, (void*)(uintptr_t)0xdead);
+      iter = digestmap_iter_next(map, iter);
+    } else {
+      tt_ptr_op(digestmap_ht_remove(ref, k), OP_EQ, v);
+      iter = digestmap_iter_next_rmv(map, iter);
+    }
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, digestmap_ht_size(ref));
+  tt_int_op(n_seen - n_seen / 2, OP_EQ, n_seen - digestmap_size(map));
+  DIGESTMAP_FOREACH(map, key, void *, val) {
+    tt_ptr_op(digestmap_ht_get(ref, key), OP_EQ, (void*)(uintptr_t)0xdead);
+    tt_ptr_op(val, OP_NE, NULL);
+  } DIGESTMAP_FOREACH_END;
+
+  /* Removing everything leaves an empty map that we can still use. */
+  SMARTLIST_FOREACH(keys, const char *, key, digestmap_remove(map, key));
+  digestmap_assert_ok(map);
+  tt_assert(digestmap_isempty(map));
+  tt_assert(digestmap_iter_done(digestmap_iter_init(map)));
+  digestmap_set(map, smartlist_get(keys, 0), (void*)1);
+  tt_ptr_op(digestmap_get(map, smartlist_get(keys, 0)), OP_EQ, (void*)1);
+  digestmap_assert_ok(map);
+
+  /* 256-bit keys work the same way. */
+  for (i = 0; i < 1000; ++i) {
+    memset(d256, 0, sizeof(d256));
+    set_uint32(d256 + DIGEST256_LEN - 4, i);
+    tt_ptr_op(digest256map_set(map256, d256, (void*)(uintptr_t)(i+1)),
+              OP_EQ, NULL);
+  }
+  digest256map_assert_ok(map256);
+  tt_int_op(digest256map_size(map256), OP_EQ, 1000);
+  for (i = 0; i < 1000; ++i) {
+    memset(d256, 0, sizeof(d256));
+    set_uint32(d256 + DIGEST256_LEN - 4, i);
+    tt_ptr_op(digest256map_get(map256, d256), OP_EQ,
+              (void*)(uintptr_t)(i+1));
+    if (i & 1)
+      tt_ptr_op(digest256map_remove(map256, d256), OP_EQ,
+                (void*)(uintptr_t)(i+1));
+  }
+  digest256map_assert_ok(map256);
+  tt_int_op(digest256map_size(map256), OP_EQ, 500);
+
+ done:
+  digestmap_free(map, NULL);
+  digestmap_ht_free(ref, NULL);
+  digest256map_free(map256, NULL);
+  SMARTLIST_FOREACH(keys, char *, cp, tor_free(cp));
+  smartlist_free(keys);
+}
+
 /** Run unit tests for getting the median of a list. */
 static void
 test_container_order_functions(void *arg)
@@ -1057,6 +1178,7 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
   CONTAINER_LEGACY(strmap),
+  CONTAINER(digestmap, 0),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
@@ -14,6 +14,10 @@
 #include "crypto_ed25519.h"
 #include "ed25519_vectors.inc"
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 extern const char AUTHORITY_SIGNKEY_3[];
 extern const char AUTHORITY_SIGNKEY_A_DIGEST[];
 extern const char AUTHORITY_SIGNKEY_A_DIGEST256[];
@@ -105,6 +109,92 @@ test_crypto_rng(void *arg)
   ;
 }
 
+/** Run unit tests for the fast per-thread RNG. */
+static void
+test_crypto_rng_fast(void *arg)
+{
+  crypto_fast_rng_t *rng = NULL, *rng2 = NULL;
+  uint8_t data1[100], data2[100], big[10000];
+  int i, allok = 1;
+  (void)arg;
+
+  rng = crypto_fast_rng_new();
+  rng2 = crypto_fast_rng_new();
+
+  /* Two generators give different streams; one generator doesn't repeat
+   * itself. */
+  crypto_fast_rng_getbytes(rng, data1, sizeof(data1));
+  crypto_fast_rng_getbytes(rng2, data2, sizeof(data2));
+  tt_mem_op(data1,OP_NE, data2,sizeof(data1));
+  crypto_fast_rng_getbytes(rng, data2, sizeof(data2));
+  tt_mem_op(data1,OP_NE, data2,sizeof(data1));
+
+  /* Requests bigger than the buffer work, and aren't all zero. */
+  memset(big, 0, sizeof(big));
+  crypto_fast_rng_getbytes(rng, big, sizeof(big));
+  tt_assert(! tor_mem_is_zero((char*)big+sizeof(big)-100, 100));
+  tt_assert(! tor_mem_is_zero((char*)big, 100));
+
+  for (i = 0; i < 1000; ++i) {
+    unsigned u = crypto_fast_rng_get_uint(rng, 100);
+    uint64_t u64 = crypto_fast_rng_get_uint64(rng, U64_LITERAL(1)<<40);
+    double d = crypto_fast_rng_get_double(rng);
+    int j = crypto_fast_rand_int(5);
+    if (u >= 100 || u64 >= (U64_LITERAL(1)<<40) || d < 0 || d >= 1.0 ||
+        j < 0 || j >= 5)
+      allok = 0;
+  }
+  tt_assert(allok);
+
+  /* The per-thread generator persists until we destroy it. */
+  tt_ptr_op(get_thread_fast_rng(), OP_EQ, get_thread_fast_rng());
+  destroy_thread_fast_rng();
+  crypto_fast_rand((char*)data1, sizeof(data1));
+  tt_assert(! tor_mem_is_zero((char*)data1, sizeof(data1)));
+
+ done:
+  crypto_fast_rng_free(rng);
+  crypto_fast_rng_free(rng2);
+}
+
+#ifndef _WIN32
+/** Make sure that a forked child doesn't repeat its parent's fast-RNG
+ * output. */
+static void
+test_crypto_rng_fast_fork(void *arg)
+{
+  crypto_fast_rng_t *rng = NULL;
+  uint8_t parent_out[32], child_out[32];
+  int fd[2] = { -1, -1 };
+  pid_t pid;
+  (void)arg;
+
+  rng = crypto_fast_rng_new();
+  tt_int_op(0, OP_EQ, pipe(fd));
+
+  pid = fork();
+  tt_int_op(pid, OP_GE, 0);
+  if (pid == 0) {
+    crypto_fast_rng_getbytes(rng, child_out, sizeof(child_out));
+    if (write_all(fd[1], (char*)child_out, sizeof(child_out), 0) < 0)
+      exit(1);
+    exit(0);
+  }
+  crypto_fast_rng_getbytes(rng, parent_out, sizeof(parent_out));
+  tt_int_op(sizeof(child_out), OP_EQ,
+            read_all(fd[0], (char*)child_out, sizeof(child_out), 0));
+  waitpid(pid, NULL, 0);
+  tt_mem_op(parent_out,OP_NE, child_out,sizeof(parent_out));
+
+ done:
+  crypto_fast_rng_free(rng);
+  if (fd[0] >= 0)
+    close(fd[0]);
+  if (fd[1] >= 0)
+    close(fd[1]);
+}
+#endif
+
 /** Run unit tests for our AES functionality */
 static void
 test_crypto_aes(void *arg)
@@ -1023,6 +1113,28 @@ test_crypto_curve25519_impl(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_crypto_curve25519_basepoint(void *arg)
+{
+  uint8_t sk[32], pk[32], pk_ladder[32];
+  static const uint8_t basepoint[32] = {9};
+  int i;
+
+  (void)arg;
+
+  tt_int_op(0, OP_EQ, curve25519_init());
+
+  for (i = 0; i < 32; ++i) {
+    crypto_rand((char*)sk, sizeof(sk));
+    tt_int_op(0, OP_EQ, curve25519_impl(pk_ladder, sk, basepoint));
+    tt_int_op(0, OP_EQ, curve25519_basepoint_impl(pk, sk));
+    tt_mem_op(pk, OP_EQ, pk_ladder, 32);
+  }
+
+ done:
+  ;
+}
+
 static void
 test_crypto_curve25519_wrappers(void *arg)
 {
@@ -1233,6 +1345,137 @@ test_crypto_ed25519_simple(void *arg)
   ;
 }
 
+static void
+test_crypto_ed25519_batch(void *arg)
+{
+  const int n = 50;
+  ed25519_keypair_t kp[4];
+  ed25519_checkable_t *ch = NULL;
+  uint8_t *msgs = NULL;
+  int *okay = NULL;
+  int i;
+
+  (void)arg;
+
+  ch = tor_malloc_zero(sizeof(ed25519_checkable_t) * n);
+  msgs = tor_malloc_zero(32 * n);
+  okay = tor_malloc_zero(sizeof(int) * n);
+
+  for (i = 0; i < 4; ++i)
+    tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp[i], 0));
+  for (i = 0; i < n; ++i) {
+    crypto_rand((char*)msgs + 32*i, 32);
+    ch[i].pubkey = &kp[i % 4].pubkey;
+    ch[i].msg = msgs + 32*i;
+    ch[i].len = 32;
+    tt_int_op(0, OP_EQ, ed25519_sign(&ch[i].signature, msgs + 32*i, 32,
+                                     &kp[i % 4]));
+  }
+
+  /* All good. */
+  tt_int_op(0, OP_EQ, ed25519_checksig_batch(okay, ch, n));
+  for (i = 0; i < n; ++i)
+    tt_int_op(okay[i], OP_EQ, 1);
+
+  /* A bad signature, and a wrong key. */
+  ch[3].signature.sig[40] ^= 1;
+  ch[45].pubkey = &kp[0].pubkey;
+  tt_int_op(-2, OP_EQ, ed25519_checksig_batch(okay, ch, n));
+  for (i = 0; i < n; ++i)
+    tt_int_op(okay[i], OP_EQ, (i != 3 && i != 45));
+  ch[3].signature.sig[40] ^= 1;
+  ch[45].pubkey = &kp[1].pubkey;
+
+  /* A non-canonical s is rejected even when the rest of the batch is fine. */
+  ch[7].signature.sig[63] |= 0x80;
+  tt_int_op(-1, OP_EQ, ed25519_checksig_batch(okay, ch, n));
+  tt_int_op(okay[7], OP_EQ, 0);
+  tt_int_op(okay[8], OP_EQ, 1);
+
+ done:
+  tor_free(ch);
+  tor_free(msgs);
+  tor_free(okay);
+}
+
+/** Find a one-byte message in *<b>ch</b> for which ed25519_checksig()
+ * rejects the signature, which happens unless the challenge hash is a
+ * multiple of the torsion point's order.  Return 0 on success. */
+static int
+ed25519_find_rejected_msg(ed25519_checkable_t *ch, uint8_t *msg,
+                          const ed25519_keypair_t *kp)
+{
+  int i;
+  for (i = 0; i < 256; ++i) {
+    *msg = (uint8_t)i;
+    if (kp && ed25519_sign(&ch->signature, msg, 1, kp) < 0)
+      return -1;
+    if (ed25519_checksig(&ch->signature, msg, 1, ch->pubkey) < 0)
+      return 0;
+  }
+  return -1;
+}
+
+static void
+test_crypto_ed25519_batch_torsion(void *arg)
+{
+  /* A point of order 8, and the public key for a seed of 32 0x42 bytes
+   * with that point added to it. */
+  const char t8_hex[] =
+    "c7176a703d4dd84fba3c0b760d10670f2a2053fa2c39ccc64ec7fd7792ac037a";
+  const char mixed_hex[] =
+    "70800703461b8dcbf9a4a6661ef74b8f946a38ccda26da8f3a8a8f5fcd945766";
+  const int n = 10;
+  ed25519_keypair_t kp, mixed_kp;
+  ed25519_public_key_t small_pk;
+  ed25519_checkable_t ch[10];
+  uint8_t msgs[10];
+  int okay[10];
+  uint8_t seed[32];
+  int i;
+
+  (void)arg;
+
+  memset(ch, 0, sizeof(ch));
+  tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp, 0));
+  for (i = 0; i < n; ++i) {
+    msgs[i] = (uint8_t)i;
+    ch[i].pubkey = &kp.pubkey;
+    ch[i].msg = &msgs[i];
+    ch[i].len = 1;
+    tt_int_op(0, OP_EQ, ed25519_sign(&ch[i].signature, &msgs[i], 1, &kp));
+  }
+
+  /* A small-order public key, with R the identity and s = 0: 8*(sB - R -
+   * hA) is always the identity, but sB - R - hA usually isn't. */
+  base16_decode((char*)small_pk.pubkey, 32, t8_hex, 64);
+  ch[2].pubkey = &small_pk;
+  memset(ch[2].signature.sig, 0, 64);
+  ch[2].signature.sig[0] = 1;
+  tt_int_op(0, OP_EQ, ed25519_find_rejected_msg(&ch[2], &msgs[2], NULL));
+
+  /* A mixed-order public key, signed with the secret key for its
+   * prime-order part. */
+  memset(seed, 0x42, sizeof(seed));
+  tt_int_op(0, OP_EQ, ed25519_secret_key_from_seed(&mixed_kp.seckey, seed));
+  base16_decode((char*)mixed_kp.pubkey.pubkey, 32, mixed_hex, 64);
+  ch[7].pubkey = &mixed_kp.pubkey;
+  tt_int_op(0, OP_EQ, ed25519_find_rejected_msg(&ch[7], &msgs[7],
+                                                &mixed_kp));
+
+  /* Both are rejected, and nothing else is. */
+  tt_int_op(-2, OP_EQ, ed25519_checksig_batch(okay, ch, n));
+  for (i = 0; i < n; ++i)
+    tt_int_op(okay[i], OP_EQ, (i != 2 && i != 7));
+  tt_int_op(-1, OP_EQ, ed25519_checksig_batch(okay, ch + 5, 3));
+  tt_int_op(okay[0], OP_EQ, 1);
+  tt_int_op(okay[1], OP_EQ, 1);
+  tt_int_op(okay[2], OP_EQ, 0);
+
+ done:
+  ;
+}
+
 static void
 test_crypto_ed25519_test_vectors(void *arg)
 {
@@ -1605,6 +1848,10 @@ test_crypto_siphash(void *arg)
 struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
+  { "rng_fast", test_crypto_rng_fast, 0, NULL, NULL },
+#ifndef _WIN32
+  { "rng_fast_fork", test_crypto_rng_fast_fork, TT_FORK, NULL, NULL },
+#endif
   { "aes_AES", test_crypto_aes, TT_FORK, &passthrough_setup, (void*)"aes" },
   { "aes_EVP", test_crypto_aes, TT_FORK, &passthrough_setup, (void*)"evp" },
   CRYPTO_LEGACY(sha),
@@ -1621,10 +1868,14 @@ struct testcase_t crypto_tests[] = {
   { "hkdf_sha256", test_crypto_hkdf_sha256, 0, NULL, NULL },
   { "curve25519_impl", test_crypto_curve25519_impl, 0, NULL, NULL },
   { "curve25519_impl_hibit", test_crypto_curve25519_impl, 0, NULL, (void*)"y"},
+  { "curve25519_basepoint", test_crypto_curve25519_basepoint, 0, NULL, NULL },
   { "curve25519_wrappers", test_crypto_curve25519_wrappers, 0, NULL, NULL },
   { "curve25519_encode", test_crypto_curve25519_encode, 0, NULL, NULL },
   { "curve25519_persist", test_crypto_curve25519_persist, 0, NULL, NULL },
   { "ed25519_simple", test_crypto_ed25519_simple, 0, NULL, NULL },
+  { "ed25519_batch", test_crypto_ed25519_batch, 0, NULL, NULL },
+  { "ed25519_batch_torsion", test_crypto_ed25519_batch_torsion, 0, NULL,
+    NULL },
   { "ed25519_test_vectors", test_crypto_ed25519_test_vectors, 0, NULL, NULL },
   { "ed25519_encode", test_crypto_ed25519_encode, 0, NULL, NULL },
   { "ed25519_convert", test_crypto_ed25519_convert, 0, NULL, NULL },
@@ -12,8 +12,11 @@
 #define ROUTERLIST_PRIVATE
 #define HIBERNATE_PRIVATE
 #define NETWORKSTATUS_PRIVATE
+#define ROUTERPARSE_PRIVATE
+#define SIGCACHE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -22,7 +25,9 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 #include "test.h"
+#include "test_helpers.h"
 
 static void
 test_dir_nicknames(void *arg)
@@ -568,6 +573,88 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+static void
+test_dir_parse_router_list_parallel(void *arg)
+{
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *serial = smartlist_new(), *parallel = smartlist_new();
+  smartlist_t *serial_bad = smartlist_new(), *parallel_bad = smartlist_new();
+  const size_t old_min_len = dirparse_parallel_min_len;
+  const size_t old_range_len = dirparse_parallel_range_len;
+  char *list = NULL;
+  const char *cp;
+  int i;
+  (void) arg;
+
+  mock_cpuworker_reset();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  for (i = 0; i < 20; ++i) {
+    smartlist_add_asprintf(chunks, "@downloaded-at 2015-03-%02d 00:00:00\n"
+                           "@source \"127.0.0.1\"\n", i+1);
+    smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL));
+    smartlist_add(chunks, tor_strdup(EX_RI_BAD_PORTS));
+    smartlist_add(chunks, tor_strdup("@source \"127.0.0.2\"\n"));
+    smartlist_add(chunks, tor_strdup(EX_RI_MAXIMAL));
+    smartlist_add(chunks, tor_strdup(EX_EI_MINIMAL));
+    smartlist_add(chunks, tor_strdup(EX_RI_BAD_FAMILY));
+  }
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  /* Parse the routers in one piece. */
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_from_string(&cp, NULL, serial, SAVED_IN_CACHE,
+                                          0, 1, NULL, serial_bad));
+  tt_int_op(40, OP_EQ, smartlist_len(serial));
+  tt_int_op(40, OP_EQ, smartlist_len(serial_bad));
+  tt_int_op(0, OP_EQ, mock_cpuworker_n_queued);
+
+  /* Now split them into lots of small ranges, and make sure that we get
+   * the same results in the same order. */
+  dirparse_parallel_min_len = 0;
+  dirparse_parallel_range_len = 2000;
+  cp = list;
+  tt_int_op(0, OP_EQ,
+            router_parse_list_from_string(&cp, NULL, parallel, SAVED_IN_CACHE,
+                                          0, 1, NULL, parallel_bad));
+  tt_int_op(mock_cpuworker_n_queued, OP_GT, 0);
+  tt_ptr_op(cp, OP_EQ, list + strlen(list));
+  tt_int_op(smartlist_len(serial), OP_EQ, smartlist_len(parallel));
+  tt_int_op(smartlist_len(serial_bad), OP_EQ, smartlist_len(parallel_bad));
+  for (i = 0; i < smartlist_len(serial); ++i) {
+    routerinfo_t *r1 = smartlist_get(serial, i);
+    routerinfo_t *r2 = smartlist_get(parallel, i);
+    tt_mem_op(r1->cache_info.signed_descriptor_digest, OP_EQ,
+              r2->cache_info.signed_descriptor_digest, DIGEST_LEN);
+    tt_int_op(r1->cache_info.saved_offset, OP_EQ,
+              r2->cache_info.saved_offset);
+    tt_int_op(r1->cache_info.annotations_len, OP_EQ,
+              r2->cache_info.annotations_len);
+  }
+  for (i = 0; i < smartlist_len(serial_bad); ++i) {
+    tt_mem_op(smartlist_get(serial_bad, i), OP_EQ,
+              smartlist_get(parallel_bad, i), DIGEST_LEN);
+  }
+
+ done:
+  dirparse_parallel_min_len = old_min_len;
+  dirparse_parallel_range_len = old_range_len;
+  UNMOCK(cpuworker_queue_work);
+  mock_cpuworker_reset();
+  tor_free(list);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  SMARTLIST_FOREACH(serial, routerinfo_t *, r, routerinfo_free(r));
+  SMARTLIST_FOREACH(parallel, routerinfo_t *, r, routerinfo_free(r));
+  SMARTLIST_FOREACH(serial_bad, char *, d, tor_free(d));
+  SMARTLIST_FOREACH(parallel_bad, char *, d, tor_free(d));
+  smartlist_free(serial);
+  smartlist_free(parallel);
+  smartlist_free(serial_bad);
+  smartlist_free(parallel_bad);
+}
+
 static download_status_t dls_minimal;
 static download_status_t dls_maximal;
 static download_status_t dls_bad_fingerprint;
@@ -1761,7 +1848,7 @@ test_a_networkstatus(
   networkstatus_voter_info_t *voter;
   document_signature_t *sig;
   networkstatus_t *vote=NULL, *v1=NULL, *v2=NULL, *v3=NULL, *con=NULL,
-    *con_md=NULL;
+    *con_md=NULL, *con_lazy=NULL;
   vote_routerstatus_t *vrs;
   routerstatus_t *rs;
   int idx, n_rs, n_vrs;
@@ -2039,6 +2126,49 @@ test_a_networkstatus(
     rs_test(rs, now);
   }
 
+  /* Parse it again lazily: we should get the same routerstatuses, in the
+   * same order, but only when we ask for them. */
+  con_lazy = networkstatus_parse_consensus_lazily(consensus_text, NULL);
+  tt_assert(con_lazy);
+  tt_assert(con_lazy->lazy_entries);
+  tt_ptr_op(con_lazy->routerstatus_list, OP_EQ, NULL);
+  tt_int_op(networkstatus_n_routerstatuses(con_lazy), OP_EQ, n_rs);
+  rs = NULL;
+  for (idx = n_rs - 1; idx >= 0; --idx) {
+    const routerstatus_t *rs_eager = smartlist_get(con->routerstatus_list,
+                                                   idx);
+    int found = 0;
+    tt_int_op(idx, OP_EQ,
+              networkstatus_vote_find_entry_idx(con_lazy,
+                                                rs_eager->identity_digest,
+                                                &found));
+    tt_assert(found);
+    tt_assert(! con_lazy->lazy_entries->parsed[idx]);
+    rs = networkstatus_vote_find_mutable_entry(con_lazy,
+                                               rs_eager->identity_digest);
+    tt_ptr_op(rs, OP_EQ, networkstatus_get_routerstatus_by_idx(con_lazy,
+                                                                idx));
+    tt_ptr_op(rs, OP_EQ,
+              networkstatus_get_parsed_routerstatus_by_idx(con_lazy, idx));
+    tt_str_op(rs->nickname, OP_EQ, rs_eager->nickname);
+    tt_mem_op(rs->descriptor_digest, OP_EQ, rs_eager->descriptor_digest,
+              DIGEST256_LEN);
+    rs_test(rs, now);
+  }
+  /* Once every entry is parsed, we drop their text, but we can still find
+   * them by descriptor digest without building a list. */
+  tt_assert(con_lazy->lazy_entries);
+  tt_int_op(con_lazy->lazy_entries->n_unparsed, OP_EQ, 0);
+  tt_ptr_op(con_lazy->lazy_entries->body, OP_EQ, NULL);
+  tt_ptr_op(rs, OP_EQ,
+            router_get_mutable_consensus_status_by_descriptor_digest(
+                                      con_lazy, rs->descriptor_digest));
+  tt_ptr_op(con_lazy->routerstatus_list, OP_EQ, NULL);
+  tt_int_op(smartlist_len(networkstatus_get_routerstatus_list(con_lazy)),
+            OP_EQ, n_rs);
+  tt_ptr_op(con_lazy->lazy_entries, OP_EQ, NULL);
+  tt_ptr_op(rs, OP_EQ, smartlist_get(con_lazy->routerstatus_list, 0));
+
   /* Check signatures.  the first voter is a pseudo-entry with a legacy key.
    * The second one hasn't signed.  The fourth one has signed: validate it. */
   voter = smartlist_get(con->voters, 1);
@@ -2207,6 +2337,8 @@ test_a_networkstatus(
     networkstatus_vote_free(con);
   if (con_md)
     networkstatus_vote_free(con_md);
+  if (con_lazy)
+    networkstatus_vote_free(con_lazy);
   if (sign_skey_1)
     crypto_pk_free(sign_skey_1);
   if (sign_skey_2)
@@ -2400,6 +2532,87 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_random_weighted_cumulative(void *testdata)
+{
+  int histogram[10];
+  uint64_t vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=0;
+  uint64_t cumulative[17];
+  int i, j, k, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  memset(cumulative,0,sizeof(cumulative));
+  tt_int_op(choose_array_element_by_cumulative_weight(cumulative, 0),
+            OP_EQ, -1);
+
+  /* Same distribution as in test_dir_random_weighted. */
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<10; ++i) {
+    total += vals[i];
+    cumulative[i] = total;
+  }
+  tt_u64_op(total, OP_EQ, 45);
+  for (i=0; i<n; ++i) {
+    choice = choose_array_element_by_cumulative_weight(cumulative, 10);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* For every length up to 17, and every position, an array where only that
+   * position has any weight should always give us that position. */
+  for (i = 1; i <= 17; ++i) {
+    for (j = 0; j < i; ++j) {
+      for (k = 0; k < i; ++k)
+        cumulative[k] = (k < j) ? 0 : 1000;
+      for (k = 0; k < 20; ++k) {
+        choice = choose_array_element_by_cumulative_weight(cumulative, i);
+        tt_int_op(choice, OP_EQ, j);
+      }
+    }
+  }
+
+  /* An array of zeros: we should choose randomly. */
+  memset(histogram,0,sizeof(histogram));
+  memset(cumulative,0,sizeof(cumulative));
+  for (i = 0; i < n; ++i) {
+    choice = choose_array_element_by_cumulative_weight(cumulative, 5);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  max_sq_error = 0;
+  for (i=0; i<5; ++i) {
+    int expected = n/5;
+    double frac_diff = 0, sq;
+    frac_diff = (histogram[i] - expected) / ((double)expected);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+ done:
+  ;
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -2954,6 +3167,57 @@ test_dir_fetch_type(void *arg)
  done: ;
 }
 
+static void
+test_dir_accept_encoding(void *arg)
+{
+  cached_dir_t *d = NULL, *r = NULL, *r2 = NULL;
+  char *body = NULL;
+  size_t body_len;
+  (void)arg;
+
+  tt_int_op(parse_accept_encoding_header(""), OP_EQ, 0);
+  tt_int_op(parse_accept_encoding_header("deflate"), OP_EQ,
+            1u << ZLIB_METHOD);
+  tt_int_op(parse_accept_encoding_header(
+                      "x-zstd, deflate,gzip ,identity, br"), OP_EQ,
+            (1u << ZSTD_METHOD) | (1u << ZLIB_METHOD) |
+            (1u << GZIP_METHOD) | (1u << NO_METHOD));
+  tt_int_op(parse_accept_encoding_header("x-gzip;q=0.5, x-zstd ; q=1"),
+            OP_EQ, (1u << GZIP_METHOD) | (1u << ZSTD_METHOD));
+
+  /* Asking for zlib gets you the original. */
+  d = new_cached_dir(tor_strdup("network-status-version 3\n"
+                                "This is not much of a consensus.\n"),
+                     time(NULL));
+  r = cached_dir_get_recompressed(d, ZLIB_METHOD);
+  tt_ptr_op(r, OP_EQ, d);
+  tt_int_op(d->refcnt, OP_EQ, 2);
+  cached_dir_decref(r);
+  r = NULL;
+
+  r = cached_dir_get_recompressed(d, ZSTD_METHOD);
+  if (!tor_compress_supports_method(ZSTD_METHOD)) {
+    tt_ptr_op(r, OP_EQ, NULL);
+    goto done;
+  }
+  tt_assert(r);
+  tt_int_op(detect_compression_method(r->dir_z, r->dir_z_len), OP_EQ,
+            ZSTD_METHOD);
+  tt_assert(!tor_gzip_uncompress(&body, &body_len, r->dir_z, r->dir_z_len,
+                                 ZSTD_METHOD, 1, LOG_WARN));
+  tt_str_op(body, OP_EQ, d->dir);
+  /* The second time, we reuse the one we made before. */
+  r2 = cached_dir_get_recompressed(d, ZSTD_METHOD);
+  tt_ptr_op(r2, OP_EQ, r);
+  tt_int_op(r->refcnt, OP_EQ, 3);
+
+ done:
+  cached_dir_decref(r2);
+  cached_dir_decref(r);
+  cached_dir_decref(d);
+  tor_free(body);
+}
+
 static void
 test_dir_packages(void *arg)
 {
@@ -3099,6 +3363,145 @@ test_dir_packages(void *arg)
   tor_free(res);
 }
 
+static void
+test_dir_sigcache(void *arg)
+{
+  crypto_pk_t *pk1 = pk_generate(0), *pk2 = pk_generate(1);
+  char digests[3][DIGEST_LEN];
+  char sigs[3][128];
+  int siglens[3];
+  uint8_t key[DIGEST256_LEN];
+  int i;
+  (void)arg;
+
+  /* Start from an empty cache, whatever earlier tests have parsed. */
+  sigcache_free_all();
+
+  for (i = 0; i < 3; ++i) {
+    crypto_rand(digests[i], DIGEST_LEN);
+    siglens[i] = crypto_pk_private_sign(pk1, sigs[i], sizeof(sigs[i]),
+                                        digests[i], DIGEST_LEN);
+    tt_int_op(siglens[i], OP_GT, 0);
+  }
+
+  /* The first check is a miss; the second is a hit. */
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[0], DIGEST_LEN,
+                                               sigs[0], siglens[0]));
+  tt_int_op(1, OP_EQ, sigcache_get_n_entries());
+  tt_u64_op(0, OP_EQ, sigcache_get_n_hits());
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[0], DIGEST_LEN,
+                                               sigs[0], siglens[0]));
+  tt_int_op(1, OP_EQ, sigcache_get_n_entries());
+  tt_u64_op(1, OP_EQ, sigcache_get_n_hits());
+
+  /* A cached signature is no good for some other digest or key, and bad
+   * signatures don't get cached. */
+  tt_int_op(-2, OP_EQ, sigcache_checksig_digest(pk1, digests[1], DIGEST_LEN,
+                                                sigs[0], siglens[0]));
+  tt_int_op(-1, OP_EQ, sigcache_checksig_digest(pk2, digests[0], DIGEST_LEN,
+                                                sigs[0], siglens[0]));
+  tt_int_op(1, OP_EQ, sigcache_get_n_entries());
+  tt_u64_op(1, OP_EQ, sigcache_get_n_hits());
+
+  /* Least recently used entries get evicted. */
+  sigcache_set_max_entries(2);
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[1], DIGEST_LEN,
+                                               sigs[1], siglens[1]));
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[0], DIGEST_LEN,
+                                               sigs[0], siglens[0]));
+  tt_u64_op(2, OP_EQ, sigcache_get_n_hits());
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[2], DIGEST_LEN,
+                                               sigs[2], siglens[2]));
+  tt_int_op(2, OP_EQ, sigcache_get_n_entries());
+  /* 0 was used more recently than 1, so 1 should be gone. */
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[0], DIGEST_LEN,
+                                               sigs[0], siglens[0]));
+  tt_u64_op(3, OP_EQ, sigcache_get_n_hits());
+  tt_int_op(0, OP_EQ, sigcache_checksig_digest(pk1, digests[1], DIGEST_LEN,
+                                               sigs[1], siglens[1]));
+  tt_u64_op(3, OP_EQ, sigcache_get_n_hits());
+
+  /* If two threads check the same signature at once, they both add it;
+   * that leaves just one entry. */
+  sigcache_free_all();
+  memset(key, 0x5a, sizeof(key));
+  sigcache_add(key);
+  sigcache_add(key);
+  tt_int_op(1, OP_EQ, sigcache_get_n_entries());
+
+ done:
+  sigcache_set_max_entries(SIGCACHE_MAX_ENTRIES);
+  sigcache_free_all();
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+
+/** Check that we can find router statuses in a consensus by identity and
+ * by descriptor digest, and that the index notices new entries. */
+static void
+test_dir_networkstatus_rs_index(void *arg)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  routerstatus_t *rs;
+  char digest[DIGEST_LEN];
+  const int n = 300;
+  int i, idx, found;
+  (void)arg;
+
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+
+  /* Entry i has an identity starting with 2*i, so the list is sorted and the
+   * odd prefixes are missing. */
+  for (i = 0; i < n; ++i) {
+    rs = tor_malloc_zero(sizeof(routerstatus_t));
+    crypto_rand(rs->identity_digest, DIGEST_LEN);
+    set_uint16(rs->identity_digest, htons(2*i));
+    crypto_rand(rs->descriptor_digest, DIGEST256_LEN);
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+
+  for (i = 0; i < n; ++i) {
+    rs = smartlist_get(ns->routerstatus_list, i);
+    tt_ptr_op(networkstatus_vote_find_entry(ns, rs->identity_digest),
+              OP_EQ, rs);
+    tt_int_op(networkstatus_vote_find_entry_idx(ns, rs->identity_digest,
+                                                &found), OP_EQ, i);
+    tt_int_op(found, OP_EQ, 1);
+    tt_ptr_op(router_get_consensus_status_by_descriptor_digest(ns,
+                                                  rs->descriptor_digest),
+              OP_EQ, rs);
+
+    /* An identity we don't have is not found, and would go after i. */
+    memcpy(digest, rs->identity_digest, DIGEST_LEN);
+    set_uint16(digest, htons(2*i+1));
+    tt_ptr_op(networkstatus_vote_find_entry(ns, digest), OP_EQ, NULL);
+    tt_int_op(networkstatus_vote_find_entry_idx(ns, digest, &found),
+              OP_EQ, i+1);
+    tt_int_op(found, OP_EQ, 0);
+    tt_ptr_op(router_get_consensus_status_by_descriptor_digest(ns, digest),
+              OP_EQ, NULL);
+  }
+
+  /* Add an entry: we should find it too. */
+  rs = tor_malloc_zero(sizeof(routerstatus_t));
+  memset(rs->identity_digest, 0xff, DIGEST_LEN);
+  memset(rs->descriptor_digest, 0xee, DIGEST256_LEN);
+  smartlist_add(ns->routerstatus_list, rs);
+  tt_ptr_op(networkstatus_vote_find_entry(ns, rs->identity_digest),
+            OP_EQ, rs);
+  tt_ptr_op(router_get_consensus_status_by_descriptor_digest(ns,
+                                                 rs->descriptor_digest),
+            OP_EQ, rs);
+  idx = networkstatus_vote_find_entry_idx(ns, rs->identity_digest, &found);
+  tt_int_op(idx, OP_EQ, n);
+  tt_int_op(found, OP_EQ, 1);
+
+ done:
+  networkstatus_vote_free(ns);
+}
+
 #define DIR_LEGACY(name)                                                   \
   { #name, test_dir_ ## name , TT_FORK, NULL, NULL }
 
@@ -3111,6 +3514,7 @@ struct testcase_t dir_tests[] = {
   DIR(routerparse_bad, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_parallel, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR_LEGACY(versions),
@@ -3121,6 +3525,8 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(random_weighted_cumulative, 0),
+  DIR(networkstatus_rs_index, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -3128,7 +3534,9 @@ struct testcase_t dir_tests[] = {
   DIR(http_handling, 0),
   DIR(purpose_needs_anonymity, 0),
   DIR(fetch_type, 0),
+  DIR(accept_encoding, 0),
   DIR(packages, 0),
+  DIR(sigcache, 0),
   END_OF_TESTCASES
 };
 
@@ -12,6 +12,7 @@
 
 #include "routerlist.h"
 #include "nodelist.h"
+#include "cpuworker.h"
 
 #include "test.h"
 #include "test_helpers.h"
@@ -84,3 +85,87 @@ helper_setup_fake_routerlist(void)
   UNMOCK(router_descriptor_is_older_than);
 }
 
+/** How many jobs have we passed to mock_cpuworker_queue_work()? */
+int mock_cpuworker_n_queued = 0;
+/** If true, mock_cpuworker_queue_work() holds on to jobs until
+ * mock_cpuworker_run_deferred() is called, rather than running them right
+ * away. */
+int mock_cpuworker_defer = 0;
+
+/** A job that mock_cpuworker_queue_work() is holding on to. */
+typedef struct mock_cpuworker_job_t {
+  int (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} mock_cpuworker_job_t;
+
+/** List of mock_cpuworker_job_t, in the order they were queued. */
+static smartlist_t *mock_cpuworker_deferred = NULL;
+
+/** Mock for cpuworker_queue_work(): run the job and its reply right away,
+ * or save them for later if mock_cpuworker_defer is set. */
+struct workqueue_entry_s *
+mock_cpuworker_queue_work(int (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  ++mock_cpuworker_n_queued;
+  if (mock_cpuworker_defer) {
+    mock_cpuworker_job_t *job = tor_malloc_zero(sizeof(*job));
+    job->fn = fn;
+    job->reply_fn = reply_fn;
+    job->arg = arg;
+    if (!mock_cpuworker_deferred)
+      mock_cpuworker_deferred = smartlist_new();
+    smartlist_add(mock_cpuworker_deferred, job);
+  } else {
+    fn(NULL, arg);
+    reply_fn(arg);
+  }
+  /* Our callers only check whether this is NULL. */
+  return (struct workqueue_entry_s *)arg;
+}
+
+/** Return the number of jobs that mock_cpuworker_queue_work() is holding
+ * on to. */
+int
+mock_cpuworker_n_deferred(void)
+{
+  return mock_cpuworker_deferred ? smartlist_len(mock_cpuworker_deferred) : 0;
+}
+
+/** Deliver the replies for every job that mock_cpuworker_queue_work() has
+ * been holding on to, running each job first if <b>run_jobs</b> is true.
+ * Return the number of replies delivered. */
+int
+mock_cpuworker_run_deferred(int run_jobs)
+{
+  smartlist_t *jobs = mock_cpuworker_deferred;
+  int n = 0;
+  mock_cpuworker_deferred = NULL;
+  if (!jobs)
+    return 0;
+  SMARTLIST_FOREACH_BEGIN(jobs, mock_cpuworker_job_t *, job) {
+    if (run_jobs)
+      job->fn(NULL, job->arg);
+    job->reply_fn(job->arg);
+    tor_free(job);
+    ++n;
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(jobs);
+  return n;
+}
+
+/** Forget every job that mock_cpuworker_queue_work() is holding on to,
+ * and reset its counters. */
+void
+mock_cpuworker_reset(void)
+{
+  if (mock_cpuworker_deferred) {
+    SMARTLIST_FOREACH(mock_cpuworker_deferred, mock_cpuworker_job_t *, job,
+                      tor_free(job));
+    smartlist_free(mock_cpuworker_deferred);
+  }
+  mock_cpuworker_n_queued = 0;
+  mock_cpuworker_defer = 0;
+}
@@ -13,5 +13,16 @@ void helper_setup_fake_routerlist(void);
 
 extern const char TEST_DESCRIPTORS[];
 
+struct workqueue_entry_s;
+extern int mock_cpuworker_n_queued;
+extern int mock_cpuworker_defer;
+struct workqueue_entry_s *mock_cpuworker_queue_work(int (*fn)(void *,
+                                                              void *),
+                                                    void (*reply_fn)(void *),
+                                                    void *arg);
+int mock_cpuworker_n_deferred(void);
+int mock_cpuworker_run_deferred(int run_jobs);
+void mock_cpuworker_reset(void);
+
 #endif
 
@@ -2,16 +2,26 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define CONNECTION_PRIVATE
+#define DIRSERV_PRIVATE
+#define MICRODESC_PRIVATE
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 
+#include "buffers.h"
 #include "config.h"
+#include "connection.h"
+#include "cpuworker.h"
+#include "dirserv.h"
 #include "dirvote.h"
 #include "microdesc.h"
 #include "networkstatus.h"
+#include "policies.h"
 #include "routerlist.h"
 #include "routerparse.h"
 
 #include "test.h"
+#include "test_helpers.h"
 
 #include <openssl/rsa.h>
 #include <openssl/bn.h>
@@ -293,6 +303,156 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+static const char test_md4[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+  "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+  "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "ntor-onion-key Gg73xH7+kTfT6bi1uNVx9gwQdQas9pROIfmc4NpAdC4=\n"
+  "a [2001:db8::1]:9001\n"
+  "p reject 25,119\n"
+  "p6 accept 80,443\n";
+
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md3, *md4;
+  char d3[DIGEST256_LEN], d4[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  curve25519_public_key_t ntor_key;
+  tor_addr_t addr;
+  time_t time3, time4;
+  char *fn = NULL, *s = NULL, *policy = NULL;
+  struct stat st;
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test3"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  time3 = time(NULL) - 3*24*60*60;
+  time4 = time(NULL);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+  crypto_digest256(d4, test_md4, strlen(test_md4), DIGEST_SHA256);
+  tt_int_op(0, OP_EQ, curve25519_public_from_base64(&ntor_key,
+                         "Gg73xH7+kTfT6bi1uNVx9gwQdQas9pROIfmc4NpAdC4="));
+  tor_addr_parse(&addr, "2001:db8::1");
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, time3, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md4, NULL,
+                                  SAVED_NOWHERE, 0, time4, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+
+  /* Rebuilding the cache writes the index. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->DataDirectory);
+  tt_int_op(file_status(fn), OP_EQ, FN_FILE);
+
+  /* When we reload, nothing gets parsed until we ask for it. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 2);
+
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 1);
+  tt_assert(! md3->unparsed);
+  tt_int_op(md3->last_listed, OP_EQ, time3);
+  tt_assert(md3->onion_pkey);
+  tt_ptr_op(md3->onion_curve25519_pkey, OP_EQ, NULL);
+  tt_assert(tor_addr_is_null(&md3->ipv6_addr));
+  tt_assert(md3->family);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  tt_str_op(smartlist_get(md3->family, 2), OP_EQ, "nodeZ");
+  tt_assert(md3->exit_policy);
+  policy = write_short_policy(md3->exit_policy);
+  tt_str_op(policy, OP_EQ, "accept 1-700,800-1000");
+  tor_free(policy);
+  tt_ptr_op(md3->ipv6_exit_policy, OP_EQ, NULL);
+
+  md4 = microdesc_cache_lookup_by_digest256(mc, d4);
+  tt_assert(md4);
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 0);
+  tt_int_op(md4->last_listed, OP_EQ, time4);
+  tt_mem_op(md4->body, OP_EQ, test_md4, strlen(test_md4));
+  tt_assert(md4->onion_curve25519_pkey);
+  tt_mem_op(md4->onion_curve25519_pkey->public_key, OP_EQ,
+            ntor_key.public_key, CURVE25519_PUBKEY_LEN);
+  tt_assert(tor_addr_eq(&md4->ipv6_addr, &addr));
+  tt_int_op(md4->ipv6_orport, OP_EQ, 9001);
+  tt_ptr_op(md4->family, OP_EQ, NULL);
+  policy = write_short_policy(md4->exit_policy);
+  tt_str_op(policy, OP_EQ, "reject 25,119");
+  tor_free(policy);
+  policy = write_short_policy(md4->ipv6_exit_policy);
+  tt_str_op(policy, OP_EQ, "accept 80,443");
+  tor_free(policy);
+
+  /* A truncated index gets ignored, and replaced. */
+  microdesc_free_all();
+  s = read_file_to_str(fn, RFTS_BIN, &st);
+  tt_assert(s);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fn, s, (size_t)st.st_size - 7, 1));
+  mc = get_microdesc_cache();
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 0);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d4));
+
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 2);
+
+  /* Rebuilding the cache doesn't make us parse anything, and the entries it
+   * carries over into the new index still work. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 2);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 1);
+  tt_int_op(md3->last_listed, OP_EQ, time3);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  md4 = microdesc_cache_lookup_by_digest256(mc, d4);
+  tt_assert(md4);
+  tt_mem_op(md4->body, OP_EQ, test_md4, strlen(test_md4));
+  tt_int_op(md4->ipv6_orport, OP_EQ, 9001);
+
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  tt_int_op(microdesc_cache_n_unparsed(mc), OP_EQ, 2);
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d4));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  smartlist_free(added);
+  tor_free(policy);
+  tor_free(s);
+  tor_free(fn);
+  microdesc_free_all();
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -619,6 +779,71 @@ test_md_parse(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+/** Make sure that we get the same microdescriptors, in the same order, when
+ * we split a batch of them into ranges and parse those in parallel. */
+static void
+test_md_parse_parallel(void *arg)
+{
+  smartlist_t *serial = NULL, *parallel = NULL;
+  smartlist_t *serial_bad = smartlist_new(), *parallel_bad = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  const size_t old_min_len = dirparse_parallel_min_len;
+  const size_t old_range_len = dirparse_parallel_range_len;
+  char *batch = NULL;
+  int i;
+  (void) arg;
+
+  mock_cpuworker_reset();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  for (i = 0; i < 10; ++i)
+    smartlist_add(chunks, (char*)MD_PARSE_TEST_DATA);
+  batch = smartlist_join_strings(chunks, "", 0, NULL);
+
+  serial = microdescs_parse_from_string(batch, NULL, 1, SAVED_NOWHERE,
+                                        serial_bad);
+  tt_int_op(smartlist_len(serial), OP_EQ, 110);
+  tt_int_op(smartlist_len(serial_bad), OP_EQ, 40);
+  tt_int_op(mock_cpuworker_n_queued, OP_EQ, 0);
+
+  dirparse_parallel_min_len = 0;
+  dirparse_parallel_range_len = 1500;
+  parallel = microdescs_parse_from_string(batch, NULL, 1, SAVED_NOWHERE,
+                                          parallel_bad);
+  tt_int_op(mock_cpuworker_n_queued, OP_GT, 0);
+  tt_int_op(smartlist_len(parallel), OP_EQ, smartlist_len(serial));
+  tt_int_op(smartlist_len(parallel_bad), OP_EQ, smartlist_len(serial_bad));
+  for (i = 0; i < smartlist_len(serial); ++i) {
+    const microdesc_t *md1 = smartlist_get(serial, i);
+    const microdesc_t *md2 = smartlist_get(parallel, i);
+    tt_mem_op(md1->digest, OP_EQ, md2->digest, DIGEST256_LEN);
+    tt_int_op(md1->off, OP_EQ, md2->off);
+    tt_int_op(md1->last_listed, OP_EQ, md2->last_listed);
+  }
+  for (i = 0; i < smartlist_len(serial_bad); ++i) {
+    tt_mem_op(smartlist_get(serial_bad, i), OP_EQ,
+              smartlist_get(parallel_bad, i), DIGEST256_LEN);
+  }
+
+ done:
+  dirparse_parallel_min_len = old_min_len;
+  dirparse_parallel_range_len = old_range_len;
+  UNMOCK(cpuworker_queue_work);
+  mock_cpuworker_reset();
+  if (serial)
+    SMARTLIST_FOREACH(serial, microdesc_t *, md, microdesc_free(md));
+  if (parallel)
+    SMARTLIST_FOREACH(parallel, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(serial);
+  smartlist_free(parallel);
+  SMARTLIST_FOREACH(serial_bad, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(parallel_bad, char *, cp, tor_free(cp));
+  smartlist_free(serial_bad);
+  smartlist_free(parallel_bad);
+  smartlist_free(chunks);
+  tor_free(batch);
+}
+
 static int mock_rgsbd_called = 0;
 static routerstatus_t *mock_rgsbd_val_a = NULL;
 static routerstatus_t *mock_rgsbd_val_b = NULL;
@@ -647,6 +872,302 @@ mock_ns_get_by_flavor(consensus_flavor_t f)
   return mock_ns_val;
 }
 
+/** Return the compressed response for the microdescriptors in <b>fps</b>,
+ * building it if it isn't in the cache, as directory_handle_command_get()
+ * does. */
+static cached_dir_t *
+get_or_build_md_response(const smartlist_t *fps)
+{
+  compressed_response_lookup_t *lookup = NULL;
+  cached_dir_t *r;
+  r = dirserv_get_compressed_response(DIR_SPOOL_MICRODESC, fps, 1, &lookup);
+  if (r) {
+    tt_ptr_op(lookup, OP_EQ, NULL);
+  } else if (lookup) {
+    r = dirserv_build_compressed_response(lookup);
+  }
+ done:
+  return r;
+}
+
+static void
+test_md_compressed_responses(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc;
+  smartlist_t *added = NULL, *fps = smartlist_new();
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const char *mds[] = { test_md1, test_md2, test_md3_noannotation };
+  const char *first, *second;
+  char d[3][DIGEST256_LEN];
+  cached_dir_t *r12 = NULL, *r1 = NULL, *r2 = NULL, *r3 = NULL, *tmp = NULL;
+  const size_t old_max_len = compressed_response_max_len;
+  const size_t old_block_len = dirserv_compress_block_len;
+  compressed_response_lookup_t *lookup = NULL;
+  char *body = NULL, *expected = NULL, *z3 = NULL;
+  size_t body_len = 0, z3_len = 0;
+  int i;
+  (void)arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_z"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  mc = get_microdesc_cache();
+  for (i = 0; i < 3; ++i) {
+    added = microdescs_add_to_cache(mc, mds[i], NULL, SAVED_NOWHERE, 0,
+                                    time(NULL), NULL);
+    tt_int_op(1, OP_EQ, smartlist_len(added));
+    memcpy(d[i], ((microdesc_t*)smartlist_get(added, 0))->digest,
+           DIGEST256_LEN);
+    smartlist_free(added);
+    added = NULL;
+  }
+
+  /* Nothing is cached at first. */
+  smartlist_add(fps, d[1]);
+  smartlist_add(fps, d[0]);
+  smartlist_add(fps, d[1]);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_compressed_response(DIR_SPOOL_MICRODESC,
+                                                          fps, 1, NULL));
+
+  /* Build a response: it has each microdescriptor once, in digest
+   * order. */
+  r12 = get_or_build_md_response(fps);
+  tt_assert(r12);
+  tt_int_op(r12->refcnt, OP_EQ, 2);
+  tt_int_op(0, OP_EQ, tor_gzip_uncompress(&body, &body_len, r12->dir_z,
+                                          r12->dir_z_len, ZLIB_METHOD,
+                                          1, LOG_WARN));
+  first = fast_memcmp(d[0], d[1], DIGEST256_LEN) < 0 ? test_md1 : test_md2;
+  second = (first == test_md1) ? test_md2 : test_md1;
+  tor_asprintf(&expected, "%s%s", first, second);
+  tt_int_op(body_len, OP_EQ, strlen(expected));
+  tt_int_op(r12->dir_len, OP_EQ, strlen(expected));
+  tt_mem_op(body, OP_EQ, expected, body_len);
+
+  /* The same request in another order gets the same response. */
+  smartlist_clear(fps);
+  smartlist_add(fps, d[0]);
+  smartlist_add(fps, d[1]);
+  tmp = dirserv_get_compressed_response(DIR_SPOOL_MICRODESC, fps, 1, NULL);
+  tt_ptr_op(tmp, OP_EQ, r12);
+  cached_dir_decref(tmp);
+  tmp = NULL;
+
+  /* Add two more entries, and make the cache just big enough that adding
+   * a response holding md3 will push out one of the three. */
+  smartlist_clear(fps);
+  smartlist_add(fps, d[0]);
+  r1 = get_or_build_md_response(fps);
+  smartlist_clear(fps);
+  smartlist_add(fps, d[1]);
+  r2 = get_or_build_md_response(fps);
+  tt_assert(r1);
+  tt_assert(r2);
+  tt_int_op(0, OP_EQ, tor_gzip_compress(&z3, &z3_len, test_md3_noannotation,
+                                        strlen(test_md3_noannotation),
+                                        ZLIB_METHOD));
+  compressed_response_max_len = r12->dir_z_len + r2->dir_z_len + z3_len;
+
+  /* Use r12, so that r1 is the least recently used... */
+  smartlist_clear(fps);
+  smartlist_add(fps, d[1]);
+  smartlist_add(fps, d[0]);
+  tmp = dirserv_get_compressed_response(DIR_SPOOL_MICRODESC, fps, 1, NULL);
+  tt_ptr_op(tmp, OP_EQ, r12);
+  cached_dir_decref(tmp);
+  tmp = NULL;
+
+  /* ... and then add another entry. r1 goes away. */
+  smartlist_clear(fps);
+  smartlist_add(fps, d[2]);
+  r3 = get_or_build_md_response(fps);
+  tt_assert(r3);
+  tt_int_op(r3->dir_z_len, OP_EQ, z3_len);
+  tt_int_op(r3->refcnt, OP_EQ, 2);
+  tt_int_op(r1->refcnt, OP_EQ, 1);
+  tt_int_op(r2->refcnt, OP_EQ, 2);
+  smartlist_clear(fps);
+  smartlist_add(fps, d[0]);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_compressed_response(DIR_SPOOL_MICRODESC,
+                                                          fps, 1, NULL));
+
+  /* We don't remember responses that would take up most of the cache. */
+  compressed_response_max_len = r3->dir_z_len;
+  smartlist_clear(fps);
+  smartlist_add(fps, d[0]);
+  smartlist_add(fps, d[2]);
+  tmp = get_or_build_md_response(fps);
+  tt_assert(tmp);
+  tt_int_op(tmp->refcnt, OP_EQ, 1);
+
+  /* We leave responses bigger than a compression block to be spooled
+   * through the cpuworkers. */
+  dirserv_compress_block_len =
+    strlen(test_md1) + strlen(test_md3_noannotation);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_compressed_response(DIR_SPOOL_MICRODESC,
+                                                          fps, 1, &lookup));
+  tt_assert(lookup);
+  compressed_response_lookup_free(lookup);
+  lookup = NULL;
+  --dirserv_compress_block_len;
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_compressed_response(DIR_SPOOL_MICRODESC,
+                                                          fps, 1, &lookup));
+  tt_ptr_op(lookup, OP_EQ, NULL);
+  dirserv_compress_block_len = old_block_len;
+
+  /* We don't answer requests for microdescriptors we don't have. */
+  smartlist_clear(fps);
+  smartlist_add(fps, (char*)"This is not the digest you seek.");
+  tt_ptr_op(NULL, OP_EQ, get_or_build_md_response(fps));
+
+ done:
+  compressed_response_max_len = old_max_len;
+  dirserv_compress_block_len = old_block_len;
+  compressed_response_lookup_free(lookup);
+  cached_dir_decref(r12);
+  cached_dir_decref(r1);
+  cached_dir_decref(r2);
+  cached_dir_decref(r3);
+  cached_dir_decref(tmp);
+  dirserv_free_all();
+  smartlist_free(added);
+  smartlist_free(fps);
+  tor_free(body);
+  tor_free(expected);
+  tor_free(z3);
+  tor_free(options->DataDirectory);
+  microdesc_free_all();
+}
+
+static void
+test_md_spool_compressed(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc;
+  smartlist_t *added = NULL, *expected_chunks = smartlist_new();
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const char *mds[] = { test_md1, test_md2, test_md3_noannotation };
+  char d[3][DIGEST256_LEN];
+  dir_connection_t *conn = NULL, *conn2 = NULL;
+  buf_t *compressed = buf_new();
+  char *z = NULL, *body = NULL, *expected = NULL;
+  size_t z_len, body_len = 0;
+  const size_t old_block_len = dirserv_compress_block_len;
+  int i;
+  (void)arg;
+
+  mock_cpuworker_reset();
+  mock_cpuworker_defer = 1;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  dirserv_compress_block_len = 2000;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_spool"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  mc = get_microdesc_cache();
+  for (i = 0; i < 3; ++i) {
+    added = microdescs_add_to_cache(mc, mds[i], NULL, SAVED_NOWHERE, 0,
+                                    time(NULL), NULL);
+    tt_int_op(1, OP_EQ, smartlist_len(added));
+    memcpy(d[i], ((microdesc_t*)smartlist_get(added, 0))->digest,
+           DIGEST256_LEN);
+    smartlist_free(added);
+    added = NULL;
+  }
+
+  /* Ask for enough microdescriptors to fill a few compression blocks. */
+  conn = dir_connection_new(AF_INET);
+  TO_CONN(conn)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->fingerprint_stack = smartlist_new();
+  for (i = 0; i < 30; ++i) {
+    smartlist_add(conn->fingerprint_stack, tor_memdup(d[i%3], DIGEST256_LEN));
+    /* We spool from the end of the list. */
+    smartlist_insert(expected_chunks, 0, (void*)mds[i%3]);
+  }
+  expected = smartlist_join_strings(expected_chunks, "", 0, NULL);
+  conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD, HIGH_COMPRESSION);
+  conn->dir_spool_src = DIR_SPOOL_MICRODESC;
+
+  /* The first block goes to a cpuworker; nothing is on the outbuf until
+   * it's done, and we don't spool any more in the meantime. */
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  tt_int_op(1, OP_EQ, mock_cpuworker_n_queued);
+  tt_assert(conn->compress_job);
+  tt_ptr_op(conn->zlib_state, OP_EQ, NULL);
+  tt_int_op(0, OP_EQ, connection_get_outbuf_len(TO_CONN(conn)));
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  tt_int_op(1, OP_EQ, mock_cpuworker_n_queued);
+
+  /* Now let the jobs finish one at a time, draining the outbuf between
+   * them. */
+  while (mock_cpuworker_n_deferred()) {
+    size_t n;
+    tt_int_op(1, OP_EQ, mock_cpuworker_run_deferred(1));
+    n = connection_get_outbuf_len(TO_CONN(conn));
+    z = tor_malloc(n+1);
+    fetch_from_buf(z, n, TO_CONN(conn)->outbuf);
+    write_to_buf(z, n, compressed);
+    tor_free(z);
+    if (conn->dir_spool_src != DIR_SPOOL_NONE &&
+        !mock_cpuworker_n_deferred())
+      tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  }
+  tt_int_op(mock_cpuworker_n_queued, OP_GT, 2);
+  tt_int_op(conn->dir_spool_src, OP_EQ, DIR_SPOOL_NONE);
+  tt_ptr_op(conn->zlib_state, OP_EQ, NULL);
+  tt_ptr_op(conn->compress_job, OP_EQ, NULL);
+
+  z_len = buf_datalen(compressed);
+  z = tor_malloc(z_len);
+  fetch_from_buf(z, z_len, compressed);
+  tt_int_op(0, OP_EQ, tor_gzip_uncompress(&body, &body_len, z, z_len,
+                                          ZLIB_METHOD, 1, LOG_WARN));
+  tt_int_op(body_len, OP_EQ, strlen(expected));
+  tt_mem_op(body, OP_EQ, expected, body_len);
+
+  /* If the connection closes while we're compressing, the job just goes
+   * away. */
+  conn2 = dir_connection_new(AF_INET);
+  TO_CONN(conn2)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn2->fingerprint_stack = smartlist_new();
+  smartlist_add(conn2->fingerprint_stack, tor_memdup(d[0], DIGEST256_LEN));
+  conn2->zlib_state = tor_zlib_new(1, ZLIB_METHOD, HIGH_COMPRESSION);
+  conn2->dir_spool_src = DIR_SPOOL_MICRODESC;
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn2));
+  tt_assert(conn2->compress_job);
+  connection_free_(TO_CONN(conn2));
+  conn2 = NULL;
+  tt_int_op(1, OP_EQ, mock_cpuworker_run_deferred(1));
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  mock_cpuworker_reset();
+  dirserv_compress_block_len = old_block_len;
+  if (conn)
+    connection_free_(TO_CONN(conn));
+  if (conn2)
+    connection_free_(TO_CONN(conn2));
+  buf_free(compressed);
+  smartlist_free(added);
+  smartlist_free(expected_chunks);
+  tor_free(z);
+  tor_free(body);
+  tor_free(expected);
+  tor_free(options->DataDirectory);
+  microdesc_free_all();
+}
+
 static void
 test_md_reject_cache(void *arg)
 {
@@ -716,8 +1237,13 @@ test_md_reject_cache(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
+  { "parse_parallel", test_md_parse_parallel, TT_FORK, NULL, NULL },
+  { "compressed_responses", test_md_compressed_responses, TT_FORK,
+    NULL, NULL },
+  { "spool_compressed", test_md_spool_compressed, TT_FORK, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
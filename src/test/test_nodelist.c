@@ -7,7 +7,12 @@
  **/
 
 #include "or.h"
+#include "config.h"
+#include "networkstatus.h"
 #include "nodelist.h"
+#include "policies.h"
+#include "routerlist.h"
+#include "routerparse.h"
 #include "test.h"
 
 /** Test the case when node_get_by_id() returns NULL,
@@ -60,12 +65,448 @@ test_nodelist_node_get_verbose_nickname_not_named(void *arg)
   return;
 }
 
+/** Helper: return a new routerinfo_t whose identity digest is all
+ * <b>id</b> bytes, with the comma-separated exit policy <b>policy</b>. */
+static routerinfo_t *
+exit_port_index_make_ri(char id, const char *policy)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  smartlist_t *items = smartlist_new();
+  memset(ri->cache_info.identity_digest, id, DIGEST_LEN);
+  ri->exit_policy = smartlist_new();
+  smartlist_split_string(items, policy, ",", 0, 0);
+  SMARTLIST_FOREACH(items, char *, item, {
+    smartlist_add(ri->exit_policy,
+                  router_parse_addr_policy_item_from_string(item, -1));
+    tor_free(item);
+  });
+  smartlist_free(items);
+  return ri;
+}
+
+/** Helper: check that nodelist_add_exits_for_port() agrees with
+ * node_might_exit_to_port() for every node, on both the real nodelist and a
+ * copy of it. */
+static void
+exit_port_index_check(uint16_t port)
+{
+  smartlist_t *nodes = nodelist_get_list();
+  smartlist_t *copy = smartlist_new();
+  bitarray_t *bits = bitarray_init_zero(64);
+  bitarray_t *bits2 = bitarray_init_zero(64);
+
+  smartlist_add_all(copy, nodes);
+  nodelist_add_exits_for_port(bits, nodes, port);
+  nodelist_add_exits_for_port(bits2, copy, port);
+  SMARTLIST_FOREACH(nodes, const node_t *, node, {
+    tt_int_op(!!bitarray_is_set(bits, node_sl_idx), OP_EQ,
+              node_might_exit_to_port(node, port));
+    tt_int_op(!!bitarray_is_set(bits2, node_sl_idx), OP_EQ,
+              node_might_exit_to_port(node, port));
+  });
+  tt_int_op(bitarray_is_set(bits, smartlist_len(nodes)), OP_EQ, 0);
+
+ done:
+  smartlist_free(copy);
+  bitarray_free(bits);
+  bitarray_free(bits2);
+}
+
+/** Check that the index of which nodes might exit to which ports stays up
+ * to date as nodes come and go. */
+static void
+test_nodelist_exit_port_index(void *arg)
+{
+  routerinfo_t *ri1, *ri2, *ri3, *ri1b = NULL, *old = NULL;
+  const node_t *node;
+  bitarray_t *bits = NULL;
+  char id[DIGEST_LEN];
+  (void)arg;
+
+  ri1 = exit_port_index_make_ri('a', "accept *:80,reject *:*");
+  ri2 = exit_port_index_make_ri('b', "reject *:80,accept *:*");
+  ri3 = exit_port_index_make_ri('c', "reject *:*");
+  nodelist_set_routerinfo(ri1, NULL);
+  nodelist_set_routerinfo(ri2, NULL);
+  nodelist_set_routerinfo(ri3, NULL);
+
+  bits = bitarray_init_zero(64);
+  nodelist_add_exits_for_port(bits, nodelist_get_list(), 80);
+  memset(id, 'a', DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_assert(bitarray_is_set(bits, node->nodelist_idx));
+  memset(id, 'b', DIGEST_LEN);
+  tt_assert(!bitarray_is_set(bits, node_get_by_id(id)->nodelist_idx));
+  memset(id, 'c', DIGEST_LEN);
+  tt_assert(!bitarray_is_set(bits, node_get_by_id(id)->nodelist_idx));
+  exit_port_index_check(80);
+  exit_port_index_check(443);
+
+  /* A new descriptor changes the node's bits. */
+  ri1b = exit_port_index_make_ri('a', "reject *:*");
+  nodelist_set_routerinfo(ri1b, &old);
+  tt_ptr_op(old, OP_EQ, ri1);
+  exit_port_index_check(80);
+  exit_port_index_check(443);
+
+  /* Dropping the node moves another one into its slot. */
+  nodelist_remove_routerinfo(ri1b);
+  memset(id, 'a', DIGEST_LEN);
+  tt_ptr_op(node_get_by_id(id), OP_EQ, NULL);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 2);
+  exit_port_index_check(80);
+  exit_port_index_check(443);
+
+  /* So does learning that a node rejects everything. */
+  memset(id, 'b', DIGEST_LEN);
+  policies_set_node_exitpolicy_to_reject_all(node_get_mutable_by_id(id));
+  exit_port_index_check(443);
+
+ done:
+  nodelist_free_all();
+  routerinfo_free(ri1);
+  routerinfo_free(ri1b);
+  routerinfo_free(ri2);
+  routerinfo_free(ri3);
+  bitarray_free(bits);
+}
+
+/** Helper: return a new routerinfo with identity digest full of <b>id</b>,
+ * IPv4 address <b>addr</b>, and a declared family of the nodes whose
+ * identity digests are full of the characters in <b>family</b>. */
+static routerinfo_t *
+node_family_make_ri(char id, uint32_t addr, const char *family)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  memset(ri->cache_info.identity_digest, id, DIGEST_LEN);
+  ri->addr = addr;
+  ri->or_port = 9001;
+  ri->declared_family = smartlist_new();
+  for ( ; *family; ++family) {
+    char digest[DIGEST_LEN], hex[HEX_DIGEST_LEN+2];
+    memset(digest, *family, DIGEST_LEN);
+    hex[0] = '$';
+    base16_encode(hex+1, sizeof(hex)-1, digest, DIGEST_LEN);
+    smartlist_add(ri->declared_family, tor_strdup(hex));
+  }
+  return ri;
+}
+
+/** Helper: return a string of the identity characters of the nodes in the
+ * family of the node whose identity digest is full of <b>id</b>, sorted.
+ * Check that nodelist_add_node_and_family() and
+ * nodelist_mark_node_and_family() agree. */
+static char *
+node_family_get(char id)
+{
+  char digest[DIGEST_LEN];
+  smartlist_t *nodes = smartlist_new(), *chars = smartlist_new();
+  bitarray_t *bits = bitarray_init_zero(64);
+  const node_t *node;
+  char *result = NULL;
+
+  memset(digest, id, DIGEST_LEN);
+  node = node_get_by_id(digest);
+  tt_assert(node);
+  nodelist_add_node_and_family(nodes, node);
+  nodelist_mark_node_and_family(bits, node);
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, n2,
+    tt_int_op(!!bitarray_is_set(bits, n2->nodelist_idx), OP_EQ,
+              smartlist_contains(nodes, n2)));
+  SMARTLIST_FOREACH(nodes, const node_t *, n2,
+    smartlist_add_asprintf(chars, "%c", n2->identity[0]));
+  smartlist_sort_strings(chars);
+  smartlist_uniq_strings(chars);
+  result = smartlist_join_strings(chars, "", 0, NULL);
+
+ done:
+  SMARTLIST_FOREACH(chars, char *, cp, tor_free(cp));
+  smartlist_free(chars);
+  smartlist_free(nodes);
+  bitarray_free(bits);
+  return result;
+}
+
+/** Check that our cache of node families gives the right answers, and is
+ * forgotten when the nodelist changes. */
+static void
+test_nodelist_family_cache(void *arg)
+{
+  routerinfo_t *ri_a, *ri_b, *ri_c, *ri_d, *ri_c2 = NULL;
+  char *fam = NULL;
+  (void)arg;
+
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+
+  /* a and b are in the same /16; b and c declare each other. */
+  ri_a = node_family_make_ri('a', 0x01020304, "");
+  ri_b = node_family_make_ri('b', 0x01020909, "c");
+  ri_c = node_family_make_ri('c', 0x05060708, "bd");
+  ri_d = node_family_make_ri('d', 0x09090909, "");
+  nodelist_set_routerinfo(ri_a, NULL);
+  nodelist_set_routerinfo(ri_b, NULL);
+  nodelist_set_routerinfo(ri_c, NULL);
+  nodelist_set_routerinfo(ri_d, NULL);
+
+#define CHECK_FAMILY(id, expected) STMT_BEGIN                  \
+    tor_free(fam);                                              \
+    fam = node_family_get(id);                                  \
+    tt_str_op(fam, OP_EQ, (expected));                          \
+  STMT_END
+
+  CHECK_FAMILY('a', "ab");
+  CHECK_FAMILY('b', "abc");
+  CHECK_FAMILY('c', "bc");
+  CHECK_FAMILY('d', "d");
+  /* Again, from the cache. */
+  CHECK_FAMILY('b', "abc");
+  CHECK_FAMILY('c', "bc");
+
+  /* A new descriptor for c breaks up its family with b. */
+  ri_c2 = node_family_make_ri('c', 0x05060708, "d");
+  nodelist_set_routerinfo(ri_c2, NULL);
+  CHECK_FAMILY('b', "ab");
+  CHECK_FAMILY('c', "c");
+
+  /* So does changing the options, once we are told about it. */
+  get_options_mutable()->EnforceDistinctSubnets = 0;
+  nodelist_note_nodes_changed();
+  CHECK_FAMILY('a', "a");
+  CHECK_FAMILY('b', "b");
+
+  /* Dropping a node moves another one into its slot. */
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+  nodelist_remove_routerinfo(ri_a);
+  CHECK_FAMILY('b', "b");
+  CHECK_FAMILY('d', "d");
+#undef CHECK_FAMILY
+
+ done:
+  tor_free(fam);
+  nodelist_free_all();
+  routerinfo_free(ri_a);
+  routerinfo_free(ri_b);
+  routerinfo_free(ri_c);
+  routerinfo_free(ri_c2);
+  routerinfo_free(ri_d);
+}
+
+/** Helper: return a new consensus listing a routerstatus for each character
+ * in <b>ids</b>, with an identity digest full of that character and IPv4
+ * address <b>addr</b> plus the character. */
+static networkstatus_t *
+node_make_consensus(const char *ids, uint32_t addr)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  for ( ; *ids; ++ids) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, *ids, DIGEST_LEN);
+    rs->addr = addr + *ids;
+    rs->or_port = 9001;
+    rs->is_flagged_running = 1;
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+/** Helper: release storage held by a consensus from node_make_consensus. */
+static void
+node_free_consensus(networkstatus_t *ns)
+{
+  if (!ns)
+    return;
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs, tor_free(rs));
+  smartlist_free(ns->routerstatus_list);
+  tor_free(ns);
+}
+
+/** Helper: return the node whose identity digest is full of <b>id</b>. */
+static const node_t *
+node_get_by_char(char id)
+{
+  char digest[DIGEST_LEN];
+  memset(digest, id, DIGEST_LEN);
+  return node_get_by_id(digest);
+}
+
+static networkstatus_t *mock_latest_consensus = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_latest_consensus;
+}
+
+/** Check that nodelist_set_consensus() gives the same nodelist when it is
+ * told about the consensus being replaced. */
+static void
+test_nodelist_set_consensus_incremental(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL, *ns3 = NULL;
+  routerstatus_t *rs;
+  (void)arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns1 = node_make_consensus("abc", 0x01020300);
+  mock_latest_consensus = ns1;
+  nodelist_set_consensus(ns1, NULL);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+
+  /* b leaves, d arrives, and c moves. */
+  ns2 = node_make_consensus("acd", 0x01020300);
+  rs = smartlist_get(ns2->routerstatus_list, 1);
+  rs->addr = 0x05060708;
+  mock_latest_consensus = ns2;
+  nodelist_set_consensus(ns2, ns1);
+  node_free_consensus(ns1);
+  ns1 = NULL;
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  tt_ptr_op(node_get_by_char('b'), OP_EQ, NULL);
+  tt_ptr_op(node_get_by_char('a')->rs, OP_EQ,
+            smartlist_get(ns2->routerstatus_list, 0));
+  tt_ptr_op(node_get_by_char('c')->rs, OP_EQ, rs);
+  tt_ptr_op(node_get_by_char('d')->rs, OP_EQ,
+            smartlist_get(ns2->routerstatus_list, 2));
+  tt_int_op(node_get_by_char('a')->is_running, OP_EQ, 1);
+
+  /* Nobody leaves, but a's flags change. */
+  ns3 = node_make_consensus("acd", 0x01020300);
+  rs = smartlist_get(ns3->routerstatus_list, 0);
+  rs->is_flagged_running = 0;
+  mock_latest_consensus = ns3;
+  nodelist_set_consensus(ns3, ns2);
+  node_free_consensus(ns2);
+  ns2 = NULL;
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  tt_ptr_op(node_get_by_char('a')->rs, OP_EQ, rs);
+  tt_int_op(node_get_by_char('a')->is_running, OP_EQ, 0);
+  tt_int_op(node_get_by_char('d')->is_running, OP_EQ, 1);
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  node_free_consensus(ns1);
+  node_free_consensus(ns2);
+  node_free_consensus(ns3);
+}
+
+/** Helper: check that the select table entry for <b>node</b> agrees with
+ * the node itself. */
+static void
+select_table_check_node(const node_select_table_t *table, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  tt_int_op(idx, OP_GE, 0);
+  tt_int_op(idx, OP_LT, table->n_nodes);
+  tt_ptr_op(smartlist_get(table->nodes, idx), OP_EQ, node);
+  tt_int_op(!!(table->flags[idx] & NST_RUNNING), OP_EQ, node->is_running);
+  tt_int_op(!!(table->flags[idx] & NST_VALID), OP_EQ, node->is_valid);
+  tt_int_op(!!(table->flags[idx] & NST_FAST), OP_EQ, node->is_fast);
+  tt_int_op(!!(table->flags[idx] & NST_GUARD), OP_EQ,
+            node->is_possible_guard);
+  tt_int_op(!!(table->flags[idx] & NST_HAS_BW), OP_EQ,
+            node->rs->has_bandwidth);
+  if (node->rs->has_bandwidth)
+    tt_int_op(table->bandwidth_kb[idx], OP_EQ, node->rs->bandwidth_kb);
+  tt_int_op(table->addr_ipv4h[idx], OP_EQ, node->rs->addr);
+ done:
+  ;
+}
+
+static void
+test_nodelist_select_table(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  const node_select_table_t *table;
+  smartlist_t *sl = smartlist_new();
+  routerstatus_t *rs;
+  (void)arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns1 = node_make_consensus("abcd", 0x01020300);
+  rs = smartlist_get(ns1->routerstatus_list, 0);
+  rs->is_valid = rs->is_fast = rs->is_possible_guard = 1;
+  rs->has_bandwidth = 1;
+  rs->bandwidth_kb = 500;
+  rs = smartlist_get(ns1->routerstatus_list, 1);
+  rs->is_valid = rs->is_fast = 1;
+  rs->has_bandwidth = 1;
+  rs->bandwidth_kb = 100;
+  rs = smartlist_get(ns1->routerstatus_list, 2);
+  rs->is_valid = 1;
+  rs->is_flagged_running = 0;
+  mock_latest_consensus = ns1;
+  nodelist_set_consensus(ns1, NULL);
+
+  table = nodelist_get_select_table();
+  tt_int_op(table->n_nodes, OP_EQ, 4);
+  tt_u64_op(table->generation, OP_EQ, nodelist_get_generation());
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, node,
+                    select_table_check_node(table, node));
+
+  /* Filtering by flags matches the nodes' own fields. */
+  router_add_running_nodes_to_smartlist(sl, 0, 0, 0, 0, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 2);
+  tt_assert(smartlist_contains(sl, node_get_by_char('a')));
+  tt_assert(smartlist_contains(sl, node_get_by_char('b')));
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, 1, 0, 0, 0, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 3);
+  tt_assert(smartlist_contains(sl, node_get_by_char('d')));
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, 0, 0, 1, 1, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, node_get_by_char('a'));
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, 0, 0, 0, 0, 1);
+  tt_int_op(smartlist_len(sl), OP_EQ, 0);
+
+  /* A new consensus refreshes the table. */
+  ns2 = node_make_consensus("bcd", 0x01020300);
+  rs = smartlist_get(ns2->routerstatus_list, 0);
+  rs->is_valid = 1;
+  rs->has_bandwidth = 1;
+  rs->bandwidth_kb = 700;
+  rs->addr = 0x05060708;
+  mock_latest_consensus = ns2;
+  nodelist_set_consensus(ns2, ns1);
+  node_free_consensus(ns1);
+  ns1 = NULL;
+
+  table = nodelist_get_select_table();
+  tt_int_op(table->n_nodes, OP_EQ, 3);
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, node,
+                    select_table_check_node(table, node));
+  tt_int_op(table->bandwidth_kb[node_get_by_char('b')->nodelist_idx],
+            OP_EQ, 700);
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  smartlist_free(sl);
+  nodelist_free_all();
+  node_free_consensus(ns1);
+  node_free_consensus(ns2);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
 struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
+  NODE(exit_port_index, TT_FORK),
+  NODE(family_cache, TT_FORK),
+  NODE(set_consensus_incremental, TT_FORK),
+  NODE(select_table, TT_FORK),
   END_OF_TESTCASES
 };
 
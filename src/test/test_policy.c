@@ -438,10 +438,312 @@ test_dump_exit_policy_to_string(void *arg)
  tor_free(ep);
 }
 
+/** Helper: set <b>addr</b> to a random address of <b>family</b>, drawn from
+ * a small pool of prefixes so that random rules and addresses overlap. */
+static void
+compiled_policy_random_addr(tor_addr_t *addr, sa_family_t family)
+{
+  if (family == AF_INET) {
+    uint32_t a = crypto_rand_int(4) << 30 | crypto_rand_int(4) << 22;
+    if (crypto_rand_int(2))
+      a |= crypto_rand_int(1<<22);
+    tor_addr_from_ipv4h(addr, a);
+  } else {
+    uint8_t a[16];
+    memset(a, 0, sizeof(a));
+    a[0] = crypto_rand_int(2) ? 0x20 : 0xfe;
+    a[1] = crypto_rand_int(4);
+    if (crypto_rand_int(2))
+      crypto_rand((char*)a+2, 14);
+    tor_addr_from_ipv6_bytes(addr, (const char*)a);
+  }
+}
+
+/** Helper: return a random port for a compiled policy test, favoring the
+ * ends of the range. */
+static uint16_t
+compiled_policy_random_port(void)
+{
+  switch (crypto_rand_int(4)) {
+    case 0: return 1 + crypto_rand_int(2);
+    case 1: return 65535 - crypto_rand_int(2);
+    case 2: return 20 + crypto_rand_int(10);
+    default: return 1 + crypto_rand_int(65535);
+  }
+}
+
+/** Check that compiled policies give the same answers as the policies they
+ * were compiled from. */
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *c = NULL;
+  addr_policy_t *ent;
+  tor_addr_t addr;
+  int round, i;
+  (void)arg;
+
+  /* No policy: accept everything. */
+  tt_ptr_op(addr_policy_compile(NULL), OP_EQ, NULL);
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, NULL), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+
+  /* We refuse to compile rules for unspecified address families. */
+  policy = smartlist_new();
+  smartlist_add(policy,
+                router_parse_addr_policy_item_from_string("reject *:*", -1));
+  ent = smartlist_get(policy, 0);
+  tt_int_op(tor_addr_family(&ent->addr), OP_EQ, AF_UNSPEC);
+  tt_ptr_op(addr_policy_compile(policy), OP_EQ, NULL);
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  /* A simple hand-written policy. */
+  policy = smartlist_new();
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                           "reject 18.0.0.0/8:*", -1));
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                           "accept 18.1.0.0/16:80", -1));
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                           "accept *:443", -1));
+  smartlist_add(policy, router_parse_addr_policy_item_from_string(
+                                           "reject *:*", -1));
+  policy_expand_unspec(&policy);
+  c = addr_policy_compile(policy);
+  tt_assert(c);
+  tor_addr_from_ipv4h(&addr, 0x12010203);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, c), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tor_addr_from_ipv4h(&addr, 0x13010203);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 443, c), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 0, c), OP_EQ,
+            ADDR_POLICY_PROBABLY_REJECTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 443, c), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 0, c), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  compiled_addr_policy_free(c);
+  c = NULL;
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  /* Random policies, compared against the uncompiled ones. */
+  for (round = 0; round < 100; ++round) {
+    int n_rules = crypto_rand_int(40);
+    policy = smartlist_new();
+    for (i = 0; i < n_rules; ++i) {
+      addr_policy_t *p = tor_malloc_zero(sizeof(addr_policy_t));
+      const sa_family_t family = crypto_rand_int(2) ? AF_INET : AF_INET6;
+      p->policy_type = crypto_rand_int(2) ?
+        ADDR_POLICY_ACCEPT : ADDR_POLICY_REJECT;
+      compiled_policy_random_addr(&p->addr, family);
+      switch (crypto_rand_int(4)) {
+        case 0: p->maskbits = 0; break;
+        case 1: p->maskbits = family == AF_INET ? 32 : 128; break;
+        default:
+          p->maskbits = crypto_rand_int(family == AF_INET ? 33 : 129);
+      }
+      if (crypto_rand_int(2)) {
+        p->prt_min = 1;
+        p->prt_max = 65535;
+      } else {
+        p->prt_min = compiled_policy_random_port();
+        p->prt_max = compiled_policy_random_port();
+        if (p->prt_min > p->prt_max) {
+          uint16_t tmp = p->prt_min;
+          p->prt_min = p->prt_max;
+          p->prt_max = tmp;
+        }
+      }
+      p->refcnt = 1;
+      smartlist_add(policy, p);
+    }
+
+    c = addr_policy_compile(policy);
+    tt_assert(c);
+    for (i = 0; i < 500; ++i) {
+      uint16_t port = crypto_rand_int(4) ? compiled_policy_random_port() : 0;
+      if (i % 50 == 0) {
+        if (!port)
+          continue;
+        tor_addr_make_unspec(&addr);
+      } else {
+        compiled_policy_random_addr(&addr,
+                                    crypto_rand_int(2) ? AF_INET : AF_INET6);
+      }
+      tt_int_op(compare_tor_addr_to_compiled_policy(&addr, port, c), OP_EQ,
+                compare_tor_addr_to_addr_policy(&addr, port, policy));
+    }
+    compiled_addr_policy_free(c);
+    c = NULL;
+    addr_policy_list_free(policy);
+    policy = NULL;
+  }
+
+ done:
+  compiled_addr_policy_free(c);
+  addr_policy_list_free(policy);
+}
+
+/** Check that short policies are shared, and that we look up ports in
+ * them correctly whatever order their entries come in. */
+static void
+test_policies_short_intern(void *arg)
+{
+  short_policy_t *p1 = NULL, *p2 = NULL, *p3 = NULL;
+  char *out = NULL;
+  (void)arg;
+
+  p1 = parse_short_policy("accept 80,443");
+  p2 = parse_short_policy("accept 80,443");
+  p3 = parse_short_policy("reject 80,443");
+  tt_assert(p1);
+  tt_ptr_op(p1, OP_EQ, p2);
+  tt_ptr_op(p1, OP_NE, p3);
+  short_policy_free(p2);
+  p2 = NULL;
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 443, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 444, p1), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 80, p3), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 81, p3), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  short_policy_free(p1);
+  short_policy_free(p3);
+  p1 = p3 = NULL;
+
+  /* Unsorted and overlapping entries still work, and still write out the
+   * way they came in. */
+  p1 = parse_short_policy("accept 443,90-95,1-25,20-89,6667");
+  tt_assert(p1);
+  out = write_short_policy(p1);
+  tt_str_op(out, OP_EQ, "accept 443,90-95,1-25,20-89,6667");
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 1, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 50, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 95, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 96, p1), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 443, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 6666, p1), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 6667, p1), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 65535, p1), OP_EQ,
+            ADDR_POLICY_REJECTED);
+
+ done:
+  short_policy_free(p1);
+  short_policy_free(p2);
+  short_policy_free(p3);
+  tor_free(out);
+}
+
+/** Mutex protecting the counters for the short_intern_threads test. */
+static tor_mutex_t *intern_thread_mutex = NULL;
+/** Number of threads in the short_intern_threads test that have finished,
+ * and number of times they saw the wrong interned policy. */
+static int intern_threads_done = 0, intern_threads_failed = 0;
+/** The interned policy that the main thread holds during the
+ * short_intern_threads test. */
+static short_policy_t *intern_thread_held = NULL;
+
+/** Helper for test_policies_short_intern_threads: intern and release
+ * policies over and over from a thread other than the main one. */
+static void
+intern_thread_fn_(void *arg)
+{
+  static const char *summaries[] = {
+    "accept 80,443", "reject 25,119", "accept 1-65535",
+  };
+  int i, failed = 0;
+  (void)arg;
+
+  for (i = 0; i < 10000; ++i) {
+    short_policy_t *p = parse_short_policy(summaries[i % 3]);
+    short_policy_t *q = parse_short_policy("accept 80,443");
+    addr_policy_t *a =
+      router_parse_addr_policy_item_from_string("reject 10.0.0.0/8:*", -1);
+    if (!p || q != intern_thread_held || !a || !a->is_canonical)
+      ++failed;
+    short_policy_free(p);
+    short_policy_free(q);
+    addr_policy_free(a);
+  }
+
+  tor_mutex_acquire(intern_thread_mutex);
+  intern_threads_failed += failed;
+  ++intern_threads_done;
+  tor_mutex_release(intern_thread_mutex);
+  spawn_exit();
+}
+
+/** Check that worker threads can intern and release short policies and
+ * canonical policy entries while other threads do the same. */
+static void
+test_policies_short_intern_threads(void *arg)
+{
+  short_policy_t *p = NULL;
+  int done = 0;
+  time_t started;
+#ifndef _WIN32
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 100*1000;
+#endif
+  (void)arg;
+
+  /* As at startup: this calls policies_init_threads() before any
+   * cpuworkers run. */
+  routerparse_init();
+  intern_thread_mutex = tor_mutex_new();
+  intern_thread_held = parse_short_policy("accept 80,443");
+  tt_assert(intern_thread_held);
+
+  spawn_func(intern_thread_fn_, NULL);
+  spawn_func(intern_thread_fn_, NULL);
+  started = time(NULL);
+  while (!done) {
+    tor_mutex_acquire(intern_thread_mutex);
+    done = (intern_threads_done == 2);
+    tor_mutex_release(intern_thread_mutex);
+    tt_assert(time(NULL) < started + 150);
+#ifndef _WIN32
+    /* Prevent the main thread from starving the worker threads. */
+    if (!done)
+      select(0, NULL, NULL, NULL, &tv);
+#endif
+  }
+  tt_int_op(intern_threads_failed, OP_EQ, 0);
+
+  /* Our reference survived all of that. */
+  p = parse_short_policy("accept 80,443");
+  tt_ptr_op(p, OP_EQ, intern_thread_held);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 443, p), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+
+ done:
+  short_policy_free(p);
+  short_policy_free(intern_thread_held);
+  intern_thread_held = NULL;
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
+  { "short_intern", test_policies_short_intern, 0, NULL, NULL },
+  { "short_intern_threads", test_policies_short_intern_threads, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
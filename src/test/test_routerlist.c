@@ -3,9 +3,13 @@
 
 #define ROUTERLIST_PRIVATE
 #include "or.h"
+#include "config.h"
+#include "cpuworker.h"
 #include "routerlist.h"
+#include "routerparse.h"
 #include "directory.h"
 #include "test.h"
+#include "test_helpers.h"
 
 /* 4 digests + 3 sep + pre + post + NULL */
 static char output[4*BASE64_DIGEST256_LEN+3+2+2+1];
@@ -92,12 +96,179 @@ test_routerlist_launch_descriptor_downloads(void *arg)
   smartlist_free(downloadable);
 }
 
+static int
+mock_router_descriptor_is_older_than(const routerinfo_t *router, int seconds)
+{
+  (void)router;
+  (void)seconds;
+  return 0;
+}
+
+static void
+test_routerlist_rebuild_store(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  routerlist_t *rl;
+  desc_store_t *store = NULL;
+  const char *last_router, *cp, *next, *msg = NULL;
+  routerinfo_t *new_ri;
+  char *first_routers = NULL, *fname = NULL, *contents = NULL;
+  size_t expected_store_len = 0;
+  struct stat st;
+  store_mmap_ref_t *mmap_ref = NULL;
+  const char *held_body = NULL;
+  char *held_copy = NULL;
+  size_t held_len = 0;
+  (void)arg;
+
+  MOCK(router_descriptor_is_older_than,
+       mock_router_descriptor_is_older_than);
+  mock_cpuworker_reset();
+  mock_cpuworker_defer = 1;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("rebuild_store"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  /* Load all but the last descriptor, as if they were in the journal. */
+  cp = TEST_DESCRIPTORS;
+  while ((next = strstr(cp+1, "\n@uploaded-at ")))
+    cp = next;
+  first_routers = tor_strndup(TEST_DESCRIPTORS, cp+1 - TEST_DESCRIPTORS);
+  /* We'll add the last one without its annotations later. */
+  last_router = strstr(cp, "\nrouter ");
+  tt_assert(last_router);
+  ++last_router;
+  tt_int_op(HELPER_NUMBER_OF_DESCRIPTORS-1, OP_EQ,
+            router_load_routers_from_string(first_routers, NULL,
+                                            SAVED_IN_JOURNAL, NULL, 0, NULL));
+  rl = router_get_routerlist();
+  store = &rl->desc_store;
+  tt_int_op(store->store_len, OP_EQ, 0);
+
+  /* Start rebuilding the store. */
+  tt_int_op(0, OP_EQ,
+            router_rebuild_store(RRS_FORCE|RRS_DONT_REMOVE_OLD, store));
+  tt_assert(store->rebuild_job);
+  tt_int_op(1, OP_EQ, mock_cpuworker_n_deferred());
+  SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+    tt_assert(ri->cache_info.in_pending_store);
+    tt_int_op(ri->cache_info.saved_location, OP_EQ, SAVED_IN_JOURNAL);
+    expected_store_len += ri->cache_info.signed_descriptor_len +
+      ri->cache_info.annotations_len;
+  } SMARTLIST_FOREACH_END(ri);
+
+  /* A second rebuild waits for the first. */
+  tt_int_op(0, OP_EQ,
+            router_rebuild_store(RRS_FORCE|RRS_DONT_REMOVE_OLD, store));
+
+  /* Now a new descriptor arrives while the cpuworker is busy. */
+  new_ri = router_parse_entry_from_string(last_router, NULL, 1, 0, NULL,
+                                          NULL);
+  tt_assert(new_ri);
+  tt_int_op(ROUTER_ADDED_SUCCESSFULLY, OP_EQ,
+            router_add_to_routerlist(new_ri, &msg, 0, 0));
+  tt_int_op(HELPER_NUMBER_OF_DESCRIPTORS, OP_EQ, smartlist_len(rl->routers));
+
+  /* Let the main thread hear that the cpuworker is done. */
+  tt_int_op(1, OP_EQ, mock_cpuworker_run_deferred(1));
+  tt_ptr_op(store->rebuild_job, OP_EQ, NULL);
+  tt_assert(store->mmap);
+  tt_int_op(store->store_len, OP_EQ, expected_store_len);
+  tt_int_op(store->mmap->size, OP_EQ, expected_store_len);
+
+  SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+    signed_descriptor_t *sd = &ri->cache_info;
+    tt_assert(! sd->in_pending_store);
+    if (sd->signed_descriptor_body == NULL) {
+      /* It's in the new store. */
+      tt_int_op(sd->saved_location, OP_EQ, SAVED_IN_CACHE);
+      tt_assert(!strcmpstart(signed_descriptor_get_body(sd), "router "));
+      tt_assert(tor_memmem(TEST_DESCRIPTORS, strlen(TEST_DESCRIPTORS),
+                           signed_descriptor_get_body(sd),
+                           sd->signed_descriptor_len));
+    } else {
+      /* It's the new descriptor, and it's still in the journal. */
+      tt_int_op(sd->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+      tt_int_op(sd->saved_offset, OP_EQ, 0);
+      tt_int_op(store->journal_len, OP_EQ, sd->signed_descriptor_len);
+      tt_mem_op(sd->signed_descriptor_body, OP_EQ, last_router,
+                sd->signed_descriptor_len);
+    }
+  } SMARTLIST_FOREACH_END(ri);
+
+  /* The journal holds only the descriptor that arrived during the
+   * rebuild. */
+  fname = get_datadir_fname_suffix(store->fname_base, ".new");
+  contents = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(contents);
+  tt_int_op(st.st_size, OP_EQ, store->journal_len);
+  tt_assert(!strcmpstart(contents, "router "));
+  tt_mem_op(contents, OP_EQ, last_router, store->journal_len);
+  routerlist_assert_ok(rl);
+
+  /* Hold a reference to one descriptor's bytes in the store, as if we were
+   * still spooling it to a dirport connection. */
+  SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, ri) {
+    signed_descriptor_t *sd = &ri->cache_info;
+    if (sd->saved_location == SAVED_IN_CACHE) {
+      mmap_ref = signed_descriptor_get_mmap_ref(sd);
+      held_body = signed_descriptor_get_body(sd);
+      held_len = sd->signed_descriptor_len;
+      break;
+    }
+  } SMARTLIST_FOREACH_END(ri);
+#ifdef _WIN32
+  /* We can't replace a mapped file on Windows, so we never hand out
+   * references to the store's mmap there. */
+  tt_ptr_op(mmap_ref, OP_EQ, NULL);
+#else
+  tt_assert(mmap_ref);
+#endif
+  held_copy = tor_memdup(held_body, held_len);
+
+  /* Rebuilding the store again replaces the mmap, but the bytes we're
+   * holding stay valid until we let go of them. */
+  tt_int_op(0, OP_EQ,
+            router_rebuild_store(RRS_FORCE|RRS_DONT_REMOVE_OLD, store));
+  tt_int_op(1, OP_EQ, mock_cpuworker_n_deferred());
+  tt_int_op(1, OP_EQ, mock_cpuworker_run_deferred(1));
+  tt_ptr_op(store->rebuild_job, OP_EQ, NULL);
+  tt_int_op(store->journal_len, OP_EQ, 0);
+  if (mmap_ref) {
+    tt_mem_op(held_body, OP_EQ, held_copy, held_len);
+    store_mmap_ref_release(mmap_ref);
+    mmap_ref = NULL;
+  }
+  routerlist_assert_ok(rl);
+
+ done:
+  if (store && store->rebuild_job)
+    mock_cpuworker_run_deferred(1);
+  mock_cpuworker_reset();
+  if (mmap_ref)
+    store_mmap_ref_release(mmap_ref);
+  tor_free(held_copy);
+  UNMOCK(router_descriptor_is_older_than);
+  UNMOCK(cpuworker_queue_work);
+  routerlist_free_all();
+  tor_free(first_routers);
+  tor_free(fname);
+  tor_free(contents);
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 
 struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
+  NODE(rebuild_store, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -2,6 +2,7 @@
 
 #include "or.h"
 #include "geoip.h"
+#include "routerlist.h"
 #include "routerset.h"
 #include "routerparse.h"
 #include "policies.h"
@@ -1463,6 +1464,106 @@ NS(test_main)(void *arg)
     routerset_free(set);
 }
 
+#undef NS_SUBMODULE
+#define NS_SUBMODULE ASPECT(routerset_contains, compiled_addrs)
+
+/*
+ * Functional test for routerset_contains, when the routerset has address
+ * patterns: the compiled matcher should agree with the address policy.
+ */
+
+static void
+NS(test_main)(void *arg)
+{
+  routerset_t *set = routerset_new();
+  tor_addr_t addr;
+  int i, r, expected;
+  (void)arg;
+
+  r = routerset_parse(set, "1.2.0.0/16,10.0.0.1,192.168.0.0/24:80-90,"
+                      "172.16.0.0/12,8.0.0.0/7:443", "test");
+  tt_int_op(r, OP_EQ, 0);
+  tt_assert(set->compiled_policies);
+
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+  tt_int_op(routerset_contains(set, &addr, 9001, NULL, NULL, -1), OP_EQ, 3);
+  tor_addr_from_ipv4h(&addr, 0x01030304);
+  tt_int_op(routerset_contains(set, &addr, 9001, NULL, NULL, -1), OP_EQ, 0);
+  tor_addr_from_ipv4h(&addr, 0xc0a80011);
+  tt_int_op(routerset_contains(set, &addr, 85, NULL, NULL, -1), OP_EQ, 3);
+  tt_int_op(routerset_contains(set, &addr, 91, NULL, NULL, -1), OP_EQ, 0);
+
+  for (i = 0; i < 10000; ++i) {
+    /* Mostly pick addresses near the patterns above. */
+    static const uint32_t bases[] = {
+      0x01020000, 0x0a000000, 0xc0a80000, 0xac100000, 0x08000000,
+    };
+    uint32_t a = bases[crypto_rand_int(5)] ^ (crypto_rand_int(1<<20) << 4);
+    uint16_t port = (crypto_rand_int(2) ? 0 : 1) + crypto_rand_int(500);
+    tor_addr_from_ipv4h(&addr, a);
+    expected = compare_tor_addr_to_addr_policy(&addr, port, set->policies)
+      == ADDR_POLICY_REJECTED ? 3 : 0;
+    tt_int_op(routerset_contains(set, &addr, port, NULL, NULL, -1),
+              OP_EQ, expected);
+  }
+
+  done:
+    routerset_free(set);
+}
+
+#undef NS_SUBMODULE
+#define NS_SUBMODULE ASPECT(routerset_contains_node, cached)
+
+/*
+ * Functional test for routerset_contains_node, when the node is in the
+ * nodelist: we should remember the answer until the node or the set
+ * changes.
+ */
+
+static void
+NS(test_main)(void *arg)
+{
+  routerset_t *set = routerset_new();
+  routerinfo_t *ri1 = tor_malloc_zero(sizeof(routerinfo_t));
+  routerinfo_t *ri2 = tor_malloc_zero(sizeof(routerinfo_t));
+  const node_t *node;
+  (void)arg;
+
+  routerset_parse(set, "1.2.0.0/16", "test");
+
+  memset(ri1->cache_info.identity_digest, 'a', DIGEST_LEN);
+  ri1->addr = 0x01020304;
+  ri1->or_port = 9001;
+  node = nodelist_set_routerinfo(ri1, NULL);
+  tt_assert(node_is_in_nodelist(node));
+
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 3);
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 3);
+  tt_int_op(set->node_results[node->nodelist_idx], OP_EQ, 4);
+
+  /* A new descriptor moves the node. */
+  memcpy(ri2->cache_info.identity_digest, ri1->cache_info.identity_digest,
+         DIGEST_LEN);
+  ri2->addr = 0x05060708;
+  ri2->or_port = 9001;
+  node = nodelist_set_routerinfo(ri2, NULL);
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 0);
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 0);
+
+  /* Adding to the set makes us check again. */
+  routerset_parse(set, "5.6.7.0/24", "test");
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 3);
+  routerset_parse(set, "$"
+                  "6161616161616161616161616161616161616161", "test");
+  tt_int_op(routerset_contains_node(set, node), OP_EQ, 4);
+
+  done:
+    nodelist_free_all();
+    routerinfo_free(ri1);
+    routerinfo_free(ri2);
+    routerset_free(set);
+}
+
 #undef NS_SUBMODULE
 #define NS_SUBMODULE ASPECT(routerset_get_all_nodes, no_routerset)
 
@@ -2080,6 +2181,7 @@ struct testcase_t routerset_tests[] = {
   TEST_CASE_ASPECT(routerset_contains, set_and_null_addr),
   TEST_CASE_ASPECT(routerset_contains, countries_no_geoip),
   TEST_CASE_ASPECT(routerset_contains, countries_geoip),
+  TEST_CASE_ASPECT(routerset_contains, compiled_addrs),
   TEST_CASE_ASPECT(routerset_add_unknown_ccs, only_flag_and_no_ccs),
   TEST_CASE_ASPECT(routerset_add_unknown_ccs, creates_set),
   TEST_CASE_ASPECT(routerset_add_unknown_ccs, add_unknown),
@@ -2090,6 +2192,7 @@ struct testcase_t routerset_tests[] = {
   TEST_CASE_ASPECT(routerset_contains_node, none),
   TEST_CASE_ASPECT(routerset_contains_node, routerinfo),
   TEST_CASE_ASPECT(routerset_contains_node, routerstatus),
+  TEST_CASE_ASPECT(routerset_contains_node, cached),
   TEST_CASE_ASPECT(routerset_get_all_nodes, no_routerset),
   TEST_CASE_ASPECT(routerset_get_all_nodes, list_with_no_nodes),
   TEST_CASE_ASPECT(routerset_get_all_nodes, list_flag_not_running),
@@ -1714,6 +1714,120 @@ test_util_gzip(void *arg)
   tor_free(buf1);
 }
 
+/** Run unit tests for compression with zstd, and for the helpers that map
+ * between compression methods and their names. */
+static void
+test_util_zstd(void *arg)
+{
+  char *buf1=NULL, *buf2=NULL, *buf3=NULL, *cp1;
+  const char *ccp2;
+  size_t len1, len2, i;
+  tor_zlib_state_t *state = NULL;
+
+  (void)arg;
+  tt_str_op(compression_method_get_name(NO_METHOD), OP_EQ, "identity");
+  tt_str_op(compression_method_get_name(ZLIB_METHOD), OP_EQ, "deflate");
+  tt_str_op(compression_method_get_name(GZIP_METHOD), OP_EQ, "gzip");
+  tt_str_op(compression_method_get_name(ZSTD_METHOD), OP_EQ, "x-zstd");
+  tt_ptr_op(compression_method_get_name(UNKNOWN_METHOD), OP_EQ, NULL);
+  tt_int_op(compression_method_get_by_name("x-deflate"), OP_EQ, ZLIB_METHOD);
+  tt_int_op(compression_method_get_by_name("x-gzip"), OP_EQ, GZIP_METHOD);
+  tt_int_op(compression_method_get_by_name("x-zstd"), OP_EQ, ZSTD_METHOD);
+  tt_int_op(compression_method_get_by_name("identity"), OP_EQ, NO_METHOD);
+  tt_int_op(compression_method_get_by_name("br"), OP_EQ, UNKNOWN_METHOD);
+  tt_assert(tor_compress_supports_method(ZLIB_METHOD));
+  tt_assert(!tor_compress_supports_method(NO_METHOD));
+  tt_assert(!tor_compress_supports_method(UNKNOWN_METHOD));
+
+#ifndef HAVE_ZSTD
+  tt_assert(!tor_compress_supports_method(ZSTD_METHOD));
+  tt_ptr_op(tor_zstd_get_version_str(), OP_EQ, NULL);
+  tt_ptr_op(tor_zlib_new(1, ZSTD_METHOD, HIGH_COMPRESSION), OP_EQ, NULL);
+  tt_skip();
+#endif
+  /* When we're built with zstd, the round trip below must always run. */
+  tt_assert(tor_compress_supports_method(ZSTD_METHOD));
+  tt_assert(tor_zstd_get_version_str());
+
+  /* Something long and somewhat compressible, so that it spans several
+   * calls to the stream functions without looking like a bomb. */
+  len1 = 100000;
+  buf1 = tor_malloc(len1 + 1);
+  crypto_rand(buf1, len1);
+  for (i = 0; i < len1; ++i)
+    buf1[i] = 'A' + (buf1[i] & 7);
+  buf1[len1] = '\0';
+
+  tt_assert(!tor_gzip_compress(&buf2, &len2, buf1, len1, ZSTD_METHOD));
+  tt_assert(len2 < len1 / 2);
+  tt_int_op(detect_compression_method(buf2, len2), OP_EQ, ZSTD_METHOD);
+  tt_assert(!tor_gzip_uncompress(&buf3, &len1, buf2, len2,
+                                 ZSTD_METHOD, 1, LOG_INFO));
+  tt_int_op(len1, OP_EQ, 100000);
+  tt_str_op(buf1, OP_EQ, buf3);
+  tor_free(buf3);
+
+  /* Concatenated frames. */
+  buf2 = tor_reallocarray(buf2, len2, 2);
+  memcpy(buf2+len2, buf2, len2);
+  tt_assert(!tor_gzip_uncompress(&buf3, &len1, buf2, len2*2,
+                                 ZSTD_METHOD, 1, LOG_INFO));
+  tt_int_op(len1, OP_EQ, 200000);
+  tt_mem_op(buf3, OP_EQ, buf1, 100000);
+  tt_mem_op(buf3+100000, OP_EQ, buf1, 100000);
+  tor_free(buf3);
+
+  /* Truncated input is fine only if we allow partial output. */
+  tt_assert(!tor_gzip_uncompress(&buf3, &len1, buf2, len2-16,
+                                 ZSTD_METHOD, 0, LOG_INFO));
+  tt_assert(len1 < 100000);
+  tt_mem_op(buf3, OP_EQ, buf1, len1);
+  tor_free(buf3);
+  tt_assert(tor_gzip_uncompress(&buf3, &len1, buf2, len2-16,
+                                ZSTD_METHOD, 1, LOG_INFO));
+  tt_ptr_op(buf3, OP_EQ, NULL);
+
+  /* Garbage is an error. */
+  memset(buf2, 0xff, 4);
+  tt_assert(tor_gzip_uncompress(&buf3, &len1, buf2, len2,
+                                ZSTD_METHOD, 1, LOG_INFO));
+  tt_ptr_op(buf3, OP_EQ, NULL);
+  tor_free(buf1);
+  tor_free(buf2);
+
+  /* Now, try streaming compression into a small buffer. */
+  state = tor_zlib_new(1, ZSTD_METHOD, LOW_COMPRESSION);
+  tt_assert(state);
+  tt_assert(tor_zlib_state_size(state) > 0);
+  tt_int_op(tor_zlib_get_total_allocation(), OP_GE,
+            tor_zlib_state_size(state));
+  cp1 = buf1 = tor_malloc(1024);
+  len1 = 1024;
+  ccp2 = "ABCDEFGHIJABCDEFGHIJ";
+  len2 = 21;
+  tt_int_op(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 0),
+            OP_EQ, TOR_ZLIB_OK);
+  tt_int_op(0, OP_EQ, len2); /* Make sure we compressed it all. */
+
+  len2 = 0;
+  tt_int_op(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 1),
+            OP_EQ, TOR_ZLIB_DONE);
+  tt_assert(cp1 > buf1); /* Make sure we really added something. */
+  tor_zlib_free(state);
+  state = NULL;
+
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf1, 1024-len1,
+                                 ZSTD_METHOD, 1, LOG_WARN));
+  tt_str_op(buf3, OP_EQ, "ABCDEFGHIJABCDEFGHIJ");
+  tt_int_op(21, OP_EQ, len2);
+
+ done:
+  tor_zlib_free(state);
+  tor_free(buf2);
+  tor_free(buf3);
+  tor_free(buf1);
+}
+
 /** Run unit tests for mmap() wrapper functionality. */
 static void
 test_util_mmap(void *arg)
@@ -4317,6 +4431,7 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(strmisc),
   UTIL_LEGACY(pow2),
   UTIL_LEGACY(gzip),
+  UTIL_TEST(zstd, 0),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
   UTIL_LEGACY(control_formats),
@@ -16,6 +16,7 @@ const char tor_git_revision[] = "";
 #include "or.h"
 #include "config.h"
 #include "rephist.h"
+#include "routerparse.h"
 #include "backtrace.h"
 #include "test.h"
 
@@ -272,6 +273,7 @@ main(int c, const char **v)
   crypto_set_tls_dh_prime();
   crypto_seed_rng(1);
   rep_hist_init();
+  routerparse_init();
   network_init();
   setup_directory();
   options_init(options);